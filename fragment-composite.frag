@@ -0,0 +1,14 @@
+// Composites weighted blended transparent fragments over the opaque scene.
+// accumulation.rgb holds the sum of the weighted, premultiplied colors and
+// accumulation.a the product of (1 - alpha), i.e. how much of the scene
+// behind still shows through; weights.r holds the sum of the weighted
+// alphas. Blend with GL_ONE_MINUS_SRC_ALPHA, GL_SRC_ALPHA.
+uniform sampler2D accumulation, weights;
+
+
+void main()
+{
+  vec4 accum = texture2D(accumulation, gl_TexCoord[0].st);
+  float weight = texture2D(weights, gl_TexCoord[0].st).r;
+  gl_FragColor = vec4(accum.rgb / clamp(weight, 1e-5, 5e4), accum.a);
+}
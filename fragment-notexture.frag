@@ -1,12 +1,21 @@
 varying vec3 Ka, Kd;
 varying vec3 normal, lightDir, halfVector;
 
+// Nothing here has a virtual texture, so in the feedback pass (see
+// fragment.frag) it asks for nothing.
+uniform bool virtualFeedback;
+
 
 void main()
 {
   vec3 n, halfV, color, Ks;
   float NdotL, NdotHV, D;
 
+  if (virtualFeedback) {
+    gl_FragColor = vec4(0.0);
+    return;
+  }
+
   n = normalize(normal);
   NdotL = max(dot(n, lightDir), 0.0);
 
@@ -3,42 +3,130 @@ varying vec3 normal, lightDir, halfVector;
 uniform sampler2D mapKa, mapKd, mapKs, mapD;
 uniform bool hasMapKa, hasMapKd, hasMapKs, hasMapD;
 
+// In weighted blended transparency mode, the color goes into an
+// accumulation target and the coverage into a second one instead (see
+// fragment-composite.frag). Nearer and more opaque fragments get more
+// weight (McGuire & Bavoil).
+uniform bool weightedBlend;
+
+// Virtual textures: a diffuse map too big to upload whole, and any other
+// map which is the same image, is drawn from tiles in a shared cache
+// texture. Its page table has a texel per tile at each mip level, giving
+// the slot in the cache of that tile or the nearest coarser one which is
+// there: x and y in rg and the tile's level in b, all as 0-255.
+uniform bool virtualKa, virtualKd, virtualKs, virtualD;
+uniform sampler2D tileCache, pageTable;
+uniform sampler2D mipTail;    // The coarsest level, as a mipmapped texture.
+uniform float virtualLevels;  // The coarsest level, which is a single tile.
+uniform vec3 tileCacheLayout; // Tile size and border, and cache size, in texels.
+
+// In the feedback pass each fragment writes out the tile its virtual
+// texture wants instead of a color: x, y, level and the texture's index
+// plus one, all as 0-255. The pass is drawn at a lower resolution, which
+// feedbackBias makes up for.
+uniform bool virtualFeedback;
+uniform float virtualIndex, feedbackBias;
+
+
+// The mip level the virtual texture wants at these tex coords, from how
+// many of its texels there are across this fragment.
+float virtualLevel(vec2 coords)
+{
+  vec2 texels = coords * exp2(virtualLevels) * tileCacheLayout.x;
+  vec2 dx = dFdx(texels);
+  vec2 dy = dFdy(texels);
+  return 0.5 * log2(max(dot(dx, dx), dot(dy, dy)));
+}
+
+
+vec4 virtualTexture(vec2 coords)
+{
+  // Biasing by the tile size makes the page table's own level selection
+  // match the texture's.
+  vec4 entry = texture2D(pageTable, coords, log2(tileCacheLayout.x));
+  vec2 slot = floor(entry.rg * 255.0 + 0.5);
+  float level = floor(entry.b * 255.0 + 0.5);
+  if (level >= virtualLevels)
+    return texture2D(mipTail, coords);
+  vec2 withinTile = fract(coords * exp2(virtualLevels - level));
+  vec2 texel = slot * (tileCacheLayout.x + 2.0 * tileCacheLayout.y) +
+      tileCacheLayout.y + withinTile * tileCacheLayout.x;
+  return texture2D(tileCache, texel / tileCacheLayout.z);
+}
+
 
 void main()
 {
-  vec3 n, halfV, color, Ks;
+  vec3 n, halfV, color, Ks, diffuse, specular;
   float NdotL, NdotHV, D;
 
+  if (virtualFeedback) {
+    if (virtualKa || virtualKd || virtualKs || virtualD) {
+      // Whichever maps are virtual, they share the tex coords.
+      vec2 coords = virtualKd ? gl_TexCoord[1].st : virtualKa ? gl_TexCoord[0].st :
+          virtualKs ? gl_TexCoord[2].st : gl_TexCoord[3].st;
+      float level = floor(clamp(virtualLevel(coords) + feedbackBias, 0.0, virtualLevels) + 0.5);
+      vec2 tile = floor(fract(coords) * exp2(virtualLevels - level));
+      gl_FragData[0] = vec4(tile, level, virtualIndex) / 255.0;
+    } else {
+      gl_FragData[0] = vec4(0.0);
+    }
+    return;
+  }
+
   n = normalize(normal);
   NdotL = max(dot(n, lightDir), 0.0);
 
-  if (hasMapKa)
+  if (virtualKa)
+    color = Ka * virtualTexture(gl_TexCoord[0].st).rgb;
+  else if (hasMapKa)
     color = Ka * texture2D(mapKa, gl_TexCoord[0].st).rgb;
   else
     color = Ka;
 
+  // Sampled outside the branch below, where the derivatives for mip
+  // selection are still defined.
+  if (virtualKd)
+    diffuse = Kd * virtualTexture(gl_TexCoord[1].st).rgb;
+  else if (hasMapKd)
+    diffuse = Kd * texture2D(mapKd, gl_TexCoord[1].st).rgb;
+  else
+    diffuse = Kd;
+  if (virtualKs)
+    specular = virtualTexture(gl_TexCoord[2].st).rgb;
+  else
+    specular = vec3(1.0);
+
   if (NdotL > 0.0) {
-    if (hasMapKd)
-      color += NdotL * Kd * texture2D(mapKd, gl_TexCoord[1].st).rgb;
-    else
-      color += NdotL * Kd;
+    color += NdotL * diffuse;
 
     halfV = normalize(halfVector);
     NdotHV = max(dot(n, halfV), 0.0);
 
     Ks = gl_FrontMaterial.specular.rgb * gl_LightSource[0].specular.rgb *
         pow(NdotHV, gl_FrontMaterial.shininess);
-    if (hasMapKs)
+    if (virtualKs)
+      color += Ks * specular;
+    else if (hasMapKs)
       color += Ks * texture2D(mapKs, gl_TexCoord[2].st).rgb;
     else
       color += Ks;
   }
 
-  if (hasMapD)
+  if (virtualD)
+    D = gl_FrontMaterial.diffuse.a * virtualTexture(gl_TexCoord[3].st).a;
+  else if (hasMapD)
     D = gl_FrontMaterial.diffuse.a * texture2D(mapD,  gl_TexCoord[3].st).a;
   else
     D = gl_FrontMaterial.diffuse.a;
 
-  gl_FragColor = vec4(color, D);
+  if (weightedBlend) {
+    float w = clamp(pow(min(1.0, D * 10.0) + 0.01, 3.0) * 1e8 *
+        pow(1.0 - gl_FragCoord.z * 0.9, 3.0), 1e-2, 3e3);
+    gl_FragData[0] = vec4(color * D * w, D);
+    gl_FragData[1] = vec4(D * w);
+  } else {
+    gl_FragData[0] = vec4(color, D);
+  }
 }
 
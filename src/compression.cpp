@@ -0,0 +1,1042 @@
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "compression.h"
+#include "hash.h"
+#include "interpolate.h"
+#include "vertexformat.h"
+
+
+//
+// CONSTANTS
+//
+
+const size_t MAX_DELTA_RUN = 16;
+const float QUANTIZED_COORD_MAX = 65535.0f;
+const float QUANTIZED_NORMAL_MAX = 32767.0f;
+
+// Limits for the Jacobi eigenvalue solver used by PCAKeyframes. It stops once
+// the off-diagonal terms are negligible next to the diagonal, which usually
+// takes well under 10 sweeps.
+const size_t MAX_JACOBI_SWEEPS = 50;
+const double JACOBI_TOLERANCE = 1e-24;
+
+// Identifies the factored keyframe file format. Change it whenever the
+// format or the way keyframes are factored changes, so old files get
+// ignored.
+const char PCA_KEYFRAMES_MAGIC[8] = { 'O', 'V', 'P', 'C', 'A', '0', '0', '1' };
+
+
+//
+// INTERNAL FUNCTIONS
+//
+
+vh::Vector3 keyframeOf(const Curve3& curve, size_t keyframe)
+{
+  if (curve.numKeyframes() == 0)
+    return vh::Vector3(0, 0, 0);
+  return curve[std::min(keyframe, curve.numKeyframes() - 1)];
+}
+
+
+size_t maxKeyframes(const std::vector<Curve3>& curves)
+{
+  size_t numKeyframes = 0;
+  for (size_t i = 0; i < curves.size(); ++i)
+    numKeyframes = std::max(numKeyframes, curves[i].numKeyframes());
+  return numKeyframes;
+}
+
+
+uint16_t quantizeCoord(float value, float low, float step)
+{
+  if (step <= 0)
+    return 0;
+  float q = floorf((value - low) / step + 0.5f);
+  return (uint16_t)std::max(0.0f, std::min(q, QUANTIZED_COORD_MAX));
+}
+
+
+void octDecode(const int16_t* in, float* out)
+{
+  float x = in[0] / QUANTIZED_NORMAL_MAX;
+  float y = in[1] / QUANTIZED_NORMAL_MAX;
+  float z = 1 - fabsf(x) - fabsf(y);
+  float t = std::max(-z, 0.0f);
+  x += (x >= 0) ? -t : t;
+  y += (y >= 0) ? -t : t;
+  float len = sqrtf(x * x + y * y + z * z);
+  out[0] = x / len;
+  out[1] = y / len;
+  out[2] = z / len;
+}
+
+
+// Converts quantized x,y,z triples back to floats.
+void dequantizeCoords(const uint16_t* in, size_t count,
+    const vh::Vector3& low, const vh::Vector3& step, float* out)
+{
+  const size_t n = count * 3;
+  size_t i = 0;
+#ifdef __SSE2__
+  // 4 coords are 12 values, which fill 3 registers. The x,y,z pattern of the
+  // scale and bias rotates by one lane from each register to the next.
+  const __m128 scale0 = _mm_setr_ps(step.x, step.y, step.z, step.x);
+  const __m128 scale1 = _mm_setr_ps(step.y, step.z, step.x, step.y);
+  const __m128 scale2 = _mm_setr_ps(step.z, step.x, step.y, step.z);
+  const __m128 bias0 = _mm_setr_ps(low.x, low.y, low.z, low.x);
+  const __m128 bias1 = _mm_setr_ps(low.y, low.z, low.x, low.y);
+  const __m128 bias2 = _mm_setr_ps(low.z, low.x, low.y, low.z);
+  const __m128i zero = _mm_setzero_si128();
+  for (; i + 12 <= n; i += 12) {
+    __m128i a = _mm_loadu_si128((const __m128i*)(in + i));
+    __m128i b = _mm_loadl_epi64((const __m128i*)(in + i + 8));
+    __m128 f0 = _mm_cvtepi32_ps(_mm_unpacklo_epi16(a, zero));
+    __m128 f1 = _mm_cvtepi32_ps(_mm_unpackhi_epi16(a, zero));
+    __m128 f2 = _mm_cvtepi32_ps(_mm_unpacklo_epi16(b, zero));
+    _mm_storeu_ps(out + i,     _mm_add_ps(_mm_mul_ps(f0, scale0), bias0));
+    _mm_storeu_ps(out + i + 4, _mm_add_ps(_mm_mul_ps(f1, scale1), bias1));
+    _mm_storeu_ps(out + i + 8, _mm_add_ps(_mm_mul_ps(f2, scale2), bias2));
+  }
+#endif
+  for (; i < n; ++i)
+    out[i] = low.data[i % 3] + in[i] * step.data[i % 3];
+}
+
+
+void applyDeltas(const int8_t* deltas, size_t n, uint16_t* values)
+{
+  size_t i = 0;
+#ifdef __SSE2__
+  for (; i + 16 <= n; i += 16) {
+    __m128i d = _mm_loadu_si128((const __m128i*)(deltas + i));
+    // Sign extend the 8 bit deltas to 16 bits.
+    __m128i dlo = _mm_srai_epi16(_mm_unpacklo_epi8(d, d), 8);
+    __m128i dhi = _mm_srai_epi16(_mm_unpackhi_epi8(d, d), 8);
+    __m128i vlo = _mm_loadu_si128((const __m128i*)(values + i));
+    __m128i vhi = _mm_loadu_si128((const __m128i*)(values + i + 8));
+    _mm_storeu_si128((__m128i*)(values + i), _mm_add_epi16(vlo, dlo));
+    _mm_storeu_si128((__m128i*)(values + i + 8), _mm_add_epi16(vhi, dhi));
+  }
+#endif
+  for (; i < n; ++i)
+    values[i] = (uint16_t)(values[i] + deltas[i]);
+}
+
+
+void octDecodeAll(const int16_t* in, size_t count, float* out)
+{
+  size_t i = 0;
+#ifdef __SSE2__
+  const __m128 invMax = _mm_set1_ps(1.0f / QUANTIZED_NORMAL_MAX);
+  const __m128 one = _mm_set1_ps(1.0f);
+  const __m128 zero = _mm_setzero_ps();
+  const __m128 signMask = _mm_set1_ps(-0.0f);
+  float x[4], y[4], z[4];
+  for (; i + 4 <= count; i += 4) {
+    __m128i packed = _mm_loadu_si128((const __m128i*)(in + i * 2));
+    // Sign extend to 32 bits, giving u0 v0 u1 v1 and u2 v2 u3 v3.
+    __m128 lo = _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpacklo_epi16(packed, packed), 16));
+    __m128 hi = _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpackhi_epi16(packed, packed), 16));
+    __m128 u = _mm_mul_ps(_mm_shuffle_ps(lo, hi, _MM_SHUFFLE(2, 0, 2, 0)), invMax);
+    __m128 v = _mm_mul_ps(_mm_shuffle_ps(lo, hi, _MM_SHUFFLE(3, 1, 3, 1)), invMax);
+
+    __m128 absU = _mm_andnot_ps(signMask, u);
+    __m128 absV = _mm_andnot_ps(signMask, v);
+    __m128 nz = _mm_sub_ps(_mm_sub_ps(one, absU), absV);
+    __m128 t = _mm_max_ps(_mm_sub_ps(zero, nz), zero);
+    // x += (x >= 0) ? -t : t, done by giving t the opposite sign to x.
+    __m128 nx = _mm_sub_ps(u, _mm_or_ps(t, _mm_and_ps(signMask, u)));
+    __m128 ny = _mm_sub_ps(v, _mm_or_ps(t, _mm_and_ps(signMask, v)));
+
+    __m128 len = _mm_sqrt_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(nx, nx), _mm_mul_ps(ny, ny)), _mm_mul_ps(nz, nz)));
+    _mm_storeu_ps(x, _mm_div_ps(nx, len));
+    _mm_storeu_ps(y, _mm_div_ps(ny, len));
+    _mm_storeu_ps(z, _mm_div_ps(nz, len));
+    for (size_t j = 0; j < 4; ++j) {
+      out[(i + j) * 3 + 0] = x[j];
+      out[(i + j) * 3 + 1] = y[j];
+      out[(i + j) * 3 + 2] = z[j];
+    }
+  }
+#endif
+  for (; i < count; ++i)
+    octDecode(in + i * 2, out + i * 3);
+}
+
+
+// Finds the eigenvalues and eigenvectors of the symmetric n x n matrix a,
+// which is destroyed in the process, using cyclic Jacobi rotations. The
+// values come out largest first; vectors holds the matching eigenvectors,
+// one after another.
+void symmetricEigen(std::vector<double>& a, size_t n,
+    std::vector<double>& values, std::vector<double>& vectors)
+{
+  // Columns of v accumulate the rotations, so they end up as the eigenvectors.
+  std::vector<double> v(n * n, 0.0);
+  for (size_t i = 0; i < n; ++i)
+    v[i * n + i] = 1.0;
+
+  for (size_t sweep = 0; sweep < MAX_JACOBI_SWEEPS; ++sweep) {
+    double offDiagonal = 0, diagonal = 0;
+    for (size_t p = 0; p < n; ++p) {
+      diagonal += a[p * n + p] * a[p * n + p];
+      for (size_t q = p + 1; q < n; ++q)
+        offDiagonal += a[p * n + q] * a[p * n + q];
+    }
+    if (offDiagonal <= JACOBI_TOLERANCE * diagonal)
+      break;
+
+    for (size_t p = 0; p < n; ++p) {
+      for (size_t q = p + 1; q < n; ++q) {
+        double apq = a[p * n + q];
+        if (apq == 0)
+          continue;
+
+        // Pick the smaller rotation angle which zeroes a[p][q].
+        double theta = (a[q * n + q] - a[p * n + p]) / (2 * apq);
+        double t = (theta >= 0 ? 1.0 : -1.0) / (fabs(theta) + sqrt(theta * theta + 1));
+        double c = 1 / sqrt(t * t + 1);
+        double s = t * c;
+
+        for (size_t k = 0; k < n; ++k) {
+          double akp = a[k * n + p], akq = a[k * n + q];
+          a[k * n + p] = c * akp - s * akq;
+          a[k * n + q] = s * akp + c * akq;
+        }
+        for (size_t k = 0; k < n; ++k) {
+          double apk = a[p * n + k], aqk = a[q * n + k];
+          a[p * n + k] = c * apk - s * aqk;
+          a[q * n + k] = s * apk + c * aqk;
+        }
+        for (size_t k = 0; k < n; ++k) {
+          double vkp = v[k * n + p], vkq = v[k * n + q];
+          v[k * n + p] = c * vkp - s * vkq;
+          v[k * n + q] = s * vkp + c * vkq;
+        }
+      }
+    }
+  }
+
+  std::vector<std::pair<double, size_t> > order(n);
+  for (size_t i = 0; i < n; ++i)
+    order[i] = std::make_pair(-a[i * n + i], i);
+  std::sort(order.begin(), order.end());
+
+  values.resize(n);
+  vectors.resize(n * n);
+  for (size_t i = 0; i < n; ++i) {
+    size_t column = order[i].second;
+    values[i] = a[column * n + column];
+    for (size_t k = 0; k < n; ++k)
+      vectors[i * n + k] = v[k * n + column];
+  }
+}
+
+
+//
+// QuantizedKeyframes METHODS
+//
+
+QuantizedKeyframes::QuantizedKeyframes(const std::vector<Curve3>& coords,
+    const std::vector<Curve3>& normals, const vh::Vector3& low, const vh::Vector3& high,
+    bool deltaCoding) :
+  _numKeyframes(0),
+  _numCoords(coords.size()),
+  _numNormals(normals.size()),
+  _low(low),
+  _step(),
+  _coordKeyframes(),
+  _absoluteCoords(),
+  _deltaCoords(),
+  _normals(),
+  _chain(),
+  _chainKeyframe(-1),
+  _coordResult(),
+  _normalResult(),
+  _coordResultTime(-1e20),
+  _normalResultTime(-1e20),
+  _maxCoordError(0),
+  _rmsCoordError(0),
+  _maxNormalError(0)
+{
+  _numKeyframes = std::max(maxKeyframes(coords), maxKeyframes(normals));
+  for (unsigned int i = 0; i < 3; ++i)
+    _step.data[i] = (high.data[i] > low.data[i]) ? (high.data[i] - low.data[i]) / QUANTIZED_COORD_MAX : 0;
+
+  for (unsigned int i = 0; i < 2; ++i) {
+    _coordFrames[i].keyframe = -1;
+    _normalFrames[i].keyframe = -1;
+  }
+
+  encodeCoords(coords, deltaCoding);
+  encodeNormals(normals);
+  measureError(coords, normals);
+}
+
+
+size_t QuantizedKeyframes::numKeyframes() const
+{
+  return _numKeyframes;
+}
+
+
+size_t QuantizedKeyframes::numCoords() const
+{
+  return _numCoords;
+}
+
+
+size_t QuantizedKeyframes::numNormals() const
+{
+  return _numNormals;
+}
+
+
+size_t QuantizedKeyframes::numDeltaKeyframes() const
+{
+  size_t count = 0;
+  for (size_t i = 0; i < _coordKeyframes.size(); ++i) {
+    if (_coordKeyframes[i].isDelta)
+      ++count;
+  }
+  return count;
+}
+
+
+size_t QuantizedKeyframes::bytesUsed() const
+{
+  return _coordKeyframes.size() * sizeof(KeyframeInfo) +
+         _absoluteCoords.size() * sizeof(uint16_t) +
+         _deltaCoords.size() * sizeof(int8_t) +
+         _normals.size() * sizeof(int16_t);
+}
+
+
+size_t QuantizedKeyframes::uncompressedBytes() const
+{
+  return (_numCoords + _numNormals) * _numKeyframes * sizeof(vh::Vector3);
+}
+
+
+const float* QuantizedKeyframes::coordsAt(float time)
+{
+  if (time != _coordResultTime || _coordResult.empty()) {
+    _coordResultTime = time;
+    return interpolate(time, _coordFrames, _coordResult, _numCoords, true);
+  }
+  return &_coordResult[0];
+}
+
+
+const float* QuantizedKeyframes::normalsAt(float time)
+{
+  if (time != _normalResultTime || _normalResult.empty()) {
+    _normalResultTime = time;
+    return interpolate(time, _normalFrames, _normalResult, _numNormals, false);
+  }
+  return &_normalResult[0];
+}
+
+
+void QuantizedKeyframes::decodeCoords(size_t keyframe, float* out)
+{
+  quantizedCoordsFor(keyframe);
+  dequantizeCoords(&_chain[0], _numCoords, _low, _step, out);
+}
+
+
+void QuantizedKeyframes::decodeNormals(size_t keyframe, float* out)
+{
+  octDecodeAll(&_normals[keyframe * _numNormals * 2], _numNormals, out);
+}
+
+
+float QuantizedKeyframes::maxCoordError() const
+{
+  return _maxCoordError;
+}
+
+
+float QuantizedKeyframes::rmsCoordError() const
+{
+  return _rmsCoordError;
+}
+
+
+float QuantizedKeyframes::maxNormalError() const
+{
+  return _maxNormalError;
+}
+
+
+void QuantizedKeyframes::printStats() const
+{
+  float diagonal = vh::length(_step * QUANTIZED_COORD_MAX);
+  fprintf(stderr, "Compressed %lu keyframes (%lu delta coded): %1.2f MB -> %1.2f MB (%1.2fx smaller)\n",
+      _numKeyframes, numDeltaKeyframes(),
+      uncompressedBytes() / 1048576.0, bytesUsed() / 1048576.0,
+      float(uncompressedBytes()) / float(std::max(bytesUsed(), (size_t)1)));
+  fprintf(stderr, "Max coord error %g (%1.4f%% of bbox diagonal), rms %g; max normal error %1.3f degrees\n",
+      _maxCoordError, diagonal > 0 ? 100.0 * _maxCoordError / diagonal : 0.0,
+      _rmsCoordError, _maxNormalError);
+}
+
+
+void QuantizedKeyframes::encodeCoords(const std::vector<Curve3>& coords, bool deltaCoding)
+{
+  const size_t n = _numCoords * 3;
+  std::vector<uint16_t> previous(n);
+  std::vector<uint16_t> current(n);
+
+  for (size_t keyframe = 0; keyframe < _numKeyframes; ++keyframe) {
+#pragma omp parallel for schedule(static)
+    for (size_t i = 0; i < _numCoords; ++i) {
+      vh::Vector3 coord = keyframeOf(coords[i], keyframe);
+      for (unsigned int j = 0; j < 3; ++j)
+        current[i * 3 + j] = quantizeCoord(coord.data[j], _low.data[j], _step.data[j]);
+    }
+
+    bool useDelta = deltaCoding && (keyframe % MAX_DELTA_RUN) != 0;
+    for (size_t i = 0; useDelta && i < n; ++i) {
+      int delta = int(current[i]) - int(previous[i]);
+      useDelta = (delta >= -128 && delta <= 127);
+    }
+
+    KeyframeInfo info;
+    info.isDelta = useDelta;
+    if (useDelta) {
+      info.offset = _deltaCoords.size();
+      _deltaCoords.resize(info.offset + n);
+      for (size_t i = 0; i < n; ++i)
+        _deltaCoords[info.offset + i] = (int8_t)(int(current[i]) - int(previous[i]));
+    } else {
+      info.offset = _absoluteCoords.size();
+      _absoluteCoords.insert(_absoluteCoords.end(), current.begin(), current.end());
+    }
+    _coordKeyframes.push_back(info);
+    previous.swap(current);
+  }
+}
+
+
+void QuantizedKeyframes::encodeNormals(const std::vector<Curve3>& normals)
+{
+  _normals.resize(_numKeyframes * _numNormals * 2);
+  for (size_t keyframe = 0; keyframe < _numKeyframes; ++keyframe) {
+    int16_t* dst = &_normals[keyframe * _numNormals * 2];
+#pragma omp parallel for schedule(static)
+    for (size_t i = 0; i < _numNormals; ++i)
+      octEncode(keyframeOf(normals[i], keyframe), dst + i * 2);
+  }
+}
+
+
+void QuantizedKeyframes::measureError(const std::vector<Curve3>& coords,
+    const std::vector<Curve3>& normals)
+{
+  std::vector<float> decoded(std::max(_numCoords, _numNormals) * 3);
+  double sumSqr = 0;
+
+  for (size_t keyframe = 0; keyframe < _numKeyframes; ++keyframe) {
+    if (_numCoords > 0) {
+      decodeCoords(keyframe, &decoded[0]);
+      for (size_t i = 0; i < _numCoords; ++i) {
+        vh::Vector3 err = keyframeOf(coords[i], keyframe) -
+            vh::Vector3(decoded[i * 3], decoded[i * 3 + 1], decoded[i * 3 + 2]);
+        float errSqr = vh::lengthSqr(err);
+        sumSqr += errSqr;
+        _maxCoordError = std::max(_maxCoordError, sqrtf(errSqr));
+      }
+    }
+
+    if (_numNormals > 0) {
+      decodeNormals(keyframe, &decoded[0]);
+      for (size_t i = 0; i < _numNormals; ++i) {
+        vh::Vector3 original = keyframeOf(normals[i], keyframe);
+        if (vh::lengthSqr(original) == 0)
+          continue;
+        float cosAngle = vh::dot(vh::norm(original),
+            vh::Vector3(decoded[i * 3], decoded[i * 3 + 1], decoded[i * 3 + 2]));
+        float angle = acosf(std::max(-1.0f, std::min(cosAngle, 1.0f))) * 180.0 / M_PI;
+        _maxNormalError = std::max(_maxNormalError, angle);
+      }
+    }
+  }
+
+  if (_numCoords > 0 && _numKeyframes > 0)
+    _rmsCoordError = sqrt(sumSqr / double(_numCoords * _numKeyframes));
+}
+
+
+void QuantizedKeyframes::quantizedCoordsFor(size_t keyframe)
+{
+  if (_chainKeyframe == int(keyframe))
+    return;
+
+  const size_t n = _numCoords * 3;
+  if (_chain.size() != n)
+    _chain.resize(n);
+
+  // Find the nearest full keyframe at or before the one we want. If the chain
+  // is already part way along the run of deltas, we can carry on from there.
+  size_t base = keyframe;
+  while (_coordKeyframes[base].isDelta)
+    --base;
+
+  size_t next;
+  if (_chainKeyframe >= int(base) && _chainKeyframe < int(keyframe)) {
+    next = _chainKeyframe + 1;
+  } else {
+    memcpy(&_chain[0], &_absoluteCoords[_coordKeyframes[base].offset], n * sizeof(uint16_t));
+    next = base + 1;
+  }
+
+  for (; next <= keyframe; ++next)
+    applyDeltas(&_deltaCoords[_coordKeyframes[next].offset], n, &_chain[0]);
+  _chainKeyframe = int(keyframe);
+}
+
+
+const float* QuantizedKeyframes::interpolate(float time, DecodedKeyframe* frames,
+    std::vector<float>& result, size_t count, bool coords)
+{
+  if (count == 0 || _numKeyframes == 0)
+    return NULL;
+
+  int left = (int)floorf(time);
+  float t = time - left;
+  left = left % int(_numKeyframes);
+  if (left < 0)
+    left += _numKeyframes;
+  int right = (left + 1) % int(_numKeyframes);
+  if (_numKeyframes == 1)
+    t = 0;
+
+  // Keep the two most recently decoded keyframes around: during playback the
+  // new left keyframe is almost always the previous right one.
+  DecodedKeyframe* decoded[2] = { NULL, NULL };
+  int wanted[2] = { left, right };
+  for (unsigned int w = 0; w < 2; ++w) {
+    for (unsigned int slot = 0; slot < 2; ++slot) {
+      if (frames[slot].keyframe == wanted[w])
+        decoded[w] = &frames[slot];
+    }
+  }
+  for (unsigned int w = 0; w < 2; ++w) {
+    if (decoded[w] != NULL || (w == 1 && t == 0))
+      continue;
+    DecodedKeyframe* slot = (decoded[1 - w] == &frames[0]) ? &frames[1] : &frames[0];
+    slot->values.resize(count * 3);
+    if (coords)
+      decodeCoords(wanted[w], &slot->values[0]);
+    else
+      decodeNormals(wanted[w], &slot->values[0]);
+    slot->keyframe = wanted[w];
+    decoded[w] = slot;
+  }
+
+  result.resize(count * 3);
+  if (t == 0)
+    memcpy(&result[0], &decoded[0]->values[0], count * 3 * sizeof(float));
+  else
+    lerpArrays(&decoded[0]->values[0], &decoded[1]->values[0], t, count * 3, &result[0]);
+  return &result[0];
+}
+
+
+//
+// PCAKeyframes::Factors METHODS
+//
+
+PCAKeyframes::Factors::Factors() :
+  numItems(0),
+  numBases(0),
+  mean(),
+  bases(),
+  weights(),
+  blended(),
+  result(),
+  resultTime(-1e20)
+{
+}
+
+
+size_t PCAKeyframes::Factors::bytesUsed() const
+{
+  return (mean.size() + bases.size() + weights.size()) * sizeof(float);
+}
+
+
+//
+// PCAKeyframes METHODS
+//
+
+PCAKeyframes::PCAKeyframes(const std::vector<Curve3>& coords,
+    const std::vector<Curve3>& normals, const vh::Vector3& low, const vh::Vector3& high,
+    size_t numBases, float errorTolerance) :
+  _numKeyframes(0),
+  _low(low),
+  _high(high),
+  _coords(),
+  _normals(),
+  _maxCoordError(0),
+  _rmsCoordError(0),
+  _maxNormalError(0)
+{
+  for (size_t i = 0; i < coords.size(); ++i)
+    _numKeyframes = std::max(_numKeyframes, coords[i].numKeyframes());
+  for (size_t i = 0; i < normals.size(); ++i)
+    _numKeyframes = std::max(_numKeyframes, normals[i].numKeyframes());
+
+  float diagonal = (high.x >= low.x) ? vh::length(high - low) : 0;
+  factor(coords, numBases, errorTolerance * diagonal, _coords);
+  factor(normals, numBases, errorTolerance, _normals);
+  measureError(coords, normals);
+}
+
+
+PCAKeyframes::PCAKeyframes() :
+  _numKeyframes(0),
+  _low(),
+  _high(),
+  _coords(),
+  _normals(),
+  _maxCoordError(0),
+  _rmsCoordError(0),
+  _maxNormalError(0)
+{
+}
+
+
+uint64_t PCAKeyframes::hash(const std::vector<Curve3>& coords,
+    const std::vector<Curve3>& normals, size_t numBases, float errorTolerance)
+{
+  uint64_t numItems[2] = { coords.size(), normals.size() };
+  uint64_t h = hashBytes(numItems, sizeof(numItems));
+  uint64_t bases = numBases;
+  h = hashBytes(&bases, sizeof(bases), h);
+  h = hashBytes(&errorTolerance, sizeof(errorTolerance), h);
+
+  const std::vector<Curve3>* curves[2] = { &coords, &normals };
+  for (unsigned int c = 0; c < 2; ++c) {
+    for (size_t i = 0; i < curves[c]->size(); ++i) {
+      const Curve3& curve = (*curves[c])[i];
+      uint64_t numKeyframes = curve.numKeyframes();
+      h = hashBytes(&numKeyframes, sizeof(numKeyframes), h);
+      for (size_t k = 0; k < curve.numKeyframes(); ++k) {
+        vh::Vector3 value = curve[k];
+        h = hashBytes(value.data, sizeof(value.data), h);
+      }
+    }
+  }
+  return h;
+}
+
+
+bool PCAKeyframes::read(const std::string& path, uint64_t hash,
+    const std::vector<Curve3>& coords, const std::vector<Curve3>& normals,
+    PCAKeyframes*& keyframes)
+{
+  // The file is the magic number, the hash, the number of keyframes, the
+  // bounding box and the errors, then the coord and normal factors.
+  keyframes = NULL;
+  FILE* file = fopen(path.c_str(), "rb");
+  if (file == NULL)
+    return errno == ENOENT;
+
+  char magic[sizeof(PCA_KEYFRAMES_MAGIC)];
+  uint64_t fileHash = 0;
+  uint32_t numKeyframes = 0;
+  PCAKeyframes* result = new PCAKeyframes();
+  bool ok = fread(magic, sizeof(magic), 1, file) == 1 &&
+            memcmp(magic, PCA_KEYFRAMES_MAGIC, sizeof(magic)) == 0 &&
+            fread(&fileHash, sizeof(fileHash), 1, file) == 1 && fileHash == hash &&
+            fread(&numKeyframes, sizeof(numKeyframes), 1, file) == 1 &&
+            fread(result->_low.data, sizeof(result->_low.data), 1, file) == 1 &&
+            fread(result->_high.data, sizeof(result->_high.data), 1, file) == 1 &&
+            fread(&result->_maxCoordError, sizeof(float), 1, file) == 1 &&
+            fread(&result->_rmsCoordError, sizeof(float), 1, file) == 1 &&
+            fread(&result->_maxNormalError, sizeof(float), 1, file) == 1;
+  ok = ok && numKeyframes == std::max(maxKeyframes(coords), maxKeyframes(normals));
+  if (ok) {
+    result->_numKeyframes = numKeyframes;
+    ok = result->readFactors(file, coords.size(), result->_coords) &&
+         result->readFactors(file, normals.size(), result->_normals);
+  }
+
+  // A truncated or inconsistent file is as good as an out of date one.
+  if (ok)
+    keyframes = result;
+  else
+    delete result;
+  ok = !ferror(file);
+  fclose(file);
+  return ok;
+}
+
+
+bool PCAKeyframes::write(const std::string& path, uint64_t hash) const
+{
+  FILE* file = fopen(path.c_str(), "wb");
+  if (file == NULL)
+    return false;
+
+  uint32_t numKeyframes = _numKeyframes;
+  bool ok = fwrite(PCA_KEYFRAMES_MAGIC, sizeof(PCA_KEYFRAMES_MAGIC), 1, file) == 1 &&
+            fwrite(&hash, sizeof(hash), 1, file) == 1 &&
+            fwrite(&numKeyframes, sizeof(numKeyframes), 1, file) == 1 &&
+            fwrite(_low.data, sizeof(_low.data), 1, file) == 1 &&
+            fwrite(_high.data, sizeof(_high.data), 1, file) == 1 &&
+            fwrite(&_maxCoordError, sizeof(float), 1, file) == 1 &&
+            fwrite(&_rmsCoordError, sizeof(float), 1, file) == 1 &&
+            fwrite(&_maxNormalError, sizeof(float), 1, file) == 1 &&
+            writeFactors(file, _coords) &&
+            writeFactors(file, _normals);
+
+  if (fclose(file) != 0)
+    ok = false;
+  return ok;
+}
+
+
+size_t PCAKeyframes::numKeyframes() const
+{
+  return _numKeyframes;
+}
+
+
+size_t PCAKeyframes::numCoords() const
+{
+  return _coords.numItems;
+}
+
+
+size_t PCAKeyframes::numNormals() const
+{
+  return _normals.numItems;
+}
+
+
+size_t PCAKeyframes::numCoordBases() const
+{
+  return _coords.numBases;
+}
+
+
+size_t PCAKeyframes::numNormalBases() const
+{
+  return _normals.numBases;
+}
+
+
+size_t PCAKeyframes::bytesUsed() const
+{
+  return _coords.bytesUsed() + _normals.bytesUsed();
+}
+
+
+size_t PCAKeyframes::uncompressedBytes() const
+{
+  return (_coords.numItems + _normals.numItems) * _numKeyframes * sizeof(vh::Vector3);
+}
+
+
+const float* PCAKeyframes::coordsAt(float time)
+{
+  return interpolate(time, _coords);
+}
+
+
+const float* PCAKeyframes::normalsAt(float time)
+{
+  return interpolate(time, _normals);
+}
+
+
+void PCAKeyframes::decodeCoords(size_t keyframe, float* out)
+{
+  reconstruct(_coords, _coords.weights.empty() ? NULL : &_coords.weights[keyframe * _coords.numBases], out);
+}
+
+
+void PCAKeyframes::decodeNormals(size_t keyframe, float* out)
+{
+  reconstruct(_normals, _normals.weights.empty() ? NULL : &_normals.weights[keyframe * _normals.numBases], out);
+}
+
+
+float PCAKeyframes::maxCoordError() const
+{
+  return _maxCoordError;
+}
+
+
+float PCAKeyframes::rmsCoordError() const
+{
+  return _rmsCoordError;
+}
+
+
+float PCAKeyframes::maxNormalError() const
+{
+  return _maxNormalError;
+}
+
+
+void PCAKeyframes::printStats() const
+{
+  float diagonal = (_high.x >= _low.x) ? vh::length(_high - _low) : 0;
+  fprintf(stderr, "Factored %lu keyframes into %lu coord and %lu normal bases: %1.2f MB -> %1.2f MB (%1.2fx smaller)\n",
+      _numKeyframes, _coords.numBases, _normals.numBases,
+      uncompressedBytes() / 1048576.0, bytesUsed() / 1048576.0,
+      float(uncompressedBytes()) / float(std::max(bytesUsed(), (size_t)1)));
+  fprintf(stderr, "Max coord error %g (%1.4f%% of bbox diagonal), rms %g; max normal error %1.3f degrees\n",
+      _maxCoordError, diagonal > 0 ? 100.0 * _maxCoordError / diagonal : 0.0,
+      _rmsCoordError, _maxNormalError);
+}
+
+
+void PCAKeyframes::factor(const std::vector<Curve3>& curves, size_t numBases,
+    float maxRMSError, Factors& factors)
+{
+  const size_t numItems = curves.size();
+  const size_t numKeyframes = _numKeyframes;
+  factors.numItems = numItems;
+  factors.numBases = 0;
+  factors.mean.assign(numItems * 3, 0.0f);
+  factors.weights.clear();
+  factors.bases.clear();
+  if (numItems == 0 || numKeyframes == 0)
+    return;
+
+#pragma omp parallel for schedule(static)
+  for (size_t i = 0; i < numItems; ++i) {
+    double sum[3] = { 0, 0, 0 };
+    for (size_t k = 0; k < numKeyframes; ++k) {
+      vh::Vector3 value = keyframeOf(curves[i], k);
+      for (unsigned int j = 0; j < 3; ++j)
+        sum[j] += value.data[j];
+    }
+    for (unsigned int j = 0; j < 3; ++j)
+      factors.mean[i * 3 + j] = float(sum[j] / numKeyframes);
+  }
+
+  // Rather than decomposing the huge matrix of centred values directly, we
+  // find the eigenvectors of its much smaller keyframe x keyframe Gram
+  // matrix; each of those gives one basis shape and its weight in every
+  // keyframe. The Gram matrix is built up one item at a time, so we never
+  // need a second copy of the keyframes.
+  std::vector<double> gram(numKeyframes * numKeyframes, 0.0);
+#pragma omp parallel
+  {
+    std::vector<double> partial(numKeyframes * numKeyframes, 0.0);
+    std::vector<double> centred(numKeyframes);
+#pragma omp for schedule(static)
+    for (size_t i = 0; i < numItems; ++i) {
+      for (unsigned int j = 0; j < 3; ++j) {
+        for (size_t k = 0; k < numKeyframes; ++k)
+          centred[k] = keyframeOf(curves[i], k).data[j] - factors.mean[i * 3 + j];
+        for (size_t a = 0; a < numKeyframes; ++a) {
+          if (centred[a] == 0)
+            continue;
+          double* row = &partial[a * numKeyframes];
+          for (size_t b = a; b < numKeyframes; ++b)
+            row[b] += centred[a] * centred[b];
+        }
+      }
+    }
+#pragma omp critical
+    for (size_t i = 0; i < gram.size(); ++i)
+      gram[i] += partial[i];
+  }
+  for (size_t a = 0; a < numKeyframes; ++a) {
+    for (size_t b = 0; b < a; ++b)
+      gram[a * numKeyframes + b] = gram[b * numKeyframes + a];
+  }
+
+  std::vector<double> values, vectors;
+  symmetricEigen(gram, numKeyframes, values, vectors);
+
+  // Each eigenvalue is the squared error we'd remove by adding its basis.
+  // Anything tiny next to the largest is just rounding noise.
+  size_t rank = 0;
+  double total = 0;
+  while (rank < numKeyframes && values[rank] > values[0] * 1e-12) {
+    total += values[rank];
+    ++rank;
+  }
+
+  size_t count = 0;
+  if (numBases > 0) {
+    count = std::min(numBases, rank);
+  } else {
+    double allowed = double(maxRMSError) * maxRMSError * numItems * numKeyframes;
+    double remaining = total;
+    while (count < rank && remaining > allowed)
+      remaining -= values[count++];
+  }
+  factors.numBases = count;
+
+  // Scale the bases to unit length, which puts their magnitude in the
+  // weights.
+  std::vector<double> scale(count);
+  for (size_t b = 0; b < count; ++b)
+    scale[b] = sqrt(values[b]);
+
+  factors.weights.resize(numKeyframes * count);
+  for (size_t k = 0; k < numKeyframes; ++k) {
+    for (size_t b = 0; b < count; ++b)
+      factors.weights[k * count + b] = float(scale[b] * vectors[b * numKeyframes + k]);
+  }
+
+  const size_t n = numItems * 3;
+  factors.bases.resize(count * n);
+#pragma omp parallel
+  {
+    std::vector<double> centred(numKeyframes);
+#pragma omp for schedule(static)
+    for (size_t i = 0; i < numItems; ++i) {
+      for (unsigned int j = 0; j < 3; ++j) {
+        for (size_t k = 0; k < numKeyframes; ++k)
+          centred[k] = keyframeOf(curves[i], k).data[j] - factors.mean[i * 3 + j];
+        for (size_t b = 0; b < count; ++b) {
+          const double* vec = &vectors[b * numKeyframes];
+          double sum = 0;
+          for (size_t k = 0; k < numKeyframes; ++k)
+            sum += vec[k] * centred[k];
+          factors.bases[b * n + i * 3 + j] = float(sum / scale[b]);
+        }
+      }
+    }
+  }
+}
+
+
+bool PCAKeyframes::readFactors(FILE* file, size_t numItems, Factors& factors)
+{
+  // Nothing is allocated until its count has been checked: the number of
+  // items has to match the model's and there can't be more bases than
+  // keyframes.
+  uint32_t counts[2] = { 0, 0 };
+  if (fread(counts, sizeof(counts), 1, file) != 1 || counts[0] != numItems ||
+      counts[1] > _numKeyframes) {
+    return false;
+  }
+
+  factors.numItems = counts[0];
+  factors.numBases = counts[1];
+  factors.mean.resize(factors.numItems * 3);
+  factors.bases.resize(factors.numBases * factors.numItems * 3);
+  factors.weights.resize(_numKeyframes * factors.numBases);
+  std::vector<float>* arrays[3] = { &factors.mean, &factors.bases, &factors.weights };
+  for (unsigned int i = 0; i < 3; ++i) {
+    size_t count = arrays[i]->size();
+    if (count > 0 && fread(&(*arrays[i])[0], sizeof(float), count, file) != count)
+      return false;
+  }
+  return true;
+}
+
+
+bool PCAKeyframes::writeFactors(FILE* file, const Factors& factors) const
+{
+  uint32_t counts[2] = { uint32_t(factors.numItems), uint32_t(factors.numBases) };
+  if (fwrite(counts, sizeof(counts), 1, file) != 1)
+    return false;
+
+  const std::vector<float>* arrays[3] = { &factors.mean, &factors.bases, &factors.weights };
+  for (unsigned int i = 0; i < 3; ++i) {
+    size_t count = arrays[i]->size();
+    if (count > 0 && fwrite(&(*arrays[i])[0], sizeof(float), count, file) != count)
+      return false;
+  }
+  return true;
+}
+
+
+void PCAKeyframes::measureError(const std::vector<Curve3>& coords,
+    const std::vector<Curve3>& normals)
+{
+  std::vector<float> decoded(std::max(_coords.numItems, _normals.numItems) * 3);
+  double sumSqr = 0;
+
+  for (size_t keyframe = 0; keyframe < _numKeyframes; ++keyframe) {
+    if (_coords.numItems > 0) {
+      decodeCoords(keyframe, &decoded[0]);
+      for (size_t i = 0; i < _coords.numItems; ++i) {
+        vh::Vector3 err = keyframeOf(coords[i], keyframe) -
+            vh::Vector3(decoded[i * 3], decoded[i * 3 + 1], decoded[i * 3 + 2]);
+        float errSqr = vh::lengthSqr(err);
+        sumSqr += errSqr;
+        _maxCoordError = std::max(_maxCoordError, sqrtf(errSqr));
+      }
+    }
+
+    if (_normals.numItems > 0) {
+      decodeNormals(keyframe, &decoded[0]);
+      for (size_t i = 0; i < _normals.numItems; ++i) {
+        vh::Vector3 original = keyframeOf(normals[i], keyframe);
+        vh::Vector3 normal(decoded[i * 3], decoded[i * 3 + 1], decoded[i * 3 + 2]);
+        if (vh::lengthSqr(original) == 0)
+          continue;
+        // The reconstructed normal isn't unit length, but only its
+        // direction matters.
+        float cosAngle = (vh::lengthSqr(normal) > 0) ? vh::dot(vh::norm(original), vh::norm(normal)) : -1;
+        float angle = acosf(std::max(-1.0f, std::min(cosAngle, 1.0f))) * 180.0 / M_PI;
+        _maxNormalError = std::max(_maxNormalError, angle);
+      }
+    }
+  }
+
+  if (_coords.numItems > 0 && _numKeyframes > 0)
+    _rmsCoordError = sqrt(sumSqr / double(_coords.numItems * _numKeyframes));
+}
+
+
+void PCAKeyframes::reconstruct(Factors& factors, const float* weights, float* out)
+{
+  blendArrays(&factors.mean[0], factors.bases.empty() ? NULL : &factors.bases[0],
+      weights, factors.numBases, factors.numItems * 3, out);
+}
+
+
+const float* PCAKeyframes::interpolate(float time, Factors& factors)
+{
+  if (factors.numItems == 0 || _numKeyframes == 0)
+    return NULL;
+  if (time == factors.resultTime && !factors.result.empty())
+    return &factors.result[0];
+
+  int left = (int)floorf(time);
+  float t = time - left;
+  left = left % int(_numKeyframes);
+  if (left < 0)
+    left += _numKeyframes;
+  int right = (left + 1) % int(_numKeyframes);
+  if (_numKeyframes == 1)
+    t = 0;
+
+  // The keyframes are linear in their weights, so blending the weights is
+  // the same as blending the reconstructed keyframes.
+  const size_t count = factors.numBases;
+  factors.blended.resize(count);
+  for (size_t b = 0; b < count; ++b) {
+    float a = factors.weights[left * count + b];
+    float c = factors.weights[right * count + b];
+    factors.blended[b] = a + (c - a) * t;
+  }
+
+  factors.result.resize(factors.numItems * 3);
+  reconstruct(factors, factors.blended.empty() ? NULL : &factors.blended[0], &factors.result[0]);
+  factors.resultTime = time;
+  return &factors.result[0];
+}
+
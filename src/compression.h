@@ -0,0 +1,213 @@
+#ifndef OBJViewer_compression_h
+#define OBJViewer_compression_h
+
+#include <cstdio>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include "vector.h"
+#include "model.h"
+
+
+//
+// TYPES
+//
+
+// A compact, read-only copy of a model's animated coords and normals.
+//
+// Coords are quantized to 16 bits per component relative to the model's
+// bounding box. Normals are octahedral-encoded into two 16 bit values. All of
+// the data for a single keyframe is held in a contiguous block, so decoding a
+// keyframe is a single linear pass.
+//
+// If delta coding is enabled, any keyframe whose coords are all within +/-127
+// quantization steps of the previous keyframe is stored as 8 bit deltas
+// instead. A full keyframe is always stored at least every MAX_DELTA_RUN
+// frames so that seeking never has to replay too long a chain.
+class QuantizedKeyframes {
+public:
+  QuantizedKeyframes(const std::vector<Curve3>& coords, const std::vector<Curve3>& normals,
+      const vh::Vector3& low, const vh::Vector3& high, bool deltaCoding);
+
+  size_t numKeyframes() const;
+  size_t numCoords() const;
+  size_t numNormals() const;
+  size_t numDeltaKeyframes() const;
+
+  size_t bytesUsed() const;
+  size_t uncompressedBytes() const;
+
+  // Interpolated values for every coord (or normal) at the given time, as 3
+  // floats per item. The result stays valid until the next call with a
+  // different time.
+  const float* coordsAt(float time);
+  const float* normalsAt(float time);
+
+  // Decompressed values for a single keyframe, as 3 floats per item.
+  void decodeCoords(size_t keyframe, float* out);
+  void decodeNormals(size_t keyframe, float* out);
+
+  // Error measured against the original data when the keyframes were
+  // compressed. Coord errors are in model units, normal errors in degrees.
+  float maxCoordError() const;
+  float rmsCoordError() const;
+  float maxNormalError() const;
+
+  void printStats() const;
+
+private:
+  struct KeyframeInfo {
+    bool isDelta;
+    size_t offset;
+  };
+
+  struct DecodedKeyframe {
+    int keyframe;
+    std::vector<float> values;
+  };
+
+  void encodeCoords(const std::vector<Curve3>& coords, bool deltaCoding);
+  void encodeNormals(const std::vector<Curve3>& normals);
+  void measureError(const std::vector<Curve3>& coords, const std::vector<Curve3>& normals);
+
+  void quantizedCoordsFor(size_t keyframe);
+  const float* interpolate(float time, DecodedKeyframe* frames, std::vector<float>& result,
+      size_t count, bool coords);
+
+private:
+  size_t _numKeyframes;
+  size_t _numCoords;
+  size_t _numNormals;
+
+  vh::Vector3 _low;
+  vh::Vector3 _step;
+
+  std::vector<KeyframeInfo> _coordKeyframes;
+  std::vector<uint16_t> _absoluteCoords;
+  std::vector<int8_t> _deltaCoords;
+  std::vector<int16_t> _normals;
+
+  // The quantized coords for the most recently decoded keyframe, so that
+  // playing forwards through a run of delta frames only applies one delta.
+  std::vector<uint16_t> _chain;
+  int _chainKeyframe;
+
+  DecodedKeyframe _coordFrames[2];
+  DecodedKeyframe _normalFrames[2];
+  std::vector<float> _coordResult;
+  std::vector<float> _normalResult;
+  float _coordResultTime;
+  float _normalResultTime;
+
+  float _maxCoordError;
+  float _rmsCoordError;
+  float _maxNormalError;
+};
+
+
+// A model's animated coords and normals factored into a mean shape plus a
+// small number of basis shapes, with a weight for each basis in each
+// keyframe (i.e. principal component analysis over the keyframes).
+//
+// A keyframe is reconstructed as the mean plus the weighted sum of the bases.
+// Because this is linear in the weights, interpolating between keyframes only
+// has to interpolate the weights: every frame costs one pass over the bases,
+// whatever the time. Memory use grows by one basis per extra degree of
+// freedom in the motion rather than by one copy of the model per keyframe,
+// so the savings are biggest on long sequences.
+//
+// The number of bases is either given directly or chosen as the fewest which
+// keep the rms error within a tolerance. Coords and normals are factored
+// separately.
+//
+// Factoring is slow for long sequences, so the result can be written to a
+// file and read back on later runs instead.
+class PCAKeyframes {
+public:
+  // If numBases is 0, the number of bases is chosen from errorTolerance
+  // instead: a fraction of the bounding box diagonal for coords and of unit
+  // length for normals.
+  PCAKeyframes(const std::vector<Curve3>& coords, const std::vector<Curve3>& normals,
+      const vh::Vector3& low, const vh::Vector3& high, size_t numBases, float errorTolerance);
+
+  // Identifies the keyframes and settings a file was written for.
+  static uint64_t hash(const std::vector<Curve3>& coords, const std::vector<Curve3>& normals,
+      size_t numBases, float errorTolerance);
+
+  // Sets keyframes to NULL if the file is missing, was written for a
+  // different hash or doesn't fit the given curves; that isn't an error.
+  // Both return false and set errno if the file couldn't be read or written.
+  static bool read(const std::string& path, uint64_t hash, const std::vector<Curve3>& coords,
+      const std::vector<Curve3>& normals, PCAKeyframes*& keyframes);
+  bool write(const std::string& path, uint64_t hash) const;
+
+  size_t numKeyframes() const;
+  size_t numCoords() const;
+  size_t numNormals() const;
+  size_t numCoordBases() const;
+  size_t numNormalBases() const;
+
+  size_t bytesUsed() const;
+  size_t uncompressedBytes() const;
+
+  // Interpolated values for every coord (or normal) at the given time, as 3
+  // floats per item. The result stays valid until the next call with a
+  // different time.
+  const float* coordsAt(float time);
+  const float* normalsAt(float time);
+
+  // Reconstructed values for a single keyframe, as 3 floats per item.
+  void decodeCoords(size_t keyframe, float* out);
+  void decodeNormals(size_t keyframe, float* out);
+
+  // Error measured against the original data when the keyframes were
+  // factored. Coord errors are in model units, normal errors in degrees.
+  float maxCoordError() const;
+  float rmsCoordError() const;
+  float maxNormalError() const;
+
+  void printStats() const;
+
+private:
+  struct Factors {
+    size_t numItems;
+    size_t numBases;
+    std::vector<float> mean;    // 3 floats per item.
+    std::vector<float> bases;   // numBases blocks of 3 floats per item.
+    std::vector<float> weights; // numBases floats per keyframe.
+    std::vector<float> blended; // Interpolated weights for the result.
+    std::vector<float> result;
+    float resultTime;
+
+    Factors();
+    size_t bytesUsed() const;
+  };
+
+  PCAKeyframes();
+
+  void factor(const std::vector<Curve3>& curves, size_t numBases, float maxRMSError,
+      Factors& factors);
+  bool readFactors(FILE* file, size_t numItems, Factors& factors);
+  bool writeFactors(FILE* file, const Factors& factors) const;
+  void measureError(const std::vector<Curve3>& coords, const std::vector<Curve3>& normals);
+
+  void reconstruct(Factors& factors, const float* weights, float* out);
+  const float* interpolate(float time, Factors& factors);
+
+private:
+  size_t _numKeyframes;
+  vh::Vector3 _low;
+  vh::Vector3 _high;
+
+  Factors _coords;
+  Factors _normals;
+
+  float _maxCoordError;
+  float _rmsCoordError;
+  float _maxNormalError;
+};
+
+
+#endif // OBJViewer_compression_h
+
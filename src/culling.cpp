@@ -0,0 +1,349 @@
+#include "culling.h"
+
+#include <algorithm>
+#include <cmath>
+
+
+//
+// CONSTANTS
+//
+
+// Nodes with this many items or fewer aren't split any further.
+const size_t MAX_ITEMS_PER_LEAF = 4;
+
+
+//
+// INTERNAL FUNCTIONS
+//
+
+// Orders a set of indexes by their points' position along one axis.
+struct ByAxis {
+  const std::vector<vh::Vector3>& points;
+  unsigned int axis;
+
+  ByAxis(const std::vector<vh::Vector3>& iPoints, unsigned int iAxis) :
+    points(iPoints), axis(iAxis)
+  {
+  }
+
+  bool operator () (size_t a, size_t b) const
+  {
+    return points[a].data[axis] < points[b].data[axis];
+  }
+};
+
+
+// The axis along which the box around the given points is longest.
+unsigned int longestAxis(const std::vector<vh::Vector3>& points, const size_t* indexes, size_t count)
+{
+  vh::Vector3 low = points[indexes[0]];
+  vh::Vector3 high = low;
+  for (size_t i = 1; i < count; ++i) {
+    const vh::Vector3& p = points[indexes[i]];
+    for (unsigned int j = 0; j < 3; ++j) {
+      low.data[j] = std::min(low.data[j], p.data[j]);
+      high.data[j] = std::max(high.data[j], p.data[j]);
+    }
+  }
+
+  vh::Vector3 size = high - low;
+  if (size.x >= size.y && size.x >= size.z)
+    return 0;
+  return (size.y >= size.z) ? 1 : 2;
+}
+
+
+// Puts the half of the indexes whose points are lowest along the longest axis
+// first. Returns the number in the first half.
+size_t splitIndexes(const std::vector<vh::Vector3>& points, size_t* indexes, size_t count)
+{
+  size_t half = count / 2;
+  std::nth_element(indexes, indexes + half, indexes + count,
+      ByAxis(points, longestAxis(points, indexes, count)));
+  return half;
+}
+
+
+void clusterRange(const std::vector<vh::Vector3>& points, size_t maxSize,
+    size_t* indexes, size_t count, std::vector<size_t>& sizes)
+{
+  if (count <= maxSize) {
+    sizes.push_back(count);
+    return;
+  }
+
+  size_t half = splitIndexes(points, indexes, count);
+  clusterRange(points, maxSize, indexes, half, sizes);
+  clusterRange(points, maxSize, indexes + half, count - half, sizes);
+}
+
+
+//
+// Frustum METHODS
+//
+
+Frustum::Frustum()
+{
+}
+
+
+void Frustum::fromMatrix(const float* m)
+{
+  // Each plane is the last row of the matrix plus or minus one of the others
+  // (Gribb & Hartmann). Element (row, col) is at m[col * 4 + row].
+  for (unsigned int i = 0; i < 3; ++i) {
+    for (unsigned int col = 0; col < 4; ++col) {
+      _planes[i * 2].data[col] = m[col * 4 + 3] + m[col * 4 + i];
+      _planes[i * 2 + 1].data[col] = m[col * 4 + 3] - m[col * 4 + i];
+    }
+  }
+
+  for (unsigned int i = 0; i < 6; ++i) {
+    vh::Vector4& plane = _planes[i];
+    float length = sqrtf(plane.x * plane.x + plane.y * plane.y + plane.z * plane.z);
+    if (length > 0)
+      plane = plane / length;
+  }
+}
+
+
+Frustum::Test Frustum::testSphere(const vh::Vector3& center, float radius) const
+{
+  Test result = kInside;
+  for (unsigned int i = 0; i < 6; ++i) {
+    const vh::Vector4& plane = _planes[i];
+    float distance = plane.x * center.x + plane.y * center.y + plane.z * center.z + plane.w;
+    if (distance < -radius)
+      return kOutside;
+    if (distance < radius)
+      result = kIntersecting;
+  }
+  return result;
+}
+
+
+Frustum::Test Frustum::testBox(const vh::Vector3& low, const vh::Vector3& high) const
+{
+  // For each plane, check the corner furthest along the plane's normal (if
+  // that's outside, the whole box is) and the corner furthest against it (if
+  // that's inside, the whole box is).
+  Test result = kInside;
+  for (unsigned int i = 0; i < 6; ++i) {
+    const vh::Vector4& plane = _planes[i];
+    float furthest = plane.w;
+    float nearest = plane.w;
+    for (unsigned int j = 0; j < 3; ++j) {
+      if (plane.data[j] >= 0) {
+        furthest += plane.data[j] * high.data[j];
+        nearest += plane.data[j] * low.data[j];
+      } else {
+        furthest += plane.data[j] * low.data[j];
+        nearest += plane.data[j] * high.data[j];
+      }
+    }
+    if (furthest < 0)
+      return kOutside;
+    if (nearest < 0)
+      result = kIntersecting;
+  }
+  return result;
+}
+
+
+bool Frustum::boxReachesNearPlane(const vh::Vector3& low, const vh::Vector3& high) const
+{
+  // The near plane is the fifth, and the corner nearest the camera is the
+  // one furthest against its normal.
+  const vh::Vector4& plane = _planes[4];
+  float nearest = plane.w;
+  for (unsigned int j = 0; j < 3; ++j)
+    nearest += plane.data[j] * ((plane.data[j] >= 0) ? low.data[j] : high.data[j]);
+  return nearest < 0;
+}
+
+
+//
+// BVH METHODS
+//
+
+BVH::BVH() :
+  _nodes(),
+  _items(),
+  _lows(),
+  _highs()
+{
+}
+
+
+void BVH::build(const std::vector<vh::Vector3>& lows, const std::vector<vh::Vector3>& highs)
+{
+  clear();
+  if (lows.empty())
+    return;
+
+  _lows = lows;
+  _highs = highs;
+  std::vector<vh::Vector3> centers(lows.size());
+  _items.resize(lows.size());
+  for (size_t i = 0; i < _items.size(); ++i) {
+    centers[i] = (lows[i] + highs[i]) / 2.0f;
+    _items[i] = i;
+  }
+  _nodes.reserve(lows.size());
+  buildNode(0, _items.size(), centers);
+}
+
+
+void BVH::clear()
+{
+  _nodes.clear();
+  _items.clear();
+  _lows.clear();
+  _highs.clear();
+}
+
+
+bool BVH::empty() const
+{
+  return _nodes.empty();
+}
+
+
+size_t BVH::numNodes() const
+{
+  return _nodes.size();
+}
+
+
+size_t BVH::cull(const Frustum& frustum, std::vector<bool>& visible) const
+{
+  visible.assign(_items.size(), false);
+  if (_nodes.empty())
+    return 0;
+  return cullNode(0, frustum, visible);
+}
+
+
+size_t BVH::buildNode(size_t first, size_t count, const std::vector<vh::Vector3>& centers)
+{
+  size_t index = _nodes.size();
+  _nodes.push_back(Node());
+
+  vh::Vector3 low = _lows[_items[first]];
+  vh::Vector3 high = _highs[_items[first]];
+  for (size_t i = first + 1; i < first + count; ++i) {
+    const vh::Vector3& itemLow = _lows[_items[i]];
+    const vh::Vector3& itemHigh = _highs[_items[i]];
+    for (unsigned int j = 0; j < 3; ++j) {
+      low.data[j] = std::min(low.data[j], itemLow.data[j]);
+      high.data[j] = std::max(high.data[j], itemHigh.data[j]);
+    }
+  }
+
+  size_t left = 0, right = 0;
+  if (count > MAX_ITEMS_PER_LEAF) {
+    size_t half = splitIndexes(centers, &_items[first], count);
+    left = buildNode(first, half, centers);
+    right = buildNode(first + half, count - half, centers);
+  }
+
+  Node& node = _nodes[index];
+  node.low = low;
+  node.high = high;
+  node.center = (low + high) / 2.0f;
+  node.radius = vh::length(high - low) / 2.0f;
+  node.first = first;
+  node.count = count;
+  node.left = left;
+  node.right = right;
+  return index;
+}
+
+
+size_t BVH::cullNode(size_t index, const Frustum& frustum, std::vector<bool>& visible) const
+{
+  // The sphere test is cheaper, so it gets the first go at rejecting (or
+  // accepting) the node; the box is tighter, so it settles what's left.
+  const Node& node = _nodes[index];
+  Frustum::Test test = frustum.testSphere(node.center, node.radius);
+  if (test == Frustum::kIntersecting)
+    test = frustum.testBox(node.low, node.high);
+
+  switch (test) {
+    case Frustum::kOutside:
+      return 0;
+    case Frustum::kInside:
+      return acceptNode(index, visible);
+    default:
+      break;
+  }
+
+  if (node.left != 0)
+    return cullNode(node.left, frustum, visible) + cullNode(node.right, frustum, visible);
+
+  // A leaf which straddles the frustum: test its items one by one.
+  size_t numVisible = 0;
+  for (size_t i = node.first; i < node.first + node.count; ++i) {
+    size_t item = _items[i];
+    if (frustum.testBox(_lows[item], _highs[item]) != Frustum::kOutside) {
+      visible[item] = true;
+      ++numVisible;
+    }
+  }
+  return numVisible;
+}
+
+
+size_t BVH::acceptNode(size_t index, std::vector<bool>& visible) const
+{
+  const Node& node = _nodes[index];
+  for (size_t i = node.first; i < node.first + node.count; ++i)
+    visible[_items[i]] = true;
+  return node.count;
+}
+
+
+//
+// FUNCTIONS
+//
+
+size_t numClusters(size_t numPoints, size_t maxSize)
+{
+  if (numPoints <= maxSize)
+    return (numPoints > 0) ? 1 : 0;
+  size_t half = numPoints / 2;
+  return numClusters(half, maxSize) + numClusters(numPoints - half, maxSize);
+}
+
+
+void clusterPoints(const std::vector<vh::Vector3>& points, size_t maxSize,
+    std::vector<size_t>& order, std::vector<size_t>& sizes)
+{
+  order.resize(points.size());
+  for (size_t i = 0; i < order.size(); ++i)
+    order[i] = i;
+  sizes.clear();
+  if (!order.empty())
+    clusterRange(points, maxSize, &order[0], order.size(), sizes);
+}
+
+
+void transformBox(const vh::Matrix4& m, const vh::Vector3& low, const vh::Vector3& high,
+    vh::Vector3& outLow, vh::Vector3& outHigh)
+{
+  // Each output axis starts from the translation and takes whichever end of
+  // each input axis moves it furthest in either direction.
+  for (unsigned int row = 0; row < 3; ++row) {
+    float lo = m.data[row][3];
+    float hi = m.data[row][3];
+    for (unsigned int col = 0; col < 3; ++col) {
+      float a = m.data[row][col] * low.data[col];
+      float b = m.data[row][col] * high.data[col];
+      lo += std::min(a, b);
+      hi += std::max(a, b);
+    }
+    outLow.data[row] = lo;
+    outHigh.data[row] = hi;
+  }
+}
+
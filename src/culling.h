@@ -0,0 +1,102 @@
+#ifndef OBJViewer_culling_h
+#define OBJViewer_culling_h
+
+#include <cstddef>
+#include <vector>
+
+#include "vector.h"
+
+
+//
+// TYPES
+//
+
+// The six planes around the region the camera can see, each stored as
+// (a, b, c, d) with the normal pointing inwards, so that a point p is on the
+// inside of the plane when a*p.x + b*p.y + c*p.z + d >= 0.
+class Frustum {
+public:
+  enum Test { kOutside, kIntersecting, kInside };
+
+  Frustum();
+
+  // Takes the planes from a combined projection * modelview matrix, stored
+  // in column-major order as GL does. Objects are then tested in the space
+  // the modelview matrix transforms from.
+  void fromMatrix(const float* m);
+
+  Test testSphere(const vh::Vector3& center, float radius) const;
+  Test testBox(const vh::Vector3& low, const vh::Vector3& high) const;
+
+  // Whether any of the box is on the camera's side of the near plane, in
+  // which case it may be clipped when drawn.
+  bool boxReachesNearPlane(const vh::Vector3& low, const vh::Vector3& high) const;
+
+private:
+  vh::Vector4 _planes[6];
+};
+
+
+// A bounding volume hierarchy over a set of items given by their bounding
+// boxes. Each node has a box and a sphere around everything below it, with
+// the items below it forming a contiguous range of _items, so a node which is
+// entirely inside the frustum can accept its whole range without visiting any
+// of its children.
+class BVH {
+public:
+  BVH();
+
+  void build(const std::vector<vh::Vector3>& lows, const std::vector<vh::Vector3>& highs);
+  void clear();
+
+  bool empty() const;
+  size_t numNodes() const;
+
+  // Sets visible[i] to whether item i's box is at least partly inside the
+  // frustum. Returns the number of visible items.
+  size_t cull(const Frustum& frustum, std::vector<bool>& visible) const;
+
+private:
+  struct Node {
+    vh::Vector3 low, high;
+    vh::Vector3 center;
+    float radius;
+    size_t first, count;   // The range of _items below this node.
+    size_t left, right;    // Child nodes. Both are 0 for a leaf.
+  };
+
+  size_t buildNode(size_t first, size_t count, const std::vector<vh::Vector3>& centers);
+  size_t cullNode(size_t node, const Frustum& frustum, std::vector<bool>& visible) const;
+  size_t acceptNode(size_t node, std::vector<bool>& visible) const;
+
+private:
+  std::vector<Node> _nodes;
+  std::vector<size_t> _items;
+  std::vector<vh::Vector3> _lows;
+  std::vector<vh::Vector3> _highs;
+};
+
+
+//
+// FUNCTIONS
+//
+
+// Splits a set of points into spatially compact clusters of at most maxSize
+// points, by halving them along the longest side of their bounding box until
+// they're small enough. On return, order holds the index of every point with
+// each cluster contiguous, and sizes holds the number of points in each
+// cluster in the same order.
+void clusterPoints(const std::vector<vh::Vector3>& points, size_t maxSize,
+    std::vector<size_t>& order, std::vector<size_t>& sizes);
+
+// The number of clusters clusterPoints will make from numPoints points.
+size_t numClusters(size_t numPoints, size_t maxSize);
+
+// The axis-aligned box around a box after it's been transformed by an affine
+// matrix (using the column vector convention).
+void transformBox(const vh::Matrix4& m, const vh::Vector3& low, const vh::Vector3& high,
+    vh::Vector3& outLow, vh::Vector3& outHigh);
+
+
+#endif // OBJViewer_culling_h
+
@@ -24,6 +24,27 @@ namespace vh {
 
     void addKeyframe(const VALUE& value)    { _keyframes.push_back(value); }
     size_t numKeyframes() const             { return _keyframes.size(); }
+
+    // Any new keyframes are copies of the last one.
+    void resize(size_t numKeyframes)
+    {
+      VALUE last = _keyframes.empty() ? VALUE() : _keyframes.back();
+      _keyframes.resize(numKeyframes, last);
+    }
+
+    void removeKeyframe(size_t index)       { _keyframes.erase(_keyframes.begin() + index); }
+
+    // Releases the memory used by the keyframes.
+    void clear()                            { std::vector<VALUE>().swap(_keyframes); }
+
+    // Drops every keyframe except the last one, keeping the memory for reuse.
+    void keepLastKeyframe()
+    {
+      if (_keyframes.size() > 1) {
+        _keyframes[0] = _keyframes.back();
+        _keyframes.resize(1);
+      }
+    }
   
     VALUE valueAt(float time) const
     {
@@ -38,6 +59,10 @@ namespace vh {
       int left = (int)floorf(time);
       int right = (left + 1) % _keyframes.size();
       float t = time - left;
+      // Exactly on a keyframe, so the next one doesn't come into it. It may
+      // not even have been loaded yet.
+      if (t == 0)
+        return _keyframes[left];
       return _keyframes[left] * (1.0 - t) + _keyframes[right] * t;
     }
 
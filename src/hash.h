@@ -0,0 +1,32 @@
+#ifndef OBJViewer_hash_h
+#define OBJViewer_hash_h
+
+#include <cstddef>
+#include <stdint.h>
+
+
+//
+// CONSTANTS
+//
+
+const uint64_t FNV_OFFSET_BASIS = 14695981039346656037ULL;
+const uint64_t FNV_PRIME = 1099511628211ULL;
+
+
+//
+// FUNCTIONS
+//
+
+// 64 bit FNV-1a, continuing from the given hash.
+inline uint64_t hashBytes(const void* data, size_t size, uint64_t hash = FNV_OFFSET_BASIS)
+{
+  const unsigned char* bytes = (const unsigned char*)data;
+  for (size_t i = 0; i < size; ++i) {
+    hash ^= bytes[i];
+    hash *= FNV_PRIME;
+  }
+  return hash;
+}
+
+
+#endif // OBJViewer_hash_h
@@ -0,0 +1,289 @@
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// The AVX2 kernel is compiled for AVX2 regardless of the compiler flags and
+// only called if the CPU supports it, so this needs a compiler which can
+// target instruction sets per function.
+#if (defined(__x86_64__) || defined(__i386__)) && \
+    (defined(__clang__) || __GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))
+#define HAVE_AVX2_KERNEL 1
+#include <immintrin.h>
+#endif
+
+#include "interpolate.h"
+
+
+//
+// CONSTANTS
+//
+
+// Arrays longer than this get split across threads.
+const size_t LERP_CHUNK_SIZE = 64 * 1024;
+
+// blendArrays() adds every array into one block of the output before moving
+// on to the next; this keeps the block in the L1 cache.
+const size_t BLEND_BLOCK_SIZE = 2048;
+
+
+//
+// TYPES
+//
+
+typedef void (*LerpKernel)(const float* a, const float* b, float t, size_t n, float* out);
+
+// out[i] += w * a[i], for n floats.
+typedef void (*AddScaledKernel)(const float* a, float w, size_t n, float* out);
+
+struct LerpKernelInfo {
+  LerpKernel kernel;
+  AddScaledKernel addScaled;
+  const char* name;
+};
+
+
+//
+// INTERNAL FUNCTIONS
+//
+
+void lerpScalar(const float* a, const float* b, float t, size_t n, float* out)
+{
+  for (size_t i = 0; i < n; ++i)
+    out[i] = a[i] + (b[i] - a[i]) * t;
+}
+
+
+void addScaledScalar(const float* a, float w, size_t n, float* out)
+{
+  for (size_t i = 0; i < n; ++i)
+    out[i] += w * a[i];
+}
+
+
+#ifdef __SSE2__
+void lerpSSE2(const float* a, const float* b, float t, size_t n, float* out)
+{
+  size_t i = 0;
+  const __m128 tt = _mm_set1_ps(t);
+  for (; i + 4 <= n; i += 4) {
+    __m128 va = _mm_loadu_ps(a + i);
+    __m128 vb = _mm_loadu_ps(b + i);
+    _mm_storeu_ps(out + i, _mm_add_ps(va, _mm_mul_ps(_mm_sub_ps(vb, va), tt)));
+  }
+  lerpScalar(a + i, b + i, t, n - i, out + i);
+}
+
+
+void addScaledSSE2(const float* a, float w, size_t n, float* out)
+{
+  size_t i = 0;
+  const __m128 ww = _mm_set1_ps(w);
+  for (; i + 4 <= n; i += 4)
+    _mm_storeu_ps(out + i, _mm_add_ps(_mm_loadu_ps(out + i), _mm_mul_ps(_mm_loadu_ps(a + i), ww)));
+  addScaledScalar(a + i, w, n - i, out + i);
+}
+#endif
+
+
+#ifdef HAVE_AVX2_KERNEL
+__attribute__((target("avx2,fma")))
+void lerpAVX2(const float* a, const float* b, float t, size_t n, float* out)
+{
+  size_t i = 0;
+  const __m256 tt = _mm256_set1_ps(t);
+  for (; i + 16 <= n; i += 16) {
+    __m256 va0 = _mm256_loadu_ps(a + i);
+    __m256 vb0 = _mm256_loadu_ps(b + i);
+    __m256 va1 = _mm256_loadu_ps(a + i + 8);
+    __m256 vb1 = _mm256_loadu_ps(b + i + 8);
+    _mm256_storeu_ps(out + i, _mm256_fmadd_ps(_mm256_sub_ps(vb0, va0), tt, va0));
+    _mm256_storeu_ps(out + i + 8, _mm256_fmadd_ps(_mm256_sub_ps(vb1, va1), tt, va1));
+  }
+  for (; i + 8 <= n; i += 8) {
+    __m256 va = _mm256_loadu_ps(a + i);
+    __m256 vb = _mm256_loadu_ps(b + i);
+    _mm256_storeu_ps(out + i, _mm256_fmadd_ps(_mm256_sub_ps(vb, va), tt, va));
+  }
+  lerpScalar(a + i, b + i, t, n - i, out + i);
+}
+
+
+__attribute__((target("avx2,fma")))
+void addScaledAVX2(const float* a, float w, size_t n, float* out)
+{
+  size_t i = 0;
+  const __m256 ww = _mm256_set1_ps(w);
+  for (; i + 16 <= n; i += 16) {
+    __m256 v0 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i), ww, _mm256_loadu_ps(out + i));
+    __m256 v1 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i + 8), ww, _mm256_loadu_ps(out + i + 8));
+    _mm256_storeu_ps(out + i, v0);
+    _mm256_storeu_ps(out + i + 8, v1);
+  }
+  for (; i + 8 <= n; i += 8)
+    _mm256_storeu_ps(out + i, _mm256_fmadd_ps(_mm256_loadu_ps(a + i), ww, _mm256_loadu_ps(out + i)));
+  addScaledScalar(a + i, w, n - i, out + i);
+}
+#endif
+
+
+LerpKernelInfo chooseLerpKernel()
+{
+  LerpKernelInfo info = { lerpScalar, addScaledScalar, "scalar" };
+#ifdef __SSE2__
+  info.kernel = lerpSSE2;
+  info.addScaled = addScaledSSE2;
+  info.name = "SSE2";
+#endif
+#ifdef HAVE_AVX2_KERNEL
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+    info.kernel = lerpAVX2;
+    info.addScaled = addScaledAVX2;
+    info.name = "AVX2";
+  }
+#endif
+  return info;
+}
+
+
+const LerpKernelInfo gLerpKernel = chooseLerpKernel();
+
+
+//
+// KeyframeArrays METHODS
+//
+
+KeyframeArrays::KeyframeArrays(const std::vector<Curve3>& curves) :
+  _numKeyframes(0),
+  _numItems(curves.size()),
+  _values(),
+  _result(),
+  _resultTime(-1e20)
+{
+  for (size_t i = 0; i < curves.size(); ++i)
+    _numKeyframes = std::max(_numKeyframes, curves[i].numKeyframes());
+  _values.resize(_numKeyframes * _numItems * 3);
+
+#pragma omp parallel for schedule(static)
+  for (size_t i = 0; i < _numItems; ++i) {
+    const Curve3& curve = curves[i];
+    for (size_t k = 0; k < _numKeyframes; ++k) {
+      vh::Vector3 value;
+      if (curve.numKeyframes() == 0)
+        value = vh::Vector3(0, 0, 0);
+      else
+        value = curve[std::min(k, curve.numKeyframes() - 1)];
+      float* dst = &_values[(k * _numItems + i) * 3];
+      dst[0] = value.x;
+      dst[1] = value.y;
+      dst[2] = value.z;
+    }
+  }
+}
+
+
+size_t KeyframeArrays::numKeyframes() const
+{
+  return _numKeyframes;
+}
+
+
+size_t KeyframeArrays::numItems() const
+{
+  return _numItems;
+}
+
+
+size_t KeyframeArrays::bytesUsed() const
+{
+  return (_values.capacity() + _result.capacity()) * sizeof(float);
+}
+
+
+const float* KeyframeArrays::keyframe(size_t index) const
+{
+  return &_values[index * _numItems * 3];
+}
+
+
+const float* KeyframeArrays::valuesAt(float time)
+{
+  if (_numKeyframes == 0 || _numItems == 0)
+    return NULL;
+
+  if (time != _resultTime) {
+    _result.resize(_numItems * 3);
+    interpolate(time, &_result[0]);
+    _resultTime = time;
+  }
+  return &_result[0];
+}
+
+
+void KeyframeArrays::interpolate(float time, float* out) const
+{
+  if (_numKeyframes == 0 || _numItems == 0)
+    return;
+
+  int left = (int)floorf(time);
+  float t = time - left;
+  left = left % int(_numKeyframes);
+  if (left < 0)
+    left += _numKeyframes;
+  int right = (left + 1) % int(_numKeyframes);
+
+  const size_t n = _numItems * 3;
+  if (t == 0 || _numKeyframes == 1)
+    memcpy(out, keyframe(left), n * sizeof(float));
+  else
+    lerpArrays(keyframe(left), keyframe(right), t, n, out);
+}
+
+
+//
+// PUBLIC FUNCTIONS
+//
+
+void lerpArrays(const float* a, const float* b, float t, size_t n, float* out)
+{
+  const LerpKernel kernel = gLerpKernel.kernel;
+  const size_t numChunks = (n + LERP_CHUNK_SIZE - 1) / LERP_CHUNK_SIZE;
+
+#pragma omp parallel for schedule(static) if (numChunks > 1)
+  for (size_t chunk = 0; chunk < numChunks; ++chunk) {
+    size_t start = chunk * LERP_CHUNK_SIZE;
+    size_t count = std::min(LERP_CHUNK_SIZE, n - start);
+    kernel(a + start, b + start, t, count, out + start);
+  }
+}
+
+
+const char* lerpArraysKernel()
+{
+  return gLerpKernel.name;
+}
+
+
+void blendArrays(const float* base, const float* arrays, const float* weights,
+    size_t numArrays, size_t n, float* out)
+{
+  const AddScaledKernel kernel = gLerpKernel.addScaled;
+  const size_t numBlocks = (n + BLEND_BLOCK_SIZE - 1) / BLEND_BLOCK_SIZE;
+  const bool threaded = (n * (numArrays + 1) > LERP_CHUNK_SIZE);
+
+#pragma omp parallel for schedule(static) if (threaded)
+  for (size_t block = 0; block < numBlocks; ++block) {
+    size_t start = block * BLEND_BLOCK_SIZE;
+    size_t count = std::min(BLEND_BLOCK_SIZE, n - start);
+    memcpy(out + start, base + start, count * sizeof(float));
+    for (size_t k = 0; k < numArrays; ++k) {
+      if (weights[k] != 0)
+        kernel(arrays + k * n + start, weights[k], count, out + start);
+    }
+  }
+}
+
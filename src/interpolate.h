@@ -0,0 +1,68 @@
+#ifndef OBJViewer_interpolate_h
+#define OBJViewer_interpolate_h
+
+#include <vector>
+
+#include "model.h"
+
+
+//
+// TYPES
+//
+
+// The keyframes for a set of 3 component curves, stored keyframe-major: all
+// of the values for keyframe 0, then all of the values for keyframe 1 and so
+// on. Interpolating every item at a given time is then a single linear pass
+// over two contiguous arrays, which lerpArrays() does with SIMD.
+class KeyframeArrays {
+public:
+  // Curves with fewer keyframes than the longest one are padded out with
+  // their last keyframe.
+  KeyframeArrays(const std::vector<Curve3>& curves);
+
+  size_t numKeyframes() const;
+  size_t numItems() const;
+  size_t bytesUsed() const;
+
+  // The values for a single keyframe, as 3 floats per item.
+  const float* keyframe(size_t index) const;
+
+  // Interpolated values for every item at the given time, as 3 floats per
+  // item. The result stays valid until the next call with a different time.
+  const float* valuesAt(float time);
+
+  // As above, but writing into a caller-supplied array.
+  void interpolate(float time, float* out) const;
+
+private:
+  size_t _numKeyframes;
+  size_t _numItems;
+  std::vector<float> _values;
+
+  std::vector<float> _result;
+  float _resultTime;
+};
+
+
+//
+// FUNCTIONS
+//
+
+// out[i] = a[i] + (b[i] - a[i]) * t, for n floats. Uses AVX2, SSE2 or plain
+// C++ depending on what the CPU supports, and splits large arrays across
+// threads.
+void lerpArrays(const float* a, const float* b, float t, size_t n, float* out);
+
+// The name of the kernel lerpArrays() is using on this CPU.
+const char* lerpArraysKernel();
+
+// out[i] = base[i] + sum over k of weights[k] * arrays[k * n + i], for n
+// floats and numArrays arrays laid end to end. Works through the output a
+// block at a time so that it stays in cache while each array is added in.
+// Uses the same kernels and threading as lerpArrays().
+void blendArrays(const float* base, const float* arrays, const float* weights,
+    size_t numArrays, size_t n, float* out);
+
+
+#endif // OBJViewer_interpolate_h
+
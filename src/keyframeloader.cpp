@@ -0,0 +1,139 @@
+#include <algorithm>
+#include <cstdio>
+#include <string>
+
+#include <unistd.h>
+
+#include "keyframeloader.h"
+#include "threadpool.h"
+
+
+//
+// TYPES
+//
+
+// Loads the vertex data from one keyframe file into its slot in the model.
+class KeyframeFileJob : public Job, public ParserCallbacks {
+public:
+  Model* model;
+  ResourceManager* resources;
+  LoadOptions options;
+  const char* path;
+  size_t keyframe;
+  std::string error;
+
+  virtual void run()
+  {
+    try {
+      loadModel(this, path, resources, options);
+      model->setKeyframe(keyframe, _data);
+    } catch (ParseException& e) {
+      error = e.what();
+    }
+    // Only hang on to the data for as long as we need it.
+    _data = KeyframeData();
+  }
+
+  virtual void beginModel(const char* path) {}
+  virtual void endModel() {}
+  virtual void coordParsed(const vh::Vector3& coord) { _data.coords.push_back(coord); }
+  virtual void texCoordParsed(const vh::Vector2& coord) { _data.texCoords.push_back(coord); }
+  virtual void normalParsed(const vh::Vector3& normal) { _data.normals.push_back(normal); }
+  virtual void colorParsed(const vh::Vector4& color) { _data.colors.push_back(color); }
+  virtual void faceParsed(Face* face) { delete face; }
+  virtual void materialParsed(const std::string& name, Material* material) { delete material; }
+  virtual void textureParsed(RawImage* texture) {}
+  virtual void partParsed(const std::string& name, const std::vector<vh::Matrix4>& instances) {}
+
+private:
+  KeyframeData _data;
+};
+
+
+//
+// KeyframeLoader METHODS
+//
+
+KeyframeLoader::KeyframeLoader(Model* model, ResourceManager* resources) :
+  _model(model),
+  _resources(resources),
+  _pool(NULL),
+  _jobs()
+{
+}
+
+
+KeyframeLoader::~KeyframeLoader()
+{
+  // Let any files still queued finish before their jobs go away.
+  delete _pool;
+  for (size_t i = 0; i < _jobs.size(); ++i)
+    delete _jobs[i];
+}
+
+
+void KeyframeLoader::start(char** paths, int numPaths)
+{
+  if (numPaths <= 0 || _pool != NULL)
+    return;
+
+  LoadOptions options;
+  options.geometryOnly = true;
+  options.expectedCoords = _model->v.size();
+
+  long numCPUs = sysconf(_SC_NPROCESSORS_ONLN);
+  size_t numThreads = std::min(size_t(numPaths), size_t(std::max(numCPUs, 1L)));
+  fprintf(stderr, "Loading %d keyframes in the background on %lu threads...\n", numPaths, numThreads);
+
+  size_t first = _model->addKeyframes(numPaths);
+  _pool = new ThreadPool(numThreads);
+  _jobs.resize(numPaths);
+  for (int i = 0; i < numPaths; ++i) {
+    _jobs[i] = new KeyframeFileJob();
+    _jobs[i]->model = _model;
+    _jobs[i]->resources = _resources;
+    _jobs[i]->options = options;
+    _jobs[i]->path = paths[i];
+    _jobs[i]->keyframe = first + i;
+  }
+  // Queued in order, so the keyframes become playable from the start.
+  for (int i = 0; i < numPaths; ++i)
+    _pool->add(_jobs[i]);
+}
+
+
+bool KeyframeLoader::finished()
+{
+  return _pool == NULL || _pool->idle();
+}
+
+
+void KeyframeLoader::finish()
+{
+  if (_pool == NULL)
+    return;
+
+  _pool->waitAll();
+  delete _pool;
+  _pool = NULL;
+
+  size_t numFailed = 0;
+  for (size_t i = 0; i < _jobs.size(); ++i) {
+    if (!_jobs[i]->error.empty()) {
+      fprintf(stderr, "%s\n", _jobs[i]->error.c_str());
+      fprintf(stderr, "Unable to load keyframe %s. Continuing without it.\n", _jobs[i]->path);
+      ++numFailed;
+    }
+  }
+
+  // Drop any keyframes which didn't load. Going backwards means the ones we
+  // still have to check keep their indexes.
+  for (size_t i = _jobs.size(); i > 0; --i) {
+    if (!_jobs[i - 1]->error.empty())
+      _model->removeKeyframe(_jobs[i - 1]->keyframe);
+    delete _jobs[i - 1];
+  }
+  fprintf(stderr, "Finished loading %lu keyframes\n", _jobs.size() - numFailed);
+  _jobs.clear();
+}
+
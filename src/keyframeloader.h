@@ -0,0 +1,52 @@
+#ifndef OBJViewer_keyframeloader_h
+#define OBJViewer_keyframeloader_h
+
+#include <vector>
+
+#include "model.h"
+#include "parser.h"
+#include "resources.h"
+
+
+class KeyframeFileJob;
+class ThreadPool;
+
+
+//
+// TYPES
+//
+
+// Loads the vertex data for a sequence of keyframe files into a model in the
+// background, parsing several files at once on a thread pool. The model has
+// to have its first keyframe already: the faces and materials come from
+// that, so they're skipped in every other file.
+//
+// Only the keyframes before Model::numLoadedKeyframes() can be used until
+// the loader has finished.
+class KeyframeLoader {
+public:
+  KeyframeLoader(Model* model, ResourceManager* resources);
+  ~KeyframeLoader();
+
+  // Adds a keyframe to the model for each file and starts loading them.
+  // Returns straight away.
+  void start(char** paths, int numPaths);
+
+  // True once every file has been parsed, whether it loaded or not.
+  bool finished();
+
+  // Waits until every file has been parsed, then reports the ones which
+  // couldn't be loaded and removes their keyframes from the model. Nothing
+  // else can be using the model while this happens.
+  void finish();
+
+private:
+  Model* _model;
+  ResourceManager* _resources;
+  ThreadPool* _pool;
+  std::vector<KeyframeFileJob*> _jobs;
+};
+
+
+#endif // OBJViewer_keyframeloader_h
+
@@ -0,0 +1,483 @@
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+
+#include <unistd.h>
+
+#include "keyframestream.h"
+#include "interpolate.h"
+#include "threadpool.h"
+
+
+//
+// CONSTANTS
+//
+
+// How far ahead of the playhead to prefetch, in seconds of playback.
+const float PREFETCH_SECONDS = 1.0f;
+
+// We need two keyframes resident to interpolate between them.
+const size_t MIN_WINDOW_SIZE = 2;
+
+
+//
+// TYPES
+//
+
+class KeyframeLoadJob : public Job {
+public:
+  KeyframeStream* stream;
+  size_t slot;
+
+  virtual void run()
+  {
+    stream->loadSlot(slot);
+  }
+};
+
+
+//
+// INTERNAL FUNCTIONS
+//
+
+// Appends a keyframe number, wrapped around to the start or end of the
+// sequence, to the list if it isn't already there.
+void addWanted(std::vector<size_t>& wanted, long keyframe, size_t numKeyframes)
+{
+  keyframe %= long(numKeyframes);
+  if (keyframe < 0)
+    keyframe += numKeyframes;
+  if (std::find(wanted.begin(), wanted.end(), size_t(keyframe)) == wanted.end())
+    wanted.push_back(keyframe);
+}
+
+
+//
+// KeyframeStream::Slot METHODS
+//
+
+KeyframeStream::Slot::Slot() :
+  keyframe(0),
+  valid(false),
+  loading(false),
+  users(0),
+  data()
+{
+}
+
+
+//
+// KeyframeStream METHODS
+//
+
+KeyframeStream::KeyframeStream(size_t windowSize) :
+  _windowSize(std::max(windowSize, MIN_WINDOW_SIZE)),
+  _fd(-1),
+  _numKeyframes(0),
+  _numRecords(0),
+  _records(),
+  _numCoords(0),
+  _numNormals(0),
+  _misses(0),
+  _slots(_windowSize),
+  _jobs(),
+  _loader(new ThreadPool(1)),
+  _result(),
+  _resultTime(-1e20)
+{
+  pthread_mutex_init(&_lock, NULL);
+  pthread_cond_init(&_slotLoaded, NULL);
+
+  for (size_t i = 0; i < _slots.size(); ++i) {
+    KeyframeLoadJob* job = new KeyframeLoadJob();
+    job->stream = this;
+    job->slot = i;
+    _jobs.push_back(job);
+  }
+}
+
+
+KeyframeStream::~KeyframeStream()
+{
+  // Let any prefetches still queued finish before their jobs go away.
+  delete _loader;
+  for (size_t i = 0; i < _jobs.size(); ++i)
+    delete _jobs[i];
+
+  if (_fd >= 0)
+    close(_fd);
+
+  pthread_cond_destroy(&_slotLoaded);
+  pthread_mutex_destroy(&_lock);
+}
+
+
+bool KeyframeStream::create(const char* dir)
+{
+  std::string path = std::string(dir) + "/objviewer-keyframes-XXXXXX";
+  std::vector<char> name(path.begin(), path.end());
+  name.push_back('\0');
+
+  _fd = mkstemp(&name[0]);
+  if (_fd < 0)
+    return false;
+  unlink(&name[0]);
+  return true;
+}
+
+
+void KeyframeStream::append(const float* coords, size_t numCoords, const float* normals, size_t numNormals)
+{
+  if (_numKeyframes == 0) {
+    _numCoords = numCoords;
+    _numNormals = numNormals;
+  }
+  resize(_numKeyframes + 1);
+  write(_numKeyframes - 1, coords, normals);
+}
+
+
+void KeyframeStream::resize(size_t numKeyframes)
+{
+  // New keyframes always go on the end of the file.
+  while (_records.size() < numKeyframes)
+    _records.push_back(_numRecords++);
+  _records.resize(numKeyframes);
+  _numKeyframes = numKeyframes;
+}
+
+
+void KeyframeStream::write(size_t keyframe, const float* coords, const float* normals)
+{
+  const char* src[] = { (const char*)coords, (const char*)normals };
+  size_t sizes[] = { _numCoords * 3 * sizeof(float), _numNormals * 3 * sizeof(float) };
+  off_t offset = off_t(_records[keyframe]) * floatsPerKeyframe() * sizeof(float);
+  for (unsigned int i = 0; i < 2; ++i) {
+    const char* data = src[i];
+    size_t size = sizes[i];
+    while (size > 0) {
+      ssize_t written = pwrite(_fd, data, size, offset);
+      if (written < 0 && errno == EINTR)
+        continue;
+      if (written <= 0) {
+        fprintf(stderr, "Error writing keyframe %lu to the keyframe store: %s\n",
+            keyframe, strerror(errno));
+        break;
+      }
+      data += written;
+      size -= written;
+      offset += written;
+    }
+  }
+}
+
+
+void KeyframeStream::removeKeyframe(size_t keyframe)
+{
+  // Its space in the file is simply never used again.
+  _records.erase(_records.begin() + keyframe);
+  _numKeyframes = _records.size();
+
+  // Anything resident now belongs to a different keyframe number.
+  pthread_mutex_lock(&_lock);
+  for (size_t i = 0; i < _slots.size(); ++i) {
+    Slot& s = _slots[i];
+    if (s.valid && s.keyframe > keyframe)
+      --s.keyframe;
+    else if (s.valid && s.keyframe == keyframe)
+      s.valid = false;
+  }
+  _resultTime = -1e20;
+  pthread_mutex_unlock(&_lock);
+}
+
+
+size_t KeyframeStream::numKeyframes() const
+{
+  return _numKeyframes;
+}
+
+
+size_t KeyframeStream::numCoords() const
+{
+  return _numCoords;
+}
+
+
+size_t KeyframeStream::numNormals() const
+{
+  return _numNormals;
+}
+
+
+size_t KeyframeStream::windowSize() const
+{
+  return _windowSize;
+}
+
+
+size_t KeyframeStream::bytesUsed() const
+{
+  // The slots are filled in lazily, but will all be in use soon enough.
+  size_t resident = std::min(_windowSize, _numKeyframes) + 1;
+  return resident * floatsPerKeyframe() * sizeof(float);
+}
+
+
+size_t KeyframeStream::misses() const
+{
+  return _misses;
+}
+
+
+const float* KeyframeStream::coordsAt(float time)
+{
+  if (_numKeyframes == 0 || _numCoords == 0)
+    return NULL;
+  interpolate(time);
+  return &_result[0];
+}
+
+
+const float* KeyframeStream::normalsAt(float time)
+{
+  if (_numKeyframes == 0 || _numNormals == 0)
+    return NULL;
+  interpolate(time);
+  return &_result[_numCoords * 3];
+}
+
+
+void KeyframeStream::read(size_t keyframe, float* coords, float* normals)
+{
+  pthread_mutex_lock(&_lock);
+  size_t slot = acquire(keyframe % _numKeyframes);
+  pthread_mutex_unlock(&_lock);
+
+  const float* data = &_slots[slot].data[0];
+  memcpy(coords, data, _numCoords * 3 * sizeof(float));
+  memcpy(normals, data + _numCoords * 3, _numNormals * 3 * sizeof(float));
+
+  pthread_mutex_lock(&_lock);
+  release(slot);
+  pthread_mutex_unlock(&_lock);
+}
+
+
+void KeyframeStream::prefetch(float time, float keyframesPerSecond)
+{
+  if (_numKeyframes == 0)
+    return;
+
+  long current = (long)floorf(time);
+  long direction = (keyframesPerSecond < 0) ? -1 : 1;
+  size_t window = std::min(_windowSize, _numKeyframes);
+  size_t ahead = window / 2;
+  if (keyframesPerSecond != 0) {
+    ahead = size_t(ceilf(fabsf(keyframesPerSecond) * PREFETCH_SECONDS));
+    ahead = std::max(std::min(ahead, window - 1), (size_t)1);
+  }
+
+  // The keyframes we want resident, most urgent first: the two we're
+  // interpolating between now, then the ones coming up, then whatever room
+  // is left behind us in case playback turns around.
+  std::vector<size_t> wanted;
+  addWanted(wanted, current, _numKeyframes);
+  addWanted(wanted, current + 1, _numKeyframes);
+  for (size_t i = 1; i <= ahead && wanted.size() < window; ++i)
+    addWanted(wanted, current + direction * long(i), _numKeyframes);
+  for (size_t i = 1; i < _numKeyframes && wanted.size() < window; ++i)
+    addWanted(wanted, current - direction * long(i), _numKeyframes);
+
+  std::vector<size_t> toLoad;
+  pthread_mutex_lock(&_lock);
+  for (size_t w = 0; w < wanted.size(); ++w) {
+    if (findSlot(wanted[w]) >= 0)
+      continue;
+
+    // Reuse a slot holding a keyframe we no longer want.
+    int slot = -1;
+    for (size_t i = 0; i < _slots.size() && slot < 0; ++i) {
+      const Slot& s = _slots[i];
+      if (s.loading || s.users > 0)
+        continue;
+      if (!s.valid || std::find(wanted.begin(), wanted.end(), s.keyframe) == wanted.end())
+        slot = i;
+    }
+    if (slot < 0)
+      break;
+
+    _slots[slot].keyframe = wanted[w];
+    _slots[slot].valid = false;
+    _slots[slot].loading = true;
+    toLoad.push_back(slot);
+  }
+  pthread_mutex_unlock(&_lock);
+
+  for (size_t i = 0; i < toLoad.size(); ++i)
+    _loader->add(_jobs[toLoad[i]]);
+}
+
+
+size_t KeyframeStream::floatsPerKeyframe() const
+{
+  return (_numCoords + _numNormals) * 3;
+}
+
+
+size_t KeyframeStream::distance(size_t a, size_t b) const
+{
+  // Playback loops, so the distance wraps around at the end.
+  size_t d = (a > b) ? a - b : b - a;
+  return std::min(d, _numKeyframes - d);
+}
+
+
+int KeyframeStream::findSlot(size_t keyframe) const
+{
+  for (size_t i = 0; i < _slots.size(); ++i) {
+    const Slot& s = _slots[i];
+    if (s.keyframe == keyframe && (s.valid || s.loading))
+      return i;
+  }
+  return -1;
+}
+
+
+size_t KeyframeStream::acquire(size_t keyframe)
+{
+  while (true) {
+    int slot = findSlot(keyframe);
+    if (slot >= 0 && !_slots[slot].loading) {
+      ++_slots[slot].users;
+      return slot;
+    }
+
+    if (slot < 0) {
+      // Not prefetched, so we'll have to read it ourselves. Empty slots get
+      // used first, then the one furthest from the keyframe we want.
+      size_t furthest = 0;
+      for (size_t i = 0; i < _slots.size(); ++i) {
+        const Slot& s = _slots[i];
+        if (s.loading || s.users > 0)
+          continue;
+        size_t d = s.valid ? distance(keyframe, s.keyframe) : _numKeyframes;
+        if (slot < 0 || d > furthest) {
+          slot = i;
+          furthest = d;
+        }
+      }
+      if (slot >= 0) {
+        Slot& s = _slots[slot];
+        s.keyframe = keyframe;
+        s.valid = false;
+        s.loading = true;
+        ++s.users;
+        ++_misses;
+
+        pthread_mutex_unlock(&_lock);
+        loadSlot(slot);
+        pthread_mutex_lock(&_lock);
+        return slot;
+      }
+    }
+
+    // Either it's being prefetched already or every slot is busy, so wait
+    // for a load to finish.
+    pthread_cond_wait(&_slotLoaded, &_lock);
+  }
+}
+
+
+void KeyframeStream::release(size_t slot)
+{
+  --_slots[slot].users;
+  pthread_cond_broadcast(&_slotLoaded);
+}
+
+
+void KeyframeStream::loadSlot(size_t slot)
+{
+  pthread_mutex_lock(&_lock);
+  Slot& s = _slots[slot];
+  size_t keyframe = s.keyframe;
+  s.data.resize(floatsPerKeyframe());
+  float* dst = &s.data[0];
+  pthread_mutex_unlock(&_lock);
+
+  // Nothing else touches a slot while it's loading, so this doesn't need
+  // the lock.
+  readKeyframe(keyframe, dst);
+
+  pthread_mutex_lock(&_lock);
+  s.loading = false;
+  s.valid = true;
+  pthread_cond_broadcast(&_slotLoaded);
+  pthread_mutex_unlock(&_lock);
+}
+
+
+void KeyframeStream::readKeyframe(size_t keyframe, float* out)
+{
+  char* dst = (char*)out;
+  size_t size = floatsPerKeyframe() * sizeof(float);
+  off_t offset = off_t(_records[keyframe]) * size;
+  while (size > 0) {
+    ssize_t bytesRead = pread(_fd, dst, size, offset);
+    if (bytesRead < 0 && errno == EINTR)
+      continue;
+    if (bytesRead <= 0) {
+      fprintf(stderr, "Error reading keyframe %lu from the keyframe store: %s\n",
+          keyframe, (bytesRead < 0) ? strerror(errno) : "unexpected end of file");
+      memset(dst, 0, size);
+      return;
+    }
+    dst += bytesRead;
+    size -= bytesRead;
+    offset += bytesRead;
+  }
+}
+
+
+void KeyframeStream::interpolate(float time)
+{
+  pthread_mutex_lock(&_lock);
+  if (time == _resultTime) {
+    pthread_mutex_unlock(&_lock);
+    return;
+  }
+
+  long left = (long)floorf(time);
+  float t = time - left;
+  left %= long(_numKeyframes);
+  if (left < 0)
+    left += _numKeyframes;
+  size_t right = (left + 1) % _numKeyframes;
+
+  size_t a = acquire(left);
+  size_t b = a;
+  if (t != 0 && right != size_t(left))
+    b = acquire(right);
+  pthread_mutex_unlock(&_lock);
+
+  // The slots we're using can't be reused until we release them, so we can
+  // do the actual work without holding the lock.
+  const size_t n = floatsPerKeyframe();
+  _result.resize(n);
+  if (a == b)
+    memcpy(&_result[0], &_slots[a].data[0], n * sizeof(float));
+  else
+    lerpArrays(&_slots[a].data[0], &_slots[b].data[0], t, n, &_result[0]);
+
+  pthread_mutex_lock(&_lock);
+  release(a);
+  if (b != a)
+    release(b);
+  _resultTime = time;
+  pthread_mutex_unlock(&_lock);
+}
+
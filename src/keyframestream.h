@@ -0,0 +1,130 @@
+#ifndef OBJViewer_keyframestream_h
+#define OBJViewer_keyframestream_h
+
+#include <vector>
+
+#include <pthread.h>
+
+
+class KeyframeLoadJob;
+class ThreadPool;
+
+
+//
+// TYPES
+//
+
+// Keyframe coords and normals held in a temporary file, one fixed size record
+// per keyframe, with only a small window of them in memory at any time.
+//
+// The window is a set of slots, each holding one keyframe. Keyframes are read
+// into a slot on demand when they're needed for interpolation, or ahead of
+// time on a background thread by prefetch(). Slots are reused for whichever
+// resident keyframe is furthest from the one being loaded, so memory use
+// depends only on the window size, not the length of the sequence.
+//
+// Interpolation (coordsAt, normalsAt and read) must only happen on one thread
+// at a time, but prefetch() can be called from another thread while it does.
+class KeyframeStream {
+public:
+  KeyframeStream(size_t windowSize);
+  ~KeyframeStream();
+
+  // Creates the backing file in the given directory. The file is unlinked
+  // straight away, so it goes when we do. Returns false and leaves errno set
+  // if it couldn't be created.
+  bool create(const char* dir);
+
+  // Writes out the next keyframe. The first keyframe sets the number of
+  // coords and normals; every later one must have the same.
+  void append(const float* coords, size_t numCoords, const float* normals, size_t numNormals);
+
+  // Makes room for more keyframes, which can then be written in any order
+  // (and from any thread, as long as it's one thread per keyframe) with
+  // write(). Must come after the first append().
+  void resize(size_t numKeyframes);
+  void write(size_t keyframe, const float* coords, const float* normals);
+
+  // Removes a keyframe, moving all of the ones after it down by one.
+  void removeKeyframe(size_t keyframe);
+
+  size_t numKeyframes() const;
+  size_t numCoords() const;
+  size_t numNormals() const;
+  size_t windowSize() const;
+
+  // Memory used by the resident window and the interpolated result.
+  size_t bytesUsed() const;
+
+  // Number of times a keyframe was needed before it had been prefetched.
+  size_t misses() const;
+
+  // Interpolated values for every coord (or normal) at the given time, as 3
+  // floats per item. The result stays valid until the next call with a
+  // different time.
+  const float* coordsAt(float time);
+  const float* normalsAt(float time);
+
+  // Copies the coords and normals for a single keyframe into the given
+  // arrays, as 3 floats each.
+  void read(size_t keyframe, float* coords, float* normals);
+
+  // Starts loading the keyframes around the given time in the background.
+  // The window leans in the direction of playback, reaching as far ahead as
+  // we'll get through in about PREFETCH_SECONDS at the given rate; a rate of
+  // zero centres it on the current keyframe.
+  void prefetch(float time, float keyframesPerSecond);
+
+private:
+  friend class KeyframeLoadJob;
+
+  struct Slot {
+    size_t keyframe;
+    bool valid;
+    bool loading;
+    size_t users;
+    std::vector<float> data;
+
+    Slot();
+  };
+
+  size_t floatsPerKeyframe() const;
+  size_t distance(size_t a, size_t b) const;
+  int findSlot(size_t keyframe) const;
+
+  // These expect _lock to be held. acquire() returns the slot holding the
+  // keyframe, loading it first if necessary, and marks it as in use until
+  // release() is called so it won't be reused.
+  size_t acquire(size_t keyframe);
+  void release(size_t slot);
+
+  // Reads a slot's keyframe from the file. Expects _lock not to be held.
+  void loadSlot(size_t slot);
+  void readKeyframe(size_t keyframe, float* out);
+
+  void interpolate(float time);
+
+private:
+  size_t _windowSize;
+  int _fd;
+  size_t _numKeyframes;
+  size_t _numRecords;
+  std::vector<size_t> _records; // Position of each keyframe in the file.
+  size_t _numCoords;
+  size_t _numNormals;
+  size_t _misses;
+
+  std::vector<Slot> _slots;
+  std::vector<KeyframeLoadJob*> _jobs;
+  ThreadPool* _loader;
+
+  std::vector<float> _result;
+  float _resultTime;
+
+  pthread_mutex_t _lock;
+  pthread_cond_t _slotLoaded;
+};
+
+
+#endif // OBJViewer_keyframestream_h
+
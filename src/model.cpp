@@ -1,4 +1,346 @@
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <cstring>
+
+#ifdef __SSE__
+#include <xmmintrin.h>
+#endif
+
 #include "model.h"
+#include "compression.h"
+#include "hash.h"
+#include "interpolate.h"
+#include "keyframestream.h"
+
+
+//
+// INTERNAL FUNCTIONS
+//
+
+// Parallel min/max reduction over the given keyframe of all the curves.
+// Curves which don't have that keyframe are skipped.
+void calculateBounds(const std::vector<Curve3>& curves, size_t keyframe,
+    vh::Vector3& low, vh::Vector3& high)
+{
+  low = vh::Vector3(1e20, 1e20, 1e20);
+  high = vh::Vector3(-1e20, -1e20, -1e20);
+
+#pragma omp parallel
+  {
+#ifdef __SSE__
+    __m128 threadLow = _mm_set1_ps(1e20f);
+    __m128 threadHigh = _mm_set1_ps(-1e20f);
+#else
+    vh::Vector3 threadLow = low;
+    vh::Vector3 threadHigh = high;
+#endif
+
+#pragma omp for schedule(static) nowait
+    for (size_t i = 0; i < curves.size(); ++i) {
+      if (curves[i].numKeyframes() <= keyframe)
+        continue;
+      vh::Vector3 p = curves[i][keyframe];
+#ifdef __SSE__
+      __m128 v = _mm_setr_ps(p.x, p.y, p.z, 0);
+      threadLow = _mm_min_ps(threadLow, v);
+      threadHigh = _mm_max_ps(threadHigh, v);
+#else
+      threadLow = vh::lowCorner(threadLow, p);
+      threadHigh = vh::highCorner(threadHigh, p);
+#endif
+    }
+
+#ifdef __SSE__
+    float lowData[4], highData[4];
+    _mm_storeu_ps(lowData, threadLow);
+    _mm_storeu_ps(highData, threadHigh);
+#else
+    float* lowData = threadLow.data;
+    float* highData = threadHigh.data;
+#endif
+
+#pragma omp critical
+    {
+      for (unsigned int i = 0; i < 3; ++i) {
+        low.data[i] = std::min(low.data[i], lowData[i]);
+        high.data[i] = std::max(high.data[i], highData[i]);
+      }
+    }
+  }
+}
+
+
+// Copies one keyframe of every curve into out, as 3 floats per curve. Curves
+// with fewer keyframes use their last one.
+void copyKeyframe(const std::vector<Curve3>& curves, size_t keyframe, float* out)
+{
+#pragma omp parallel for schedule(static)
+  for (size_t i = 0; i < curves.size(); ++i) {
+    vh::Vector3 value(0, 0, 0);
+    if (curves[i].numKeyframes() > 0)
+      value = curves[i][std::min(keyframe, curves[i].numKeyframes() - 1)];
+    out[i * 3 + 0] = value.x;
+    out[i * 3 + 1] = value.y;
+    out[i * 3 + 2] = value.z;
+  }
+}
+
+
+// Smooth normals for one keyframe: the normalised sum of the normals of the
+// faces around each coord, as 3 floats per coord.
+void calculateFaceNormals(const std::vector<Face*>& faces, const float* coords,
+    size_t numCoords, float* normals)
+{
+  std::fill(normals, normals + numCoords * 3, 0.0f);
+  for (size_t i = 0; i < faces.size(); ++i) {
+    const Face& face = *faces[i];
+    const float* pa = coords + face[0].v * 3;
+    const float* pb = coords + face[1].v * 3;
+    const float* pc = coords + face[2].v * 3;
+    vh::Vector3 a(pa[0], pa[1], pa[2]);
+    vh::Vector3 b(pb[0], pb[1], pb[2]);
+    vh::Vector3 c(pc[0], pc[1], pc[2]);
+    vh::Vector3 faceNormal = vh::norm(vh::cross(b - a, c - a));
+
+    for (size_t j = 0; j < face.size(); ++j) {
+      float* normal = normals + face[j].v * 3;
+      normal[0] += faceNormal.x;
+      normal[1] += faceNormal.y;
+      normal[2] += faceNormal.z;
+    }
+  }
+
+  for (size_t i = 0; i < numCoords; ++i) {
+    float* normal = normals + i * 3;
+    vh::Vector3 n = vh::norm(vh::Vector3(normal[0], normal[1], normal[2]));
+    normal[0] = n.x;
+    normal[1] = n.y;
+    normal[2] = n.z;
+  }
+}
+
+
+// Twice the signed area of the triangle abc: positive if the corners go
+// anticlockwise.
+float turn(const vh::Vector2& a, const vh::Vector2& b, const vh::Vector2& c)
+{
+  return (b.x - a.x) * (c.y - a.y) - (b.y - a.y) * (c.x - a.x);
+}
+
+
+// Splits a polygon into triangles by ear clipping, appending the three
+// corner indexes of each triangle to triangles. The polygon is projected
+// onto the plane of its Newell normal first, which is the best fit for
+// polygons that aren't quite flat and also tells us which way round the
+// corners go. Concave polygons are fine. Self-intersecting or degenerate
+// ones may not have an ear at every step; when that happens we clip the
+// most convex corner anyway so that we always finish.
+void triangulateFace(const Face& face, const float* coords, std::vector<unsigned int>& triangles)
+{
+  const size_t n = face.size();
+  std::vector<vh::Vector3> points(n);
+  for (size_t i = 0; i < n; ++i) {
+    const float* p = coords + face[i].v * 3;
+    points[i] = vh::Vector3(p[0], p[1], p[2]);
+  }
+
+  vh::Vector3 normal(0, 0, 0);
+  for (size_t i = 0; i < n; ++i) {
+    const vh::Vector3& a = points[i];
+    const vh::Vector3& b = points[(i + 1) % n];
+    normal.x += (a.y - b.y) * (a.z + b.z);
+    normal.y += (a.z - b.z) * (a.x + b.x);
+    normal.z += (a.x - b.x) * (a.y + b.y);
+  }
+
+  // With no area there's nothing to get wrong, so just use a fan.
+  if (vh::lengthSqr(normal) == 0) {
+    for (size_t i = 1; i + 1 < n; ++i) {
+      triangles.push_back(0);
+      triangles.push_back(i);
+      triangles.push_back(i + 1);
+    }
+    return;
+  }
+
+  // Any axis which isn't parallel to the normal will do to build the rest of
+  // the basis from, so use the one the normal points along least.
+  vh::Vector3 axis(0, 0, 1);
+  if (fabsf(normal.x) <= fabsf(normal.y) && fabsf(normal.x) <= fabsf(normal.z))
+    axis = vh::Vector3(1, 0, 0);
+  else if (fabsf(normal.y) <= fabsf(normal.z))
+    axis = vh::Vector3(0, 1, 0);
+  vh::Vector3 u = vh::norm(vh::cross(axis, normal));
+  vh::Vector3 w = vh::norm(vh::cross(normal, u));
+
+  std::vector<vh::Vector2> projected(n);
+  for (size_t i = 0; i < n; ++i)
+    projected[i] = vh::Vector2(vh::dot(points[i], u), vh::dot(points[i], w));
+
+  // Starting from the second corner means a convex polygon comes out as a fan
+  // around the first one.
+  std::vector<unsigned int> remaining(n);
+  for (size_t i = 0; i < n; ++i)
+    remaining[i] = i;
+  size_t pos = 1;
+  while (remaining.size() > 3) {
+    const size_t count = remaining.size();
+    size_t ear = count;
+    size_t mostConvex = pos % count;
+    float mostConvexTurn = -1e30f;
+    for (size_t k = 0; k < count && ear == count; ++k) {
+      size_t i = (pos + k) % count;
+      const vh::Vector2& a = projected[remaining[(i + count - 1) % count]];
+      const vh::Vector2& b = projected[remaining[i]];
+      const vh::Vector2& c = projected[remaining[(i + 1) % count]];
+      float t = turn(a, b, c);
+      if (t > mostConvexTurn) {
+        mostConvex = i;
+        mostConvexTurn = t;
+      }
+      if (t <= 0)
+        continue;
+
+      // It's an ear if no other corner lies inside it or on its edges.
+      // Corners in the same place as one of the ear's don't count, so that
+      // polygons which touch themselves still work.
+      bool isEar = true;
+      for (size_t j = 0; j < count && isEar; ++j) {
+        const vh::Vector2& p = projected[remaining[j]];
+        if ((p.x == a.x && p.y == a.y) || (p.x == b.x && p.y == b.y) || (p.x == c.x && p.y == c.y))
+          continue;
+        isEar = turn(a, b, p) < 0 || turn(b, c, p) < 0 || turn(c, a, p) < 0;
+      }
+      if (isEar)
+        ear = i;
+    }
+    if (ear == count)
+      ear = mostConvex;
+
+    triangles.push_back(remaining[(ear + count - 1) % count]);
+    triangles.push_back(remaining[ear]);
+    triangles.push_back(remaining[(ear + 1) % count]);
+    remaining.erase(remaining.begin() + ear);
+    pos = ear;
+  }
+  triangles.insert(triangles.end(), remaining.begin(), remaining.end());
+}
+
+
+void flagChanges(const std::vector<float>& first, const std::vector<float>& other,
+    std::vector<bool>& changed)
+{
+  for (size_t i = 0; i < changed.size(); ++i) {
+    if (changed[i])
+      continue;
+    for (unsigned int j = 0; j < 3; ++j) {
+      if (other[i * 3 + j] != first[i * 3 + j])
+        changed[i] = true;
+    }
+  }
+}
+
+
+// Pads every curve out to numKeyframes with copies of its last keyframe.
+// Returns the number of bytes added.
+template <typename VALUE>
+size_t padCurves(std::vector< vh::Curve<VALUE> >& curves, size_t numKeyframes)
+{
+  size_t added = 0;
+  for (size_t i = 0; i < curves.size(); ++i) {
+    if (curves[i].numKeyframes() < numKeyframes) {
+      added += (numKeyframes - curves[i].numKeyframes()) * sizeof(VALUE);
+      curves[i].resize(numKeyframes);
+    }
+  }
+  return added;
+}
+
+
+// Removes a keyframe from every curve which has it. Returns the number of
+// bytes removed.
+template <typename VALUE>
+size_t removeFromCurves(std::vector< vh::Curve<VALUE> >& curves, size_t keyframe)
+{
+  size_t removed = 0;
+  for (size_t i = 0; i < curves.size(); ++i) {
+    if (curves[i].numKeyframes() > keyframe) {
+      curves[i].removeKeyframe(keyframe);
+      removed += sizeof(VALUE);
+    }
+  }
+  return removed;
+}
+
+
+// Copies values into one keyframe of the curves, for as many items as both
+// have.
+template <typename VALUE>
+void setCurveKeyframe(std::vector< vh::Curve<VALUE> >& curves, size_t keyframe,
+    const std::vector<VALUE>& values)
+{
+  size_t n = std::min(curves.size(), values.size());
+  for (size_t i = 0; i < n; ++i)
+    curves[i][keyframe] = values[i];
+}
+
+
+//
+// MemoryUsage METHODS
+//
+
+MemoryUsage::MemoryUsage() :
+    coords(0),
+    normals(0),
+    texCoords(0),
+    colors(0),
+    keyframes(0),
+    faces(0),
+    materials(0),
+    texturePixels(0),
+    vertexBuffers(0),
+    textures(0)
+{
+}
+
+
+size_t MemoryUsage::cpuTotal() const
+{
+  return coords + normals + texCoords + colors + keyframes + faces + materials + texturePixels;
+}
+
+
+size_t MemoryUsage::gpuTotal() const
+{
+  return vertexBuffers + textures;
+}
+
+
+void MemoryUsage::printJSON(FILE* out) const
+{
+  fprintf(out,
+      "{\n"
+      "  \"cpu\": {\n"
+      "    \"positions\": %lu,\n"
+      "    \"normals\": %lu,\n"
+      "    \"texcoords\": %lu,\n"
+      "    \"colors\": %lu,\n"
+      "    \"keyframes\": %lu,\n"
+      "    \"faces\": %lu,\n"
+      "    \"materials\": %lu,\n"
+      "    \"texture_pixels\": %lu,\n"
+      "    \"total\": %lu\n"
+      "  },\n"
+      "  \"gpu\": {\n"
+      "    \"vertex_buffers\": %lu,\n"
+      "    \"textures\": %lu,\n"
+      "    \"total\": %lu\n"
+      "  }\n"
+      "}\n",
+      coords, normals, texCoords, colors, keyframes, faces, materials, texturePixels,
+      cpuTotal(), vertexBuffers, textures, gpuTotal());
+}
 
 
 //
@@ -21,6 +363,34 @@ Material::Material() :
 }
 
 
+bool Material::operator == (const Material& other) const
+{
+  for (unsigned int i = 0; i < 4; ++i) {
+    if (Ka.data[i] != other.Ka.data[i] || Kd.data[i] != other.Kd.data[i] ||
+        Ks.data[i] != other.Ks.data[i] || Tf.data[i] != other.Tf.data[i])
+      return false;
+  }
+  return d == other.d && Ns == other.Ns &&
+         mapKa == other.mapKa && mapKd == other.mapKd && mapKs == other.mapKs &&
+         mapD == other.mapD && mapBump == other.mapBump;
+}
+
+
+size_t Material::hash() const
+{
+  // FNV-1a over the parameters and texture pointers.
+  uint64_t h = hashBytes(Ka.data, sizeof(Ka.data));
+  h = hashBytes(Kd.data, sizeof(Kd.data), h);
+  h = hashBytes(Ks.data, sizeof(Ks.data), h);
+  h = hashBytes(Tf.data, sizeof(Tf.data), h);
+  h = hashBytes(&d, sizeof(d), h);
+  h = hashBytes(&Ns, sizeof(Ns), h);
+  RawImage* maps[] = { mapKa, mapKd, mapKs, mapD, mapBump };
+  h = hashBytes(maps, sizeof(maps), h);
+  return size_t(h);
+}
+
+
 //
 // Vertex METHODS
 //
@@ -34,7 +404,7 @@ Vertex::Vertex(int _v, int _vt, int _vn, int _c) : v(_v), vt(_vt), vn(_vn), c(_c
 // Face METHODS
 //
 
-Face::Face(Material* m) : material(m), vertexes()
+Face::Face(Material* m) : material(m), vertexes(), part(-1)
 {
 }
 
@@ -57,20 +427,46 @@ unsigned int Face::size() const
 }
 
 
+//
+// ModelPart METHODS
+//
+
+ModelPart::ModelPart(const std::string& iName, const std::vector<vh::Matrix4>& iInstances) :
+  name(iName),
+  instances(iInstances)
+{
+}
+
+
 //
 // Model METHODS
 //
 
 Model::Model() :
-    v(), vt(), vn(), colors(), faces(), materials(),
+    v(), vt(), vn(), colors(), faces(), materials(), parts(),
     low(1e20, 1e20, 1e20),
     high(-1e20, -1e20, -1e20),
+    memory(),
     _coordNum(0),
     _texCoordNum(0),
     _normalNum(0),
     _colorNum(0),
-    _numKeyframes(0)
+    _numKeyframes(0),
+    _keyframeLow(),
+    _keyframeHigh(),
+    _quantizedKeyframes(NULL),
+    _pcaKeyframes(NULL),
+    _coordArrays(NULL),
+    _normalArrays(NULL),
+    _keyframeStream(NULL),
+    _normalsCalculated(false),
+    _texturesWithPixels(),
+    _coordKeyframeBytes(0),
+    _normalKeyframeBytes(0),
+    _keyframeLoaded(),
+    _numLoadedKeyframes(0)
 {
+  pthread_mutex_init(&_loadLock, NULL);
 }
 
 
@@ -79,49 +475,85 @@ Model::~Model()
   for (unsigned int i = 0; i < faces.size(); ++i)
     delete faces[i];
   // TODO: delete materials.
+  delete _quantizedKeyframes;
+  delete _pcaKeyframes;
+  delete _coordArrays;
+  delete _normalArrays;
+  delete _keyframeStream;
+  pthread_mutex_destroy(&_loadLock);
 }
 
 
 void Model::addV(const vh::Vector3& newV)
 {
-  while (_coordNum >= v.size())
+  while (_coordNum >= v.size()) {
     v.push_back(Curve3());
+    memory.coords += sizeof(Curve3);
+  }
   v[_coordNum].addKeyframe(newV);
-  ++_coordNum;
-
-  // TODO: bounding box should be represented as a pair of curves too.
-  for (unsigned int i = 0; i < 3; ++i) {
-    if (newV.data[i] < low.data[i])
-      low.data[i] = newV.data[i];
-    if (newV.data[i] > high.data[i])
-      high.data[i] = newV.data[i];
+  if (v[_coordNum].numKeyframes() == 1) {
+    memory.coords += sizeof(vh::Vector3);
+  } else {
+    memory.keyframes += sizeof(vh::Vector3);
+    _coordKeyframeBytes += sizeof(vh::Vector3);
   }
+  ++_coordNum;
 }
 
 
 void Model::addVt(const vh::Vector2& newVt)
 {
-  while (_texCoordNum >= vt.size())
+  // Streamed models only keep the first keyframe of these.
+  if (_keyframeStream != NULL && _texCoordNum < vt.size()) {
+    ++_texCoordNum;
+    return;
+  }
+  while (_texCoordNum >= vt.size()) {
     vt.push_back(Curve2());
+    memory.texCoords += sizeof(Curve2);
+  }
   vt[_texCoordNum].addKeyframe(newVt);
+  if (vt[_texCoordNum].numKeyframes() == 1)
+    memory.texCoords += sizeof(vh::Vector2);
+  else
+    memory.keyframes += sizeof(vh::Vector2);
   ++_texCoordNum;
 }
 
 
 void Model::addVn(const vh::Vector3& newVn)
 {
-  while (_normalNum >= vn.size())
+  while (_normalNum >= vn.size()) {
     vn.push_back(Curve3());
+    memory.normals += sizeof(Curve3);
+  }
   vn[_normalNum].addKeyframe(newVn);
+  if (vn[_normalNum].numKeyframes() == 1) {
+    memory.normals += sizeof(vh::Vector3);
+  } else {
+    memory.keyframes += sizeof(vh::Vector3);
+    _normalKeyframeBytes += sizeof(vh::Vector3);
+  }
   ++_normalNum;
 }
 
 
 void Model::addColor(const vh::Vector4& newColor)
 {
-  while (_colorNum >= colors.size())
+  // Streamed models only keep the first keyframe of these.
+  if (_keyframeStream != NULL && _colorNum < colors.size()) {
+    ++_colorNum;
+    return;
+  }
+  while (_colorNum >= colors.size()) {
     colors.push_back(Curve4());
+    memory.colors += sizeof(Curve4);
+  }
   colors[_colorNum].addKeyframe(newColor);
+  if (colors[_colorNum].numKeyframes() == 1)
+    memory.colors += sizeof(vh::Vector4);
+  else
+    memory.keyframes += sizeof(vh::Vector4);
   ++_colorNum;
 }
 
@@ -129,15 +561,93 @@ void Model::addColor(const vh::Vector4& newColor)
 void Model::addFace(Face* newFace)
 {
   faces.push_back(newFace);
+  memory.faces += sizeof(Face*) + sizeof(Face) + newFace->size() * sizeof(Vertex);
+}
+
+
+size_t Model::addPart(const std::string& name, const std::vector<vh::Matrix4>& instances)
+{
+  parts.push_back(ModelPart(name, instances));
+  memory.faces += sizeof(ModelPart) + name.size() + instances.size() * sizeof(vh::Matrix4);
+  return parts.size() - 1;
 }
 
 
 void Model::addMaterial(const std::string& name, Material* newMaterial)
 {
+  if (materials.count(name) == 0)
+    memory.materials += sizeof(Material) + name.size();
   materials[name] = newMaterial;
 }
 
 
+void Model::addTexture(RawImage* texture)
+{
+  // The same texture can be referenced by many materials, so only count it
+  // the first time we see it.
+  if (texture == NULL || _texturesWithPixels.count(texture) > 0)
+    return;
+  _texturesWithPixels.insert(texture);
+  memory.texturePixels += size_t(texture->getWidth()) * texture->getHeight() *
+      texture->getBytesPerPixel();
+}
+
+
+void Model::removeTexturePixels(RawImage* texture)
+{
+  if (_texturesWithPixels.erase(texture) == 0)
+    return;
+  memory.texturePixels -= size_t(texture->getWidth()) * texture->getHeight() *
+      texture->getBytesPerPixel();
+}
+
+
+size_t Model::mergeDuplicateMaterials()
+{
+  // Bucket the materials by hash, keeping the first of each set of equal
+  // materials as the canonical one.
+  std::map<size_t, std::vector<Material*> > buckets;
+  std::map<Material*, Material*> canonical;
+  std::map<std::string, Material*>::iterator m;
+  for (m = materials.begin(); m != materials.end(); ++m) {
+    Material* material = m->second;
+    if (canonical.count(material) > 0)
+      continue;
+
+    std::vector<Material*>& bucket = buckets[material->hash()];
+    Material* match = material;
+    for (size_t i = 0; i < bucket.size(); ++i) {
+      if (*bucket[i] == *material) {
+        match = bucket[i];
+        break;
+      }
+    }
+    if (match == material)
+      bucket.push_back(material);
+    canonical[material] = match;
+  }
+
+  for (size_t i = 0; i < faces.size(); ++i) {
+    std::map<Material*, Material*>::iterator c = canonical.find(faces[i]->material);
+    if (c != canonical.end())
+      faces[i]->material = c->second;
+  }
+
+  size_t removed = 0;
+  for (m = materials.begin(); m != materials.end(); ++m)
+    m->second = canonical[m->second];
+  std::map<Material*, Material*>::iterator c;
+  for (c = canonical.begin(); c != canonical.end(); ++c) {
+    if (c->first != c->second) {
+      delete c->first;
+      memory.materials -= sizeof(Material);
+      ++removed;
+    }
+  }
+  return removed;
+}
+
+
 void Model::newKeyframe()
 {
   _coordNum = 0;
@@ -146,6 +656,35 @@ void Model::newKeyframe()
   _colorNum = 0;
 
   ++_numKeyframes;
+  _keyframeLoaded.push_back(true);
+  if (_numLoadedKeyframes == _numKeyframes - 1)
+    _numLoadedKeyframes = _numKeyframes;
+}
+
+
+void Model::endKeyframe()
+{
+  if (_numKeyframes == 0)
+    return;
+
+  size_t keyframe = _numKeyframes - 1;
+  vh::Vector3 keyframeLow, keyframeHigh;
+  // When streaming, the curves only hold the previous keyframe and this one.
+  size_t index = (_keyframeStream != NULL) ? std::min(keyframe, (size_t)1) : keyframe;
+  calculateBounds(v, index, keyframeLow, keyframeHigh);
+
+  while (_keyframeLow.numKeyframes() <= keyframe) {
+    _keyframeLow.addKeyframe(keyframeLow);
+    _keyframeHigh.addKeyframe(keyframeHigh);
+  }
+  _keyframeLow[keyframe] = keyframeLow;
+  _keyframeHigh[keyframe] = keyframeHigh;
+
+  low = vh::lowCorner(low, keyframeLow);
+  high = vh::highCorner(high, keyframeHigh);
+
+  if (_keyframeStream != NULL)
+    streamKeyframe(keyframe);
 }
 
 
@@ -154,3 +693,524 @@ size_t Model::numKeyframes()
   return _numKeyframes;
 }
 
+
+size_t Model::addKeyframes(size_t count)
+{
+  size_t first = _numKeyframes;
+  _numKeyframes += count;
+  _keyframeLow.resize(_numKeyframes);
+  _keyframeHigh.resize(_numKeyframes);
+  _keyframeLoaded.resize(_numKeyframes, false);
+
+  if (_keyframeStream != NULL) {
+    _keyframeStream->resize(_numKeyframes);
+    return first;
+  }
+
+  size_t coordBytes = padCurves(v, _numKeyframes);
+  size_t normalBytes = padCurves(vn, _numKeyframes);
+  memory.keyframes += coordBytes + normalBytes;
+  memory.keyframes += padCurves(vt, _numKeyframes);
+  memory.keyframes += padCurves(colors, _numKeyframes);
+  _coordKeyframeBytes += coordBytes;
+  _normalKeyframeBytes += normalBytes;
+  return first;
+}
+
+
+void Model::setKeyframe(size_t keyframe, const KeyframeData& data)
+{
+  vh::Vector3 keyframeLow(1e20, 1e20, 1e20);
+  vh::Vector3 keyframeHigh(-1e20, -1e20, -1e20);
+
+  if (_keyframeStream != NULL) {
+    // Missing items come from the first keyframe, which is all the curves
+    // hold while loading.
+    std::vector<float> coords(v.size() * 3), normals(vn.size() * 3);
+    for (size_t i = 0; i < v.size(); ++i) {
+      vh::Vector3 coord = (i < data.coords.size()) ? data.coords[i] : v[i][0];
+      keyframeLow = vh::lowCorner(keyframeLow, coord);
+      keyframeHigh = vh::highCorner(keyframeHigh, coord);
+      coords[i * 3 + 0] = coord.x;
+      coords[i * 3 + 1] = coord.y;
+      coords[i * 3 + 2] = coord.z;
+    }
+    if (_normalsCalculated && !v.empty()) {
+      calculateFaceNormals(faces, &coords[0], v.size(), &normals[0]);
+    } else {
+      for (size_t i = 0; i < vn.size(); ++i) {
+        vh::Vector3 normal = (i < data.normals.size()) ? data.normals[i] : vn[i][0];
+        normals[i * 3 + 0] = normal.x;
+        normals[i * 3 + 1] = normal.y;
+        normals[i * 3 + 2] = normal.z;
+      }
+    }
+    _keyframeStream->write(keyframe, coords.empty() ? NULL : &coords[0],
+                           normals.empty() ? NULL : &normals[0]);
+  } else {
+    setCurveKeyframe(v, keyframe, data.coords);
+    setCurveKeyframe(vt, keyframe, data.texCoords);
+    setCurveKeyframe(vn, keyframe, data.normals);
+    setCurveKeyframe(colors, keyframe, data.colors);
+
+    std::vector<float> coords(v.size() * 3);
+    for (size_t i = 0; i < v.size(); ++i) {
+      vh::Vector3 coord = v[i][keyframe];
+      keyframeLow = vh::lowCorner(keyframeLow, coord);
+      keyframeHigh = vh::highCorner(keyframeHigh, coord);
+      coords[i * 3 + 0] = coord.x;
+      coords[i * 3 + 1] = coord.y;
+      coords[i * 3 + 2] = coord.z;
+    }
+    if (_normalsCalculated && !v.empty()) {
+      std::vector<float> normals(v.size() * 3);
+      calculateFaceNormals(faces, &coords[0], v.size(), &normals[0]);
+      for (size_t i = 0; i < v.size(); ++i)
+        vn[i][keyframe] = vh::Vector3(normals[i * 3], normals[i * 3 + 1], normals[i * 3 + 2]);
+    }
+  }
+
+  _keyframeLow[keyframe] = keyframeLow;
+  _keyframeHigh[keyframe] = keyframeHigh;
+
+  pthread_mutex_lock(&_loadLock);
+  low = vh::lowCorner(low, keyframeLow);
+  high = vh::highCorner(high, keyframeHigh);
+  _keyframeLoaded[keyframe] = true;
+  while (_numLoadedKeyframes < _numKeyframes && _keyframeLoaded[_numLoadedKeyframes])
+    ++_numLoadedKeyframes;
+  pthread_mutex_unlock(&_loadLock);
+}
+
+
+size_t Model::numLoadedKeyframes()
+{
+  pthread_mutex_lock(&_loadLock);
+  size_t result = _numLoadedKeyframes;
+  pthread_mutex_unlock(&_loadLock);
+  return result;
+}
+
+
+void Model::removeKeyframe(size_t keyframe)
+{
+  if (keyframe >= _numKeyframes)
+    return;
+
+  if (_keyframeStream != NULL) {
+    _keyframeStream->removeKeyframe(keyframe);
+  } else {
+    size_t coordBytes = removeFromCurves(v, keyframe);
+    size_t normalBytes = removeFromCurves(vn, keyframe);
+    memory.keyframes -= coordBytes + normalBytes;
+    memory.keyframes -= removeFromCurves(vt, keyframe);
+    memory.keyframes -= removeFromCurves(colors, keyframe);
+    _coordKeyframeBytes -= coordBytes;
+    _normalKeyframeBytes -= normalBytes;
+  }
+  _keyframeLow.removeKeyframe(keyframe);
+  _keyframeHigh.removeKeyframe(keyframe);
+  --_numKeyframes;
+
+  pthread_mutex_lock(&_loadLock);
+  _keyframeLoaded.erase(_keyframeLoaded.begin() + keyframe);
+  _numLoadedKeyframes = std::min(_numLoadedKeyframes, keyframe);
+  while (_numLoadedKeyframes < _numKeyframes && _keyframeLoaded[_numLoadedKeyframes])
+    ++_numLoadedKeyframes;
+  pthread_mutex_unlock(&_loadLock);
+}
+
+
+bool Model::streamKeyframes(const char* dir, size_t windowSize)
+{
+  if (_keyframeStream != NULL || _numKeyframes > 0)
+    return false;
+
+  _keyframeStream = new KeyframeStream(windowSize);
+  if (!_keyframeStream->create(dir)) {
+    delete _keyframeStream;
+    _keyframeStream = NULL;
+    return false;
+  }
+  return true;
+}
+
+
+bool Model::keyframesStreamed() const
+{
+  return _keyframeStream != NULL;
+}
+
+
+void Model::prefetchKeyframes(float time, float keyframesPerSecond)
+{
+  // The window wraps around, so it could take in keyframes which haven't
+  // been written yet.
+  if (_keyframeStream != NULL && numLoadedKeyframes() == _numKeyframes)
+    _keyframeStream->prefetch(time, keyframesPerSecond);
+}
+
+
+void Model::boundsAt(float time, vh::Vector3& timeLow, vh::Vector3& timeHigh) const
+{
+  if (_keyframeLow.numKeyframes() == 0) {
+    timeLow = low;
+    timeHigh = high;
+  } else {
+    timeLow = _keyframeLow.valueAt(time);
+    timeHigh = _keyframeHigh.valueAt(time);
+  }
+}
+
+
+void Model::calculateNormals()
+{
+  // Setup a normal of 0,0,0,0 for all keyframes.
+  while (vn.size() < v.size()) {
+    Curve3 curve;
+    while (curve.numKeyframes() < _numKeyframes)
+      curve.addKeyframe(vh::Vector3(0, 0, 0));
+    vn.push_back(curve);
+
+    memory.normals += sizeof(Curve3) + sizeof(vh::Vector3);
+    if (_numKeyframes > 1) {
+      memory.keyframes += (_numKeyframes - 1) * sizeof(vh::Vector3);
+      _normalKeyframeBytes += (_numKeyframes - 1) * sizeof(vh::Vector3);
+    }
+  }
+
+  std::vector<float> coords(v.size() * 3), normals(v.size() * 3);
+  for (size_t frame = 0; !v.empty() && frame < _numKeyframes; ++frame) {
+    copyKeyframe(v, frame, &coords[0]);
+    calculateFaceNormals(faces, &coords[0], v.size(), &normals[0]);
+    for (size_t i = 0; i < v.size(); ++i)
+      vn[i][frame] = vh::Vector3(normals[i * 3], normals[i * 3 + 1], normals[i * 3 + 2]);
+  }
+
+  for (size_t i = 0; i < faces.size(); ++i) {
+    Face& face = *faces[i];
+    for (size_t j = 0; j < face.size(); ++j)
+      face[j].vn = face[j].v;
+  }
+  _normalsCalculated = true;
+}
+
+
+size_t Model::triangulate()
+{
+  std::vector<size_t> polygons;
+  for (size_t i = 0; i < faces.size(); ++i) {
+    if (faces[i]->size() > 3)
+      polygons.push_back(i);
+  }
+  if (polygons.empty())
+    return 0;
+
+  std::vector<float> coords(v.size() * 3);
+  if (!v.empty())
+    copyKeyframe(v, 0, &coords[0]);
+
+  std::vector<std::vector<unsigned int> > triangles(polygons.size());
+#pragma omp parallel for schedule(static)
+  for (size_t i = 0; i < polygons.size(); ++i)
+    triangulateFace(*faces[polygons[i]], &coords[0], triangles[i]);
+
+  // Put the triangles where the polygon was, so the faces stay in the same
+  // order.
+  std::vector<Face*> newFaces;
+  newFaces.reserve(faces.size() + polygons.size());
+  size_t next = 0;
+  for (size_t i = 0; i < faces.size(); ++i) {
+    Face* face = faces[i];
+    if (next == polygons.size() || polygons[next] != i) {
+      newFaces.push_back(face);
+      continue;
+    }
+
+    const std::vector<unsigned int>& corners = triangles[next];
+    for (size_t j = 0; j < corners.size(); j += 3) {
+      Face* triangle = new Face(face->material);
+      triangle->part = face->part;
+      triangle->vertexes.push_back((*face)[corners[j]]);
+      triangle->vertexes.push_back((*face)[corners[j + 1]]);
+      triangle->vertexes.push_back((*face)[corners[j + 2]]);
+      newFaces.push_back(triangle);
+      memory.faces += sizeof(Face*) + sizeof(Face) + 3 * sizeof(Vertex);
+    }
+    memory.faces -= sizeof(Face*) + sizeof(Face) + face->size() * sizeof(Vertex);
+    delete face;
+    ++next;
+  }
+  faces.swap(newFaces);
+  return polygons.size();
+}
+
+
+void Model::compressKeyframes(bool deltaCoding)
+{
+  if (_quantizedKeyframes != NULL || _pcaKeyframes != NULL || _keyframeStream != NULL)
+    return;
+
+  _quantizedKeyframes = new QuantizedKeyframes(v, vn, low, high, deltaCoding);
+  _quantizedKeyframes->printStats();
+
+  for (size_t i = 0; i < v.size(); ++i)
+    v[i].clear();
+  for (size_t i = 0; i < vn.size(); ++i)
+    vn[i].clear();
+
+  // Only the empty curves are left behind.
+  memory.coords = v.size() * sizeof(Curve3);
+  memory.normals = vn.size() * sizeof(Curve3);
+  memory.keyframes += _quantizedKeyframes->bytesUsed();
+  memory.keyframes -= _coordKeyframeBytes + _normalKeyframeBytes;
+  _coordKeyframeBytes = 0;
+  _normalKeyframeBytes = 0;
+}
+
+
+QuantizedKeyframes* Model::quantizedKeyframes()
+{
+  return _quantizedKeyframes;
+}
+
+
+void Model::factorKeyframes(size_t numBases, float errorTolerance,
+    const std::string& cacheFile)
+{
+  if (_quantizedKeyframes != NULL || _pcaKeyframes != NULL || _keyframeStream != NULL)
+    return;
+
+  uint64_t hash = 0;
+  if (!cacheFile.empty()) {
+    hash = PCAKeyframes::hash(v, vn, numBases, errorTolerance);
+    if (!PCAKeyframes::read(cacheFile, hash, v, vn, _pcaKeyframes)) {
+      fprintf(stderr, "Unable to read factored keyframes from %s: %s\n",
+          cacheFile.c_str(), strerror(errno));
+    }
+  }
+  if (_pcaKeyframes == NULL) {
+    _pcaKeyframes = new PCAKeyframes(v, vn, low, high, numBases, errorTolerance);
+    if (!cacheFile.empty() && !_pcaKeyframes->write(cacheFile, hash)) {
+      fprintf(stderr, "Unable to write factored keyframes to %s: %s\n",
+          cacheFile.c_str(), strerror(errno));
+    }
+  }
+  _pcaKeyframes->printStats();
+
+  for (size_t i = 0; i < v.size(); ++i)
+    v[i].clear();
+  for (size_t i = 0; i < vn.size(); ++i)
+    vn[i].clear();
+
+  memory.coords = v.size() * sizeof(Curve3);
+  memory.normals = vn.size() * sizeof(Curve3);
+  memory.keyframes += _pcaKeyframes->bytesUsed();
+  memory.keyframes -= _coordKeyframeBytes + _normalKeyframeBytes;
+  _coordKeyframeBytes = 0;
+  _normalKeyframeBytes = 0;
+}
+
+
+PCAKeyframes* Model::pcaKeyframes()
+{
+  return _pcaKeyframes;
+}
+
+
+void Model::packKeyframes()
+{
+  if (_keyframeStream != NULL) {
+    // Everything is already on disk; all the curves hold now is a copy of
+    // the last keyframe.
+    for (size_t i = 0; i < v.size(); ++i)
+      v[i].clear();
+    for (size_t i = 0; i < vn.size(); ++i)
+      vn[i].clear();
+
+    memory.coords = v.size() * sizeof(Curve3);
+    memory.normals = vn.size() * sizeof(Curve3);
+    memory.keyframes -= _coordKeyframeBytes + _normalKeyframeBytes;
+    _coordKeyframeBytes = 0;
+    _normalKeyframeBytes = 0;
+    memory.keyframes += _keyframeStream->bytesUsed();
+    fprintf(stderr, "Streaming %lu keyframes for %lu coords and %lu normals, with %lu resident at a time.\n",
+        _keyframeStream->numKeyframes(), v.size(), vn.size(),
+        std::min(_keyframeStream->windowSize(), _keyframeStream->numKeyframes()));
+    return;
+  }
+
+  if (_quantizedKeyframes != NULL || _pcaKeyframes != NULL || _coordArrays != NULL ||
+      _numKeyframes < 2)
+    return;
+
+  _coordArrays = new KeyframeArrays(v);
+  _normalArrays = new KeyframeArrays(vn);
+  fprintf(stderr, "Packed %lu keyframes for %lu coords and %lu normals, using the %s kernel.\n",
+      _coordArrays->numKeyframes(), v.size(), vn.size(), lerpArraysKernel());
+
+  for (size_t i = 0; i < v.size(); ++i)
+    v[i].clear();
+  for (size_t i = 0; i < vn.size(); ++i)
+    vn[i].clear();
+
+  // The first keyframe of each still counts as coords or normals; the rest
+  // count as keyframes.
+  size_t coordFrameBytes = v.size() * sizeof(vh::Vector3);
+  size_t normalFrameBytes = vn.size() * sizeof(vh::Vector3);
+  memory.coords = v.size() * sizeof(Curve3) + coordFrameBytes;
+  memory.normals = vn.size() * sizeof(Curve3) + normalFrameBytes;
+  memory.keyframes -= _coordKeyframeBytes + _normalKeyframeBytes;
+  _coordKeyframeBytes = _coordArrays->bytesUsed() - coordFrameBytes;
+  _normalKeyframeBytes = _normalArrays->bytesUsed() - normalFrameBytes;
+  memory.keyframes += _coordKeyframeBytes + _normalKeyframeBytes;
+}
+
+
+const float* Model::coordsAt(float time)
+{
+  if (_quantizedKeyframes != NULL)
+    return _quantizedKeyframes->coordsAt(time);
+  if (_pcaKeyframes != NULL)
+    return _pcaKeyframes->coordsAt(time);
+  if (_coordArrays != NULL)
+    return _coordArrays->valuesAt(time);
+  if (_keyframeStream != NULL)
+    return _keyframeStream->coordsAt(time);
+  return NULL;
+}
+
+
+const float* Model::normalsAt(float time)
+{
+  if (_quantizedKeyframes != NULL)
+    return _quantizedKeyframes->normalsAt(time);
+  if (_pcaKeyframes != NULL)
+    return _pcaKeyframes->normalsAt(time);
+  if (_normalArrays != NULL)
+    return _normalArrays->valuesAt(time);
+  if (_keyframeStream != NULL)
+    return _keyframeStream->normalsAt(time);
+  return NULL;
+}
+
+
+void Model::keyframeData(size_t keyframe, float* coords, float* normals)
+{
+  if (_quantizedKeyframes != NULL) {
+    _quantizedKeyframes->decodeCoords(keyframe, coords);
+    _quantizedKeyframes->decodeNormals(keyframe, normals);
+  } else if (_pcaKeyframes != NULL) {
+    _pcaKeyframes->decodeCoords(keyframe, coords);
+    _pcaKeyframes->decodeNormals(keyframe, normals);
+  } else if (_coordArrays != NULL) {
+    memcpy(coords, _coordArrays->keyframe(keyframe), v.size() * 3 * sizeof(float));
+    memcpy(normals, _normalArrays->keyframe(keyframe), vn.size() * 3 * sizeof(float));
+  } else if (_keyframeStream != NULL && _keyframeStream->numKeyframes() > 0) {
+    _keyframeStream->read(keyframe, coords, normals);
+  } else {
+    copyKeyframe(v, keyframe, coords);
+    copyKeyframe(vn, keyframe, normals);
+  }
+}
+
+
+bool Model::texCoordsOrColorsAnimated() const
+{
+  for (size_t i = 0; i < vt.size(); ++i) {
+    const Curve2& curve = vt[i];
+    for (size_t k = 1; k < curve.numKeyframes(); ++k) {
+      if (curve[k].u != curve[0].u || curve[k].v != curve[0].v)
+        return true;
+    }
+  }
+  for (size_t i = 0; i < colors.size(); ++i) {
+    const Curve4& curve = colors[i];
+    for (size_t k = 1; k < curve.numKeyframes(); ++k) {
+      for (unsigned int j = 0; j < 4; ++j) {
+        if (curve[k].data[j] != curve[0].data[j])
+          return true;
+      }
+    }
+  }
+  return false;
+}
+
+
+void Model::findAnimatedVertices(std::vector<bool>& animatedCoords, std::vector<bool>& animatedNormals)
+{
+  animatedCoords.assign(v.size(), false);
+  animatedNormals.assign(vn.size(), false);
+  if (_numKeyframes < 2 || v.empty() || vn.empty())
+    return;
+
+  // Compare against the keyframes as the renderer will see them, so that
+  // this works the same whether they're in curves, arrays or compressed.
+  std::vector<float> firstCoords(v.size() * 3), firstNormals(vn.size() * 3);
+  std::vector<float> coords(v.size() * 3), normals(vn.size() * 3);
+  keyframeData(0, &firstCoords[0], &firstNormals[0]);
+  for (size_t k = 1; k < _numKeyframes; ++k) {
+    keyframeData(k, &coords[0], &normals[0]);
+    flagChanges(firstCoords, coords, animatedCoords);
+    flagChanges(firstNormals, normals, animatedNormals);
+  }
+}
+
+
+void Model::streamKeyframe(size_t keyframe)
+{
+  // The first keyframe decides how many coords and normals each keyframe
+  // has. If it came without normals, we calculate them from the faces for
+  // every keyframe as it arrives, since the curves won't be around later.
+  if (keyframe == 0) {
+    _normalsCalculated = vn.empty();
+    if (_normalsCalculated) {
+      while (vn.size() < v.size()) {
+        vn.push_back(Curve3());
+        memory.normals += sizeof(Curve3);
+      }
+      for (size_t i = 0; i < faces.size(); ++i) {
+        Face& face = *faces[i];
+        for (size_t j = 0; j < face.size(); ++j)
+          face[j].vn = face[j].v;
+      }
+    }
+  } else {
+    size_t numCoords = _keyframeStream->numCoords();
+    size_t numNormals = _keyframeStream->numNormals();
+    if (_coordNum != numCoords || (!_normalsCalculated && _normalNum != numNormals)) {
+      fprintf(stderr, "Keyframe %lu has %lu coords and %lu normals, but the first keyframe had %lu and %lu. "
+          "Missing values are copied from the previous keyframe and extra ones are ignored.\n",
+          keyframe, _coordNum, _normalNum, numCoords, numNormals);
+    }
+
+    // Only the items in the first keyframe are referenced by faces.
+    while (v.size() > numCoords) {
+      memory.coords -= sizeof(Curve3) + v.back().numKeyframes() * sizeof(vh::Vector3);
+      v.pop_back();
+    }
+    while (vn.size() > numNormals) {
+      memory.normals -= sizeof(Curve3) + vn.back().numKeyframes() * sizeof(vh::Vector3);
+      vn.pop_back();
+    }
+  }
+
+  std::vector<float> coords(v.size() * 3), normals(vn.size() * 3);
+  copyKeyframe(v, keyframe, &coords[0]);
+  if (_normalsCalculated)
+    calculateFaceNormals(faces, &coords[0], v.size(), &normals[0]);
+  else
+    copyKeyframe(vn, keyframe, &normals[0]);
+  _keyframeStream->append(coords.empty() ? NULL : &coords[0], v.size(),
+                          normals.empty() ? NULL : &normals[0], vn.size());
+
+  // The newest keyframe stays in the curves to fill any gaps in the next one.
+  for (size_t i = 0; i < v.size(); ++i)
+    v[i].keepLastKeyframe();
+  for (size_t i = 0; i < vn.size(); ++i)
+    vn[i].keepLastKeyframe();
+  memory.keyframes -= _coordKeyframeBytes + _normalKeyframeBytes;
+  _coordKeyframeBytes = 0;
+  _normalKeyframeBytes = 0;
+}
+
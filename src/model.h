@@ -1,9 +1,13 @@
 #ifndef OBJViewer_model_h
 #define OBJViewer_model_h
 
+#include <cstdio>
 #include <map>
+#include <set>
 #include <vector>
 
+#include <pthread.h>
+
 #include <imagelib.h>
 //#include "math3d.h"
 #include "vector.h"
@@ -25,6 +29,11 @@ struct Material {
   RawImage* mapBump; // Bump map.
 
   Material();
+
+  // Materials are equal if all of their parameters match and they use the
+  // same texture objects.
+  bool operator == (const Material& other) const;
+  size_t hash() const;
 };
 
 
@@ -38,6 +47,7 @@ struct Vertex {
 struct Face {
   Material *material;
   std::vector<Vertex> vertexes;
+  int part; // Index into Model::parts, or -1 if the face isn't in one.
 
   Face(Material *m = NULL);
 
@@ -48,11 +58,65 @@ struct Face {
 };
 
 
+// A breakdown of the memory used by a model, in bytes. The CPU side is kept
+// up to date by the Model as data is added to it; the GPU side is filled in
+// by the Renderer as it creates buffers and textures.
+struct MemoryUsage {
+  // CPU memory.
+  size_t coords;        // First keyframe of each coord, plus the curves.
+  size_t normals;       // First keyframe of each normal, plus the curves.
+  size_t texCoords;     // First keyframe of each tex coord, plus the curves.
+  size_t colors;        // First keyframe of each color, plus the curves.
+  size_t keyframes;     // All keyframes after the first, or the compressed store.
+  size_t faces;         // Faces and instance transforms, plus the per-vertex
+                        // indexes in render groups.
+  size_t materials;
+  size_t texturePixels; // Texture pixels not yet uploaded to the GPU.
+
+  // GPU memory.
+  size_t vertexBuffers; // Vertex and index buffers.
+  size_t textures;
+
+  MemoryUsage();
+
+  size_t cpuTotal() const;
+  size_t gpuTotal() const;
+
+  void printJSON(FILE* out) const;
+};
+
+
 typedef vh::Curve<vh::Vector2> Curve2;
 typedef vh::Curve<vh::Vector3> Curve3;
 typedef vh::Curve<vh::Vector4> Curve4;
 
 
+// A piece of the model which is drawn once for each of a set of transforms,
+// such as one of the models referenced by a scene file. Its vertices are
+// stored once, untransformed.
+struct ModelPart {
+  std::string name;
+  std::vector<vh::Matrix4> instances;
+
+  ModelPart(const std::string& iName, const std::vector<vh::Matrix4>& iInstances);
+};
+
+
+// The vertex data for a single keyframe, as loaded from a file.
+struct KeyframeData {
+  std::vector<vh::Vector3> coords;
+  std::vector<vh::Vector2> texCoords;
+  std::vector<vh::Vector3> normals;
+  std::vector<vh::Vector4> colors;
+};
+
+
+class KeyframeArrays;
+class KeyframeStream;
+class PCAKeyframes;
+class QuantizedKeyframes;
+
+
 class Model {
 public:
   std::vector<Curve3> v;
@@ -61,10 +125,17 @@ public:
   std::vector<Curve4> colors;
   std::vector<Face*> faces;
   std::map<std::string, Material*> materials;
+  std::vector<ModelPart> parts;
 
+  // The bounding box over all keyframes, of the vertices as they're stored
+  // (i.e. before any part's instance transforms).
   vh::Vector3 low;
   vh::Vector3 high;
 
+  // Anything which adds to or removes from the arrays above without going
+  // through the methods below must update this too.
+  MemoryUsage memory;
+
   Model();
   ~Model();
 
@@ -75,10 +146,115 @@ public:
 
   void addFace(Face* newFace);
   void addMaterial(const std::string& name, Material* newMaterial);
+  void addTexture(RawImage* texture);
+  void removeTexturePixels(RawImage* texture);
+
+  // Returns the new part's index, which is what its faces should have in
+  // their part field.
+  size_t addPart(const std::string& name, const std::vector<vh::Matrix4>& instances);
+
+  // Points every face and material name using a duplicate material at a
+  // single shared copy of it and deletes the duplicates. Returns the number
+  // of materials removed.
+  size_t mergeDuplicateMaterials();
 
   void newKeyframe();
+  void endKeyframe();
   size_t numKeyframes();
 
+  // For loading keyframes in parallel. addKeyframes() makes room for count
+  // more keyframes after the existing ones, initially copies of the last
+  // one, and returns the index of the first. setKeyframe() fills one of
+  // them in and can be called from several threads at once, as long as
+  // they're all setting different keyframes. Faces, materials and the
+  // number of items all come from the existing keyframes: extra items are
+  // ignored and missing ones keep their values from the last keyframe.
+  //
+  // The keyframes can be used while this is going on, but only the ones
+  // before numLoadedKeyframes(): the run of keyframes from the start which
+  // have all been set. Once every keyframe has been set it's the same as
+  // numKeyframes().
+  size_t addKeyframes(size_t count);
+  void setKeyframe(size_t keyframe, const KeyframeData& data);
+  size_t numLoadedKeyframes();
+
+  // Removes a keyframe, e.g. one which failed to load.
+  void removeKeyframe(size_t keyframe);
+
+  // Writes each keyframe's coords and normals out to a temporary file in the
+  // given directory as soon as it's loaded, keeping only windowSize of them
+  // in memory during playback. Must be called before anything is loaded.
+  // Tex coords and colors are taken from the first keyframe only. Returns
+  // false if the file couldn't be created, in which case the keyframes are
+  // kept in memory as usual.
+  bool streamKeyframes(const char* dir, size_t windowSize);
+  bool keyframesStreamed() const;
+
+  // Starts loading the streamed keyframes we'll need soon, given the current
+  // time and the playback rate in keyframes per second (negative for
+  // backwards). Does nothing unless the keyframes are streamed and have all
+  // been loaded.
+  void prefetchKeyframes(float time, float keyframesPerSecond);
+
+  // The bounding box of the model at a given time, interpolated from the
+  // boxes for the keyframes on either side. Every vertex lies within this
+  // box when it's interpolated the same way.
+  void boundsAt(float time, vh::Vector3& timeLow, vh::Vector3& timeHigh) const;
+
+  // Calculates smooth vertex normals from the faces, for models which don't
+  // have any normals of their own. Keyframes set after this get their
+  // normals calculated as they arrive.
+  void calculateNormals();
+
+  // Splits every face with more than three vertices into triangles, using
+  // the coords from the first keyframe. Concave faces are handled. Returns
+  // the number of faces which were split.
+  size_t triangulate();
+
+  // Replaces the coord and normal curves with a quantized copy. After this
+  // the curves in v and vn are empty and all access must go through
+  // coordsAt() and normalsAt().
+  void compressKeyframes(bool deltaCoding);
+  QuantizedKeyframes* quantizedKeyframes();
+
+  // Replaces the coord and normal curves with a mean shape plus a set of
+  // basis shapes, as for compressKeyframes(). Uses numBases bases, or if
+  // that's 0 as few as will keep the rms error within errorTolerance (as a
+  // fraction of the bounding box diagonal). Does nothing if the keyframes
+  // have already been compressed. If cacheFile isn't empty the factors are
+  // read from it when it was written for the same keyframes and settings,
+  // and written to it otherwise.
+  void factorKeyframes(size_t numBases, float errorTolerance, const std::string& cacheFile);
+  PCAKeyframes* pcaKeyframes();
+
+  // Replaces the coord and normal curves with contiguous per-keyframe arrays
+  // which can be interpolated in bulk. As with compressKeyframes, the curves
+  // in v and vn are empty afterwards. Does nothing for models with only one
+  // keyframe, or if the keyframes have already been compressed or factored.
+  // For streamed keyframes this just releases the curves.
+  void packKeyframes();
+
+  // Interpolated coords (or normals) for every vertex at the given time, as
+  // 3 floats each. Returns NULL if the keyframes are still held in the
+  // curves, in which case use v[i].valueAt(time) instead.
+  const float* coordsAt(float time);
+  const float* normalsAt(float time);
+
+  // Copies the coords and normals for a single keyframe into the given
+  // arrays, as 3 floats each.
+  void keyframeData(size_t keyframe, float* coords, float* normals);
+
+  // True if any tex coord or color changes between keyframes.
+  bool texCoordsOrColorsAnimated() const;
+
+  // Flags each coord and normal which changes between keyframes.
+  void findAnimatedVertices(std::vector<bool>& animatedCoords, std::vector<bool>& animatedNormals);
+
+private:
+  // Writes the keyframe that's just been loaded to the stream and drops all
+  // but the newest keyframe from the curves.
+  void streamKeyframe(size_t keyframe);
+
 private:
   size_t _coordNum;
   size_t _texCoordNum;
@@ -86,6 +262,29 @@ private:
   size_t _colorNum;
 
   size_t _numKeyframes;
+
+  // Bounding box for each keyframe.
+  Curve3 _keyframeLow;
+  Curve3 _keyframeHigh;
+
+  QuantizedKeyframes* _quantizedKeyframes;
+  PCAKeyframes* _pcaKeyframes;
+  KeyframeArrays* _coordArrays;
+  KeyframeArrays* _normalArrays;
+  KeyframeStream* _keyframeStream;
+  bool _normalsCalculated;
+
+  std::set<RawImage*> _texturesWithPixels;
+  size_t _coordKeyframeBytes;
+  size_t _normalKeyframeBytes;
+
+  // Which keyframes have been set, and how many in a row from the start.
+  std::vector<bool> _keyframeLoaded;
+  size_t _numLoadedKeyframes;
+
+  // Guards low, high and the loaded keyframes while keyframes are being set
+  // in parallel.
+  pthread_mutex_t _loadLock;
 };
 
 
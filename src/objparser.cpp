@@ -635,11 +635,26 @@ Material *objParseUSEMTL(char *line, char*& col, std::map<std::string, Material*
 }
 
 
+// Lines which only describe the faces and their materials.
+bool objIsTopologyLine(OBJFileLineType lineType) {
+  switch (lineType) {
+    case OBJ_LINETYPE_F:
+    case OBJ_LINETYPE_FO:
+    case OBJ_LINETYPE_USEMTL:
+    case OBJ_LINETYPE_MTLLIB:
+      return true;
+    default:
+      return false;
+  }
+}
+
+
 //
 // PUBLIC FUNCTIONS
 //
 
-void loadOBJ(ParserCallbacks* callbacks, const char* path, ResourceManager* resources)
+void loadOBJ(ParserCallbacks* callbacks, const char* path, ResourceManager* resources,
+    const LoadOptions& options)
   throw(ParseException)
 {
   FILE *f = fopen(path, "r");
@@ -649,6 +664,7 @@ void loadOBJ(ParserCallbacks* callbacks, const char* path, ResourceManager* reso
   char line[_MAX_LINE_LEN];
   char *col;
   unsigned int line_no = 0;
+  size_t numCoords = 0;
 
   std::map<std::string, Material*> materials;
   Material *activeMaterial = NULL;
@@ -665,9 +681,14 @@ void loadOBJ(ParserCallbacks* callbacks, const char* path, ResourceManager* reso
 
       col = line;
       eatSpace(col);
-      switch (objParseLineType(col, col)) {
+      OBJFileLineType lineType = objParseLineType(col, col);
+      if (options.geometryOnly && objIsTopologyLine(lineType))
+        continue;
+
+      switch (lineType) {
         case OBJ_LINETYPE_V:
           callbacks->coordParsed(objParseV(col, col));
+          ++numCoords;
           break;
         case OBJ_LINETYPE_VT:
           callbacks->texCoordParsed(objParseVT(col, col));
@@ -710,6 +731,12 @@ void loadOBJ(ParserCallbacks* callbacks, const char* path, ResourceManager* reso
     fclose(f);
     throw ParseException("[%s: line %d, col %d] %s\n", path, line_no, (int)(col - line), ex.what());
   }
+  fclose(f);
+
+  if (options.expectedCoords > 0 && numCoords != options.expectedCoords) {
+    fprintf(stderr, "Warning: %s has %lu coords, but the first keyframe has %lu.\n",
+        path, numCoords, options.expectedCoords);
+  }
 }
 
 
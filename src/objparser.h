@@ -5,7 +5,8 @@
 #include "resources.h"
 
 
-void loadOBJ(ParserCallbacks* callbacks, const char* path, ResourceManager* resources)
+void loadOBJ(ParserCallbacks* callbacks, const char* path, ResourceManager* resources,
+    const LoadOptions& options)
   throw(ParseException);
 
 
@@ -9,6 +9,7 @@
 #include <getopt.h>
 #include <libgen.h>
 
+#include <cerrno>
 #include <cmath>
 #include <cstring>
 #include <cstdio>
@@ -16,6 +17,7 @@
 #include <string>
 
 #include "curve.h"
+#include "keyframeloader.h"
 #include "objviewer.h"
 #include "parser.h"
 
@@ -58,6 +60,26 @@ OBJViewerApp::OBJViewerApp(int argc, char **argv) :
   _maxTextureWidth(0),
   _maxTextureHeight(0),
   _animFPS(30.0),
+  _compressKeyframes(false),
+  _deltaCodeKeyframes(false),
+  _pcaBases(0),
+  _pcaErrorTolerance(0),
+  _pcaCachePath(),
+  _memoryReport(false),
+  _vertexFormat(),
+  _gpuKeyframes(false),
+  _gpuMemoryBudget(0),
+  _asyncPlayback(true),
+  _streamWindow(0),
+  _frameCacheBudget(0),
+  _lodPixelError(0),
+  _lodCachePath(),
+  _sortTriangles(false),
+  _transparencyMode(kSortedTransparency),
+  _occlusionCulling(false),
+  _virtualTextureBudget(0),
+  _keyframePaths(NULL),
+  _numKeyframePaths(0),
   _camera(new Camera())
 {
   glutInit(&argc, argv);
@@ -74,8 +96,28 @@ OBJViewerApp::OBJViewerApp(int argc, char **argv) :
   processArgs(argc, argv);
   _renderer = new Renderer(_resources, _model, _camera,
       _maxTextureWidth, _maxTextureHeight, _animFPS);
+  _renderer->setCompressKeyframes(_compressKeyframes, _deltaCodeKeyframes);
+  _renderer->setPCAKeyframes(_pcaBases, _pcaErrorTolerance, _pcaCachePath);
+  _renderer->setVertexFormat(_vertexFormat);
+  _renderer->setGPUKeyframes(_gpuKeyframes, _gpuMemoryBudget);
+  _renderer->setAsyncPlayback(_asyncPlayback);
+  _renderer->setFrameCache(_frameCacheBudget);
+  _renderer->setDetailLevels(_lodPixelError, _lodCachePath);
+  _renderer->setSortTriangles(_sortTriangles);
+  _renderer->setTransparencyMode(_transparencyMode);
+  _renderer->setOcclusionCulling(_occlusionCulling);
+  _renderer->setVirtualTextures(_virtualTextureBudget, tempDir());
   _renderer->prepare();
 
+  // The rest of the keyframes load while we're drawing the first.
+  if (_numKeyframePaths > 0) {
+    KeyframeLoader* loader = new KeyframeLoader(_model, _resources);
+    loader->start(_keyframePaths, _numKeyframePaths);
+    _renderer->setKeyframeLoader(loader);
+  }
+  if (_memoryReport && !_renderer->loadingKeyframes() && !_renderer->loadingTextures())
+    _renderer->printMemoryReport(stdout);
+
   glutDisplayFunc(doRender);
   glutReshapeFunc(doResize);
   glutKeyboardFunc(doKeyPressed);
@@ -95,7 +137,13 @@ OBJViewerApp::~OBJViewerApp()
 
 void OBJViewerApp::redraw()
 {
-  currentRenderer()->render(currWidth, currHeight);
+  Renderer* renderer = currentRenderer();
+  bool loading = renderer->loadingKeyframes() || renderer->loadingTextures();
+  renderer->render(currWidth, currHeight);
+
+  // The memory report waits until all of the keyframes and textures are in.
+  if (_memoryReport && loading && !renderer->loadingKeyframes() && !renderer->loadingTextures())
+    renderer->printMemoryReport(stdout);
 }
 
 
@@ -114,10 +162,8 @@ void OBJViewerApp::keyPressed(unsigned char key, int x, int y)
 {
   vh::Vector3 low(-1, -1, -1);
   vh::Vector3 high(1, 1, 1);
-  if (currentRenderer() != NULL && currentRenderer()->currentModel() != NULL) {
-    low = currentRenderer()->currentModel()->low;
-    high = currentRenderer()->currentModel()->high;
-  }
+  if (currentRenderer() != NULL && currentRenderer()->currentModel() != NULL)
+    currentRenderer()->modelBounds(low, high);
 
   switch (key) {
     case 27: // 27 is the ESC key.
@@ -175,6 +221,18 @@ void OBJViewerApp::keyPressed(unsigned char key, int x, int y)
     case 'h':
       currentRenderer()->toggleHeadlightType();
       break;
+    case 'u':
+      currentRenderer()->toggleFrustumCulling();
+      break;
+    case 'q':
+      currentRenderer()->toggleOcclusionCulling();
+      break;
+    case 'd':
+      currentRenderer()->toggleDetailLevels();
+      break;
+    case 't':
+      currentRenderer()->toggleTransparencyMode();
+      break;
     case ',':
       currentRenderer()->previousFrame();
       break;
@@ -207,6 +265,10 @@ void OBJViewerApp::keyPressed(unsigned char key, int x, int y)
       printf("g     Print OpenGL info.\n");
       printf("n     Flip the normals.\n");
       printf("h     Toggle the type of headlight between directional and spot.\n");
+      printf("u     Toggle view frustum culling on/off.\n");
+      printf("q     Toggle occlusion culling on/off.\n");
+      printf("d     Toggle simplified levels of detail on/off.\n");
+      printf("t     Toggle between sorted and weighted blended transparency.\n");
       printf("m     Jump back to the first frame.\n");
       printf(",     Step back 1 frame.\n");
       printf(".     Step forward 1 frame.\n");
@@ -280,6 +342,7 @@ void OBJViewerApp::beginModel(const char* path)
 
 void OBJViewerApp::endModel()
 {
+  _model->endKeyframe();
 }
 
 
@@ -312,23 +375,8 @@ void OBJViewerApp::faceParsed(Face* face)
   if (_model->numKeyframes() > 1)
     return;
 
-  if (face->size() == 4) {
-    Face* newFace = new Face(face->material);
-    newFace->vertexes.push_back(face->vertexes[0]);
-    newFace->vertexes.push_back(face->vertexes[1]);
-    newFace->vertexes.push_back(face->vertexes[2]);
-    _model->addFace(newFace);
-
-    newFace = new Face(face->material);
-    newFace->vertexes.push_back(face->vertexes[0]);
-    newFace->vertexes.push_back(face->vertexes[2]);
-    newFace->vertexes.push_back(face->vertexes[3]);
-    _model->addFace(newFace);
-
-    delete face;
-  } else {
-    _model->addFace(face);
-  }
+  // Quads and other polygons get triangulated once the model has loaded.
+  _model->addFace(face);
 }
 
 
@@ -340,7 +388,16 @@ void OBJViewerApp::materialParsed(const std::string& name, Material* material)
 
 void OBJViewerApp::textureParsed(RawImage* texture)
 {
-  // At the moment we don't need to do anything here, but we probably will do soon...
+  _model->addTexture(texture);
+}
+
+
+void OBJViewerApp::partParsed(const std::string& name, const std::vector<vh::Matrix4>& instances)
+{
+  if (_model->numKeyframes() > 1)
+    return;
+
+  _model->addPart(name, instances);
 }
 
 
@@ -357,8 +414,95 @@ void OBJViewerApp::usage(char *progname)
 "                               If our actual frame rate is different to this\n"
 "                               the frames will be interpolated. The default\n"
 "                               is 30.0 fps.\n"
+"  -k,--compress-keyframes      Store the animated coords & normals in a\n"
+"                               quantized form to save memory. Prints the\n"
+"                               size reduction and the error introduced.\n"
+"  -d,--delta-keyframes         As above, but also store keyframes as deltas\n"
+"                               from the previous keyframe where possible.\n"
+"  -c,--pca-keyframes N|E%%     Store the animated coords & normals as a\n"
+"                               mean shape plus N basis shapes, with a\n"
+"                               weight for each in every keyframe. Given as\n"
+"                               a percentage, uses as few bases as will\n"
+"                               keep the rms error below that much of the\n"
+"                               bounding box diagonal. Overrides -k and -d.\n"
+"                               Prints the size reduction and the error\n"
+"                               introduced. The factors are cached in\n"
+"                               <objfile>.pca, so only the first run with\n"
+"                               a given model and setting pays for them.\n"
+"  -v,--vertex-format FORMAT    How to store vertices on the GPU. One of:\n"
+"                               float       32 bit floats everywhere (the\n"
+"                                           default).\n"
+"                               half        Half float positions & tex\n"
+"                                           coords, 10:10:10:2 normals and\n"
+"                                           8 bit colors.\n"
+"                               packed      As half, but with 16 bit\n"
+"                                           integer positions.\n"
+"                               octahedral  As packed, but with octahedral\n"
+"                                           normals.\n"
+"  -p,--playback MODE           Where to interpolate animation keyframes:\n"
+"                               cpu   On the CPU, on a worker thread while\n"
+"                                     the previous frame is drawing (the\n"
+"                                     default).\n"
+"                               sync  On the CPU, on the render thread.\n"
+"                               gpu   In the vertex shader. All keyframes\n"
+"                                     are uploaded to the GPU up front; if\n"
+"                                     they don't fit we fall back to the CPU.\n"
+"  -G,--gpu-memory MB           How much GPU memory the keyframes can use in\n"
+"                               gpu playback mode. The default is to ask the\n"
+"                               driver, where it supports that.\n"
+"  -s,--stream-keyframes N      Keep the animated coords & normals in a\n"
+"                               temporary file and only hold N keyframes in\n"
+"                               memory at a time, loading the ones around\n"
+"                               the current frame in the background. Tex\n"
+"                               coords & colors come from the first keyframe.\n"
+"                               The file goes in $TMPDIR, or /tmp if that\n"
+"                               isn't set.\n"
+"  -b,--frame-cache MB          Keep up to MB megabytes of interpolated\n"
+"                               frames on the GPU, so that once an animation\n"
+"                               has looped it plays back without\n"
+"                               interpolating. Playback steps through a\n"
+"                               fixed set of times so that each loop hits\n"
+"                               the same frames.\n"
+"  -l,--lod PIXELS              Simplify each part of the model into a chain\n"
+"                               of levels of detail, each with half the\n"
+"                               triangles of the one before, and draw each\n"
+"                               part at the simplest level which is no more\n"
+"                               than PIXELS out on screen. The levels are\n"
+"                               cached in <objfile>.lod.\n"
+"  -z,--sort-triangles          Sort the triangles within transparent parts of\n"
+"                               the model from back to front, as well as the\n"
+"                               parts themselves. The sorting happens in the\n"
+"                               background, for the view in the frame\n"
+"                               before.\n"
+"  -w,--weighted-blend          Draw transparent parts of the model in one\n"
+"                               unsorted pass with weighted blended order\n"
+"                               independent transparency, instead of sorting\n"
+"                               them. Needs floating point render targets.\n"
+"  -o,--occlusion-culling       Skip parts of the model hidden behind other\n"
+"                               parts, using occlusion queries from earlier\n"
+"                               frames. A part coming into view may show up\n"
+"                               a frame late.\n"
+"  -V,--virtual-textures MB     Draw diffuse maps too big to upload whole\n"
+"                               (bigger than the maximum texture size, or\n"
+"                               4096 if there isn't one) as virtual\n"
+"                               textures: each is cut into tiles at every\n"
+"                               mip level and only the tiles the view needs\n"
+"                               are kept on the GPU, in a cache of about MB\n"
+"                               megabytes. The tiles go in a temporary file\n"
+"                               in $TMPDIR, or /tmp if that isn't set.\n"
+"  -m,--memory-report           Print a breakdown of the memory used by the\n"
+"                               model, as JSON on stdout, once it's loaded.\n"
 "  -h,--help                    Print this message and exit.\n"
 "\n"
+"Models can be .obj, .ply or .scene files. A .scene file places copies of\n"
+"other models, one statement per line:\n"
+"  model NAME PATH              Declares a model, relative to the scene file.\n"
+"  instance NAME [xform ...]    Places a copy of it, where each xform is one\n"
+"                               of 'translate X Y Z', 'rotate X Y Z' (degrees\n"
+"                               about each axis) or 'scale S' / 'scale X Y Z'\n"
+"                               and they apply in the order written.\n"
+"Each model is loaded once and its copies are drawn with instancing.\n"
+"\n"
 "You can also press keys to perform various functions while viewing a model.\n"
 "To see a list of these, press the '?' key.\n"
             , basename(progname));
@@ -372,7 +516,7 @@ bool OBJViewerApp::parseDimensions(char* dimensions, size_t& width, size_t& heig
     return false;
   width = atoi(tok);
 
-  tok = strtok(dimensions, "x");
+  tok = strtok(NULL, "x");
   if (tok == NULL)
     height = width;
   else
@@ -382,12 +526,33 @@ bool OBJViewerApp::parseDimensions(char* dimensions, size_t& width, size_t& heig
 }
 
 
+const char* OBJViewerApp::tempDir() const
+{
+  const char* dir = getenv("TMPDIR");
+  return (dir != NULL) ? dir : "/tmp";
+}
+
+
 void OBJViewerApp::processArgs(int argc, char **argv)
 {
-  const char *short_opts = "ht:f:";
+  const char *short_opts = "ht:f:kdc:v:p:G:s:b:l:zwoV:m";
   struct option long_opts[] = {
     { "max-texture-size",   required_argument,  NULL, 't' },
     { "fps",                required_argument,  NULL, 'f' },
+    { "compress-keyframes", no_argument,        NULL, 'k' },
+    { "delta-keyframes",    no_argument,        NULL, 'd' },
+    { "pca-keyframes",      required_argument,  NULL, 'c' },
+    { "vertex-format",      required_argument,  NULL, 'v' },
+    { "playback",           required_argument,  NULL, 'p' },
+    { "gpu-memory",         required_argument,  NULL, 'G' },
+    { "stream-keyframes",   required_argument,  NULL, 's' },
+    { "frame-cache",        required_argument,  NULL, 'b' },
+    { "lod",                required_argument,  NULL, 'l' },
+    { "sort-triangles",     no_argument,        NULL, 'z' },
+    { "weighted-blend",     no_argument,        NULL, 'w' },
+    { "occlusion-culling",  no_argument,        NULL, 'o' },
+    { "virtual-textures",   required_argument,  NULL, 'V' },
+    { "memory-report",      no_argument,        NULL, 'm' },
     { "help",               no_argument,        NULL, 'h' },
     { NULL, 0, NULL, 0 }
   };
@@ -403,6 +568,86 @@ void OBJViewerApp::processArgs(int argc, char **argv)
     case 'f':
       _animFPS = atof(optarg);
       break;
+    case 'k':
+      _compressKeyframes = true;
+      break;
+    case 'd':
+      _compressKeyframes = true;
+      _deltaCodeKeyframes = true;
+      break;
+    case 'c':
+      {
+        char* end = NULL;
+        double value = strtod(optarg, &end);
+        if (*end == '%')
+          _pcaErrorTolerance = value / 100.0;
+        else
+          _pcaBases = size_t(value);
+        if (end == optarg || (_pcaBases == 0 && _pcaErrorTolerance <= 0)) {
+          usage(argv[0]);
+          exit(1);
+        }
+      }
+      break;
+    case 'v':
+      if (!VertexFormat::named(optarg, _vertexFormat)) {
+        usage(argv[0]);
+        exit(1);
+      }
+      break;
+    case 'p':
+      if (strcmp(optarg, "gpu") == 0) {
+        _gpuKeyframes = true;
+      } else if (strcmp(optarg, "cpu") == 0) {
+        _gpuKeyframes = false;
+        _asyncPlayback = true;
+      } else if (strcmp(optarg, "sync") == 0) {
+        _gpuKeyframes = false;
+        _asyncPlayback = false;
+      } else {
+        usage(argv[0]);
+        exit(1);
+      }
+      break;
+    case 'G':
+      _gpuMemoryBudget = size_t(atof(optarg) * 1048576.0);
+      break;
+    case 's':
+      _streamWindow = strtoul(optarg, NULL, 10);
+      if (_streamWindow == 0) {
+        usage(argv[0]);
+        exit(1);
+      }
+      break;
+    case 'b':
+      _frameCacheBudget = size_t(atof(optarg) * 1048576.0);
+      break;
+    case 'l':
+      _lodPixelError = atof(optarg);
+      if (_lodPixelError <= 0) {
+        usage(argv[0]);
+        exit(1);
+      }
+      break;
+    case 'z':
+      _sortTriangles = true;
+      break;
+    case 'w':
+      _transparencyMode = kWeightedBlendedTransparency;
+      break;
+    case 'o':
+      _occlusionCulling = true;
+      break;
+    case 'V':
+      _virtualTextureBudget = size_t(atof(optarg) * 1048576.0);
+      if (_virtualTextureBudget == 0) {
+        usage(argv[0]);
+        exit(1);
+      }
+      break;
+    case 'm':
+      _memoryReport = true;
+      break;
     case 'h':
       usage(argv[0]);
       exit(0);
@@ -416,12 +661,28 @@ void OBJViewerApp::processArgs(int argc, char **argv)
   argc -= optind;
   argv += optind;
 
+  if (_streamWindow > 0) {
+    const char* dir = tempDir();
+    if (!_model->streamKeyframes(dir, _streamWindow)) {
+      fprintf(stderr, "Unable to create a keyframe store in %s: %s. Keeping all keyframes in memory.\n",
+          dir, strerror(errno));
+    }
+  }
+
+  // The first file which loads provides the faces and materials. Any files
+  // after it are keyframes, which get loaded in the background once we're up
+  // and running.
   for (int arg = 0; arg < argc; ++arg) {
     const char* modelPath = argv[arg];
     try {
       fprintf(stderr, "Loading model %s\n", modelPath);
       loadModel(this, modelPath, _resources);
       fprintf(stderr, "Finished loading model %s\n", modelPath);
+      _pcaCachePath = std::string(modelPath) + ".pca";
+      _lodCachePath = std::string(modelPath) + ".lod";
+      _keyframePaths = argv + arg + 1;
+      _numKeyframePaths = argc - arg - 1;
+      break;
     } catch (ParseException& e) {
       fprintf(stderr, "%s\n", e.what());
       fprintf(stderr, "Unable to load model. Continuing with default model.\n");
@@ -34,6 +34,7 @@ public:
   virtual void faceParsed(Face* face);
   virtual void materialParsed(const std::string& name, Material* material);
   virtual void textureParsed(RawImage* texture);
+  virtual void partParsed(const std::string& name, const std::vector<vh::Matrix4>& instances);
 
 private:
   //! Prints help about the command line syntax and options to stderr.
@@ -41,6 +42,9 @@ private:
 
   bool parseDimensions(char* dimensions, size_t& width, size_t& height);
 
+  //! Where temporary files go: $TMPDIR, or /tmp if that isn't set.
+  const char* tempDir() const;
+
   //! Process the command line arguments.
   void processArgs(int argc, char **argv);
 
@@ -55,6 +59,25 @@ private:
   Renderer* _renderer;
   size_t _maxTextureWidth, _maxTextureHeight;
   float _animFPS;
+  bool _compressKeyframes, _deltaCodeKeyframes;
+  size_t _pcaBases;
+  float _pcaErrorTolerance;
+  std::string _pcaCachePath;
+  bool _memoryReport;
+  VertexFormat _vertexFormat;
+  bool _gpuKeyframes;
+  size_t _gpuMemoryBudget;
+  bool _asyncPlayback;
+  size_t _streamWindow;
+  size_t _frameCacheBudget;
+  float _lodPixelError;
+  std::string _lodCachePath;
+  bool _sortTriangles;
+  TransparencyMode _transparencyMode;
+  bool _occlusionCulling;
+  size_t _virtualTextureBudget;
+  char** _keyframePaths;
+  int _numKeyframePaths;
 
   Camera* _camera;
 };
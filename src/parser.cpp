@@ -1,11 +1,11 @@
 #include <cstdarg>
 #include <cstdio>
 #include <cstring>
-#include <libgen.h>
 
 #include "parser.h"
 #include "objparser.h"
 #include "plyparser.h"
+#include "sceneparser.h"
 
 //
 // EXCEPTION METHODS
@@ -27,19 +27,34 @@ const char* ParseException::what() const throw()
 }
 
 
+//
+// LoadOptions METHODS
+//
+
+LoadOptions::LoadOptions() :
+  geometryOnly(false),
+  expectedCoords(0)
+{
+}
+
+
 //
 // PUBLIC FUNCTIONS
 //
 
-void loadModel(ParserCallbacks* callbacks, const char* path, ResourceManager* resources)
+void loadModel(ParserCallbacks* callbacks, const char* path, ResourceManager* resources,
+    const LoadOptions& options)
   throw(ParseException)
 {
   if (callbacks == NULL)
     throw ParseException("You didn't provide any callbacks; parsing will do nothing!");
 
-  const char *filename = basename(const_cast<char *>(path));
-  if (filename == NULL)
-    throw ParseException("Invalid model filename: %s does not name a file.", filename);
+  // Not basename(), since that isn't guaranteed to be thread safe and
+  // keyframes get loaded in parallel.
+  const char *filename = strrchr(path, '/');
+  filename = (filename != NULL) ? filename + 1 : path;
+  if (*filename == '\0')
+    throw ParseException("Invalid model filename: %s does not name a file.", path);
 
   // Check that the file exists.
   FILE *file = fopen(path, "rb");
@@ -54,11 +69,15 @@ void loadModel(ParserCallbacks* callbacks, const char* path, ResourceManager* re
 
   if (strcasecmp(ext, ".obj") == 0) {
     callbacks->beginModel(path);
-    loadOBJ(callbacks, path, resources);
+    loadOBJ(callbacks, path, resources, options);
     callbacks->endModel();
   } else if (strcasecmp(ext, ".ply") == 0) {
     callbacks->beginModel(path);
-    loadPLY(callbacks, path, resources);
+    loadPLY(callbacks, path, resources, options);
+    callbacks->endModel();
+  } else if (strcasecmp(ext, ".scene") == 0) {
+    callbacks->beginModel(path);
+    loadScene(callbacks, path, resources, options);
     callbacks->endModel();
   } else {
     throw ParseException("Unknown model format: %s", ext);
@@ -21,6 +21,20 @@ public:
 };
 
 
+// Controls how much of a file loadModel reads.
+struct LoadOptions {
+  // Only read the vertex data: faces, usemtl and mtllib lines are skipped
+  // without being parsed. Used for every keyframe after the first, since
+  // those take their faces and materials from the first one.
+  bool geometryOnly;
+
+  // If non-zero, warn when the file doesn't have exactly this many coords.
+  size_t expectedCoords;
+
+  LoadOptions();
+};
+
+
 // Implement this and override the relevant methods to provide your own custom
 // parsing behaviour.
 class ParserCallbacks {
@@ -35,10 +49,17 @@ public:
   virtual void faceParsed(Face* face) = 0;
   virtual void materialParsed(const std::string& name, Material* material) = 0;
   virtual void textureParsed(RawImage* texture) = 0;
+
+  // Scene files only: called before the faces of each model the scene
+  // uses, with a transform for every copy of it in the scene. Parts are
+  // numbered from 0 in the order they're parsed, and each face's part field
+  // says which one it's in.
+  virtual void partParsed(const std::string& name, const std::vector<vh::Matrix4>& instances) = 0;
 };
 
 
-void loadModel(ParserCallbacks* callbacks, const char* path, ResourceManager* resources)
+void loadModel(ParserCallbacks* callbacks, const char* path, ResourceManager* resources,
+    const LoadOptions& options = LoadOptions())
   throw(ParseException);
 
 
@@ -1,4 +1,5 @@
 #include <cstdio>
+#include <pthread.h>
 #include "ply.h"  // From the thirdparty directory.
 
 //#include "math3d.h"
@@ -61,6 +62,10 @@ bool hasNormals = false;
 bool hasRGB = false;
 bool hasIntensity = false;
 
+// The ply library keeps some of its parsing state in static variables, as
+// do we, so only one file can be loaded at a time.
+pthread_mutex_t gPLYLock = PTHREAD_MUTEX_INITIALIZER;
+
 
 //
 // INTERNAL FUNCTIONS
@@ -77,9 +82,12 @@ void plyParseFaces(ParserCallbacks* callbacks, PlyFile* plySrc,
 // PUBLIC FUNCTIONS
 //
 
-void loadPLY(ParserCallbacks* callbacks, const char* path, ResourceManager* resources)
+void loadPLY(ParserCallbacks* callbacks, const char* path, ResourceManager* resources,
+    const LoadOptions& options)
   throw(ParseException)
 {
+  pthread_mutex_lock(&gPLYLock);
+
   int numElements = 0;
   char** elementNames = NULL;
   int fileType = 0;
@@ -87,6 +95,8 @@ void loadPLY(ParserCallbacks* callbacks, const char* path, ResourceManager* reso
   PlyFile* plySrc = ply_open_for_reading(const_cast<char*>(path),
       &numElements, &elementNames, &fileType, &version);
 
+  bool readVertices = false;
+
   for (int i = 0; i < numElements; ++i) {
     char* sectionName = elementNames[i];
     int sectionSize = 0;
@@ -96,6 +106,11 @@ void loadPLY(ParserCallbacks* callbacks, const char* path, ResourceManager* reso
         plySrc, sectionName, &sectionSize, &numProperties);
 
     if (strcmp("vertex", sectionName) == 0) {
+      if (options.expectedCoords > 0 && size_t(sectionSize) != options.expectedCoords) {
+        fprintf(stderr, "Warning: %s has %d coords, but the first keyframe has %lu.\n",
+            path, sectionSize, options.expectedCoords);
+      }
+
       ply_get_property(plySrc, sectionName, &vertexProps[0]); 
       ply_get_property(plySrc, sectionName, &vertexProps[1]); 
       ply_get_property(plySrc, sectionName, &vertexProps[2]);
@@ -134,6 +149,12 @@ void loadPLY(ParserCallbacks* callbacks, const char* path, ResourceManager* reso
         else if (hasIntensity)
           callbacks->colorParsed(vh::Vector4(plyVert.intensity, plyVert.intensity, plyVert.intensity, 1.0));
       }
+      readVertices = true;
+    } else if (options.geometryOnly) {
+      // We only want the vertices, so there's no need to read past them.
+      if (readVertices)
+        break;
+      ply_get_other_element(plySrc, sectionName, sectionSize);
     } else if (strcmp("face", sectionName) == 0) {
       ply_get_property(plySrc, sectionName, &faceProps[0]);
       ply_get_other_properties(plySrc, sectionName, offsetof(PLYFace, otherData));
@@ -158,5 +179,6 @@ void loadPLY(ParserCallbacks* callbacks, const char* path, ResourceManager* reso
   }
 
   ply_close(plySrc);
+  pthread_mutex_unlock(&gPLYLock);
 }
 
@@ -12,17 +12,174 @@
 #include <GLUT/glut.h>
 #endif
 
+#include <algorithm>
+#include <cerrno>
 #include <cmath>
 #include <cstdlib>
+#include <cstring>
+#include <limits>
+#include <set>
+
+#include <sys/time.h>
 
 #include "renderer.h"
+#include "hash.h"
+#include "keyframeloader.h"
+#include "textureloader.h"
 
 
 //
 // CONSTANTS
 //
 
-const size_t MAX_FACES_PER_VBO = 1000000;
+// Each material's triangles are split into spatially compact render groups
+// of up to this many, so that the groups can be frustum culled.
+const size_t MAX_TRIANGLES_PER_GROUP = 4096;
+
+// How many simplified levels to make for each render group, when detail
+// levels are on. Each has half the triangles of the one before.
+const size_t MAX_DETAIL_LEVELS = 4;
+
+// Depth sorting starts with an insertion sort, since the order from the
+// last frame is usually nearly right. If it takes more than this many moves
+// per item, the view has changed too much and a full sort takes over.
+const size_t MAX_SORT_MOVES = 8;
+
+// A render group is only skipped by occlusion culling once this many query
+// results in a row have found it hidden, so that groups flickering on the
+// edge of visibility don't pop in and out.
+const unsigned int MIN_HIDDEN_RESULTS = 3;
+
+// The boxes drawn for occlusion queries are padded by this fraction of the
+// model's size, so that a flat group (a wall, say) isn't hidden by its own
+// triangles.
+const float OCCLUSION_BOX_PADDING = 0.002f;
+
+// The corners of a box, numbered so that bits 0, 1 and 2 say whether x, y
+// and z come from the high end, making up its 12 triangles. They all wind
+// anticlockwise seen from outside, so the back faces can be culled.
+const GLuint BOX_TRIANGLES[36] = {
+  0, 4, 6,  0, 6, 2,    1, 3, 7,  1, 7, 5,
+  0, 1, 5,  0, 5, 4,    2, 6, 7,  2, 7, 3,
+  0, 2, 3,  0, 3, 1,    4, 5, 7,  4, 7, 6
+};
+
+// Older glext.h files don't have these.
+#ifndef GL_GPU_MEMORY_INFO_CURRENT_AVAILABLE_VIDMEM_NVX
+#define GL_GPU_MEMORY_INFO_CURRENT_AVAILABLE_VIDMEM_NVX 0x9049
+#endif
+#ifndef GL_VBO_FREE_MEMORY_ATI
+#define GL_VBO_FREE_MEMORY_ATI 0x87FB
+#endif
+
+// How many vertex buffers each render group cycles through when fences are
+// available. With three, the buffer we fill for the next frame was last
+// drawn two frames ago, so the GPU has almost always finished with it.
+const size_t NUM_VERTEX_BUFFERS = 3;
+
+// Dirty vertex ranges closer together than this are merged, since rewriting
+// a few unchanged vertices is cheaper than flushing another range.
+const size_t MIN_DIRTY_RANGE_GAP = 32;
+
+// Dirty ranges shorter than this are filled on a single thread.
+const size_t MIN_PARALLEL_RANGE = 1000;
+
+// How long to wait for a fence before giving up, in nanoseconds.
+const GLuint64 FENCE_TIMEOUT = 1000000000;
+
+// With a frame cache, playback steps through the times a display running at
+// this rate would show, so that each loop lands on the same ones.
+const float BAKED_FRAMES_PER_SECOND = 60.0f;
+
+// How close (in samples) a time has to be to a sample to count as on it.
+const float SAMPLE_TOLERANCE = 1e-3f;
+
+// Roughly how much texture data to upload per frame while textures are
+// loading, so that a model with lots of them doesn't stall for seconds.
+const size_t TEXTURE_UPLOAD_BYTES_PER_FRAME = 8 * 1024 * 1024;
+
+// Textures bigger than this across are drawn as virtual textures, when
+// they're on and there's no smaller maximum texture size.
+const size_t VIRTUAL_TEXTURE_SIZE = 4096;
+
+// The virtual texture feedback pass is drawn at this fraction of the window
+// size in each direction.
+const int FEEDBACK_SCALE = 4;
+
+// How many tiles to copy into the virtual texture cache per frame.
+const size_t TILE_UPLOADS_PER_FRAME = 16;
+
+// The texture units for the virtual texture cache, page tables and mip
+// tails, after the ones for the material's maps.
+const unsigned int TILE_CACHE_UNIT = 4;
+const unsigned int PAGE_TABLE_UNIT = 5;
+const unsigned int MIP_TAIL_UNIT = 6;
+
+
+//
+// TYPES
+//
+
+// Interpolates the vertex buffers for a set of render groups on a worker
+// thread. The buffers are mapped (and unmapped afterwards) by the GL thread.
+class PlaybackJob : public Job {
+public:
+  float time;
+  std::vector<RenderGroup*> groups;
+  std::vector<size_t> buffers;
+  std::vector<char*> pointers;
+  std::vector<bool> everything;
+  size_t bytesWritten;
+
+  virtual void run()
+  {
+    bytesWritten = 0;
+    for (size_t i = 0; i < groups.size(); ++i)
+      bytesWritten += groups[i]->fillBuffer(time, pointers[i], everything[i]);
+  }
+};
+
+
+// Sorts the triangles within a set of transparent render groups on a
+// worker thread. The GL thread uploads the results.
+class SortJob : public Job {
+public:
+  vh::Vector4 depthRow;
+  std::vector<RenderGroup*> groups;
+
+  virtual void run()
+  {
+    for (size_t i = 0; i < groups.size(); ++i)
+      groups[i]->sortTriangles(depthRow);
+  }
+};
+
+
+// Orders indexes by the depth they've been given, furthest away (the most
+// negative eye space z) first.
+struct ByDepth {
+  const std::vector<float>& depths;
+
+  ByDepth(const std::vector<float>& iDepths) :
+    depths(iDepths)
+  {
+  }
+
+  bool operator () (unsigned int a, unsigned int b) const
+  {
+    return depths[a] < depths[b];
+  }
+};
+
+
+// Sort order for render groups which keeps the number of state changes
+// between them down.
+struct DrawsBefore {
+  bool operator () (const RenderGroup* a, const RenderGroup* b) const
+  {
+    return a->drawsBefore(*b);
+  }
+};
 
 
 //
@@ -31,25 +188,51 @@ const size_t MAX_FACES_PER_VBO = 1000000;
 
 void checkGLError(const char *errMsg, const char *okMsg = NULL);
 size_t systemTimeInMilliseconds();
+double preciseTimeInMilliseconds();
+bool hasGLExtension(const char* name);
+bool sortByDepth(std::vector<unsigned int>& order, const std::vector<float>& depths);
+void materialTextures(Material* material, RawImage* textures[4]);
 
 
 //
 // FramesPerSecond METHODS
 //
 
-FramesPerSecond::FramesPerSecond() : _framesDrawn(0), _since(0), _fps(0.0)
+FramesPerSecond::FramesPerSecond() :
+  _framesDrawn(0),
+  _since(0),
+  _fps(0.0),
+  _lastFrame(0.0),
+  _frameTimeSum(0.0),
+  _frameTimeSumSq(0.0),
+  _frameTime(0.0),
+  _frameTimeStdDev(0.0)
 {
 }
 
 
 void FramesPerSecond::increment()
 {
-  ++_framesDrawn;
+  double frameEnd = preciseTimeInMilliseconds();
+  if (_lastFrame > 0) {
+    double frameTime = frameEnd - _lastFrame;
+    _frameTimeSum += frameTime;
+    _frameTimeSumSq += frameTime * frameTime;
+    ++_framesDrawn;
+  }
+  _lastFrame = frameEnd;
 
   int now = glutGet(GLUT_ELAPSED_TIME);
   if (now - _since > 1000) {
     _fps = _framesDrawn * 1000.0 / (now - _since);
+    if (_framesDrawn > 0) {
+      double mean = _frameTimeSum / _framesDrawn;
+      double variance = _frameTimeSumSq / _framesDrawn - mean * mean;
+      _frameTime = mean;
+      _frameTimeStdDev = (variance > 0) ? sqrt(variance) : 0.0;
+    }
     _framesDrawn = 0;
+    _frameTimeSum = _frameTimeSumSq = 0.0;
     _since = now;
   }
 }
@@ -61,844 +244,3742 @@ float FramesPerSecond::fps() const
 }
 
 
+float FramesPerSecond::frameTime() const
+{
+  return _frameTime;
+}
+
+
+float FramesPerSecond::frameTimeStdDev() const
+{
+  return _frameTimeStdDev;
+}
+
+
 //
-// RenderGroup METHODS
+// VertexRange METHODS
 //
 
-RenderGroup::RenderGroup(Material* iMaterial, RenderGroupType iType, GLuint iShaderProgramID) :
-  _material(iMaterial),
-  _type(iType),
-  _size(0),
-  _hasColors(false),
-  _currentTime(-1e20),
-  _flipNormals(false),
-  _coords(),
-  _texCoords(),
-  _normals(),
-  _colors(),
-  _bufferID(0),
-  _indexesID(0),
-  _shaderProgramID(iShaderProgramID)
+VertexRange::VertexRange(size_t iStart, size_t iEnd) :
+  start(iStart),
+  end(iEnd)
 {
 }
 
 
-Material* RenderGroup::getMaterial() const
+//
+// ShaderLocations METHODS
+//
+
+ShaderLocations::ShaderLocations() :
+  positionScale(-1),
+  positionBias(-1),
+  normalEncoding(-1),
+  interpolateKeyframes(-1),
+  keyframeFraction(-1),
+  packedNormal(-1),
+  nextPosition(-1),
+  nextNormal(-1),
+  weightedBlend(-1),
+  instanced(-1),
+  tileCache(-1),
+  pageTable(-1),
+  mipTail(-1),
+  virtualLevels(-1),
+  tileCacheLayout(-1),
+  virtualFeedback(-1),
+  virtualIndex(-1),
+  feedbackBias(-1)
 {
-  return _material;
+  for (unsigned int i = 0; i < 4; ++i)
+    maps[i] = hasMaps[i] = -1;
+  for (unsigned int i = 0; i < 3; ++i)
+    instanceRows[i] = -1;
+  for (unsigned int i = 0; i < 4; ++i)
+    virtualMaps[i] = -1;
 }
 
 
-void RenderGroup::add(Model* model, Face* face)
-{
-  if (_size == 0) {
-    _hasColors = (*face)[0].c >= 0;
-  }
+//
+// DrawState METHODS
+//
 
-  for (size_t i = 0; i < face->size(); ++i) {
-    int vi = (*face)[i].v;
-    _coords.push_back(&model->v[vi]);
+DrawState::DrawState() :
+  _calls(0),
+  _weightedBlend(false),
+  _virtualFeedback(false),
+  _locations(),
+  _uniforms()
+{
+  reset();
+}
 
-    int vti = (*face)[i].vt;
-    _texCoords.push_back(&model->vt[vti]);
 
-    int vni = (*face)[i].vn;
-    _normals.push_back(&model->vn[vni]);
+void DrawState::reset()
+{
+  _program = -1;
+  _arrayBuffer = -1;
+  _elementBuffer = -1;
+  _activeTexture = -1;
+  _clientActiveTexture = -1;
+  for (unsigned int i = 0; i < kNumTextureUnits; ++i)
+    _textures[i] = -1;
+  for (unsigned int i = 0; i < 4; ++i)
+    _texCoordArrays[i] = -1;
+  for (unsigned int i = 0; i < kNumClientStates; ++i)
+    _clientStates[i] = -1;
+  for (unsigned int i = 0; i < kMaxAttribs; ++i)
+    _attribArrays[i] = -1;
+  _materialKnown = false;
+  _material = NULL;
+  _shininess = -1;
+}
 
-    if (_hasColors) {
-      int ci = (*face)[i].c;
-      _colors.push_back(&model->colors[ci]);
-    }
 
-    ++_size;
+void DrawState::restore()
+{
+  clientState(GL_VERTEX_ARRAY, false);
+  clientState(GL_NORMAL_ARRAY, false);
+  clientState(GL_COLOR_ARRAY, false);
+  for (unsigned int i = 0; i < 4; ++i)
+    texCoordArray(i, false);
+  for (unsigned int i = 0; i < kNumTextureUnits; ++i)
+    bindTexture(i, 0);
+  for (GLint i = 0; i < kMaxAttribs; ++i) {
+    if (_attribArrays[i] == 1)
+      vertexAttribArray(i, false);
   }
+  bindBuffer(GL_ARRAY_BUFFER, 0);
+  bindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+  // Fixed function drawing after us, like the HUD's raster positions, would
+  // otherwise go through the last group's vertex shader and whatever
+  // scaling, keyframe blending or instancing it was left set up for.
+  if (_program != 0) {
+    glUseProgram(0);
+    ++_calls;
+  }
+  reset();
 }
 
 
-size_t RenderGroup::size() const
+size_t DrawState::calls() const
 {
-  return _size;
+  return _calls;
 }
 
 
-size_t RenderGroup::floatsPerVertex() const
+void DrawState::resetCalls()
 {
-  // First 9 floats are: x, y, z, u, v, nx, ny, nz, nw.
-  return 9 + (_hasColors ? 3 : 0);
-  //return 7 + (_hasColors ? 3 : 0); // skipping u,v coords while debugging.
+  _calls = 0;
 }
 
 
-void RenderGroup::flipNormals()
+void DrawState::countCalls(size_t n)
 {
-  _flipNormals = !_flipNormals;
-  _currentTime = -1.0; // force the next setTime call to recalculate.
+  _calls += n;
 }
 
 
-void RenderGroup::prepare()
+bool DrawState::weightedBlend() const
 {
-  size_t bufferSize = _size * sizeof(float) * floatsPerVertex();
-
-  // Get a buffer ID for the coords & allocate space for them. 
-  glGenBuffers(1, &_bufferID);
-  glBindBuffer(GL_ARRAY_BUFFER, _bufferID);
-  glBufferData(GL_ARRAY_BUFFER, bufferSize, NULL, GL_STREAM_DRAW);
-  checkGLError("Error setting up vertex buffer");
+  return _weightedBlend;
+}
 
-  // Get a buffer ID for the indexes, upload them and clear out the local copy.
-  glGenBuffers(1, &_indexesID);
-  glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, _indexesID);
-  glBufferData(GL_ELEMENT_ARRAY_BUFFER,
-      sizeof(GLuint) * _size, NULL, GL_STATIC_DRAW);
-  checkGLError("Error setting up index buffer");
 
-  GLuint* indexBuffer = (GLuint*)glMapBuffer(GL_ELEMENT_ARRAY_BUFFER, GL_WRITE_ONLY);
-  for (GLuint i = 0; i < _size; ++i)
-    indexBuffer[i] = i;
-  glUnmapBuffer(GL_ELEMENT_ARRAY_BUFFER);
-  checkGLError("Error filling index buffer");
+void DrawState::setWeightedBlend(bool enabled)
+{
+  _weightedBlend = enabled;
 }
 
 
-void RenderGroup::render(float time)
+bool DrawState::virtualFeedback() const
 {
-  checkGLError("Error before RenderGroup::render");
-  glBindBuffer(GL_ARRAY_BUFFER, _bufferID);
-  glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, _indexesID);
-
-  glEnableClientState(GL_VERTEX_ARRAY);
-  checkGLError("Error before setTime");
-  setTime(time);
-  checkGLError("Error in setTime.");
+  return _virtualFeedback;
+}
 
-  // Set up the shaders for this render group.
-  setupShaders();
 
-  // Now start the rendering.
-  GLuint stride = sizeof(float) * floatsPerVertex();
-  GLuint offset = 0;
+void DrawState::setVirtualFeedback(bool enabled)
+{
+  _virtualFeedback = enabled;
+}
 
-  glVertexPointer(3, GL_FLOAT, stride, (const GLvoid*)offset);
-  offset += 3 * sizeof(float);
-  checkGLError("Error setting up vertex pointer");
 
-  RawImage* textures[4] = { NULL, NULL, NULL, NULL };
-  if (_material != NULL) {
-    textures[0] = _material->mapKa;
-    textures[1] = _material->mapKd;
-    textures[2] = _material->mapKs;
-    textures[3] = _material->mapD;
+const ShaderLocations& DrawState::useProgram(GLuint program)
+{
+  if (_program != GLint(program)) {
+    glUseProgram(program);
+    _program = program;
+    ++_calls;
   }
-  for (int i = 0; i < 4; ++i) {
-    glActiveTexture(GL_TEXTURE0 + i);
-    glClientActiveTexture(GL_TEXTURE0 + i);
-    if (textures[i] != NULL) {
-      glEnable(GL_TEXTURE_2D);
-      glEnableClientState(GL_TEXTURE_COORD_ARRAY);
-      glBindTexture(GL_TEXTURE_2D, textures[i]->getTexID());
-      glTexCoordPointer(2, GL_FLOAT, stride, (const GLvoid*)offset);
-    } else {
-      glDisable(GL_TEXTURE_2D);
-      glDisableClientState(GL_TEXTURE_COORD_ARRAY);
-      glBindTexture(GL_TEXTURE_2D, 0);
+
+  std::map<GLuint, ShaderLocations>::iterator found = _locations.find(program);
+  if (found != _locations.end())
+    return found->second;
+
+  const char* mapNames[] = { "mapKa", "mapKd", "mapKs", "mapD" };
+  const char* flagNames[] = { "hasMapKa", "hasMapKd", "hasMapKs", "hasMapD" };
+  const char* rowNames[] = { "instanceRow0", "instanceRow1", "instanceRow2" };
+  const char* virtualNames[] = { "virtualKa", "virtualKd", "virtualKs", "virtualD" };
+  ShaderLocations& locations = _locations[program];
+  if (program != 0) {
+    locations.positionScale = glGetUniformLocation(program, "positionScale");
+    locations.positionBias = glGetUniformLocation(program, "positionBias");
+    locations.normalEncoding = glGetUniformLocation(program, "normalEncoding");
+    locations.interpolateKeyframes = glGetUniformLocation(program, "interpolateKeyframes");
+    locations.keyframeFraction = glGetUniformLocation(program, "keyframeFraction");
+    for (unsigned int i = 0; i < 4; ++i) {
+      locations.maps[i] = glGetUniformLocation(program, mapNames[i]);
+      locations.hasMaps[i] = glGetUniformLocation(program, flagNames[i]);
     }
+    locations.packedNormal = glGetAttribLocation(program, "packedNormal");
+    locations.nextPosition = glGetAttribLocation(program, "nextPosition");
+    locations.nextNormal = glGetAttribLocation(program, "nextNormal");
+    locations.weightedBlend = glGetUniformLocation(program, "weightedBlend");
+    locations.instanced = glGetUniformLocation(program, "instanced");
+    for (unsigned int i = 0; i < 3; ++i)
+      locations.instanceRows[i] = glGetAttribLocation(program, rowNames[i]);
+    for (unsigned int i = 0; i < 4; ++i)
+      locations.virtualMaps[i] = glGetUniformLocation(program, virtualNames[i]);
+    locations.tileCache = glGetUniformLocation(program, "tileCache");
+    locations.pageTable = glGetUniformLocation(program, "pageTable");
+    locations.mipTail = glGetUniformLocation(program, "mipTail");
+    locations.virtualLevels = glGetUniformLocation(program, "virtualLevels");
+    locations.tileCacheLayout = glGetUniformLocation(program, "tileCacheLayout");
+    locations.virtualFeedback = glGetUniformLocation(program, "virtualFeedback");
+    locations.virtualIndex = glGetUniformLocation(program, "virtualIndex");
+    locations.feedbackBias = glGetUniformLocation(program, "feedbackBias");
+    _calls += 33;
   }
-  offset += 2 * sizeof(float);
-  checkGLError("Error setting up textures.");
+  return locations;
+}
 
-  glEnableClientState(GL_NORMAL_ARRAY);
-  glNormalPointer(GL_FLOAT, stride, (const GLvoid*)offset);
-  offset += 4 * sizeof(float);
-  checkGLError("Error setting up normals.");
 
-  if (_hasColors) {
-    glEnableClientState(GL_COLOR_ARRAY);
-    glColorPointer(3, GL_FLOAT, stride, (const GLvoid*)offset);
-    offset += 3 * sizeof(float);
-  } else if (_material != NULL) {
-    glDisableClientState(GL_COLOR_ARRAY);
-    glMaterialfv(GL_FRONT_AND_BACK, GL_AMBIENT, _material->Ka.data);
-    glMaterialfv(GL_FRONT_AND_BACK, GL_DIFFUSE, _material->Kd.data);
-    glMaterialfv(GL_FRONT_AND_BACK, GL_SPECULAR, _material->Ks.data);
-  } else {
-    glDisableClientState(GL_COLOR_ARRAY);
-    float defaultColor[] = { 1.0, 1.0, 1.0, 1.0 };
-    glMaterialfv(GL_FRONT_AND_BACK, GL_AMBIENT, defaultColor);
-    glMaterialfv(GL_FRONT_AND_BACK, GL_DIFFUSE, defaultColor);
-    glMaterialfv(GL_FRONT_AND_BACK, GL_SPECULAR, defaultColor);
-  }
-  checkGLError("Error setting up colors.");
+void DrawState::uniform1i(GLint loc, GLint value)
+{
+  if (uniformChanged(loc, vh::Vector3(value, 0, 0)))
+    glUniform1i(loc, value);
+}
 
-  if (_material != NULL) {
-    float shininess = std::min(_material->Ns * 128.0, 128.0);
-    glMaterialf(GL_FRONT_AND_BACK, GL_SHININESS, shininess);
-  } else {
-    glMaterialf(GL_FRONT_AND_BACK, GL_SHININESS, 10.0);
-  }
-  checkGLError("Error setting up shininess.");
- 
-  switch (_type) {
-    case kTriangleGroup:
-      glDrawElements(GL_TRIANGLES, _size, GL_UNSIGNED_INT, 0);
-      break;
-    case kPolygonGroup:
-      glDrawElements(GL_POLYGON, _size, GL_UNSIGNED_INT, 0);
-      break;
-  }
-  checkGLError("Error drawing elements.");
 
-  glDisableClientState(GL_VERTEX_ARRAY);
-  for (int i = 0; i < 4; ++i) {
-    glActiveTexture(GL_TEXTURE0 + i);
-    glClientActiveTexture(GL_TEXTURE0 + i);
-    glDisable(GL_TEXTURE_2D);
-    glDisableClientState(GL_TEXTURE_COORD_ARRAY);
-  }
-  glDisableClientState(GL_TEXTURE_COORD_ARRAY);
-  glDisableClientState(GL_NORMAL_ARRAY);
-  if (_hasColors)
-    glDisableClientState(GL_COLOR_ARRAY);
+void DrawState::uniform1f(GLint loc, GLfloat value)
+{
+  if (uniformChanged(loc, vh::Vector3(value, 0, 0)))
+    glUniform1f(loc, value);
+}
 
-  // Release the VBOs.
-  glBindBuffer(GL_ARRAY_BUFFER, 0);
-  glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
-  checkGLError("Error clearing up.");
+
+void DrawState::uniform3fv(GLint loc, const GLfloat* value)
+{
+  if (uniformChanged(loc, vh::Vector3(value[0], value[1], value[2])))
+    glUniform3fv(loc, 1, value);
 }
 
 
-void RenderGroup::renderPoints(float time)
+void DrawState::bindBuffer(GLenum target, GLuint buffer)
 {
-  glBindBuffer(GL_ARRAY_BUFFER, _bufferID);
-  glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, _indexesID);
-  glDisable(GL_LIGHTING);
-  glEnableClientState(GL_VERTEX_ARRAY);
+  GLint& current = (target == GL_ELEMENT_ARRAY_BUFFER) ? _elementBuffer : _arrayBuffer;
+  if (current == GLint(buffer))
+    return;
+  glBindBuffer(target, buffer);
+  current = buffer;
+  ++_calls;
+}
 
-  setTime(time);
 
-  GLuint stride = sizeof(float) * floatsPerVertex();
-  glVertexPointer(3, GL_FLOAT, stride, 0);
-  
-  glColor3f(0.0, 1.0, 1.0);
-  glEnable(GL_POLYGON_OFFSET_POINT);
-  glPolygonMode(GL_FRONT_AND_BACK, GL_POINT);
-  glPolygonOffset(0, -5);
-  glPointSize(5);
+void DrawState::bindTexture(unsigned int unit, GLuint texture)
+{
+  if (_textures[unit] == GLint(texture))
+    return;
 
-  switch (_type) {
-    case kTriangleGroup:
-      glDrawElements(GL_TRIANGLES, _size, GL_UNSIGNED_INT, 0);
-      break;
-    case kPolygonGroup:
-      glDrawElements(GL_POLYGON, _size, GL_UNSIGNED_INT, 0);
-      break;
+  activeTexture(unit);
+  // Going from no texture to some texture or back needs the unit enabling or
+  // disabling as well.
+  if (texture == 0 || _textures[unit] <= 0) {
+    if (texture != 0)
+      glEnable(GL_TEXTURE_2D);
+    else
+      glDisable(GL_TEXTURE_2D);
+    ++_calls;
   }
-
-  glPolygonOffset(0, 0);
-  glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
-  glDisable(GL_POLYGON_OFFSET_POINT);
-  glDisableClientState(GL_VERTEX_ARRAY);
-  glEnable(GL_LIGHTING);
-  glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
-  glBindBuffer(GL_ARRAY_BUFFER, 0);
+  glBindTexture(GL_TEXTURE_2D, texture);
+  _textures[unit] = texture;
+  ++_calls;
 }
 
 
-void RenderGroup::renderLines(float time)
+void DrawState::texCoordArray(unsigned int unit, bool enabled)
 {
-  glBindBuffer(GL_ARRAY_BUFFER, _bufferID);
-  glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, _indexesID);
-  glDisable(GL_LIGHTING);
-  glEnableClientState(GL_VERTEX_ARRAY);
+  if (_texCoordArrays[unit] == int(enabled))
+    return;
+  clientActiveTexture(unit);
+  if (enabled)
+    glEnableClientState(GL_TEXTURE_COORD_ARRAY);
+  else
+    glDisableClientState(GL_TEXTURE_COORD_ARRAY);
+  _texCoordArrays[unit] = enabled;
+  ++_calls;
+}
 
-  setTime(time);
 
-  GLuint stride = sizeof(float) * floatsPerVertex();
-  glVertexPointer(3, GL_FLOAT, stride, 0);
-  
-  glColor3f(0.8, 0.8, 0.8);
-  glEnable(GL_POLYGON_OFFSET_LINE);
-  glPolygonMode(GL_FRONT_AND_BACK, GL_LINE);
-  glPolygonOffset(0, -3);
+void DrawState::texCoordPointer(unsigned int unit, GLenum type, GLsizei stride, const GLvoid* offset)
+{
+  clientActiveTexture(unit);
+  glTexCoordPointer(2, type, stride, offset);
+  ++_calls;
+}
 
-  switch (_type) {
-    case kTriangleGroup:
-      glDrawElements(GL_TRIANGLES, _size, GL_UNSIGNED_INT, 0);
-      break;
-    case kPolygonGroup:
-      glDrawElements(GL_POLYGON, _size, GL_UNSIGNED_INT, 0);
-      break;
-  }
 
-  glPolygonOffset(0, 0);
-  glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
-  glDisable(GL_POLYGON_OFFSET_LINE);
-  glDisableClientState(GL_VERTEX_ARRAY);
-  glEnable(GL_LIGHTING);
-  glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
-  glBindBuffer(GL_ARRAY_BUFFER, 0);
+void DrawState::clientState(GLenum array, bool enabled)
+{
+  int& current = _clientStates[clientStateIndex(array)];
+  if (current == int(enabled))
+    return;
+  if (enabled)
+    glEnableClientState(array);
+  else
+    glDisableClientState(array);
+  current = enabled;
+  ++_calls;
 }
 
 
-void RenderGroup::setTime(float time)
+void DrawState::vertexAttribArray(GLint loc, bool enabled)
 {
-  // Note: This function assumes that the correct vertex buffer has already been bound.
-
-  if (time == _currentTime)
+  if (loc < 0 || loc >= kMaxAttribs || _attribArrays[loc] == int(enabled))
     return;
+  if (enabled)
+    glEnableVertexAttribArray(loc);
+  else
+    glDisableVertexAttribArray(loc);
+  _attribArrays[loc] = enabled;
+  ++_calls;
+}
 
-  _currentTime = time;
 
-  // Calculate the current animation frame.
-  const size_t vertexSize = floatsPerVertex();
-  float* vertexBuffer = (float*)glMapBuffer(GL_ARRAY_BUFFER, GL_WRITE_ONLY);
-#pragma omp parallel for schedule(dynamic, 100)
-  for (size_t i = 0; i < _coords.size(); ++i) {
-    vh::Vector3 coord = _coords[i]->valueAt(time);
-    float* vertexBufferPos = vertexBuffer + (i * vertexSize);
-    vertexBufferPos[0] = coord.x;
-    vertexBufferPos[1] = coord.y;
-    vertexBufferPos[2] = coord.z;
-  }
-  vertexBuffer += 3;
-#pragma omp parallel for schedule(dynamic, 100)
-  for (size_t i = 0; i < _texCoords.size(); ++i) {
-    vh::Vector2 texCoord = _texCoords[i]->valueAt(time);
-    float* vertexBufferPos = vertexBuffer + (i * vertexSize);
-    vertexBufferPos[0] = texCoord.x;
-    vertexBufferPos[1] = texCoord.y;
-  }
-  vertexBuffer += 2;
-  if (!_flipNormals) {
-#pragma omp parallel for schedule(dynamic, 100)
-    for (size_t i = 0; i < _normals.size(); ++i) {
-      vh::Vector3 normal = _normals[i]->valueAt(time);
-      float* vertexBufferPos = vertexBuffer + (i * vertexSize);
-      vertexBufferPos[0] = normal.x;
-      vertexBufferPos[1] = normal.y;
-      vertexBufferPos[2] = normal.z;
-      vertexBufferPos[3] = 1;
-    }
+void DrawState::material(const Material* material)
+{
+  if (_materialKnown && material == _material)
+    return;
+
+  if (material != NULL) {
+    glMaterialfv(GL_FRONT_AND_BACK, GL_AMBIENT, material->Ka.data);
+    glMaterialfv(GL_FRONT_AND_BACK, GL_DIFFUSE, material->Kd.data);
+    glMaterialfv(GL_FRONT_AND_BACK, GL_SPECULAR, material->Ks.data);
   } else {
-#pragma omp parallel for schedule(dynamic, 100)
-    for (size_t i = 0; i < _normals.size(); ++i) {
-      vh::Vector3 normal = _normals[i]->valueAt(time);
-      float* vertexBufferPos = vertexBuffer + (i * vertexSize);
-      vertexBufferPos[0] = -normal.x;
-      vertexBufferPos[1] = -normal.y;
-      vertexBufferPos[2] = -normal.z;
-      vertexBufferPos[3] = 1.0;
-    }
+    float defaultColor[] = { 1.0, 1.0, 1.0, 1.0 };
+    glMaterialfv(GL_FRONT_AND_BACK, GL_AMBIENT, defaultColor);
+    glMaterialfv(GL_FRONT_AND_BACK, GL_DIFFUSE, defaultColor);
+    glMaterialfv(GL_FRONT_AND_BACK, GL_SPECULAR, defaultColor);
   }
-  vertexBuffer += 4;
-  if (_hasColors) {
-#pragma omp parallel for schedule(dynamic, 100)
-    for (size_t i = 0; i < _colors.size(); ++i) {
-      vh::Vector4 color = _colors[i]->valueAt(time);
-      float* vertexBufferPos = vertexBuffer + (i * vertexSize);
-      vertexBufferPos[0] = color.r;
-      vertexBufferPos[1] = color.g;
-      vertexBufferPos[2] = color.b;
-    }
-    vertexBuffer += 3;
+  _materialKnown = true;
+  _material = material;
+  _calls += 3;
+}
+
+
+void DrawState::shininess(float value)
+{
+  if (_shininess == value)
+    return;
+  glMaterialf(GL_FRONT_AND_BACK, GL_SHININESS, value);
+  _shininess = value;
+  ++_calls;
+}
+
+
+int DrawState::clientStateIndex(GLenum array) const
+{
+  switch (array) {
+    case GL_NORMAL_ARRAY:
+      return kNormalArray;
+    case GL_COLOR_ARRAY:
+      return kColorArray;
+    default:
+      return kVertexArray;
   }
-  glUnmapBuffer(GL_ARRAY_BUFFER);
 }
 
 
-void RenderGroup::setupShaders()
+void DrawState::activeTexture(unsigned int unit)
 {
-  glUseProgram(_shaderProgramID);
-  checkGLError("Error setting up shaders (bad program ID?)");
+  if (_activeTexture == int(unit))
+    return;
+  glActiveTexture(GL_TEXTURE0 + unit);
+  _activeTexture = unit;
+  ++_calls;
+}
 
-  const char* flagNames[] = { "hasMapKa", "hasMapKd", "hasMapKs", "hasMapD" };
-  if (_material != NULL) {
-    RawImage* textures[] = { _material->mapKa, _material->mapKd, _material->mapKs, _material->mapD };
-    const char* names[] = { "mapKa", "mapKd", "mapKs", "mapD" };
 
-    for (size_t i = 0; i < 4; ++i) {
-      if (textures[i] != NULL) {
-        glUniform1i(glGetUniformLocation(_shaderProgramID, names[i]), i);
-        checkGLError("Error setting up texture for shader");
+void DrawState::clientActiveTexture(unsigned int unit)
+{
+  if (_clientActiveTexture == int(unit))
+    return;
+  glClientActiveTexture(GL_TEXTURE0 + unit);
+  _clientActiveTexture = unit;
+  ++_calls;
+}
 
-        glUniform1i(glGetUniformLocation(_shaderProgramID, flagNames[i]), 1);
-        checkGLError("Error setting up texture flag for shader");
-      } else {
-        glUniform1i(glGetUniformLocation(_shaderProgramID, flagNames[i]), 0);
-        checkGLError("Error setting up texture flag for shader");
-      }
-    }
-  } else {
-    for (size_t i = 0; i < 4; ++i) {
-      glUniform1i(glGetUniformLocation(_shaderProgramID, flagNames[i]), 0);
-      checkGLError("Error setting up texture flag for shader");
-    }
-  }
+
+bool DrawState::uniformChanged(GLint loc, const vh::Vector3& value)
+{
+  if (loc < 0)
+    return false;
+
+  std::pair<GLuint, GLint> key(GLuint(_program), loc);
+  std::map<std::pair<GLuint, GLint>, vh::Vector3>::iterator current = _uniforms.find(key);
+  if (current != _uniforms.end() &&
+      current->second.x == value.x && current->second.y == value.y && current->second.z == value.z)
+    return false;
+  _uniforms[key] = value;
+  ++_calls;
+  return true;
 }
 
 
 //
-// Renderer METHODS
+// RenderGroup METHODS
 //
 
-Renderer::Renderer(ResourceManager* resources, Model* model, Camera* camera,
-    size_t maxTextureWidth, size_t maxTextureHeight, float animFPS) :
-  _headlightType(kDirectional),
-  _drawPolys(true),
-  _drawPoints(false),
-  _drawLines(false),
-  _resources(resources),
-  _model(model),
-  _camera(camera),
-  _animFPS(animFPS),
-  _maxTextureWidth(maxTextureWidth),
-  _maxTextureHeight(maxTextureHeight),
-  _renderGroups(),
-  _currentMapKa(NULL),
-  _currentMapKd(NULL),
-  _currentMapKs(NULL),
-  _currentMapD(NULL),
-  _fps(),
-  _shaderWithMaterial(0),
-  _shaderNoMaterial(0),
-  _currentTime(0),
-  _playing(false),
-  _since(0)
+RenderGroup::RenderGroup(Material* iMaterial, GLuint iShaderProgramID,
+    const VertexFormat& iFormat) :
+  _material(iMaterial),
+  _size(0),
+  _hasColors(false),
+  _currentTime(-1e20),
+  _flipNormals(false),
+  _format(iFormat),
+  _positionScale(1, 1, 1),
+  _positionBias(0, 0, 0),
+  _packScale(1, 1, 1),
+  _model(NULL),
+  _coords(),
+  _texCoords(),
+  _normals(),
+  _colors(),
+  _indexesID(0),
+  _numIndexes(0),
+  _detailLevels(),
+  _levelRanges(),
+  _detailLevel(0),
+  _triangleCenters(),
+  _triangleDepths(),
+  _triangleOrder(),
+  _orderChanged(false),
+  _sortedRange(0, 0),
+  _bufferID(0),
+  _currentBuffer(0),
+  _bufferIDs(),
+  _mappedBuffers(),
+  _lastDrawn(),
+  _bufferFilled(),
+  _dirtyRanges(),
+  _staticBufferID(0),
+  _staticAnimated(false),
+  _staticTime(-1e20),
+  _keyframeBufferID(0),
+  _numKeyframes(0),
+  _instances(NULL),
+  _instanceBufferID(0),
+  _virtualTextures(NULL),
+  _virtualIndex(0),
+  _shaderProgramID(iShaderProgramID)
 {
-  glClearColor(0.2, 0.2, 0.2, 1.0);
-  glEnable(GL_DEPTH_TEST);
-  glEnable(GL_LIGHTING);
-  glEnable(GL_LIGHT0);
-  glEnable(GL_BLEND);
-  glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+}
 
-  for (unsigned int i = 0; i < 4; ++i) {
-    glActiveTexture(GL_TEXTURE0 + i);
-    glEnable(GL_TEXTURE_2D);
+
+Material* RenderGroup::getMaterial() const
+{
+  return _material;
+}
+
+
+void RenderGroup::add(Model* model, Face* face)
+{
+  if (_size == 0) {
+    _model = model;
+    _hasColors = (*face)[0].c >= 0;
   }
 
-  //float ambient[4] = { 0.2f, 0.2f, 0.2f, 1.0f };
-  //glLightModelfv(GL_LIGHT_MODEL_AMBIENT, ambient);
-  glShadeModel(GL_SMOOTH);
+  for (size_t i = 0; i < face->size(); ++i) {
+    _coords.push_back((*face)[i].v);
+    _texCoords.push_back((*face)[i].vt);
+    _normals.push_back((*face)[i].vn);
+    if (_hasColors)
+      _colors.push_back((*face)[i].c);
+
+    ++_size;
+  }
 }
 
 
-Renderer::~Renderer()
+size_t RenderGroup::size() const
 {
-  delete _model;
-  std::list<RenderGroup*>::iterator iter;
-  for (iter = _renderGroups.begin(); iter != _renderGroups.end(); ++iter)
-    delete *iter;
+  return _size;
 }
 
 
-Camera* Renderer::currentCamera()
+size_t RenderGroup::animatedBytesPerVertex() const
 {
-  return _camera;
+  return _format.animatedBytesPerVertex();
 }
 
 
-Model* Renderer::currentModel()
+size_t RenderGroup::staticBytesPerVertex() const
 {
-  return _model;
+  return _format.staticBytesPerVertex(_hasColors);
 }
 
 
-void Renderer::toggleDrawPolys()
+size_t RenderGroup::cpuBytes() const
 {
-  _drawPolys = !_drawPolys;
+  size_t detailBytes = sizeof(VertexRange) * _levelRanges.capacity() +
+      sizeof(vh::Vector3) * _triangleCenters.capacity() +
+      sizeof(float) * _triangleDepths.capacity() +
+      sizeof(unsigned int) * _triangleOrder.capacity();
+  for (size_t i = 0; i < _detailLevels.size(); ++i)
+    detailBytes += sizeof(unsigned int) * _detailLevels[i].indexes.capacity();
+  return sizeof(int) * (_coords.capacity() + _texCoords.capacity() +
+                        _normals.capacity() + _colors.capacity()) +
+      sizeof(VertexRange) * _dirtyRanges.capacity() + detailBytes;
 }
 
 
-void Renderer::toggleDrawPoints()
+size_t RenderGroup::gpuBytes() const
 {
-  _drawPoints = !_drawPoints;
+  if (_bufferID == 0)
+    return 0;
+  return _bufferIDs.size() * _size * animatedBytesPerVertex() +
+      _size * staticBytesPerVertex() + _numIndexes * sizeof(GLuint) + keyframeBytes(_numKeyframes);
 }
 
 
-void Renderer::toggleDrawLines()
+size_t RenderGroup::keyframeBytes(size_t numKeyframes) const
 {
-  _drawLines = !_drawLines;
+  return numKeyframes * _size * _format.animatedBytesPerVertex();
 }
 
 
-void Renderer::toggleHeadlightType()
+bool RenderGroup::hasGPUKeyframes() const
 {
-  if (_headlightType == kSpotlight)
-    _headlightType = kDirectional;
-  else
-    _headlightType = kSpotlight;
+  return _keyframeBufferID != 0;
 }
 
 
-void Renderer::printGLInfo()
+void RenderGroup::flipNormals()
 {
-  fprintf(stderr, "GL_MAX_COMBINED_TEXTURE_UNITS = %d\n",
-    glGet(GL_MAX_COMBINED_TEXTURE_IMAGE_UNITS));
-  fprintf(stderr, "GL_MAX_TEXTURE_COORDS = %d\n",
-    glGet(GL_MAX_TEXTURE_COORDS));
+  _flipNormals = !_flipNormals;
+
+  // Every normal has changed, so every buffer needs refilling in full.
+  _currentTime = -1.0;
+  _bufferFilled.assign(_bufferFilled.size(), false);
 }
 
 
-void Renderer::prepare()
+void RenderGroup::findDirtyRanges(const std::vector<bool>& animatedCoords,
+    const std::vector<bool>& animatedNormals, bool animatedTexCoordsOrColors)
 {
-  prepareMaterials();
-  prepareModel();
-  prepareShaders();
-  prepareRenderGroups();
+  _dirtyRanges.clear();
+  for (size_t i = 0; i < _size; ++i) {
+    if (!animatedCoords[_coords[i]] && !animatedNormals[_normals[i]])
+      continue;
 
-  loadTextures(_renderGroups);
-  _camera->frontView(_model->low, _model->high);
+    if (!_dirtyRanges.empty() && i - _dirtyRanges.back().end < MIN_DIRTY_RANGE_GAP)
+      _dirtyRanges.back().end = i + 1;
+    else
+      _dirtyRanges.push_back(VertexRange(i, i + 1));
+  }
+  _staticAnimated = animatedTexCoordsOrColors;
 }
 
 
-void Renderer::render(int width, int height)
+size_t RenderGroup::numDirtyVertices() const
 {
-  glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+  size_t count = 0;
+  for (size_t i = 0; i < _dirtyRanges.size(); ++i)
+    count += _dirtyRanges[i].end - _dirtyRanges[i].start;
+  return count;
+}
 
-  // If we're playing the animation, calculate the new frame time.
-  if (_playing)
-    setTime(calculatePlaybackTime());
 
-  // Apply the camera settings.
-  if (_model != NULL) {
-    setupCamera(width, height, _model->low, _model->high);
-  } else {
-    vh::Vector3 low(-1, -1, -1);
-    vh::Vector3 high(1, 1, 1);
-    setupCamera(width, height, low, high);
-  }
+void RenderGroup::keyframesChanged()
+{
+  calculatePositionScale();
+  _currentTime = -1.0;
+  _staticTime = -1e20;
+  _bufferFilled.assign(_bufferFilled.size(), false);
+}
 
-  // Draw the scene.
-  glMatrixMode(GL_MODELVIEW);
-  glLoadIdentity();
 
-  // Put a light at the same position as the camera.
-  headlight(GL_LIGHT0, vh::Vector4(1, 1, 1, 1));
+void RenderGroup::keyframesChanged(const vh::Vector3& low, const vh::Vector3& high)
+{
+  if (_format.positions != kFloatPositions)
+    setPositionScale(low, high);
+  _currentTime = -1.0;
+  _staticTime = -1e20;
+  _bufferFilled.assign(_bufferFilled.size(), false);
+}
 
-  transformToCamera();
-  if (_model != NULL) {
-    std::list<RenderGroup*>::iterator iter;
 
-    if (_drawPolys) {
-      for (iter = _renderGroups.begin(); iter != _renderGroups.end(); ++iter) {
-        RenderGroup* group = *iter;
-        group->render(_currentTime);
-      }
+void RenderGroup::prepare(size_t numBuffers, bool persistent)
+{
+  size_t bufferSize = _size * animatedBytesPerVertex();
+
+  calculatePositionScale();
+
+  // Get buffer IDs for the coords & normals and allocate space for them.
+  _bufferIDs.resize(numBuffers, 0);
+  _mappedBuffers.resize(numBuffers, NULL);
+  _lastDrawn.resize(numBuffers, 0);
+  _bufferFilled.resize(numBuffers, false);
+  glGenBuffers(numBuffers, &_bufferIDs[0]);
+  for (size_t i = 0; i < numBuffers; ++i) {
+    glBindBuffer(GL_ARRAY_BUFFER, _bufferIDs[i]);
+#ifdef GL_ARB_buffer_storage
+    if (persistent) {
+      const GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+      glBufferStorage(GL_ARRAY_BUFFER, bufferSize, NULL, flags);
+      _mappedBuffers[i] = (char*)glMapBufferRange(GL_ARRAY_BUFFER, 0, bufferSize, flags);
+      continue;
     }
+#endif
+    glBufferData(GL_ARRAY_BUFFER, bufferSize, NULL, GL_STREAM_DRAW);
+  }
+  _currentBuffer = 0;
+  _bufferID = _bufferIDs[0];
+  checkGLError("Error setting up vertex buffer");
 
-    if (_drawPoints) {
-      glDisable(GL_LIGHTING);
-      for (iter = _renderGroups.begin(); iter != _renderGroups.end(); ++iter) {
-        RenderGroup* group = *iter;
-        group->renderPoints(_currentTime);
-      }
-      glEnable(GL_LIGHTING);
+  // The tex coords and colors get uploaded right away.
+  glGenBuffers(1, &_staticBufferID);
+  glBindBuffer(GL_ARRAY_BUFFER, _staticBufferID);
+  glBufferData(GL_ARRAY_BUFFER, _size * staticBytesPerVertex(), NULL, GL_STATIC_DRAW);
+  fillStaticBuffer(0.0f);
+  glBindBuffer(GL_ARRAY_BUFFER, 0);
+  checkGLError("Error setting up static vertex buffer");
+
+  // The index buffer holds every vertex in order, for level 0, followed by
+  // the indexes for each simplified level and then, if we're sorting, level
+  // 0 again in sorted order.
+  _levelRanges.clear();
+  _levelRanges.push_back(VertexRange(0, _size));
+  for (size_t i = 0; i < _detailLevels.size(); ++i) {
+    size_t start = _levelRanges.back().end;
+    _levelRanges.push_back(VertexRange(start, start + _detailLevels[i].indexes.size()));
+  }
+  _numIndexes = _levelRanges.back().end;
+  if (sortsTriangles()) {
+    _sortedRange = VertexRange(_numIndexes, _numIndexes + _size);
+    _numIndexes += _size;
+  }
+
+  // Get a buffer ID for the indexes, upload them and clear out the local copy.
+  glGenBuffers(1, &_indexesID);
+  glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, _indexesID);
+  glBufferData(GL_ELEMENT_ARRAY_BUFFER,
+      sizeof(GLuint) * _numIndexes, NULL, GL_STATIC_DRAW);
+  checkGLError("Error setting up index buffer");
+
+  GLuint* indexBuffer = (GLuint*)glMapBuffer(GL_ELEMENT_ARRAY_BUFFER, GL_WRITE_ONLY);
+  for (GLuint i = 0; i < _size; ++i)
+    indexBuffer[i] = i;
+  for (GLuint i = 0; i < _sortedRange.end - _sortedRange.start; ++i)
+    indexBuffer[_sortedRange.start + i] = i;
+  for (size_t i = 0; i < _detailLevels.size(); ++i) {
+    std::vector<unsigned int>& indexes = _detailLevels[i].indexes;
+    std::copy(indexes.begin(), indexes.end(), indexBuffer + _levelRanges[i + 1].start);
+    std::vector<unsigned int>().swap(indexes);
+  }
+  glUnmapBuffer(GL_ELEMENT_ARRAY_BUFFER);
+  checkGLError("Error filling index buffer");
+}
+
+
+bool RenderGroup::prepareKeyframes(size_t numKeyframes)
+{
+  checkGLError("Error before RenderGroup::prepareKeyframes");
+
+  glGenBuffers(1, &_keyframeBufferID);
+  glBindBuffer(GL_ARRAY_BUFFER, _keyframeBufferID);
+  glBufferData(GL_ARRAY_BUFFER, keyframeBytes(numKeyframes), NULL, GL_STATIC_DRAW);
+  GLenum err = glGetError();
+  glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+  if (err != GL_NO_ERROR) {
+    glDeleteBuffers(1, &_keyframeBufferID);
+    _keyframeBufferID = 0;
+    return false;
+  }
+  _numKeyframes = numKeyframes;
+  return true;
+}
+
+
+void RenderGroup::uploadKeyframe(size_t keyframe, const float* coords, const float* normals)
+{
+  const size_t stride = animatedBytesPerVertex();
+  std::vector<char> block(_size * stride);
+
+#pragma omp parallel for schedule(dynamic, 100)
+  for (size_t i = 0; i < _size; ++i) {
+    const float* coord = coords + _coords[i] * 3;
+    const float* normal = normals + _normals[i] * 3;
+    packAnimatedVertex(i, vh::Vector3(coord[0], coord[1], coord[2]),
+        vh::Vector3(normal[0], normal[1], normal[2]), &block[0]);
+  }
+
+  glBindBuffer(GL_ARRAY_BUFFER, _keyframeBufferID);
+  glBufferSubData(GL_ARRAY_BUFFER, keyframe * block.size(), block.size(), &block[0]);
+  glBindBuffer(GL_ARRAY_BUFFER, 0);
+  checkGLError("Error uploading keyframe");
+}
+
+
+bool RenderGroup::drawsBefore(const RenderGroup& other) const
+{
+  if (_shaderProgramID != other._shaderProgramID)
+    return _shaderProgramID < other._shaderProgramID;
+
+  RawImage* textures[4] = { NULL, NULL, NULL, NULL };
+  RawImage* otherTextures[4] = { NULL, NULL, NULL, NULL };
+  if (_material != NULL) {
+    textures[0] = _material->mapKa;
+    textures[1] = _material->mapKd;
+    textures[2] = _material->mapKs;
+    textures[3] = _material->mapD;
+  }
+  if (other._material != NULL) {
+    otherTextures[0] = other._material->mapKa;
+    otherTextures[1] = other._material->mapKd;
+    otherTextures[2] = other._material->mapKs;
+    otherTextures[3] = other._material->mapD;
+  }
+  for (unsigned int i = 0; i < 4; ++i) {
+    if (textures[i] != otherTextures[i])
+      return textures[i] < otherTextures[i];
+  }
+
+  return _material < other._material;
+}
+
+
+void RenderGroup::growBounds(const float* coords, vh::Vector3& low, vh::Vector3& high) const
+{
+  for (size_t i = 0; i < _coords.size(); ++i) {
+    const float* coord = coords + _coords[i] * 3;
+    for (unsigned int j = 0; j < 3; ++j) {
+      low.data[j] = std::min(low.data[j], coord[j]);
+      high.data[j] = std::max(high.data[j], coord[j]);
     }
+  }
+}
 
-    if (_drawLines) {
-      glDisable(GL_LIGHTING);
-      for (iter = _renderGroups.begin(); iter != _renderGroups.end(); ++iter) {
-        RenderGroup* group = *iter;
-        group->renderLines(_currentTime);
-      }
-      glEnable(GL_LIGHTING);
+
+uint64_t RenderGroup::detailHash(const float* coords) const
+{
+  const std::vector<int>* arrays[4] = { &_coords, &_texCoords, &_normals, &_colors };
+  uint64_t hash = hashBytes(&_size, sizeof(_size));
+  for (unsigned int i = 0; i < 4; ++i) {
+    if (!arrays[i]->empty())
+      hash = hashBytes(&(*arrays[i])[0], sizeof(int) * arrays[i]->size(), hash);
+  }
+  for (size_t i = 0; i < _size; ++i)
+    hash = hashBytes(coords + _coords[i] * 3, sizeof(float) * 3, hash);
+  return hash;
+}
+
+
+void RenderGroup::buildDetailLevels(const float* coords, size_t maxLevels)
+{
+  // Simplifying needs to know which of our vertices share a position and
+  // which could share an index: each distinct coord becomes a vertex and
+  // each distinct combination of coord, tex coord, normal and color a
+  // corner, numbered by the first of our vertices which has it.
+  typedef std::pair<std::pair<int, int>, std::pair<int, int> > Attributes;
+  std::map<int, unsigned int> vertexIDs;
+  std::map<Attributes, unsigned int> cornerIDs;
+  std::vector<vh::Vector3> positions;
+  std::vector<unsigned int> vertices(_size);
+  std::vector<unsigned int> corners(_size);
+  for (size_t i = 0; i < _size; ++i) {
+    std::map<int, unsigned int>::iterator vertex = vertexIDs.find(_coords[i]);
+    if (vertex == vertexIDs.end()) {
+      const float* coord = coords + _coords[i] * 3;
+      vertex = vertexIDs.insert(std::make_pair(_coords[i], (unsigned int)positions.size())).first;
+      positions.push_back(vh::Vector3(coord[0], coord[1], coord[2]));
     }
-  } else {
-    drawDefaultModel();
+    vertices[i] = vertex->second;
+
+    Attributes attributes(std::make_pair(_coords[i], _texCoords[i]),
+        std::make_pair(_normals[i], _hasColors ? _colors[i] : -1));
+    corners[i] = cornerIDs.insert(std::make_pair(attributes, (unsigned int)i)).first->second;
   }
-  drawHUD(width, height, _fps.fps());
 
-  glutSwapBuffers();
-  glMatrixMode(GL_PROJECTION);
-  glPopMatrix();
+  simplifyMesh(positions, vertices, corners, maxLevels, _detailLevels);
+}
 
-  _fps.increment();
+
+const std::vector<DetailLevel>& RenderGroup::detailLevels() const
+{
+  return _detailLevels;
 }
 
 
-void Renderer::setTime(float time)
+void RenderGroup::setDetailLevels(const std::vector<DetailLevel>& levels)
 {
-  time = fmodf(time, _model->numKeyframes());
-  if (time < 0)
-    time += _model->numKeyframes();
-  _currentTime = time;
+  _detailLevels = levels;
 }
 
 
-void Renderer::nextFrame()
+size_t RenderGroup::numDetailLevels() const
 {
-  setTime(fmodf(_currentTime + 1.0, _model->numKeyframes()));
+  return std::max(_levelRanges.size(), size_t(1));
 }
 
 
-void Renderer::previousFrame()
+float RenderGroup::detailError(size_t level) const
 {
-  if (_currentTime < 1.0)
-    setTime(_currentTime + _model->numKeyframes() - 1.0);
-  else
-    setTime(_currentTime - 1.0);
+  return (level == 0) ? 0.0f : _detailLevels[level - 1].error;
+}
+
+
+void RenderGroup::setDetailLevel(size_t level)
+{
+  _detailLevel = std::min(level, numDetailLevels() - 1);
+}
+
+
+size_t RenderGroup::numTrianglesDrawn() const
+{
+  if (_levelRanges.empty())
+    return _size / 3 * numInstances();
+  const VertexRange& range = _levelRanges[_detailLevel];
+  return (range.end - range.start) / 3 * numInstances();
+}
+
+
+void RenderGroup::prepareTriangleSort(const float* coords)
+{
+  size_t numTriangles = _size / 3;
+  _triangleCenters.resize(numTriangles);
+  _triangleDepths.assign(numTriangles, 0.0f);
+  _triangleOrder.resize(numTriangles);
+  for (size_t t = 0; t < numTriangles; ++t) {
+    vh::Vector3 center(0, 0, 0);
+    for (size_t j = 0; j < 3; ++j) {
+      const float* coord = coords + _coords[t * 3 + j] * 3;
+      center = center + vh::Vector3(coord[0], coord[1], coord[2]);
+    }
+    _triangleCenters[t] = center / 3.0f;
+    _triangleOrder[t] = t;
+  }
+}
+
+
+bool RenderGroup::sortsTriangles() const
+{
+  return !_triangleCenters.empty();
+}
+
+
+void RenderGroup::sortTriangles(const vh::Vector4& depthRow)
+{
+  for (size_t t = 0; t < _triangleCenters.size(); ++t) {
+    const vh::Vector3& center = _triangleCenters[t];
+    _triangleDepths[t] = depthRow.x * center.x + depthRow.y * center.y +
+        depthRow.z * center.z + depthRow.w;
+  }
+  if (sortByDepth(_triangleOrder, _triangleDepths))
+    _orderChanged = true;
+}
+
+
+size_t RenderGroup::uploadSortedTriangles()
+{
+  if (!_orderChanged || _indexesID == 0)
+    return 0;
+
+  std::vector<GLuint> indexes(_triangleOrder.size() * 3);
+  for (size_t i = 0; i < _triangleOrder.size(); ++i) {
+    GLuint first = _triangleOrder[i] * 3;
+    indexes[i * 3] = first;
+    indexes[i * 3 + 1] = first + 1;
+    indexes[i * 3 + 2] = first + 2;
+  }
+
+  size_t bytes = sizeof(GLuint) * indexes.size();
+  glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, _indexesID);
+  glBufferSubData(GL_ELEMENT_ARRAY_BUFFER, sizeof(GLuint) * _sortedRange.start, bytes, &indexes[0]);
+  glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+  _orderChanged = false;
+  return bytes;
+}
+
+
+void RenderGroup::setInstances(const std::vector<vh::Matrix4>* instances, GLuint buffer)
+{
+  _instances = instances;
+  _instanceBufferID = buffer;
+}
+
+
+bool RenderGroup::instanced() const
+{
+  return _instances != NULL;
+}
+
+
+size_t RenderGroup::numInstances() const
+{
+  return (_instances != NULL) ? _instances->size() : 1;
+}
+
+
+const std::vector<vh::Matrix4>* RenderGroup::instances() const
+{
+  return _instances;
+}
+
+
+void RenderGroup::setVirtualTexture(VirtualTextureCache* cache, size_t index)
+{
+  _virtualTextures = cache;
+  _virtualIndex = index;
+}
+
+
+void RenderGroup::render(float time, DrawState& state)
+{
+  size_t left = 0, right = 0;
+  float fraction = 0;
+  if (hasGPUKeyframes())
+    keyframesAt(time, left, right, fraction);
+
+  // Set up the shaders for this render group.
+  const ShaderLocations& locations = state.useProgram(_shaderProgramID);
+  setupShaders(state, locations, fraction);
+
+  // Now start the rendering. Tex coords and colors come from the static
+  // buffer, which starts with the tex coords. Only the state which differs
+  // from the previous group actually gets sent to GL, but the pointers have
+  // to be set every time because each group has its own buffers.
+  GLuint stride = staticBytesPerVertex();
+  GLenum texCoordType = (_format.texCoords == kHalfTexCoords) ? GL_HALF_FLOAT : GL_FLOAT;
+  const GLvoid* texCoordOffset = (const GLvoid*)0;
+  const GLvoid* colorOffset = (const GLvoid*)_format.staticColorOffset();
+
+  RawImage* textures[4] = { NULL, NULL, NULL, NULL };
+  materialTextures(_material, textures);
+  state.bindBuffer(GL_ARRAY_BUFFER, _staticBufferID);
+  for (unsigned int i = 0; i < 4; ++i) {
+    if (textures[i] != NULL) {
+      state.bindTexture(i, textures[i]->getTexID());
+      state.texCoordArray(i, true);
+      state.texCoordPointer(i, texCoordType, stride, texCoordOffset);
+    } else if (virtualMap(i)) {
+      state.bindTexture(i, 0);
+      state.texCoordArray(i, true);
+      state.texCoordPointer(i, texCoordType, stride, texCoordOffset);
+    } else {
+      state.bindTexture(i, 0);
+      state.texCoordArray(i, false);
+    }
+  }
+  if (usesVirtualTexture()) {
+    state.bindTexture(TILE_CACHE_UNIT, _virtualTextures->cacheTexture());
+    state.bindTexture(PAGE_TABLE_UNIT, _virtualTextures->pageTable(_virtualIndex));
+    state.bindTexture(MIP_TAIL_UNIT, _virtualTextures->mipTail(_virtualIndex));
+  } else {
+    state.bindTexture(TILE_CACHE_UNIT, 0);
+    state.bindTexture(PAGE_TABLE_UNIT, 0);
+    state.bindTexture(MIP_TAIL_UNIT, 0);
+  }
+
+  state.clientState(GL_COLOR_ARRAY, _hasColors);
+  if (_hasColors) {
+    if (_format.colors == kByteColors)
+      glColorPointer(4, GL_UNSIGNED_BYTE, stride, colorOffset);
+    else
+      glColorPointer(3, GL_FLOAT, stride, colorOffset);
+    state.countCalls(1);
+  } else {
+    state.material(_material);
+  }
+  state.shininess((_material != NULL) ? std::min(_material->Ns * 128.0, 128.0) : 10.0);
+
+  // Positions and normals come from the keyframe buffer if we have one:
+  // the left keyframe goes in the usual place and the right keyframe goes
+  // in the nextPosition and nextNormal attributes.
+  GLuint animatedStride = animatedBytesPerVertex();
+  state.clientState(GL_VERTEX_ARRAY, true);
+  if (hasGPUKeyframes()) {
+    GLuint keyframeStride = animatedStride;
+    size_t blockSize = _size * keyframeStride;
+    state.bindBuffer(GL_ARRAY_BUFFER, _keyframeBufferID);
+    setupVertexPointer(keyframeStride, left * blockSize);
+    setupNormalPointer(state, locations, keyframeStride, left * blockSize + _format.animatedNormalOffset());
+
+    if (locations.nextPosition >= 0) {
+      state.vertexAttribArray(locations.nextPosition, true);
+      glVertexAttribPointer(locations.nextPosition, 3, positionType(), GL_FALSE, keyframeStride,
+          (const GLvoid*)(right * blockSize));
+      state.countCalls(1);
+    }
+    if (locations.nextNormal >= 0) {
+      state.vertexAttribArray(locations.nextNormal, true);
+      setupNormalAttribute(locations.nextNormal, keyframeStride,
+          right * blockSize + _format.animatedNormalOffset());
+      state.countCalls(1);
+    }
+  } else {
+    state.bindBuffer(GL_ARRAY_BUFFER, _bufferID);
+    setupVertexPointer(animatedStride, 0);
+    setupNormalPointer(state, locations, animatedStride, _format.animatedNormalOffset());
+    state.vertexAttribArray(locations.nextPosition, false);
+    state.vertexAttribArray(locations.nextNormal, false);
+  }
+  state.countCalls(1);
+
+  state.bindBuffer(GL_ELEMENT_ARRAY_BUFFER, _indexesID);
+  drawInstances(state, locations);
+}
+
+
+void RenderGroup::renderPoints(float time)
+{
+  glBindBuffer(GL_ARRAY_BUFFER, _bufferID);
+  glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, _indexesID);
+  glDisable(GL_LIGHTING);
+  glEnableClientState(GL_VERTEX_ARRAY);
+
+  setupFixedFunctionPositions(time);
+
+  glColor3f(0.0, 1.0, 1.0);
+  glEnable(GL_POLYGON_OFFSET_POINT);
+  glPolygonMode(GL_FRONT_AND_BACK, GL_POINT);
+  glPolygonOffset(0, -5);
+  glPointSize(5);
+
+  drawFixedFunctionElements();
+
+  glPolygonOffset(0, 0);
+  glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
+  glDisable(GL_POLYGON_OFFSET_POINT);
+  glDisableClientState(GL_VERTEX_ARRAY);
+  glEnable(GL_LIGHTING);
+  glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+  glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
+
+void RenderGroup::renderLines(float time)
+{
+  glBindBuffer(GL_ARRAY_BUFFER, _bufferID);
+  glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, _indexesID);
+  glDisable(GL_LIGHTING);
+  glEnableClientState(GL_VERTEX_ARRAY);
+
+  setupFixedFunctionPositions(time);
+
+  glColor3f(0.8, 0.8, 0.8);
+  glEnable(GL_POLYGON_OFFSET_LINE);
+  glPolygonMode(GL_FRONT_AND_BACK, GL_LINE);
+  glPolygonOffset(0, -3);
+
+  drawFixedFunctionElements();
+
+  glPolygonOffset(0, 0);
+  glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
+  glDisable(GL_POLYGON_OFFSET_LINE);
+  glDisableClientState(GL_VERTEX_ARRAY);
+  glEnable(GL_LIGHTING);
+  glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+  glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
+
+bool RenderGroup::isCurrent(float time) const
+{
+  if (time == _currentTime)
+    return true;
+  // Nothing changes with time, so once the buffer is filled it's good for all.
+  return _dirtyRanges.empty() && _bufferFilled[_currentBuffer];
+}
+
+
+size_t RenderGroup::nextBuffer() const
+{
+  if (_bufferIDs.size() < 2)
+    return _currentBuffer;
+
+  size_t next = (_currentBuffer + 1) % _bufferIDs.size();
+  for (size_t i = 0; i < _bufferIDs.size(); ++i) {
+    if (i != _currentBuffer && _lastDrawn[i] < _lastDrawn[next])
+      next = i;
+  }
+  return next;
+}
+
+
+size_t RenderGroup::lastDrawn(size_t buffer) const
+{
+  return _lastDrawn[buffer];
+}
+
+
+bool RenderGroup::isFilled(size_t buffer) const
+{
+  return _bufferFilled[buffer];
+}
+
+
+char* RenderGroup::mapBuffer(size_t buffer)
+{
+  if (_mappedBuffers[buffer] != NULL)
+    return _mappedBuffers[buffer];
+
+  // The parts of the buffer outside the dirty ranges have to be kept, so we
+  // can only invalidate it if we're going to fill the whole thing. When
+  // there's more than one buffer the caller has already checked that the
+  // GPU isn't using this one, so there's no need for the driver to
+  // synchronise either.
+  GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_FLUSH_EXPLICIT_BIT;
+  if (!_bufferFilled[buffer])
+    flags |= GL_MAP_INVALIDATE_BUFFER_BIT;
+  if (_bufferIDs.size() > 1)
+    flags |= GL_MAP_UNSYNCHRONIZED_BIT;
+
+  glBindBuffer(GL_ARRAY_BUFFER, _bufferIDs[buffer]);
+  char* vertexBuffer = (char*)glMapBufferRange(GL_ARRAY_BUFFER, 0,
+      _size * animatedBytesPerVertex(), flags);
+  glBindBuffer(GL_ARRAY_BUFFER, 0);
+  return vertexBuffer;
+}
+
+
+void RenderGroup::unmapBuffer(size_t buffer)
+{
+  // Persistent buffers are coherent, so there's nothing to flush.
+  if (_mappedBuffers[buffer] != NULL)
+    return;
+
+  const size_t stride = animatedBytesPerVertex();
+  glBindBuffer(GL_ARRAY_BUFFER, _bufferIDs[buffer]);
+  if (!_bufferFilled[buffer]) {
+    glFlushMappedBufferRange(GL_ARRAY_BUFFER, 0, _size * stride);
+  } else {
+    for (size_t i = 0; i < _dirtyRanges.size(); ++i) {
+      const VertexRange& range = _dirtyRanges[i];
+      glFlushMappedBufferRange(GL_ARRAY_BUFFER, range.start * stride,
+          (range.end - range.start) * stride);
+    }
+  }
+  glUnmapBuffer(GL_ARRAY_BUFFER);
+  glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
+
+size_t RenderGroup::fillBuffer(float time, char* vertexBuffer, bool everything) const
+{
+  // Packed or compressed keyframes are interpolated for the whole model at
+  // once (and only once per time), so all we need to do here is gather them.
+  const float* modelCoords = _model->coordsAt(time);
+  const float* modelNormals = _model->normalsAt(time);
+
+  std::vector<VertexRange> allVertices;
+  const std::vector<VertexRange>* ranges = &_dirtyRanges;
+  if (everything) {
+    allVertices.push_back(VertexRange(0, _size));
+    ranges = &allVertices;
+  }
+
+  size_t bytesWritten = 0;
+  for (size_t r = 0; r < ranges->size(); ++r) {
+    const VertexRange& range = (*ranges)[r];
+#pragma omp parallel for schedule(dynamic, 100) if (range.end - range.start >= MIN_PARALLEL_RANGE)
+    for (size_t i = range.start; i < range.end; ++i) {
+      vh::Vector3 coord, normal;
+      if (modelCoords != NULL) {
+        const float* src = modelCoords + _coords[i] * 3;
+        coord = vh::Vector3(src[0], src[1], src[2]);
+      } else {
+        coord = _model->v[_coords[i]].valueAt(time);
+      }
+      if (modelNormals != NULL) {
+        const float* src = modelNormals + _normals[i] * 3;
+        normal = vh::Vector3(src[0], src[1], src[2]);
+      } else {
+        normal = _model->vn[_normals[i]].valueAt(time);
+      }
+      packAnimatedVertex(i, coord, normal, vertexBuffer);
+    }
+    bytesWritten += (range.end - range.start) * animatedBytesPerVertex();
+  }
+  return bytesWritten;
+}
+
+
+void RenderGroup::useBuffer(size_t buffer, float time)
+{
+  _currentBuffer = buffer;
+  _bufferID = _bufferIDs[buffer];
+  _bufferFilled[buffer] = true;
+  _currentTime = time;
+}
+
+
+void RenderGroup::markDrawn(size_t frame)
+{
+  _lastDrawn[_currentBuffer] = frame;
+}
+
+
+GLuint RenderGroup::bakeBuffer() const
+{
+#ifdef GL_ARB_copy_buffer
+  const size_t bufferSize = _size * animatedBytesPerVertex();
+  GLuint baked = 0;
+  glGenBuffers(1, &baked);
+  glBindBuffer(GL_COPY_WRITE_BUFFER, baked);
+  glBufferData(GL_COPY_WRITE_BUFFER, bufferSize, NULL, GL_STATIC_DRAW);
+  if (glGetError() != GL_NO_ERROR) {
+    glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+    glDeleteBuffers(1, &baked);
+    return 0;
+  }
+
+  // The copy happens on the GPU, in order with the draws, so it sees the
+  // buffer as it is now even if it gets refilled later.
+  glBindBuffer(GL_COPY_READ_BUFFER, _bufferID);
+  glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, 0, 0, bufferSize);
+  glBindBuffer(GL_COPY_READ_BUFFER, 0);
+  glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+  return baked;
+#else
+  return 0;
+#endif
+}
+
+
+void RenderGroup::useBakedBuffer(GLuint buffer, float time)
+{
+  _bufferID = buffer;
+  _currentTime = time;
+}
+
+
+size_t RenderGroup::updateStaticBuffer(float time)
+{
+  if (!_staticAnimated || time == _staticTime)
+    return 0;
+
+  glBindBuffer(GL_ARRAY_BUFFER, _staticBufferID);
+  size_t bytesWritten = fillStaticBuffer(time);
+  glBindBuffer(GL_ARRAY_BUFFER, 0);
+  return bytesWritten;
+}
+
+
+void RenderGroup::packAnimatedVertex(size_t index, const vh::Vector3& coord,
+    const vh::Vector3& normal, char* dst) const
+{
+  char* vertex = dst + index * animatedBytesPerVertex();
+
+  vh::Vector3 position;
+  for (unsigned int j = 0; j < 3; ++j)
+    position.data[j] = (coord.data[j] - _positionBias.data[j]) * _packScale.data[j];
+  packPosition(_format.positions, position, vertex);
+
+  const float normalSign = _flipNormals ? -1.0 : 1.0;
+  packNormal(_format.normals,
+      vh::Vector3(normal.x * normalSign, normal.y * normalSign, normal.z * normalSign),
+      vertex + _format.animatedNormalOffset());
+}
+
+
+size_t RenderGroup::fillStaticBuffer(float time)
+{
+  // Note: This function assumes that the static buffer has already been bound.
+  const size_t stride = staticBytesPerVertex();
+  std::vector<char> block(_size * stride);
+
+  const TexCoordFormat texCoordFormat = _format.texCoords;
+#pragma omp parallel for schedule(dynamic, 100)
+  for (size_t i = 0; i < _texCoords.size(); ++i) {
+    vh::Vector2 texCoord = _model->vt[_texCoords[i]].valueAt(time);
+    packTexCoord(texCoordFormat, texCoord, &block[i * stride]);
+  }
+
+  if (_hasColors) {
+    const ColorFormat colorFormat = _format.colors;
+    const size_t colorOffset = _format.staticColorOffset();
+#pragma omp parallel for schedule(dynamic, 100)
+    for (size_t i = 0; i < _colors.size(); ++i) {
+      vh::Vector4 color = _model->colors[_colors[i]].valueAt(time);
+      packColor(colorFormat, color, &block[i * stride + colorOffset]);
+    }
+  }
+
+  if (!block.empty())
+    glBufferSubData(GL_ARRAY_BUFFER, 0, block.size(), &block[0]);
+  _staticTime = time;
+  return block.size();
+}
+
+
+void RenderGroup::setupShaders(DrawState& state, const ShaderLocations& locations, float keyframeFraction)
+{
+  state.uniform3fv(locations.positionScale, _positionScale.data);
+  state.uniform3fv(locations.positionBias, _positionBias.data);
+  state.uniform1i(locations.normalEncoding, _format.normals);
+  state.uniform1i(locations.interpolateKeyframes, hasGPUKeyframes());
+  state.uniform1f(locations.keyframeFraction, keyframeFraction);
+  state.uniform1i(locations.weightedBlend, state.weightedBlend());
+  state.uniform1i(locations.instanced, instanced());
+
+  RawImage* textures[4] = { NULL, NULL, NULL, NULL };
+  materialTextures(_material, textures);
+  for (unsigned int i = 0; i < 4; ++i) {
+    if (textures[i] != NULL)
+      state.uniform1i(locations.maps[i], i);
+    state.uniform1i(locations.hasMaps[i], textures[i] != NULL);
+  }
+
+  state.uniform1i(locations.virtualFeedback, state.virtualFeedback());
+  for (unsigned int i = 0; i < 4; ++i)
+    state.uniform1i(locations.virtualMaps[i], virtualMap(i));
+  if (usesVirtualTexture()) {
+    float layout[3] = {
+      float(_virtualTextures->tileSize()),
+      float(_virtualTextures->tileBorder()),
+      float(_virtualTextures->cacheSize())
+    };
+    state.uniform1i(locations.tileCache, TILE_CACHE_UNIT);
+    state.uniform1i(locations.pageTable, PAGE_TABLE_UNIT);
+    state.uniform1i(locations.mipTail, MIP_TAIL_UNIT);
+    state.uniform1f(locations.virtualLevels, _virtualTextures->numLevels(_virtualIndex) - 1);
+    state.uniform3fv(locations.tileCacheLayout, layout);
+    state.uniform1f(locations.virtualIndex, _virtualIndex + 1);
+    state.uniform1f(locations.feedbackBias, -std::log(float(FEEDBACK_SCALE)) / std::log(2.0f));
+  }
+}
+
+
+// Whether one of the material's maps (numbered as in materialTextures())
+// should come from the group's virtual texture: any map which is its image
+// does.
+bool RenderGroup::virtualMap(unsigned int map) const
+{
+  if (_virtualTextures == NULL || !_virtualTextures->ready(_virtualIndex))
+    return false;
+  RawImage* maps[4] = { _material->mapKa, _material->mapKd, _material->mapKs, _material->mapD };
+  return maps[map] == _virtualTextures->image(_virtualIndex);
+}
+
+
+bool RenderGroup::usesVirtualTexture() const
+{
+  for (unsigned int i = 0; i < 4; ++i) {
+    if (virtualMap(i))
+      return true;
+  }
+  return false;
+}
+
+
+GLenum RenderGroup::positionType() const
+{
+  switch (_format.positions) {
+    case kHalfPositions:
+      return GL_HALF_FLOAT;
+    case kShortPositions:
+      return GL_SHORT;
+    default:
+      return GL_FLOAT;
+  }
+}
+
+
+void RenderGroup::setupVertexPointer(GLsizei stride, size_t offset)
+{
+  // Note: This function assumes that the correct vertex buffer has already been bound.
+  glVertexPointer(3, positionType(), stride, (const GLvoid*)offset);
+}
+
+
+void RenderGroup::setupNormalPointer(DrawState& state, const ShaderLocations& locations,
+    GLsizei stride, size_t offset)
+{
+  // Packed normals go through a generic attribute because glNormalPointer
+  // can't take them everywhere; the vertex shader unpacks them.
+  if (_format.normals == kFloatNormals) {
+    state.clientState(GL_NORMAL_ARRAY, true);
+    state.vertexAttribArray(locations.packedNormal, false);
+    glNormalPointer(GL_FLOAT, stride, (const GLvoid*)offset);
+    state.countCalls(1);
+    return;
+  }
+
+  state.clientState(GL_NORMAL_ARRAY, false);
+  if (locations.packedNormal >= 0) {
+    state.vertexAttribArray(locations.packedNormal, true);
+    setupNormalAttribute(locations.packedNormal, stride, offset);
+    state.countCalls(1);
+  }
+}
+
+
+void RenderGroup::setupNormalAttribute(GLint loc, GLsizei stride, size_t offset)
+{
+  switch (_format.normals) {
+    case kFloatNormals:
+      glVertexAttribPointer(loc, 3, GL_FLOAT, GL_FALSE, stride, (const GLvoid*)offset);
+      break;
+    case kPackedNormals:
+      glVertexAttribPointer(loc, 4, GL_INT_2_10_10_10_REV, GL_TRUE, stride, (const GLvoid*)offset);
+      break;
+    case kOctahedralNormals:
+      glVertexAttribPointer(loc, 2, GL_SHORT, GL_TRUE, stride, (const GLvoid*)offset);
+      break;
+  }
+}
+
+
+void RenderGroup::setupFixedFunctionPositions(float time)
+{
+  // Points and lines are drawn with the fixed function pipeline, so the
+  // position scale and bias go onto the modelview matrix instead (see
+  // drawFixedFunctionElements). There's no interpolation without the
+  // shaders, so with the keyframes on the GPU we draw the nearest one.
+  glUseProgram(0);
+  glMatrixMode(GL_MODELVIEW);
+
+  if (hasGPUKeyframes()) {
+    size_t left, right;
+    float fraction;
+    keyframesAt(time, left, right, fraction);
+    GLuint keyframeStride = animatedBytesPerVertex();
+    glBindBuffer(GL_ARRAY_BUFFER, _keyframeBufferID);
+    setupVertexPointer(keyframeStride, (fraction < 0.5f ? left : right) * _size * keyframeStride);
+  } else {
+    setupVertexPointer(animatedBytesPerVertex(), 0);
+  }
+}
+
+
+void RenderGroup::drawElements()
+{
+  const VertexRange& range = (_detailLevel == 0 && sortsTriangles()) ?
+      _sortedRange : _levelRanges[_detailLevel];
+  glDrawElements(GL_TRIANGLES, range.end - range.start, GL_UNSIGNED_INT,
+      (const GLvoid*)(range.start * sizeof(GLuint)));
+}
+
+
+void RenderGroup::drawInstances(DrawState& state, const ShaderLocations& locations)
+{
+  // The rows aren't used without instances, but their arrays mustn't be left
+  // enabled by an instanced group or they'd be read for every vertex.
+  if (_instances == NULL) {
+    for (unsigned int r = 0; r < 3; ++r)
+      state.vertexAttribArray(locations.instanceRows[r], false);
+    drawElements();
+    state.countCalls(1);
+    return;
+  }
+
+#if defined(GL_ARB_instanced_arrays) && defined(GL_ARB_draw_instanced)
+  if (_instanceBufferID != 0) {
+    // The rows advance once per instance instead of once per vertex. The
+    // divisors belong to the attribute indexes rather than the program, so
+    // they go back to 0 for whatever uses those indexes next.
+    GLsizei stride = 12 * sizeof(float);
+    state.bindBuffer(GL_ARRAY_BUFFER, _instanceBufferID);
+    for (unsigned int r = 0; r < 3; ++r) {
+      GLint loc = locations.instanceRows[r];
+      if (loc < 0)
+        continue;
+      state.vertexAttribArray(loc, true);
+      glVertexAttribPointer(loc, 4, GL_FLOAT, GL_FALSE, stride, (const GLvoid*)(r * 4 * sizeof(float)));
+      glVertexAttribDivisorARB(loc, 1);
+      state.countCalls(2);
+    }
+
+    const VertexRange& range = (_detailLevel == 0 && sortsTriangles()) ?
+        _sortedRange : _levelRanges[_detailLevel];
+    glDrawElementsInstancedARB(GL_TRIANGLES, range.end - range.start, GL_UNSIGNED_INT,
+        (const GLvoid*)(range.start * sizeof(GLuint)), _instances->size());
+    state.countCalls(1);
+
+    for (unsigned int r = 0; r < 3; ++r) {
+      if (locations.instanceRows[r] >= 0) {
+        glVertexAttribDivisorARB(locations.instanceRows[r], 0);
+        state.countCalls(1);
+      }
+    }
+    return;
+  }
+#endif
+
+  // Otherwise each instance is a separate draw, with its rows set as
+  // constant attributes.
+  for (unsigned int r = 0; r < 3; ++r)
+    state.vertexAttribArray(locations.instanceRows[r], false);
+  for (size_t i = 0; i < _instances->size(); ++i) {
+    const vh::Matrix4& m = (*_instances)[i];
+    for (unsigned int r = 0; r < 3; ++r) {
+      if (locations.instanceRows[r] >= 0) {
+        glVertexAttrib4fv(locations.instanceRows[r], m.data[r]);
+        state.countCalls(1);
+      }
+    }
+    drawElements();
+    state.countCalls(1);
+  }
+}
+
+
+void RenderGroup::drawFixedFunctionElements()
+{
+  // The instance's transform, then the position scale and bias, go onto the
+  // modelview matrix for each draw.
+  for (size_t i = 0; i < numInstances(); ++i) {
+    glPushMatrix();
+    if (_instances != NULL) {
+      const vh::Matrix4& m = (*_instances)[i];
+      float columnMajor[16];
+      for (unsigned int row = 0; row < 4; ++row) {
+        for (unsigned int col = 0; col < 4; ++col)
+          columnMajor[col * 4 + row] = m.data[row][col];
+      }
+      glMultMatrixf(columnMajor);
+    }
+    glTranslatef(_positionBias.x, _positionBias.y, _positionBias.z);
+    glScalef(_positionScale.x, _positionScale.y, _positionScale.z);
+    drawElements();
+    glPopMatrix();
+  }
+}
+
+
+void RenderGroup::keyframesAt(float time, size_t& left, size_t& right, float& fraction) const
+{
+  int whole = (int)floorf(time);
+  fraction = time - whole;
+  whole = whole % int(_numKeyframes);
+  if (whole < 0)
+    whole += _numKeyframes;
+  left = whole;
+  right = (left + 1) % _numKeyframes;
+}
+
+
+void RenderGroup::calculatePositionScale()
+{
+  if (_format.positions == kFloatPositions)
+    return;
+
+  // Use the tightest box we can cheaply find: the group's own coords over all
+  // of their keyframes if we still have the curves, or the box for the whole
+  // model if they've been packed or compressed.
+  vh::Vector3 low = _model->low;
+  vh::Vector3 high = _model->high;
+  if (!_coords.empty() && _model->v[_coords[0]].numKeyframes() > 0) {
+    low = high = _model->v[_coords[0]][0];
+    for (size_t i = 0; i < _coords.size(); ++i) {
+      const Curve3& curve = _model->v[_coords[i]];
+      for (size_t k = 0; k < curve.numKeyframes(); ++k) {
+        vh::Vector3 coord = curve[k];
+        for (unsigned int j = 0; j < 3; ++j) {
+          low.data[j] = std::min(low.data[j], coord.data[j]);
+          high.data[j] = std::max(high.data[j], coord.data[j]);
+        }
+      }
+    }
+  }
+  setPositionScale(low, high);
+}
+
+
+void RenderGroup::setPositionScale(const vh::Vector3& low, const vh::Vector3& high)
+{
+  const float range = (_format.positions == kShortPositions) ? 32767.0f : 1.0f;
+  for (unsigned int j = 0; j < 3; ++j) {
+    float halfExtent = (high.data[j] - low.data[j]) / 2.0f;
+    if (halfExtent <= 0)
+      halfExtent = 1;
+    _positionBias.data[j] = (low.data[j] + high.data[j]) / 2.0f;
+    _positionScale.data[j] = halfExtent / range;
+    _packScale.data[j] = range / halfExtent;
+  }
+}
+
+
+//
+// FrameCache METHODS
+//
+
+FrameCache::FrameCache(size_t budget, size_t samplesPerKeyframe) :
+  _budget(budget),
+  _samplesPerKeyframe(std::max(samplesPerKeyframe, (size_t)1)),
+  _bytesUsed(0),
+  _hits(0),
+  _misses(0),
+  _entries(),
+  _lru()
+{
+}
+
+
+FrameCache::~FrameCache()
+{
+  clear();
+}
+
+
+size_t FrameCache::samplesPerKeyframe() const
+{
+  return _samplesPerKeyframe;
+}
+
+
+float FrameCache::snap(float time) const
+{
+  return floorf(time * _samplesPerKeyframe + 0.5f) / _samplesPerKeyframe;
+}
+
+
+GLuint FrameCache::find(const RenderGroup* group, float time)
+{
+  Entry* entry = lookup(group, time);
+  if (entry == NULL) {
+    ++_misses;
+    return 0;
+  }
+  ++_hits;
+  return entry->buffer;
+}
+
+
+bool FrameCache::contains(const RenderGroup* group, float time)
+{
+  return lookup(group, time) != NULL;
+}
+
+
+void FrameCache::bake(RenderGroup* group, float time)
+{
+  long sample = sampleAt(time);
+  size_t bytes = group->size() * group->animatedBytesPerVertex();
+  if (sample < 0 || bytes > _budget || _entries.count(Key(sample, group)) > 0)
+    return;
+
+  while (_bytesUsed + bytes > _budget && !_lru.empty())
+    remove(_entries.find(_lru.back()));
+
+  GLuint buffer = group->bakeBuffer();
+  if (buffer == 0)
+    return;
+
+  Key key(sample, group);
+  _lru.push_front(key);
+  Entry entry;
+  entry.buffer = buffer;
+  entry.bytes = bytes;
+  entry.lru = _lru.begin();
+  _entries[key] = entry;
+  _bytesUsed += bytes;
+}
+
+
+void FrameCache::clear()
+{
+  while (!_entries.empty())
+    remove(_entries.begin());
+}
+
+
+size_t FrameCache::budget() const
+{
+  return _budget;
+}
+
+
+size_t FrameCache::bytesUsed() const
+{
+  return _bytesUsed;
+}
+
+
+size_t FrameCache::numEntries() const
+{
+  return _entries.size();
+}
+
+
+float FrameCache::hitRate() const
+{
+  size_t lookups = _hits + _misses;
+  return (lookups > 0) ? float(_hits) / float(lookups) : 0.0f;
+}
+
+
+long FrameCache::sampleAt(float time) const
+{
+  float sample = time * _samplesPerKeyframe;
+  float nearest = floorf(sample + 0.5f);
+  if (fabsf(sample - nearest) > SAMPLE_TOLERANCE)
+    return -1;
+  return long(nearest);
+}
+
+
+FrameCache::Entry* FrameCache::lookup(const RenderGroup* group, float time)
+{
+  long sample = sampleAt(time);
+  if (sample < 0)
+    return NULL;
+
+  std::map<Key, Entry>::iterator entry = _entries.find(Key(sample, group));
+  if (entry == _entries.end())
+    return NULL;
+
+  _lru.splice(_lru.begin(), _lru, entry->second.lru);
+  return &entry->second;
+}
+
+
+void FrameCache::remove(std::map<Key, Entry>::iterator entry)
+{
+  // The GL keeps the buffer around until any draws using it are done.
+  glDeleteBuffers(1, &entry->second.buffer);
+  _bytesUsed -= entry->second.bytes;
+  _lru.erase(entry->second.lru);
+  _entries.erase(entry);
+}
+
+
+//
+// OcclusionCuller METHODS
+//
+
+OcclusionCuller::OcclusionCuller() :
+  _lows(),
+  _highs(),
+  _boxBuffer(0),
+  _boxIndexes(0),
+  _queries(),
+  _pending(),
+  _hiddenFor(),
+  _toQuery(),
+  _numOccluded(0),
+  _numTested(0)
+{
+}
+
+
+OcclusionCuller::~OcclusionCuller()
+{
+  clear();
+}
+
+
+bool OcclusionCuller::prepare(const std::vector<vh::Vector3>& lows, const std::vector<vh::Vector3>& highs)
+{
+  clear();
+#ifdef GL_ARB_occlusion_query
+  if (lows.empty() || !hasGLExtension("GL_ARB_occlusion_query"))
+    return false;
+
+  vh::Vector3 low = lows[0];
+  vh::Vector3 high = highs[0];
+  for (size_t i = 1; i < lows.size(); ++i) {
+    for (unsigned int j = 0; j < 3; ++j) {
+      low.data[j] = std::min(low.data[j], lows[i].data[j]);
+      high.data[j] = std::max(high.data[j], highs[i].data[j]);
+    }
+  }
+  float pad = OCCLUSION_BOX_PADDING * vh::length(high - low);
+  vh::Vector3 padding(pad, pad, pad);
+
+  size_t numBoxes = lows.size();
+  std::vector<float> corners(numBoxes * 8 * 3);
+  std::vector<GLuint> indexes(numBoxes * 36);
+  _lows.resize(numBoxes);
+  _highs.resize(numBoxes);
+  for (size_t i = 0; i < numBoxes; ++i) {
+    _lows[i] = lows[i] - padding;
+    _highs[i] = highs[i] + padding;
+    for (unsigned int k = 0; k < 8; ++k) {
+      for (unsigned int j = 0; j < 3; ++j)
+        corners[(i * 8 + k) * 3 + j] = (k & (1 << j)) ? _highs[i].data[j] : _lows[i].data[j];
+    }
+    for (unsigned int k = 0; k < 36; ++k)
+      indexes[i * 36 + k] = GLuint(i * 8) + BOX_TRIANGLES[k];
+  }
+
+  glGenBuffers(1, &_boxBuffer);
+  glBindBuffer(GL_ARRAY_BUFFER, _boxBuffer);
+  glBufferData(GL_ARRAY_BUFFER, sizeof(float) * corners.size(), &corners[0], GL_STATIC_DRAW);
+  glBindBuffer(GL_ARRAY_BUFFER, 0);
+  glGenBuffers(1, &_boxIndexes);
+  glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, _boxIndexes);
+  glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(GLuint) * indexes.size(), &indexes[0], GL_STATIC_DRAW);
+  glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+
+  _queries.resize(numBoxes);
+  glGenQueries(numBoxes, &_queries[0]);
+  _pending.assign(numBoxes, false);
+  _hiddenFor.assign(numBoxes, 0);
+  _toQuery.assign(numBoxes, false);
+  return true;
+#else
+  return false;
+#endif
+}
+
+
+void OcclusionCuller::clear()
+{
+#ifdef GL_ARB_occlusion_query
+  if (!_queries.empty())
+    glDeleteQueries(_queries.size(), &_queries[0]);
+  if (_boxBuffer != 0) {
+    glDeleteBuffers(1, &_boxBuffer);
+    glDeleteBuffers(1, &_boxIndexes);
+  }
+#endif
+  _lows.clear();
+  _highs.clear();
+  _boxBuffer = 0;
+  _boxIndexes = 0;
+  _queries.clear();
+  _pending.clear();
+  _hiddenFor.clear();
+  _toQuery.clear();
+  _numOccluded = 0;
+  _numTested = 0;
+}
+
+
+bool OcclusionCuller::prepared() const
+{
+  return !_queries.empty();
+}
+
+
+void OcclusionCuller::cull(const Frustum& frustum, std::vector<bool>& visible)
+{
+  _numOccluded = 0;
+  _numTested = 0;
+#ifdef GL_ARB_occlusion_query
+  for (size_t i = 0; i < _queries.size(); ++i) {
+    // We never wait for a result: one which isn't ready yet is left for a
+    // later frame, and the group keeps its last verdict until then.
+    if (_pending[i]) {
+      GLuint available = 0;
+      glGetQueryObjectuiv(_queries[i], GL_QUERY_RESULT_AVAILABLE, &available);
+      if (available) {
+        GLuint samples = 0;
+        glGetQueryObjectuiv(_queries[i], GL_QUERY_RESULT, &samples);
+        _hiddenFor[i] = (samples == 0) ? _hiddenFor[i] + 1 : 0;
+        _pending[i] = false;
+      }
+    }
+
+    if (!visible[i] || frustum.boxReachesNearPlane(_lows[i], _highs[i])) {
+      _hiddenFor[i] = 0;
+      _toQuery[i] = false;
+      continue;
+    }
+
+    ++_numTested;
+    _toQuery[i] = !_pending[i];
+    if (_hiddenFor[i] >= MIN_HIDDEN_RESULTS) {
+      visible[i] = false;
+      ++_numOccluded;
+    }
+  }
+#endif
+}
+
+
+void OcclusionCuller::query()
+{
+#ifdef GL_ARB_occlusion_query
+  if (_queries.empty())
+    return;
+
+  // Boxes reaching the near plane are never queried, so every box is
+  // closed and only its front faces need drawing.
+  glUseProgram(0);
+  glColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
+  glDepthMask(GL_FALSE);
+  glEnable(GL_CULL_FACE);
+  glBindBuffer(GL_ARRAY_BUFFER, _boxBuffer);
+  glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, _boxIndexes);
+  glEnableClientState(GL_VERTEX_ARRAY);
+  glVertexPointer(3, GL_FLOAT, 0, 0);
+
+  for (size_t i = 0; i < _queries.size(); ++i) {
+    if (!_toQuery[i])
+      continue;
+    glBeginQuery(GL_SAMPLES_PASSED, _queries[i]);
+    glDrawElements(GL_TRIANGLES, 36, GL_UNSIGNED_INT, (const GLvoid*)(i * 36 * sizeof(GLuint)));
+    glEndQuery(GL_SAMPLES_PASSED);
+    _pending[i] = true;
+    _toQuery[i] = false;
+  }
+
+  glDisableClientState(GL_VERTEX_ARRAY);
+  glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+  glBindBuffer(GL_ARRAY_BUFFER, 0);
+  glDisable(GL_CULL_FACE);
+  glDepthMask(GL_TRUE);
+  glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+#endif
+}
+
+
+size_t OcclusionCuller::numOccluded() const
+{
+  return _numOccluded;
+}
+
+
+size_t OcclusionCuller::numTested() const
+{
+  return _numTested;
+}
+
+
+//
+// Renderer METHODS
+//
+
+Renderer::Renderer(ResourceManager* resources, Model* model, Camera* camera,
+    size_t maxTextureWidth, size_t maxTextureHeight, float animFPS) :
+  _headlightType(kDirectional),
+  _drawPolys(true),
+  _drawPoints(false),
+  _drawLines(false),
+  _resources(resources),
+  _model(model),
+  _camera(camera),
+  _animFPS(animFPS),
+  _maxTextureWidth(maxTextureWidth),
+  _maxTextureHeight(maxTextureHeight),
+  _renderGroups(),
+  _instanceBuffers(),
+  _drawnLow(),
+  _drawnHigh(),
+  _currentMapKa(NULL),
+  _currentMapKd(NULL),
+  _currentMapKs(NULL),
+  _currentMapD(NULL),
+  _fps(),
+  _shaderWithMaterial(0),
+  _shaderNoMaterial(0),
+  _currentTime(0),
+  _playing(false),
+  _since(0),
+  _compressKeyframes(false),
+  _deltaCodeKeyframes(false),
+  _pcaBases(0),
+  _pcaErrorTolerance(0),
+  _pcaCachePath(),
+  _vertexFormat(),
+  _gpuKeyframes(false),
+  _gpuMemoryBudget(0),
+  _numVertexBuffers(1),
+  _persistentBuffers(false),
+  _frameFences(),
+  _frame(1),
+  _completedFrame(0),
+  _asyncPlayback(true),
+  _workers(NULL),
+  _playbackJob(NULL),
+  _playbackJobRunning(false),
+  _playbackJobFrom(0),
+  _keyframeLoader(NULL),
+  _numLoadedKeyframes(0),
+  _loadedLow(),
+  _loadedHigh(),
+  _textureLoader(NULL),
+  _virtualTextureBudget(0),
+  _virtualTextureDir(),
+  _virtualTextures(NULL),
+  _feedbackFramebuffer(0),
+  _feedbackWidth(0),
+  _feedbackHeight(0),
+  _feedbackFrame(0),
+  _feedback(),
+  _frameCacheBudget(0),
+  _frameCache(NULL),
+  _playbackCarry(0),
+  _bytesUploaded(0),
+  _frustumCulling(true),
+  _groupBVH(),
+  _visibleGroups(),
+  _numVisibleGroups(0),
+  _frustum(),
+  _occlusionCulling(false),
+  _occlusionCuller(),
+  _groupCenters(),
+  _groupRadii(),
+  _pixelError(0),
+  _detailCachePath(),
+  _useDetailLevels(true),
+  _trianglesDrawn(0),
+  _transparentGroups(),
+  _transparentOrder(),
+  _transparentDepths(),
+  _sortTriangles(false),
+  _sortJob(NULL),
+  _sortJobRunning(false),
+  _transparencyMode(kSortedTransparency),
+  _compositeProgram(0),
+  _blendFramebuffer(0),
+  _blendDepthTexture(0),
+  _blendWidth(0),
+  _blendHeight(0),
+  _previousFramebuffer(0),
+  _memory()
+{
+  glClearColor(0.2, 0.2, 0.2, 1.0);
+  glEnable(GL_DEPTH_TEST);
+  glEnable(GL_LIGHTING);
+  glEnable(GL_LIGHT0);
+  glEnable(GL_BLEND);
+  glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+
+  for (unsigned int i = 0; i < 4; ++i) {
+    glActiveTexture(GL_TEXTURE0 + i);
+    glEnable(GL_TEXTURE_2D);
+  }
+
+  //float ambient[4] = { 0.2f, 0.2f, 0.2f, 1.0f };
+  //glLightModelfv(GL_LIGHT_MODEL_AMBIENT, ambient);
+  glShadeModel(GL_SMOOTH);
+
+  _blendTextures[0] = _blendTextures[1] = 0;
+  _feedbackRenderbuffers[0] = _feedbackRenderbuffers[1] = 0;
+  _feedbackPixelBuffers[0] = _feedbackPixelBuffers[1] = 0;
+  _feedbackPixels[0] = _feedbackPixels[1] = 0;
+}
+
+
+Renderer::~Renderer()
+{
+  finishPlaybackJob();
+  finishSortJob();
+  delete _playbackJob;
+  delete _sortJob;
+  delete _workers;
+  // The loaders are still writing into the model until they're gone.
+  delete _keyframeLoader;
+  delete _textureLoader;
+  delete _virtualTextures;
+  delete _frameCache;
+  for (size_t i = 0; i < _frameFences.size(); ++i) {
+    if (_frameFences[i] != 0)
+      glDeleteSync(_frameFences[i]);
+  }
+#ifdef GL_ARB_framebuffer_object
+  if (_blendFramebuffer != 0) {
+    glDeleteFramebuffers(1, &_blendFramebuffer);
+    glDeleteTextures(2, _blendTextures);
+    glDeleteTextures(1, &_blendDepthTexture);
+  }
+  if (_feedbackFramebuffer != 0) {
+    glDeleteFramebuffers(1, &_feedbackFramebuffer);
+    glDeleteRenderbuffers(2, _feedbackRenderbuffers);
+  }
+#endif
+  if (_feedbackPixelBuffers[0] != 0)
+    glDeleteBuffers(2, _feedbackPixelBuffers);
+
+  delete _model;
+  std::list<RenderGroup*>::iterator iter;
+  for (iter = _renderGroups.begin(); iter != _renderGroups.end(); ++iter)
+    delete *iter;
+  for (size_t i = 0; i < _instanceBuffers.size(); ++i) {
+    if (_instanceBuffers[i] != 0)
+      glDeleteBuffers(1, &_instanceBuffers[i]);
+  }
+}
+
+
+Camera* Renderer::currentCamera()
+{
+  return _camera;
+}
+
+
+Model* Renderer::currentModel()
+{
+  return _model;
+}
+
+
+void Renderer::toggleDrawPolys()
+{
+  _drawPolys = !_drawPolys;
+}
+
+
+void Renderer::toggleDrawPoints()
+{
+  _drawPoints = !_drawPoints;
+}
+
+
+void Renderer::toggleDrawLines()
+{
+  _drawLines = !_drawLines;
+}
+
+
+void Renderer::toggleFrustumCulling()
+{
+  _frustumCulling = !_frustumCulling;
+}
+
+
+void Renderer::toggleOcclusionCulling()
+{
+  _occlusionCulling = !_occlusionCulling;
+}
+
+
+void Renderer::toggleDetailLevels()
+{
+  _useDetailLevels = !_useDetailLevels;
+}
+
+
+void Renderer::toggleTransparencyMode()
+{
+  if (_transparencyMode == kSortedTransparency)
+    _transparencyMode = kWeightedBlendedTransparency;
+  else
+    _transparencyMode = kSortedTransparency;
+}
+
+
+void Renderer::toggleHeadlightType()
+{
+  if (_headlightType == kSpotlight)
+    _headlightType = kDirectional;
+  else
+    _headlightType = kSpotlight;
+}
+
+
+void Renderer::printGLInfo()
+{
+  fprintf(stderr, "GL_MAX_COMBINED_TEXTURE_UNITS = %d\n",
+    glGet(GL_MAX_COMBINED_TEXTURE_IMAGE_UNITS));
+  fprintf(stderr, "GL_MAX_TEXTURE_COORDS = %d\n",
+    glGet(GL_MAX_TEXTURE_COORDS));
+}
+
+
+void Renderer::prepare()
+{
+  prepareMaterials();
+  prepareModel();
+  packKeyframes();
+  prepareShaders();
+
+  size_t groupsBefore = countRenderGroups();
+  size_t merged = _model->mergeDuplicateMaterials();
+  prepareVertexBuffers();
+  preparePlayback();
+  prepareInstances();
+  prepareRenderGroups();
+  calculateGroupBounds();
+  fprintf(stderr, "Merged %lu duplicate materials: %lu draw calls per frame before, %lu after.\n",
+      merged, groupsBefore, _renderGroups.size());
+  prepareGPUKeyframes();
+
+  loadTextures(_renderGroups);
+
+  vh::Vector3 low, high;
+  modelBounds(low, high);
+  _camera->frontView(low, high);
+}
+
+
+void Renderer::render(int width, int height)
+{
+  glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+  _bytesUploaded = 0;
+
+  // If we're playing the animation, calculate the new frame time. When
+  // interpolating in the background, the frame we show is the one calculated
+  // during the last frame and the new time is what we start calculating now.
+  bool interpolated = finishPlaybackJob();
+  finishSortJob();
+  updateKeyframeLoader();
+  updateTextureLoader();
+  updateVirtualTextures();
+  if (_playing) {
+    float time = calculatePlaybackTime();
+    float nextTime = time;
+    if (!interpolated) {
+      // Nothing was ready, so show the new time now and start on the one
+      // after it.
+      nextTime = time + (time - _currentTime);
+      setTime(time);
+    }
+    _model->prefetchKeyframes(_currentTime, _animFPS);
+    updateRenderGroups(_currentTime);
+    startPlaybackJob(nextTime);
+  } else {
+    if (_model != NULL)
+      _model->prefetchKeyframes(_currentTime, 0);
+    updateRenderGroups(_currentTime);
+  }
+
+  // Apply the camera settings. The clip planes are fitted to the bounding box
+  // for the current time, rather than the box around the whole animation.
+  // Models with parts use the box around all their instances.
+  if (_model != NULL) {
+    vh::Vector3 low, high;
+    if (_model->parts.empty())
+      _model->boundsAt(_currentTime, low, high);
+    else
+      modelBounds(low, high);
+    setupCamera(width, height, low, high);
+  } else {
+    vh::Vector3 low(-1, -1, -1);
+    vh::Vector3 high(1, 1, 1);
+    setupCamera(width, height, low, high);
+  }
+
+  // Draw the scene.
+  glMatrixMode(GL_MODELVIEW);
+  glLoadIdentity();
+
+  // Put a light at the same position as the camera.
+  headlight(GL_LIGHT0, vh::Vector4(1, 1, 1, 1));
+
+  transformToCamera();
+  if (_model != NULL) {
+    std::list<RenderGroup*>::iterator iter;
+    size_t i;
+    float projection[16], modelview[16];
+    glGetFloatv(GL_PROJECTION_MATRIX, projection);
+    glGetFloatv(GL_MODELVIEW_MATRIX, modelview);
+    cullRenderGroups(projection, modelview);
+    chooseDetailLevels(projection, modelview, height);
+    sortTransparentGroups(modelview);
+
+    // The opaque groups go first, in the order they were sorted into, then
+    // the transparent ones from back to front.
+    _drawState.resetCalls();
+    _trianglesDrawn = 0;
+    if (_drawPolys) {
+      drawFeedback(width, height);
+      _drawState.reset();
+      for (iter = _renderGroups.begin(), i = 0; i < _transparentGroupsStart; ++iter, ++i) {
+        RenderGroup* group = *iter;
+        if (_visibleGroups[i]) {
+          group->render(_currentTime, _drawState);
+          _trianglesDrawn += group->numTrianglesDrawn();
+        }
+      }
+      // Only the opaque groups can hide anything, so this is the depth
+      // buffer the boxes get tested against.
+      if (occlusionCullingActive()) {
+        _drawState.restore();
+        _occlusionCuller.query();
+      }
+      // With weighted blending, the order doesn't matter.
+      bool weighted = (_transparencyMode == kWeightedBlendedTransparency) &&
+          beginWeightedBlend(width, height);
+      for (i = 0; i < _transparentOrder.size(); ++i) {
+        size_t index = weighted ? i : _transparentOrder[i];
+        RenderGroup* group = _transparentGroups[index];
+        if (_visibleGroups[_transparentGroupsStart + index]) {
+          group->render(_currentTime, _drawState);
+          _trianglesDrawn += group->numTrianglesDrawn();
+        }
+      }
+      _drawState.restore();
+      if (weighted)
+        endWeightedBlend();
+      checkGLError("Error drawing render groups.");
+    }
+
+    if (_drawPoints) {
+      glDisable(GL_LIGHTING);
+      for (iter = _renderGroups.begin(), i = 0; iter != _renderGroups.end(); ++iter, ++i) {
+        RenderGroup* group = *iter;
+        if (_visibleGroups[i])
+          group->renderPoints(_currentTime);
+      }
+      glEnable(GL_LIGHTING);
+    }
+
+    if (_drawLines) {
+      glDisable(GL_LIGHTING);
+      for (iter = _renderGroups.begin(), i = 0; iter != _renderGroups.end(); ++iter, ++i) {
+        RenderGroup* group = *iter;
+        if (_visibleGroups[i])
+          group->renderLines(_currentTime);
+      }
+      glEnable(GL_LIGHTING);
+    }
+
+    startSortJob(modelview);
+  } else {
+    drawDefaultModel();
+  }
+  drawHUD(width, height, _fps.fps());
+
+  endFrame();
+  glutSwapBuffers();
+  glMatrixMode(GL_PROJECTION);
+  glPopMatrix();
+
+  _fps.increment();
+}
+
+
+void Renderer::setTime(float time)
+{
+  _currentTime = wrapTime(time);
+}
+
+
+void Renderer::nextFrame()
+{
+  setTime(fmodf(_currentTime + 1.0, _model->numKeyframes()));
+}
+
+
+void Renderer::previousFrame()
+{
+  if (_currentTime < 1.0)
+    setTime(_currentTime + _model->numKeyframes() - 1.0);
+  else
+    setTime(_currentTime - 1.0);
+}
+
+
+void Renderer::firstFrame()
+{
+  _currentTime = 0.0;
+}
+
+
+void Renderer::lastFrame()
+{
+  setTime(_model->numKeyframes() - 1);
+}
+
+
+void Renderer::togglePlaying()
+{
+  _playing = !_playing;
+  if (_playing)
+    _since = glutGet(GLUT_ELAPSED_TIME);
+}
+
+
+void Renderer::flipNormals()
+{
+  // The worker may be reading the flag we're about to change.
+  finishPlaybackJob();
+
+  std::list<RenderGroup*>::iterator iter;
+  for (iter = _renderGroups.begin(); iter != _renderGroups.end(); ++iter)
+    (*iter)->flipNormals();
+  if (_frameCache != NULL)
+    _frameCache->clear();
+
+  // Normals on the GPU have the flip baked in too.
+  if (_gpuKeyframes)
+    uploadGPUKeyframes();
+}
+
+
+void Renderer::setCompressKeyframes(bool compress, bool deltaCoding)
+{
+  _compressKeyframes = compress;
+  _deltaCodeKeyframes = deltaCoding;
+}
+
+
+void Renderer::setPCAKeyframes(size_t numBases, float errorTolerance,
+    const std::string& cacheFile)
+{
+  _pcaBases = numBases;
+  _pcaErrorTolerance = errorTolerance;
+  _pcaCachePath = cacheFile;
+}
+
+
+void Renderer::setVertexFormat(const VertexFormat& format)
+{
+  _vertexFormat = format;
+}
+
+
+void Renderer::setGPUKeyframes(bool enabled, size_t memoryBudget)
+{
+  _gpuKeyframes = enabled;
+  _gpuMemoryBudget = memoryBudget;
+}
+
+
+void Renderer::setAsyncPlayback(bool enabled)
+{
+  _asyncPlayback = enabled;
+}
+
+
+void Renderer::setFrameCache(size_t budget)
+{
+  _frameCacheBudget = budget;
+}
+
+
+void Renderer::setDetailLevels(float pixelError, const std::string& cacheFile)
+{
+  _pixelError = pixelError;
+  _detailCachePath = cacheFile;
+}
+
+
+void Renderer::setSortTriangles(bool enabled)
+{
+  _sortTriangles = enabled;
+}
+
+
+void Renderer::setTransparencyMode(TransparencyMode mode)
+{
+  _transparencyMode = mode;
+}
+
+
+void Renderer::setVirtualTextures(size_t cacheBytes, const std::string& dir)
+{
+  _virtualTextureBudget = cacheBytes;
+  _virtualTextureDir = dir;
+}
+
+
+void Renderer::setOcclusionCulling(bool enabled)
+{
+  _occlusionCulling = enabled;
+}
+
+
+void Renderer::setKeyframeLoader(KeyframeLoader* loader)
+{
+  delete _keyframeLoader;
+  _keyframeLoader = loader;
+  _numLoadedKeyframes = 0;
+  _loadedLow = vh::Vector3(1e20, 1e20, 1e20);
+  _loadedHigh = vh::Vector3(-1e20, -1e20, -1e20);
+
+  // We can't tell which vertices are animated until we have all of the
+  // keyframes, so until then they all are.
+  findDirtyRanges();
+  updateKeyframeLoader();
+}
+
+
+bool Renderer::loadingKeyframes() const
+{
+  return _keyframeLoader != NULL;
+}
+
+
+bool Renderer::loadingTextures() const
+{
+  return _textureLoader != NULL || (_virtualTextures != NULL && _virtualTextures->building());
+}
+
+
+MemoryUsage Renderer::memoryUsage() const
+{
+  MemoryUsage usage;
+  if (_model != NULL)
+    usage = _model->memory;
+  usage.faces += _memory.faces;
+  usage.vertexBuffers += _memory.vertexBuffers;
+  if (_frameCache != NULL)
+    usage.vertexBuffers += _frameCache->bytesUsed();
+  usage.textures += _memory.textures;
+  if (_textureLoader != NULL) {
+    usage.texturePixels += _textureLoader->pendingBytes();
+    usage.textures += _textureLoader->gpuBytes();
+  }
+  if (_virtualTextures != NULL) {
+    usage.texturePixels += _virtualTextures->cpuBytes();
+    usage.textures += _virtualTextures->gpuBytes();
+  }
+  return usage;
+}
+
+
+void Renderer::printMemoryReport(FILE* out) const
+{
+  memoryUsage().printJSON(out);
+}
+
+
+void Renderer::modelBounds(vh::Vector3& low, vh::Vector3& high) const
+{
+  if (_model->parts.empty() || _renderGroups.empty()) {
+    low = _model->low;
+    high = _model->high;
+  } else {
+    low = _drawnLow;
+    high = _drawnHigh;
+  }
+}
+
+
+void Renderer::setupCamera(int width, int height, const vh::Vector3& low, const vh::Vector3& high)
+{
+  vh::Vector3 target = _camera->getTarget();
+  float distance = _camera->getDistance();
+
+  // Here we use the model's bounding sphere to calculate good values for
+  // the near and far clipping planes.
+  
+  // Radius of bounding sphere == half distance between opposite bbox corners
+  // FIXME: For some reason the radius ends up being too small, so instead I'm
+  // using the diameter for now.
+  float radius = length(high - low); 
+  // v is the vector from our target to the bbox center, but we'll only need
+  // the z component (see below) so that's all we calculate.
+  float vz = ((high.z + low.z) / 2.0) - target.z;
+  // Since our direction vector d for the camera is 0,0,1 the dot product of v
+  // and d is simply v.z. This gives us the distance along our direction vector
+  // at which we're level with the bbox center: _rotation.w + vz. Subtract the
+  // radius from that and we've got out near clip plane.
+  float nearClip = distance + vz - radius;
+  // The far clip plane will always be the near clip plane plus the diameter.
+  float farClip = nearClip + 2 * radius;
+  // Make sure the near clip plane doesn't end up behind us.
+  if (nearClip < 0.01)
+    nearClip = 0.01;
+  // Make sure the far clip plane doesn't end up behind the near clip plane.
+  if (farClip <= nearClip)
+    farClip = nearClip + 0.01;
+
+  glMatrixMode(GL_PROJECTION);
+  glPushMatrix();
+
+  glLoadIdentity();
+  glViewport(0, 0, width, height); // Set the viewport to be the entire window
+  gluPerspective(_camera->getFieldOfViewY(), double(width) / double(height),
+      nearClip, farClip);
+}
+
+
+void Renderer::transformToCamera()
+{
+  vh::Vector3 target = _camera->getTarget();
+  vh::Vector4 rotation = _camera->getRotation();
+  float distance = _camera->getDistance();
+  glTranslatef(-target.x, -target.y, -target.z - distance);
+  glRotatef(rotation.x, 1, 0, 0);
+  glRotatef(rotation.y, 0, 1, 0);
+  glRotatef(rotation.z, 0, 0, 1);
+}
+
+
+void Renderer::prepareModel()
+{
+  // Fill in default texture coordinates where necessary.
+  size_t defaultTexCoordIndex = _model->vt.size();
+  _model->addVt(vh::Vector2(0.5, 0.5));
+  for (size_t i = 0; i < _model->faces.size(); ++i) {
+    Face& face = *_model->faces[i];
+    for (size_t vertexNum = 0; vertexNum < face.size(); ++vertexNum) {
+      if (face[vertexNum].vt < 0)
+        face[vertexNum].vt = defaultTexCoordIndex;
+    }
+  }
+
+  // Everything is drawn as triangles.
+  size_t polygons = _model->triangulate();
+  if (polygons > 0)
+    fprintf(stderr, "Triangulated %lu polygons.\n", polygons);
+
+  // Calculate the normals if they're not present.
+  if (_model->vn.size() == 0) {
+    fprintf(stderr, "Calculating normals...\n");
+    _model->calculateNormals();
+  }
+
+  countAnimatedPoints();
+}
+
+
+void Renderer::countAnimatedPoints()
+{
+  // Count the animated points. Streamed keyframes aren't in the curves, so
+  // we can't do this for them.
+  if (_model->numKeyframes() > 1 && !_model->keyframesStreamed()) {
+    size_t animatedPoints = 0;
+
+    vh::Vector3 size = _model->high - _model->low;
+    for (size_t i = 0; i < _model->v.size(); ++i) {
+      Curve3& curve = _model->v[i];
+      const vh::Vector3 initialPos = curve[0];
+      for (size_t keyFrame = 1; keyFrame < curve.numKeyframes(); ++keyFrame) {
+        const vh::Vector3 keyPos = curve[keyFrame];
+        // If a vertex has moved by more than 1% of the total object size...
+        if (lengthSqr( (keyPos - initialPos) / size ) > 1e-4) {
+          ++animatedPoints;
+          break;
+        }
+      }
+    }
+
+    fprintf(stderr, "%ld of %ld points (%1.2f%%) are animated.\n",
+        animatedPoints, _model->v.size(),
+        100.0 * float(animatedPoints) / float(_model->v.size()));
+  }
+}
+
+
+void Renderer::packKeyframes()
+{
+  // There's nothing to gain from either of these with a single keyframe,
+  // which is all we have when the rest are still to be loaded.
+  if (_model->numKeyframes() < 2)
+    return;
+
+  if ((_pcaBases > 0 || _pcaErrorTolerance > 0) && !_model->keyframesStreamed()) {
+    fprintf(stderr, "Factoring keyframes...\n");
+    _model->factorKeyframes(_pcaBases, _pcaErrorTolerance, _pcaCachePath);
+  } else if (_compressKeyframes && !_model->keyframesStreamed()) {
+    fprintf(stderr, "Compressing keyframes...\n");
+    _model->compressKeyframes(_deltaCodeKeyframes);
+  } else {
+    _model->packKeyframes();
+  }
+}
+
+
+size_t Renderer::countRenderGroups()
+{
+  // This mirrors the grouping in prepareRenderGroups, but only counts the
+  // triangles for each part and material rather than creating the groups.
+  std::map<std::pair<int, Material*>, size_t> numTriangles[2];
+  for (size_t i = 0; i < _model->faces.size(); ++i) {
+    Face* face = _model->faces[i];
+    if (face->size() != 3)
+      continue;
+
+    Material* material = face->material;
+    bool isTransparent = (material != NULL) && (material->d != 1 || material->mapD != NULL);
+    ++numTriangles[isTransparent ? 1 : 0][std::make_pair(face->part, material)];
+  }
+
+  size_t count = 0;
+  for (unsigned int i = 0; i < 2; ++i) {
+    std::map<std::pair<int, Material*>, size_t>::iterator iter;
+    for (iter = numTriangles[i].begin(); iter != numTriangles[i].end(); ++iter)
+      count += numClusters(iter->second, MAX_TRIANGLES_PER_GROUP);
+  }
+  return count;
+}
+
+
+void Renderer::prepareInstances()
+{
+  // Every part gets one buffer holding the top three rows of each of its
+  // instance transforms; the bottom row is always (0, 0, 0, 1).
+  _instanceBuffers.assign(_model->parts.size(), 0);
+  if (_model->parts.empty())
+    return;
+
+  size_t numInstances = 0;
+  for (size_t i = 0; i < _model->parts.size(); ++i)
+    numInstances += _model->parts[i].instances.size();
+
+#if defined(GL_ARB_instanced_arrays) && defined(GL_ARB_draw_instanced)
+  if (hasGLExtension("GL_ARB_instanced_arrays") && hasGLExtension("GL_ARB_draw_instanced")) {
+    for (size_t i = 0; i < _model->parts.size(); ++i) {
+      const std::vector<vh::Matrix4>& instances = _model->parts[i].instances;
+      std::vector<float> rows(instances.size() * 12);
+      for (size_t j = 0; j < instances.size(); ++j)
+        memcpy(&rows[j * 12], instances[j].data, sizeof(float) * 12);
+
+      glGenBuffers(1, &_instanceBuffers[i]);
+      glBindBuffer(GL_ARRAY_BUFFER, _instanceBuffers[i]);
+      glBufferData(GL_ARRAY_BUFFER, sizeof(float) * rows.size(), &rows[0], GL_STATIC_DRAW);
+      _memory.vertexBuffers += sizeof(float) * rows.size();
+    }
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    checkGLError("Error creating instance buffers.");
+    fprintf(stderr, "Drawing %lu instances of %lu models with instanced arrays.\n",
+        numInstances, _model->parts.size());
+    return;
+  }
+#endif
+  fprintf(stderr, "Instanced arrays aren't supported here, so %lu instances of %lu models "
+      "will be drawn one at a time.\n", numInstances, _model->parts.size());
+}
+
+
+void Renderer::prepareRenderGroups()
+{
+  // Gather the triangles for each part and material. Every face is a
+  // triangle by this point (see prepareModel).
+  fprintf(stderr, "Creating render groups...\n");
+  std::map<std::pair<int, Material*>, std::vector<Face*> > triangles[2];
+  for (size_t i = 0; i < _model->faces.size(); ++i) {
+    Face* face = _model->faces[i];
+    if (face->size() != 3)
+      continue;
+
+    Material* material = face->material;
+    bool isTransparent = (material != NULL) && (material->d != 1 || material->mapD != NULL);
+    triangles[isTransparent ? 1 : 0][std::make_pair(face->part, material)].push_back(face);
+  }
+
+  // Split each material's triangles into spatially compact clusters, going
+  // by where they are in the first keyframe, and make a render group for
+  // each cluster. Keep the groups with transparent materials apart, so that
+  // they can go last and be rendered after the opaque ones. Groups in a part
+  // are drawn once for each of its instances.
+  std::vector<float> coords(_model->v.size() * 3);
+  std::vector<float> normals(_model->vn.size() * 3);
+  if (!coords.empty())
+    _model->keyframeData(0, &coords[0], normals.empty() ? NULL : &normals[0]);
+
+  std::vector<RenderGroup*> groups[2];
+  for (unsigned int t = 0; t < 2; ++t) {
+    std::map<std::pair<int, Material*>, std::vector<Face*> >::iterator iter;
+    for (iter = triangles[t].begin(); iter != triangles[t].end(); ++iter) {
+      int part = iter->first.first;
+      Material* material = iter->first.second;
+      const std::vector<Face*>& faces = iter->second;
+
+      std::vector<vh::Vector3> centers(faces.size());
+      for (size_t i = 0; i < faces.size(); ++i) {
+        const Face& face = *faces[i];
+        vh::Vector3 center(0, 0, 0);
+        for (size_t j = 0; j < 3; ++j) {
+          const float* coord = &coords[face[j].v * 3];
+          center = center + vh::Vector3(coord[0], coord[1], coord[2]);
+        }
+        centers[i] = center / 3.0f;
+      }
+
+      std::vector<size_t> order, sizes;
+      clusterPoints(centers, MAX_TRIANGLES_PER_GROUP, order, sizes);
+      size_t next = 0;
+      for (size_t i = 0; i < sizes.size(); ++i) {
+        RenderGroup* group = new RenderGroup(material,
+            material ? _shaderWithMaterial : _shaderNoMaterial, _vertexFormat);
+        for (size_t j = 0; j < sizes[i]; ++j)
+          group->add(_model, faces[order[next++]]);
+        if (part >= 0)
+          group->setInstances(&_model->parts[part].instances, _instanceBuffers[part]);
+        groups[t].push_back(group);
+      }
+    }
+  }
+
+  fprintf(stderr, "Sorting render groups...\n");
+  std::vector<RenderGroup*>& opaque = groups[0];
+  std::vector<RenderGroup*>& transparent = groups[1];
+  sortRenderGroups(opaque);
+  sortRenderGroups(transparent);
+  _renderGroups.insert(_renderGroups.end(), opaque.begin(), opaque.end());
+  _transparentGroupsStart = _renderGroups.size();
+  _renderGroups.insert(_renderGroups.end(), transparent.begin(), transparent.end());
+
+  findDirtyRanges();
+  if (!coords.empty()) {
+    prepareDetailLevels(&coords[0]);
+    prepareTransparency(&coords[0]);
+  }
+
+  // Prepare the render groups.
+  fprintf(stderr, "Preparing render groups...\n");
+  std::list<RenderGroup*>::iterator groupIter;
+  for (groupIter = _renderGroups.begin(); groupIter != _renderGroups.end(); ++groupIter) {
+    (*groupIter)->prepare(_numVertexBuffers, _persistentBuffers);
+    _memory.faces += (*groupIter)->cpuBytes();
+    _memory.vertexBuffers += (*groupIter)->gpuBytes();
+  }
+}
+
+
+void Renderer::sortRenderGroups(std::vector<RenderGroup*>& groups)
+{
+  // Groups sharing a program, textures and material get drawn back to back,
+  // so the draw state only changes between runs of them. The sort is stable
+  // so that the groups for one material keep their order.
+  std::stable_sort(groups.begin(), groups.end(), DrawsBefore());
+}
+
+
+void Renderer::calculateGroupBounds()
+{
+  // The boxes take in every keyframe, so they hold for any time. Culling is
+  // off while keyframes are still loading, so there's no need to redo this
+  // until they've all arrived.
+  std::vector<RenderGroup*> groups(_renderGroups.begin(), _renderGroups.end());
+  const float big = std::numeric_limits<float>::max();
+  std::vector<vh::Vector3> lows(groups.size(), vh::Vector3(big, big, big));
+  std::vector<vh::Vector3> highs(groups.size(), vh::Vector3(-big, -big, -big));
+
+  std::vector<float> coords(_model->v.size() * 3);
+  std::vector<float> normals(_model->vn.size() * 3);
+  for (size_t k = 0; !coords.empty() && k < _model->numKeyframes(); ++k) {
+    _model->keyframeData(k, &coords[0], normals.empty() ? NULL : &normals[0]);
+#pragma omp parallel for schedule(static)
+    for (size_t i = 0; i < groups.size(); ++i)
+      groups[i]->growBounds(&coords[0], lows[i], highs[i]);
+  }
+
+  // An instanced group's box takes in all of its instances, so the group is
+  // only culled when every one of them is hidden.
+#pragma omp parallel for schedule(dynamic)
+  for (size_t i = 0; i < groups.size(); ++i) {
+    const std::vector<vh::Matrix4>* instances = groups[i]->instances();
+    if (instances == NULL)
+      continue;
+    vh::Vector3 low(big, big, big), high(-big, -big, -big);
+    for (size_t j = 0; j < instances->size(); ++j) {
+      vh::Vector3 instanceLow, instanceHigh;
+      transformBox((*instances)[j], lows[i], highs[i], instanceLow, instanceHigh);
+      low = vh::lowCorner(low, instanceLow);
+      high = vh::highCorner(high, instanceHigh);
+    }
+    lows[i] = low;
+    highs[i] = high;
+  }
+
+  _drawnLow = vh::Vector3(big, big, big);
+  _drawnHigh = vh::Vector3(-big, -big, -big);
+  for (size_t i = 0; i < groups.size(); ++i) {
+    _drawnLow = vh::lowCorner(_drawnLow, lows[i]);
+    _drawnHigh = vh::highCorner(_drawnHigh, highs[i]);
+  }
+
+  _groupBVH.build(lows, highs);
+  _visibleGroups.assign(groups.size(), true);
+  _numVisibleGroups = groups.size();
+  if (!_occlusionCuller.prepare(lows, highs) && _occlusionCulling) {
+    fprintf(stderr, "Occlusion queries aren't supported here, so occlusion culling is off.\n");
+    _occlusionCulling = false;
+  }
+
+  _groupCenters.resize(groups.size());
+  _groupRadii.resize(groups.size());
+  for (size_t i = 0; i < groups.size(); ++i) {
+    _groupCenters[i] = (lows[i] + highs[i]) / 2.0f;
+    _groupRadii[i] = vh::length(highs[i] - lows[i]) / 2.0f;
+  }
+}
+
+
+void Renderer::cullRenderGroups(const float* projection, const float* modelview)
+{
+  // The frustum planes come from the projection and modelview matrices
+  // multiplied together, which puts them in model space.
+  float clip[16];
+  for (unsigned int col = 0; col < 4; ++col) {
+    for (unsigned int row = 0; row < 4; ++row) {
+      float sum = 0;
+      for (unsigned int k = 0; k < 4; ++k)
+        sum += projection[k * 4 + row] * modelview[col * 4 + k];
+      clip[col * 4 + row] = sum;
+    }
+  }
+
+  _frustum.fromMatrix(clip);
+
+  if (!_frustumCulling || _groupBVH.empty() || _keyframeLoader != NULL) {
+    _visibleGroups.assign(_renderGroups.size(), true);
+    _numVisibleGroups = _renderGroups.size();
+  } else {
+    _numVisibleGroups = _groupBVH.cull(_frustum, _visibleGroups);
+  }
+
+  if (occlusionCullingActive()) {
+    _occlusionCuller.cull(_frustum, _visibleGroups);
+    _numVisibleGroups -= _occlusionCuller.numOccluded();
+  }
+}
+
+
+bool Renderer::occlusionCullingActive() const
+{
+  // The boxes only take in the keyframes loaded so far, like the BVH's, and
+  // the queries need the polygons in the depth buffer.
+  return _occlusionCulling && _occlusionCuller.prepared() && _drawPolys &&
+      _keyframeLoader == NULL;
+}
+
+
+void Renderer::prepareDetailLevels(const float* coords)
+{
+  if (_pixelError <= 0)
+    return;
+
+  // Groups which haven't changed since they were cached keep their levels;
+  // the rest get simplified now.
+  std::vector<RenderGroup*> groups(_renderGroups.begin(), _renderGroups.end());
+  std::vector<uint64_t> hashes(groups.size());
+  DetailLevelSizes sizes;
+  for (size_t i = 0; i < groups.size(); ++i) {
+    hashes[i] = groups[i]->detailHash(coords);
+    sizes[hashes[i]] = groups[i]->size();
+  }
+
+  DetailLevelCache cache;
+  if (!_detailCachePath.empty() &&
+      !readDetailLevels(_detailCachePath, sizes, MAX_DETAIL_LEVELS, cache)) {
+    fprintf(stderr, "Unable to read detail levels from %s: %s\n",
+        _detailCachePath.c_str(), strerror(errno));
+  }
+
+  std::vector<RenderGroup*> missing;
+  for (size_t i = 0; i < groups.size(); ++i) {
+    DetailLevelCache::iterator found = cache.find(hashes[i]);
+    if (found != cache.end())
+      groups[i]->setDetailLevels(found->second);
+    else
+      missing.push_back(groups[i]);
+  }
+  if (missing.empty())
+    return;
+
+  fprintf(stderr, "Simplifying %lu of %lu render groups...\n", missing.size(), groups.size());
+#pragma omp parallel for schedule(dynamic)
+  for (size_t i = 0; i < missing.size(); ++i)
+    missing[i]->buildDetailLevels(coords, MAX_DETAIL_LEVELS);
+
+  if (_detailCachePath.empty())
+    return;
+  cache.clear();
+  for (size_t i = 0; i < groups.size(); ++i)
+    cache[hashes[i]] = groups[i]->detailLevels();
+  if (!writeDetailLevels(_detailCachePath, cache)) {
+    fprintf(stderr, "Unable to write detail levels to %s: %s\n",
+        _detailCachePath.c_str(), strerror(errno));
+  }
+}
+
+
+void Renderer::chooseDetailLevels(const float* projection, const float* modelview, int height)
+{
+  // A level's error, projected onto the screen at the nearest point of the
+  // group's bounding sphere, is about the furthest any pixel of the group
+  // can be out by. Each group gets the simplest level where that's no more
+  // than _pixelError. Groups with the camera inside their sphere always get
+  // level 0. The modelview matrix may scale, so distances are scaled too.
+  float scale = sqrtf(modelview[0] * modelview[0] + modelview[1] * modelview[1] +
+      modelview[2] * modelview[2]);
+  float pixelsPerUnit = projection[5] * height * 0.5f * scale;
+  bool enabled = _pixelError > 0 && _useDetailLevels && !_groupCenters.empty();
+
+  std::list<RenderGroup*>::iterator iter;
+  size_t i;
+  for (iter = _renderGroups.begin(), i = 0; iter != _renderGroups.end(); ++iter, ++i) {
+    RenderGroup* group = *iter;
+    size_t level = 0;
+    if (enabled && _visibleGroups[i] && !group->sortsTriangles()) {
+      const vh::Vector3& center = _groupCenters[i];
+      float depth = -(modelview[2] * center.x + modelview[6] * center.y +
+          modelview[10] * center.z + modelview[14]);
+      float distance = depth - _groupRadii[i] * scale;
+      while (distance > 0 && level + 1 < group->numDetailLevels() &&
+             group->detailError(level + 1) * pixelsPerUnit <= _pixelError * distance)
+        ++level;
+    }
+    group->setDetailLevel(level);
+  }
+}
+
+
+void Renderer::prepareTransparency(const float* coords)
+{
+  std::list<RenderGroup*>::iterator iter = _renderGroups.begin();
+  std::advance(iter, _transparentGroupsStart);
+  _transparentGroups.assign(iter, _renderGroups.end());
+  _transparentOrder.resize(_transparentGroups.size());
+  _transparentDepths.assign(_transparentGroups.size(), 0.0f);
+  for (size_t i = 0; i < _transparentOrder.size(); ++i)
+    _transparentOrder[i] = i;
+
+  if (!_sortTriangles || _transparentGroups.empty())
+    return;
+
+  // The triangles of an instanced group can't have one order that suits
+  // every instance, so those groups are only sorted as a whole.
+  size_t numSorted = 0;
+  for (size_t i = 0; i < _transparentGroups.size(); ++i) {
+    if (!_transparentGroups[i]->instanced()) {
+      _transparentGroups[i]->prepareTriangleSort(coords);
+      ++numSorted;
+    }
+  }
+  fprintf(stderr, "Sorting triangles in %lu of %lu transparent render groups.\n",
+      numSorted, _transparentGroups.size());
+  if (_workers == NULL)
+    _workers = new ThreadPool(1);
+  _sortJob = new SortJob();
+}
+
+
+void Renderer::sortTransparentGroups(const float* modelview)
+{
+  // Groups are sorted by the eye space depth of their centers. The order
+  // carries over from the last frame, so this is usually quick.
+  for (size_t i = 0; i < _transparentGroups.size(); ++i) {
+    const vh::Vector3& center = _groupCenters[_transparentGroupsStart + i];
+    _transparentDepths[i] = modelview[2] * center.x + modelview[6] * center.y +
+        modelview[10] * center.z + modelview[14];
+  }
+  sortByDepth(_transparentOrder, _transparentDepths);
+}
+
+
+void Renderer::startSortJob(const float* modelview)
+{
+  // The triangles are sorted for this frame's view while the GPU is busy
+  // drawing it, ready for the next frame.
+  if (_sortJob == NULL || _sortJobRunning || _transparencyMode != kSortedTransparency)
+    return;
+
+  _sortJob->depthRow = vh::Vector4(modelview[2], modelview[6], modelview[10], modelview[14]);
+  _sortJob->groups.clear();
+  for (size_t i = 0; i < _transparentGroups.size(); ++i) {
+    if (_visibleGroups[_transparentGroupsStart + i])
+      _sortJob->groups.push_back(_transparentGroups[i]);
+  }
+  if (_sortJob->groups.empty())
+    return;
+
+  _sortJobRunning = true;
+  _workers->add(_sortJob);
+}
+
+
+void Renderer::finishSortJob()
+{
+  if (!_sortJobRunning)
+    return;
+
+  _workers->wait(_sortJob);
+  _sortJobRunning = false;
+  for (size_t i = 0; i < _sortJob->groups.size(); ++i)
+    _bytesUploaded += _sortJob->groups[i]->uploadSortedTriangles();
+  checkGLError("Error uploading sorted triangles.");
+}
+
+
+bool Renderer::prepareWeightedBlend(int width, int height)
+{
+  if (_compositeProgram == 0) {
+    fprintf(stderr, "Weighted blended transparency isn't supported here, so transparency stays sorted.\n");
+    _transparencyMode = kSortedTransparency;
+    return false;
+  }
+  if (_blendFramebuffer != 0 && width == _blendWidth && height == _blendHeight)
+    return true;
+
+  GLenum status = 0;
+#if defined(GL_ARB_framebuffer_object) && defined(GL_ARB_texture_float)
+  if (_blendFramebuffer == 0) {
+    glGenFramebuffers(1, &_blendFramebuffer);
+    glGenTextures(2, _blendTextures);
+    glGenTextures(1, &_blendDepthTexture);
+  }
+
+  // The accumulation and weight targets need to go well past 1, so they're
+  // half floats.
+  GLuint textures[3] = { _blendTextures[0], _blendTextures[1], _blendDepthTexture };
+  for (unsigned int i = 0; i < 3; ++i) {
+    glBindTexture(GL_TEXTURE_2D, textures[i]);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    if (textures[i] == _blendDepthTexture) {
+      glTexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH_COMPONENT24, width, height, 0,
+          GL_DEPTH_COMPONENT, GL_UNSIGNED_INT, NULL);
+    } else {
+      glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA16F_ARB, width, height, 0, GL_RGBA, GL_FLOAT, NULL);
+    }
+  }
+  glBindTexture(GL_TEXTURE_2D, 0);
+
+  GLint previous = 0;
+  glGetIntegerv(GL_DRAW_FRAMEBUFFER_BINDING, &previous);
+  glBindFramebuffer(GL_FRAMEBUFFER, _blendFramebuffer);
+  glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, _blendTextures[0], 0);
+  glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT1, GL_TEXTURE_2D, _blendTextures[1], 0);
+  glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, _blendDepthTexture, 0);
+  const GLenum buffers[2] = { GL_COLOR_ATTACHMENT0, GL_COLOR_ATTACHMENT1 };
+  glDrawBuffers(2, buffers);
+  status = glCheckFramebufferStatus(GL_FRAMEBUFFER);
+  glBindFramebuffer(GL_FRAMEBUFFER, previous);
+  checkGLError("Error setting up weighted blended transparency");
+
+  _blendWidth = width;
+  _blendHeight = height;
+  if (status == GL_FRAMEBUFFER_COMPLETE)
+    return true;
+#endif
+
+  fprintf(stderr, "Unable to set up weighted blended transparency (framebuffer status 0x%x), "
+      "so transparency stays sorted.\n", status);
+  _transparencyMode = kSortedTransparency;
+  return false;
+}
+
+
+bool Renderer::beginWeightedBlend(int width, int height)
+{
+  if (_transparentGroups.empty())
+    return false;
+
+  // Everything below changes GL state behind the draw state's back.
+  _drawState.restore();
+  if (!prepareWeightedBlend(width, height))
+    return false;
+
+#ifdef GL_ARB_framebuffer_object
+  // The transparent groups still need depth testing against the opaque
+  // ones, so their depth comes across first. Then each fragment adds its
+  // weighted color and alpha to the first target and its weight to the
+  // second, and multiplies the first target's alpha by (1 - alpha).
+  glGetIntegerv(GL_DRAW_FRAMEBUFFER_BINDING, &_previousFramebuffer);
+  glActiveTexture(GL_TEXTURE0);
+  glBindTexture(GL_TEXTURE_2D, _blendDepthTexture);
+  glCopyTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, 0, 0, width, height);
+  glBindTexture(GL_TEXTURE_2D, 0);
+
+  glBindFramebuffer(GL_FRAMEBUFFER, _blendFramebuffer);
+  glClearColor(0.0, 0.0, 0.0, 1.0);
+  glClear(GL_COLOR_BUFFER_BIT);
+  glClearColor(0.2, 0.2, 0.2, 1.0);
+  glDepthMask(GL_FALSE);
+  glBlendFuncSeparate(GL_ONE, GL_ONE, GL_ZERO, GL_ONE_MINUS_SRC_ALPHA);
+  _drawState.setWeightedBlend(true);
+  return true;
+#else
+  return false;
+#endif
+}
+
+
+void Renderer::endWeightedBlend()
+{
+#ifdef GL_ARB_framebuffer_object
+  _drawState.setWeightedBlend(false);
+  glDepthMask(GL_TRUE);
+  glBindFramebuffer(GL_FRAMEBUFFER, _previousFramebuffer);
+
+  // Composite over the opaque groups with a quad covering the screen.
+  glDisable(GL_DEPTH_TEST);
+  glDisable(GL_LIGHTING);
+  glBlendFunc(GL_ONE_MINUS_SRC_ALPHA, GL_SRC_ALPHA);
+  glUseProgram(_compositeProgram);
+  for (unsigned int i = 0; i < 2; ++i) {
+    glActiveTexture(GL_TEXTURE0 + i);
+    glBindTexture(GL_TEXTURE_2D, _blendTextures[i]);
+  }
+
+  glBegin(GL_QUADS);
+  glTexCoord2f(0, 0);
+  glVertex2f(-1, -1);
+  glTexCoord2f(1, 0);
+  glVertex2f(1, -1);
+  glTexCoord2f(1, 1);
+  glVertex2f(1, 1);
+  glTexCoord2f(0, 1);
+  glVertex2f(-1, 1);
+  glEnd();
+
+  for (unsigned int i = 0; i < 2; ++i) {
+    glActiveTexture(GL_TEXTURE0 + i);
+    glBindTexture(GL_TEXTURE_2D, 0);
+  }
+  glActiveTexture(GL_TEXTURE0);
+  glUseProgram(0);
+  glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+  glEnable(GL_LIGHTING);
+  glEnable(GL_DEPTH_TEST);
+  checkGLError("Error compositing transparent render groups.");
+#endif
+}
+
+
+bool Renderer::prepareFeedback(int width, int height)
+{
+  if (_feedbackFramebuffer != 0 && width == _feedbackWidth && height == _feedbackHeight)
+    return true;
+
+  GLenum status = 0;
+#ifdef GL_ARB_framebuffer_object
+  if (_feedbackFramebuffer == 0) {
+    glGenFramebuffers(1, &_feedbackFramebuffer);
+    glGenRenderbuffers(2, _feedbackRenderbuffers);
+  }
+  glBindRenderbuffer(GL_RENDERBUFFER, _feedbackRenderbuffers[0]);
+  glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, width, height);
+  glBindRenderbuffer(GL_RENDERBUFFER, _feedbackRenderbuffers[1]);
+  glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, width, height);
+  glBindRenderbuffer(GL_RENDERBUFFER, 0);
+
+  GLint previous = 0;
+  glGetIntegerv(GL_DRAW_FRAMEBUFFER_BINDING, &previous);
+  glBindFramebuffer(GL_FRAMEBUFFER, _feedbackFramebuffer);
+  glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, _feedbackRenderbuffers[0]);
+  glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, _feedbackRenderbuffers[1]);
+  status = glCheckFramebufferStatus(GL_FRAMEBUFFER);
+  glBindFramebuffer(GL_FRAMEBUFFER, previous);
+
+  // Whatever was read back at the old size is no use now.
+  _feedbackPixels[0] = _feedbackPixels[1] = 0;
+#ifdef GL_ARB_pixel_buffer_object
+  if (hasGLExtension("GL_ARB_pixel_buffer_object")) {
+    if (_feedbackPixelBuffers[0] == 0)
+      glGenBuffers(2, _feedbackPixelBuffers);
+    for (unsigned int i = 0; i < 2; ++i) {
+      glBindBuffer(GL_PIXEL_PACK_BUFFER, _feedbackPixelBuffers[i]);
+      glBufferData(GL_PIXEL_PACK_BUFFER, size_t(width) * height * 4, NULL, GL_STREAM_READ);
+    }
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+  }
+#endif
+  checkGLError("Error setting up the virtual texture feedback pass");
+
+  _feedbackWidth = width;
+  _feedbackHeight = height;
+  if (status == GL_FRAMEBUFFER_COMPLETE)
+    return true;
+#endif
+
+  // The textures still get drawn from their coarsest tiles, they just never
+  // get any sharper.
+  fprintf(stderr, "Unable to set up the virtual texture feedback pass (framebuffer status 0x%x), "
+      "so no more tiles will be loaded.\n", status);
+  _virtualTextureBudget = 0;
+  return false;
+}
+
+
+// Draws the visible groups into the feedback framebuffer, each fragment
+// writing out the virtual texture tile it wants, and hands what was drawn to
+// the cache to load.
+void Renderer::drawFeedback(int width, int height)
+{
+  if (_virtualTextures == NULL || _virtualTextureBudget == 0)
+    return;
+
+  // Everything below changes GL state behind the draw state's back.
+  _drawState.restore();
+  int feedbackWidth = std::max(width / FEEDBACK_SCALE, 1);
+  int feedbackHeight = std::max(height / FEEDBACK_SCALE, 1);
+  if (!prepareFeedback(feedbackWidth, feedbackHeight))
+    return;
+
+#ifdef GL_ARB_framebuffer_object
+  // Transparent groups want their tiles as much as opaque ones, so they're
+  // drawn the same way, with blending off.
+  GLint previous = 0;
+  glGetIntegerv(GL_DRAW_FRAMEBUFFER_BINDING, &previous);
+  glBindFramebuffer(GL_FRAMEBUFFER, _feedbackFramebuffer);
+  glViewport(0, 0, feedbackWidth, feedbackHeight);
+  glClearColor(0.0, 0.0, 0.0, 0.0);
+  glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+  glClearColor(0.2, 0.2, 0.2, 1.0);
+  glDisable(GL_BLEND);
+
+  _drawState.reset();
+  _drawState.setVirtualFeedback(true);
+  std::list<RenderGroup*>::iterator iter = _renderGroups.begin();
+  for (size_t i = 0; iter != _renderGroups.end(); ++iter, ++i) {
+    if (_visibleGroups[i])
+      (*iter)->render(_currentTime, _drawState);
+  }
+  _drawState.setVirtualFeedback(false);
+  _drawState.restore();
+
+  readFeedback();
+  glBindFramebuffer(GL_FRAMEBUFFER, previous);
+  glViewport(0, 0, width, height);
+  glEnable(GL_BLEND);
+  checkGLError("Error drawing the virtual texture feedback pass.");
+#endif
+}
+
+
+// With pixel buffers, this frame's feedback is read into one of them without
+// waiting for it and the one read last frame is what gets looked at.
+// Otherwise we wait for this frame's.
+void Renderer::readFeedback()
+{
+  size_t numPixels = size_t(_feedbackWidth) * _feedbackHeight;
+#ifdef GL_ARB_pixel_buffer_object
+  if (_feedbackPixelBuffers[0] != 0) {
+    size_t current = _feedbackFrame % 2;
+    size_t last = 1 - current;
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, _feedbackPixelBuffers[current]);
+    glReadPixels(0, 0, _feedbackWidth, _feedbackHeight, GL_RGBA, GL_UNSIGNED_BYTE, 0);
+    _feedbackPixels[current] = numPixels;
+    ++_feedbackFrame;
+
+    if (_feedbackPixels[last] > 0) {
+      glBindBuffer(GL_PIXEL_PACK_BUFFER, _feedbackPixelBuffers[last]);
+      const unsigned char* pixels = (const unsigned char*)glMapBuffer(GL_PIXEL_PACK_BUFFER, GL_READ_ONLY);
+      if (pixels != NULL) {
+        _virtualTextures->requestTiles(pixels, _feedbackPixels[last]);
+        glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+      }
+    }
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    return;
+  }
+#endif
+
+  _feedback.resize(numPixels * 4);
+  glReadPixels(0, 0, _feedbackWidth, _feedbackHeight, GL_RGBA, GL_UNSIGNED_BYTE, &_feedback[0]);
+  _virtualTextures->requestTiles(&_feedback[0], numPixels);
+}
+
+
+void Renderer::prepareMaterials()
+{
+  // Prepare the materials.
+  fprintf(stderr, "Preparing materials...\n");
+  std::map<std::string, Material*>::iterator m;
+  for (m = _model->materials.begin(); m != _model->materials.end(); ++m) {
+    Material* material = m->second;
+    if (material->d != 1) {
+      material->Ka.a = material->d;
+      material->Kd.a = material->d;
+      material->Ks.a = material->d;
+    }
+  }
+}
+
+
+void Renderer::prepareShaders()
+{
+  GLuint vertexShader, fragmentShader;
+
+  // Set up the shader program for objects with a material.
+  vertexShader = loadShader(GL_VERTEX_SHADER, "vertex.vert");
+  fragmentShader = loadShader(GL_FRAGMENT_SHADER, "fragment.frag");
+  if (vertexShader != 0 && fragmentShader != 0)
+    _shaderWithMaterial = linkProgram(vertexShader, fragmentShader);
+
+  // Set up the shader program for objects without a material.
+  vertexShader = loadShader(GL_VERTEX_SHADER, "vertex-notexture.vert");
+  fragmentShader = loadShader(GL_FRAGMENT_SHADER, "fragment-notexture.frag");
+  if (vertexShader != 0 && fragmentShader != 0)
+    _shaderNoMaterial = linkProgram(vertexShader, fragmentShader);
+
+  // Set up the program for compositing weighted blended transparency, if
+  // we can render to floating point textures.
+#if defined(GL_ARB_framebuffer_object) && defined(GL_ARB_texture_float)
+  if (hasGLExtension("GL_ARB_framebuffer_object") && hasGLExtension("GL_ARB_texture_float")) {
+    vertexShader = loadShader(GL_VERTEX_SHADER, "vertex-composite.vert");
+    fragmentShader = loadShader(GL_FRAGMENT_SHADER, "fragment-composite.frag");
+    if (vertexShader != 0 && fragmentShader != 0)
+      _compositeProgram = linkProgram(vertexShader, fragmentShader);
+  }
+  if (_compositeProgram != 0) {
+    glUseProgram(_compositeProgram);
+    glUniform1i(glGetUniformLocation(_compositeProgram, "accumulation"), 0);
+    glUniform1i(glGetUniformLocation(_compositeProgram, "weights"), 1);
+    glUseProgram(0);
+  }
+#endif
+}
+
+
+void Renderer::prepareGPUKeyframes()
+{
+  size_t numKeyframes = _model->numKeyframes();
+  if (!_gpuKeyframes || numKeyframes < 2)
+    return;
+
+  // Only positions and normals get interpolated on the GPU.
+  if (_model->texCoordsOrColorsAnimated()) {
+    fprintf(stderr, "Tex coords or colors are animated, so keyframes will be interpolated on the CPU.\n");
+    _gpuKeyframes = false;
+    return;
+  }
+
+  std::list<RenderGroup*>::iterator iter;
+  size_t needed = 0;
+  for (iter = _renderGroups.begin(); iter != _renderGroups.end(); ++iter)
+    needed += (*iter)->keyframeBytes(numKeyframes);
+
+  size_t budget = (_gpuMemoryBudget > 0) ? _gpuMemoryBudget : availableGPUMemory();
+  if (budget > 0 && needed > budget) {
+    fprintf(stderr, "Keyframes need %1.1f MB but only %1.1f MB of GPU memory is available, "
+        "so they'll be interpolated on the CPU.\n", needed / 1048576.0, budget / 1048576.0);
+    _gpuKeyframes = false;
+    return;
+  }
+
+  fprintf(stderr, "Uploading %lu keyframes (%1.1f MB) for interpolation on the GPU...\n",
+      numKeyframes, needed / 1048576.0);
+  size_t failed = 0;
+  for (iter = _renderGroups.begin(); iter != _renderGroups.end(); ++iter) {
+    if ((*iter)->prepareKeyframes(numKeyframes))
+      _memory.vertexBuffers += (*iter)->keyframeBytes(numKeyframes);
+    else
+      ++failed;
+  }
+  if (failed > 0) {
+    fprintf(stderr, "Out of GPU memory: %lu of %lu render groups will interpolate on the CPU.\n",
+        failed, _renderGroups.size());
+  }
+  uploadGPUKeyframes();
+}
+
+
+void Renderer::uploadGPUKeyframes()
+{
+  std::vector<float> coords(_model->v.size() * 3);
+  std::vector<float> normals(_model->vn.size() * 3);
+  std::list<RenderGroup*>::iterator iter;
+  for (size_t keyframe = 0; keyframe < _model->numKeyframes(); ++keyframe) {
+    _model->keyframeData(keyframe, &coords[0], &normals[0]);
+    for (iter = _renderGroups.begin(); iter != _renderGroups.end(); ++iter) {
+      if ((*iter)->hasGPUKeyframes())
+        (*iter)->uploadKeyframe(keyframe, &coords[0], &normals[0]);
+    }
+  }
 }
 
 
-void Renderer::firstFrame()
+size_t Renderer::availableGPUMemory()
 {
-  _currentTime = 0.0;
+  // Only the NVIDIA and AMD drivers will tell us this. Everywhere else we
+  // find out when a buffer allocation fails.
+  const char* extensions = (const char*)glGetString(GL_EXTENSIONS);
+  GLint available[4] = { 0, 0, 0, 0 };
+  if (extensions != NULL && strstr(extensions, "GL_NVX_gpu_memory_info") != NULL)
+    glGetIntegerv(GL_GPU_MEMORY_INFO_CURRENT_AVAILABLE_VIDMEM_NVX, available);
+  else if (extensions != NULL && strstr(extensions, "GL_ATI_meminfo") != NULL)
+    glGetIntegerv(GL_VBO_FREE_MEMORY_ATI, available);
+  return size_t(available[0]) * 1024;
 }
 
 
-void Renderer::lastFrame()
+void Renderer::prepareVertexBuffers()
 {
-  _currentTime = _model->numKeyframes() - 1;
+  // Without fences we can't tell when the GPU has finished with a buffer, so
+  // we have to stick with one buffer per group and let the driver stall.
+  if (hasGLExtension("GL_ARB_sync")) {
+    _numVertexBuffers = NUM_VERTEX_BUFFERS;
+    _frameFences.resize(NUM_VERTEX_BUFFERS, 0);
+#ifdef GL_ARB_buffer_storage
+    _persistentBuffers = hasGLExtension("GL_ARB_buffer_storage");
+#endif
+  }
+
+  // Baked frames are copied from the vertex buffers on the GPU.
+  if (_frameCacheBudget > 0) {
+#ifdef GL_ARB_copy_buffer
+    if (hasGLExtension("GL_ARB_copy_buffer")) {
+      size_t samplesPerKeyframe = size_t(BAKED_FRAMES_PER_SECOND / _animFPS + 0.5f);
+      _frameCache = new FrameCache(_frameCacheBudget, samplesPerKeyframe);
+      fprintf(stderr, "Caching up to %1.1f MB of interpolated frames, %lu per keyframe.\n",
+          _frameCacheBudget / 1048576.0, _frameCache->samplesPerKeyframe());
+    }
+#endif
+    if (_frameCache == NULL)
+      fprintf(stderr, "Can't copy vertex buffers on this GPU, so interpolated frames won't be cached.\n");
+  }
 }
 
 
-void Renderer::togglePlaying()
+void Renderer::preparePlayback()
 {
-  _playing = !_playing;
-  if (_playing)
-    _since = glutGet(GLUT_ELAPSED_TIME);
+  // The worker fills a buffer while we draw from another, so it needs at
+  // least two.
+  if (_playbackJob == NULL && _asyncPlayback && _numVertexBuffers > 1 && _model->numKeyframes() > 1) {
+    if (_workers == NULL)
+      _workers = new ThreadPool(1);
+    _playbackJob = new PlaybackJob();
+  }
+
+  fprintf(stderr, "Using %lu %svertex buffer%s per render group, interpolating %s.\n",
+      _numVertexBuffers, _persistentBuffers ? "persistently mapped " : "",
+      (_numVertexBuffers == 1) ? "" : "s",
+      (_playbackJob != NULL) ? "in the background" : "on the render thread");
 }
 
 
-void Renderer::flipNormals()
+void Renderer::findDirtyRanges()
 {
+  std::vector<bool> animatedCoords, animatedNormals;
+  bool animatedTexCoordsOrColors = true;
+  if (loadingKeyframes()) {
+    animatedCoords.assign(_model->v.size(), true);
+    animatedNormals.assign(_model->vn.size(), true);
+  } else {
+    _model->findAnimatedVertices(animatedCoords, animatedNormals);
+    animatedTexCoordsOrColors = _model->texCoordsOrColorsAnimated();
+  }
+
+  size_t numVertices = 0, numDirty = 0;
   std::list<RenderGroup*>::iterator iter;
-  for (iter = _renderGroups.begin(); iter != _renderGroups.end(); ++iter)
-    (*iter)->flipNormals();
+  for (iter = _renderGroups.begin(); iter != _renderGroups.end(); ++iter) {
+    (*iter)->findDirtyRanges(animatedCoords, animatedNormals, animatedTexCoordsOrColors);
+    numVertices += (*iter)->size();
+    numDirty += (*iter)->numDirtyVertices();
+  }
+
+  if (_model->numKeyframes() > 1 && !loadingKeyframes()) {
+    fprintf(stderr, "Refilling positions and normals for %lu of %lu vertices (%1.2f%%) as the time changes.\n",
+        numDirty, numVertices, (numVertices > 0) ? 100.0 * numDirty / numVertices : 0.0);
+  }
 }
 
 
-void Renderer::setupCamera(int width, int height, const vh::Vector3& low, const vh::Vector3& high)
+void Renderer::updateRenderGroups(float time)
 {
-  vh::Vector3 target = _camera->getTarget();
-  float distance = _camera->getDistance();
-
-  // Here we use the model's bounding sphere to calculate good values for
-  // the near and far clipping planes.
-  
-  // Radius of bounding sphere == half distance between opposite bbox corners
-  // FIXME: For some reason the radius ends up being too small, so instead I'm
-  // using the diameter for now.
-  float radius = length(high - low); 
-  // v is the vector from our target to the bbox center, but we'll only need
-  // the z component (see below) so that's all we calculate.
-  float vz = ((high.z + low.z) / 2.0) - target.z;
-  // Since our direction vector d for the camera is 0,0,1 the dot product of v
-  // and d is simply v.z. This gives us the distance along our direction vector
-  // at which we're level with the bbox center: _rotation.w + vz. Subtract the
-  // radius from that and we've got out near clip plane.
-  float nearClip = distance + vz - radius;
-  // The far clip plane will always be the near clip plane plus the diameter.
-  float farClip = nearClip + 2 * radius;
-  // Make sure the near clip plane doesn't end up behind us.
-  if (nearClip < 0.01)
-    nearClip = 0.01;
-  // Make sure the far clip plane doesn't end up behind the near clip plane.
-  if (farClip <= nearClip)
-    farClip = nearClip + 0.01;
+  std::list<RenderGroup*>::iterator iter;
+  for (iter = _renderGroups.begin(); iter != _renderGroups.end(); ++iter) {
+    RenderGroup* group = *iter;
+    _bytesUploaded += group->updateStaticBuffer(time);
 
-  glMatrixMode(GL_PROJECTION);
-  glPushMatrix();
+    // With the keyframes on the GPU, the positions and normals never change.
+    if (group->hasGPUKeyframes() || group->isCurrent(time) || useBakedFrame(group, time))
+      continue;
 
-  glLoadIdentity();
-  glViewport(0, 0, width, height); // Set the viewport to be the entire window
-  gluPerspective(_camera->getFieldOfViewY(), double(width) / double(height),
-      nearClip, farClip);
+    size_t buffer = group->nextBuffer();
+    waitForFrame(group->lastDrawn(buffer));
+    bool everything = !group->isFilled(buffer);
+    _bytesUploaded += group->fillBuffer(time, group->mapBuffer(buffer), everything);
+    group->unmapBuffer(buffer);
+    group->useBuffer(buffer, time);
+    bakeFrame(group, time);
+  }
+  checkGLError("Error updating vertex buffers.");
 }
 
 
-void Renderer::transformToCamera()
+bool Renderer::useBakedFrame(RenderGroup* group, float time)
 {
-  vh::Vector3 target = _camera->getTarget();
-  vh::Vector4 rotation = _camera->getRotation();
-  float distance = _camera->getDistance();
-  glTranslatef(-target.x, -target.y, -target.z - distance);
-  glRotatef(rotation.x, 1, 0, 0);
-  glRotatef(rotation.y, 0, 1, 0);
-  glRotatef(rotation.z, 0, 0, 1);
+  if (_frameCache == NULL)
+    return false;
+
+  GLuint buffer = _frameCache->find(group, time);
+  if (buffer == 0)
+    return false;
+  group->useBakedBuffer(buffer, time);
+  return true;
 }
 
 
-void Renderer::prepareModel()
+void Renderer::bakeFrame(RenderGroup* group, float time)
 {
-  // Fill in default texture coordinates where necessary.
-  size_t defaultTexCoordIndex = _model->vt.size();
-  _model->addVt(vh::Vector2(0.5, 0.5));
-  for (size_t i = 0; i < _model->faces.size(); ++i) {
-    Face& face = *_model->faces[i];
-    for (size_t vertexNum = 0; vertexNum < face.size(); ++vertexNum) {
-      if (face[vertexNum].vt < 0)
-        face[vertexNum].vt = defaultTexCoordIndex;
-    }
-  }
-
-  // Calculate the normals if they're not present.
-  if (_model->vn.size() == 0) {
-    fprintf(stderr, "Calculating normals...\n");
+  // Until every keyframe has loaded, what we'd bake is only provisional.
+  if (_frameCache != NULL && !loadingKeyframes() && _model->numKeyframes() > 1)
+    _frameCache->bake(group, time);
+}
 
-    // Setup a normal of 0,0,0,0 for all keyframes.
-    while (_model->vn.size() < _model->v.size()) {
-      Curve3 curve;
-      while (curve.numKeyframes() < _model->numKeyframes())
-        curve.addKeyframe(vh::Vector3(0, 0, 0));
-      _model->vn.push_back(curve);
-    }
 
-    for (size_t i = 0; i < _model->faces.size(); ++i) {
-      Face& face = *_model->faces[i];
-      for (size_t frame = 0; frame < _model->numKeyframes(); ++frame) {
-        const vh::Vector3& a = _model->v[face[0].v][frame];
-        const vh::Vector3& b = _model->v[face[1].v][frame];
-        const vh::Vector3& c = _model->v[face[2].v][frame];
-        vh::Vector3 faceNormal = vh::norm(vh::cross(b - a, c - a));
-
-        for (size_t j = 0; j < face.size(); ++j) {
-          Curve3& curve = _model->vn[face[j].v];
-          curve[frame] = curve[frame] + faceNormal;
-        }
-      }
-      for (size_t j = 0; j < face.size(); ++j)
-        face[j].vn = face[j].v;
-    }
+void Renderer::updateKeyframeLoader()
+{
+  if (_keyframeLoader == NULL)
+    return;
 
-    for (size_t i = 0; i < _model->vn.size(); ++i) {
-      for (size_t frame = 0; frame < _model->numKeyframes(); ++frame)
-        _model->vn[i][frame] = vh::norm(_model->vn[i][frame]);
-    }
+  if (_keyframeLoader->finished()) {
+    finishLoadingKeyframes();
+    return;
   }
 
-  // Count the animated points.
-  if (_model->numKeyframes() > 1) {
-    size_t animatedPoints = 0;
-
-    vh::Vector3 size = _model->high - _model->low;
-    for (size_t i = 0; i < _model->v.size(); ++i) {
-      Curve3& curve = _model->v[i];
-      const vh::Vector3 initialPos = curve[0];
-      for (size_t keyFrame = 1; keyFrame < curve.numKeyframes(); ++keyFrame) {
-        const vh::Vector3 keyPos = curve[keyFrame];
-        // If a vertex has moved by more than 1% of the total object size...
-        if (lengthSqr( (keyPos - initialPos) / size ) > 1e-4) {
-          ++animatedPoints;
-          break;
-        }
-      }
-    }
+  size_t numLoaded = _model->numLoadedKeyframes();
+  if (numLoaded == _numLoadedKeyframes)
+    return;
 
-    fprintf(stderr, "%ld of %ld points (%1.2f%%) are animated.\n",
-        animatedPoints, _model->v.size(),
-        100.0 * float(animatedPoints) / float(_model->v.size()));
+  // Packed positions have to fit inside the box the render groups were set
+  // up for, so widen it whenever a new keyframe goes outside.
+  vh::Vector3 low = _loadedLow;
+  vh::Vector3 high = _loadedHigh;
+  for (size_t keyframe = _numLoadedKeyframes; keyframe < numLoaded; ++keyframe) {
+    vh::Vector3 keyframeLow, keyframeHigh;
+    _model->boundsAt(keyframe, keyframeLow, keyframeHigh);
+    low = vh::lowCorner(low, keyframeLow);
+    high = vh::highCorner(high, keyframeHigh);
   }
+  _numLoadedKeyframes = numLoaded;
+
+  bool grown = false;
+  for (unsigned int j = 0; j < 3; ++j)
+    grown = grown || low.data[j] < _loadedLow.data[j] || high.data[j] > _loadedHigh.data[j];
+  _loadedLow = low;
+  _loadedHigh = high;
+  if (!grown || _vertexFormat.positions == kFloatPositions)
+    return;
+
+  std::list<RenderGroup*>::iterator iter;
+  for (iter = _renderGroups.begin(); iter != _renderGroups.end(); ++iter)
+    (*iter)->keyframesChanged(low, high);
 }
 
 
-void Renderer::prepareRenderGroups()
+void Renderer::finishLoadingKeyframes()
 {
-  // Create the render groups. Each material will have up to one group for
-  // each of triangles, quads and general polygons.
-  fprintf(stderr, "Creating render groups...\n");
-  std::map<Material*, std::list<RenderGroup*> > triangles;
-  std::map<Material*, std::list<RenderGroup*> > polys;
-  std::map<Material*, std::list<RenderGroup*> > transparentTriangles;
-  std::map<Material*, std::list<RenderGroup*> > transparentPolys;
+  // Nothing else is using the model while we're between playback jobs, and
+  // there's no worker until this is done anyway.
+  _keyframeLoader->finish();
+  delete _keyframeLoader;
+  _keyframeLoader = NULL;
+
+  countAnimatedPoints();
+  packKeyframes();
+  if (_frameCache != NULL)
+    _frameCache->clear();
+  std::list<RenderGroup*>::iterator iter;
+  for (iter = _renderGroups.begin(); iter != _renderGroups.end(); ++iter)
+    (*iter)->keyframesChanged();
+  findDirtyRanges();
+  calculateGroupBounds();
+  prepareGPUKeyframes();
+  preparePlayback();
+  setTime(_currentTime);
+}
 
-  for (size_t i = 0; i < _model->faces.size(); ++i) {
-    Face* face = _model->faces[i];
-    if (face->size() < 3)
-      continue;
 
-    // Note that we've already triangulated quads by this point.
-    Material* material = face->material;
+float Renderer::wrapTime(float time)
+{
+  time = fmodf(time, _model->numKeyframes());
+  if (time < 0)
+    time += _model->numKeyframes();
+  return clampToLoadedKeyframes(time);
+}
 
-    bool isTransparent = (material != NULL) && (material->d != 1 || material->mapD != NULL);
-    bool isTriangle = (face->size() == 3);
 
-    RenderGroupType type = isTriangle ? kTriangleGroup : kPolygonGroup;
-    std::map<Material*, std::list<RenderGroup*> >* groupMap;
+float Renderer::clampToLoadedKeyframes(float time)
+{
+  // We can't interpolate past the last keyframe loaded so far, so playback
+  // waits there until the next one arrives.
+  if (_keyframeLoader == NULL)
+    return time;
+  size_t numLoaded = _model->numLoadedKeyframes();
+  float last = (numLoaded > 0) ? float(numLoaded - 1) : 0.0f;
+  if (numLoaded < _model->numKeyframes() && time > last)
+    return last;
+  return time;
+}
+
 
-    if (isTriangle)
-      groupMap = isTransparent ? &transparentTriangles : &triangles;
-    else
-      groupMap = isTransparent ? &transparentPolys : &polys;
+void Renderer::startPlaybackJob(float time)
+{
+  if (_playbackJob == NULL)
+    return;
 
-    if (groupMap->find(material) == groupMap->end()) {
-      (*groupMap)[material] = std::list<RenderGroup*>();
-      (*groupMap)[material].push_back(new RenderGroup(material, type,
-          material ? _shaderWithMaterial : _shaderNoMaterial));
-    }
+  time = wrapTime(time);
 
-    std::list<RenderGroup*>& groups = (*groupMap)[material];
-    if ((!isTriangle && groups.front()->size() > 0) || groups.front()->size() >= MAX_FACES_PER_VBO)
-      groups.push_front(new RenderGroup(material, type,
-          material ? _shaderWithMaterial : _shaderNoMaterial));
-    groups.front()->add(_model, face);
-  }
+  _playbackJob->time = time;
+  _playbackJob->groups.clear();
+  _playbackJob->buffers.clear();
+  _playbackJob->pointers.clear();
+  _playbackJob->everything.clear();
 
-  // Copy the render groups into the _renderGroups list. Make sure the groups
-  // with transparent materials go last, so that they'll be rendered after the
-  // opaque materials.
-  fprintf(stderr, "Sorting render groups...\n");
-  std::map<Material*, std::list<RenderGroup*> >::iterator listIter;
+  // Map the buffers here, since the worker can't make GL calls.
   std::list<RenderGroup*>::iterator iter;
+  for (iter = _renderGroups.begin(); iter != _renderGroups.end(); ++iter) {
+    RenderGroup* group = *iter;
+    if (group->hasGPUKeyframes() || group->isCurrent(time) ||
+        (_frameCache != NULL && _frameCache->contains(group, time)))
+      continue;
 
-  for (listIter = triangles.begin(); listIter != triangles.end(); ++listIter) {
-    for (iter = listIter->second.begin(); iter != listIter->second.end(); ++iter)
-      _renderGroups.push_back(*iter);
-  }
-  for (listIter = polys.begin(); listIter != polys.end(); ++listIter) {
-    for (iter = listIter->second.begin(); iter != listIter->second.end(); ++iter)
-      _renderGroups.push_back(*iter);
-  }
-  _transparentGroupsStart = _renderGroups.size();
-  for (listIter = transparentTriangles.begin(); listIter != transparentTriangles.end(); ++listIter) {
-    for (iter = listIter->second.begin(); iter != listIter->second.end(); ++iter)
-      _renderGroups.push_back(*iter);
-  }
-  for (listIter = transparentPolys.begin(); listIter != transparentPolys.end(); ++listIter) {
-    for (iter = listIter->second.begin(); iter != listIter->second.end(); ++iter)
-      _renderGroups.push_back(*iter);
+    size_t buffer = group->nextBuffer();
+    waitForFrame(group->lastDrawn(buffer));
+    _playbackJob->groups.push_back(group);
+    _playbackJob->buffers.push_back(buffer);
+    _playbackJob->pointers.push_back(group->mapBuffer(buffer));
+    _playbackJob->everything.push_back(!group->isFilled(buffer));
   }
+  checkGLError("Error mapping vertex buffers.");
 
-  // Prepare the render groups.
-  fprintf(stderr, "Preparing render groups...\n");
-  std::list<RenderGroup*>::iterator groupIter;
-  for (groupIter = _renderGroups.begin(); groupIter != _renderGroups.end(); ++groupIter)
-    (*groupIter)->prepare();
+  if (_playbackJob->groups.empty())
+    return;
+
+  _playbackJobFrom = _currentTime;
+  _playbackJobRunning = true;
+  _workers->add(_playbackJob);
 }
 
 
-void Renderer::prepareMaterials()
+bool Renderer::finishPlaybackJob()
 {
-  // Prepare the materials.
-  fprintf(stderr, "Preparing materials...\n");
-  std::map<std::string, Material*>::iterator m;
-  for (m = _model->materials.begin(); m != _model->materials.end(); ++m) {
-    Material* material = m->second;
-    if (material->d != 1) {
-      material->Ka.a = material->d;
-      material->Kd.a = material->d;
-      material->Ks.a = material->d;
-    }
+  if (!_playbackJobRunning)
+    return false;
+
+  _workers->wait(_playbackJob);
+  _playbackJobRunning = false;
+  for (size_t i = 0; i < _playbackJob->groups.size(); ++i) {
+    RenderGroup* group = _playbackJob->groups[i];
+    group->unmapBuffer(_playbackJob->buffers[i]);
+    group->useBuffer(_playbackJob->buffers[i], _playbackJob->time);
+    bakeFrame(group, _playbackJob->time);
   }
+  _bytesUploaded += _playbackJob->bytesWritten;
+  checkGLError("Error unmapping vertex buffers.");
+
+  // If the time has been changed by hand since we started, the result isn't
+  // what we want to show next. It may still save some work later though.
+  if (!_playing || _currentTime != _playbackJobFrom)
+    return false;
+
+  _currentTime = _playbackJob->time;
+  return true;
 }
 
 
-void Renderer::prepareShaders()
+void Renderer::waitForFrame(size_t frame)
 {
-  GLuint vertexShader, fragmentShader;
+  if (frame <= _completedFrame || _frameFences.empty())
+    return;
 
-  // Set up the shader program for objects with a material.
-  vertexShader = loadShader(GL_VERTEX_SHADER, "vertex.vert");
-  fragmentShader = loadShader(GL_FRAGMENT_SHADER, "fragment.frag");
-  if (vertexShader != 0 && fragmentShader != 0)
-    _shaderWithMaterial = linkProgram(vertexShader, fragmentShader);
+  // Fences signal in order, so this also means every earlier frame is done.
+  GLsync& fence = _frameFences[frame % _frameFences.size()];
+  if (fence != 0) {
+    glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, FENCE_TIMEOUT);
+    glDeleteSync(fence);
+    fence = 0;
+  }
+  _completedFrame = frame;
+}
 
-  // Set up the shader program for objects without a material.
-  vertexShader = loadShader(GL_VERTEX_SHADER, "vertex-notexture.vert");
-  fragmentShader = loadShader(GL_FRAGMENT_SHADER, "fragment-notexture.frag");
-  if (vertexShader != 0 && fragmentShader != 0)
-    _shaderNoMaterial = linkProgram(vertexShader, fragmentShader);
+
+void Renderer::endFrame()
+{
+  std::list<RenderGroup*>::iterator iter;
+  for (iter = _renderGroups.begin(); iter != _renderGroups.end(); ++iter)
+    (*iter)->markDrawn(_frame);
+
+  // Don't let the CPU get more frames ahead of the GPU than we have fences.
+  if (!_frameFences.empty()) {
+    GLsync& fence = _frameFences[_frame % _frameFences.size()];
+    if (fence != 0) {
+      waitForFrame(_frame - _frameFences.size());
+      // Still there if we already knew that frame was done.
+      if (fence != 0)
+        glDeleteSync(fence);
+    }
+    fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+  }
+  ++_frame;
 }
 
 
@@ -914,89 +3995,104 @@ void Renderer::drawDefaultModel()
 
 void Renderer::loadTextures(std::list<RenderGroup*>& groups)
 {
-  Material* currentMaterial = NULL;
+  bool pixelBuffers = false;
+#ifdef GL_ARB_pixel_buffer_object
+  pixelBuffers = hasGLExtension("GL_ARB_pixel_buffer_object");
+#endif
+  _textureLoader = new TextureLoader(_model, _maxTextureWidth, _maxTextureHeight, pixelBuffers);
+
+  // Virtual textures need a framebuffer to draw the feedback pass into.
+  if (_virtualTextureBudget > 0) {
+#ifdef GL_ARB_framebuffer_object
+    if (hasGLExtension("GL_ARB_framebuffer_object"))
+      _virtualTextures = new VirtualTextureCache(_virtualTextureBudget, glGet(GL_MAX_TEXTURE_SIZE));
+#endif
+    if (_virtualTextures == NULL)
+      fprintf(stderr, "Virtual textures aren't supported here, so big textures will be downsampled.\n");
+  }
 
+  std::vector<Material*> materials;
+  std::set<Material*> seen;
   std::list<RenderGroup*>::iterator iter;
   for (iter = groups.begin(); iter != groups.end(); ++iter) {
     Material* material = (*iter)->getMaterial();
-    if (material != NULL && material != currentMaterial) {
-      loadTexture(material->mapD, true);
-      loadTexture(material->mapKa, false);
-      loadTexture(material->mapKd, false);
-      loadTexture(material->mapKs, false);
+    if (material != NULL && seen.insert(material).second)
+      materials.push_back(material);
+  }
+
+  // An image which is virtual anywhere is virtual everywhere, so it never
+  // goes to the texture loader: both would be reading its pixels and
+  // freeing them.
+  std::map<Material*, RawImage*> chosen;
+  std::set<RawImage*> virtualImages;
+  if (_virtualTextures != NULL) {
+    size_t maxWidth = _maxTextureWidth;
+    size_t maxHeight = _maxTextureHeight;
+    if (maxWidth == 0 && maxHeight == 0) {
+      maxWidth = std::min(VIRTUAL_TEXTURE_SIZE, size_t(glGet(GL_MAX_TEXTURE_SIZE)));
+      maxHeight = maxWidth;
+    }
+    chooseVirtualTextures(materials, maxWidth, maxHeight, chosen);
+    for (iter = groups.begin(); iter != groups.end(); ++iter) {
+      Material* material = (*iter)->getMaterial();
+      if (material != NULL && chosen[material] != NULL) {
+        virtualImages.insert(chosen[material]);
+        (*iter)->setVirtualTexture(_virtualTextures, _virtualTextures->add(chosen[material]));
+      }
     }
   }
+
+  for (size_t i = 0; i < materials.size(); ++i) {
+    Material* material = materials[i];
+    if (virtualImages.count(material->mapD) == 0)
+      _textureLoader->add(material->mapD, true);
+    if (virtualImages.count(material->mapKa) == 0)
+      _textureLoader->add(material->mapKa, false);
+    if (virtualImages.count(material->mapKd) == 0)
+      _textureLoader->add(material->mapKd, false);
+    if (virtualImages.count(material->mapKs) == 0)
+      _textureLoader->add(material->mapKs, false);
+  }
+  _textureLoader->start();
+  updateTextureLoader();
+
+  if (_virtualTextures != NULL && _virtualTextures->numTextures() == 0) {
+    delete _virtualTextures;
+    _virtualTextures = NULL;
+  } else if (_virtualTextures != NULL) {
+    _virtualTextures->start(_model, _virtualTextureDir.c_str());
+    checkGLError("Error creating the virtual texture cache.");
+  }
 }
 
 
-void Renderer::loadTexture(RawImage* tex, bool isMatte)
+void Renderer::updateTextureLoader()
 {
-  // If tex is null, or tex is already loaded.
-  if (tex == NULL || tex->getTexID() != (unsigned int)-1)
+  if (_textureLoader == NULL)
     return;
-  fprintf(stderr, "Loading %dx%d %d bpp texture onto the GPU.\n",
-      tex->getWidth(), tex->getHeight(), tex->getBytesPerPixel() * 8);
-
-  GLenum targetType;
-  if (isMatte) {
-    targetType = GL_ALPHA;
-  } else {
-    switch (tex->getType()) {
-    case GL_BGR:
-      targetType = GL_RGB;
-      break;
-    case GL_BGRA:
-      targetType = GL_RGBA;
-      break;
-    default:
-      targetType = tex->getType();
-      break;
-    }
-  }
-  checkGLError("Some GL error before loading texture.");
 
-  GLuint texID;
-  glGenTextures(1, &texID);
+  _bytesUploaded += _textureLoader->update(TEXTURE_UPLOAD_BYTES_PER_FRAME);
+  checkGLError("Error uploading textures.");
+  if (!_textureLoader->finished())
+    return;
 
-  glBindTexture(GL_TEXTURE_2D, texID);
-  checkGLError("Texture not bound.");
-  glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
-  checkGLError("Pixel storage format not set.");
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-  checkGLError("Texture parameters not set.");
-  
-  unsigned int downsampleX = 1;
-  unsigned int downsampleY = 1;
-  if (_maxTextureWidth > 0) {
-    while (tex->getWidth() / downsampleX > _maxTextureWidth)
-      ++downsampleX;
-  }
-  if (_maxTextureHeight > 0) {
-    while (tex->getHeight() / downsampleY > _maxTextureHeight)
-      ++downsampleY;
-  }
+  fprintf(stderr, "Finished loading %lu textures.\n", _textureLoader->numTextures());
+  _memory.textures += _textureLoader->gpuBytes();
+  delete _textureLoader;
+  _textureLoader = NULL;
+}
 
-  if (downsampleX == 1 || downsampleY == 1) {
-    glTexImage2D(GL_TEXTURE_2D, 0, targetType, tex->getWidth(), tex->getHeight(), 0,
-                 tex->getType(), GL_UNSIGNED_BYTE, tex->getPixels());
-  } else {
-    fprintf(stderr, "Downsampling texture %d: %ux%u --> %ux%u\n", texID,
-      tex->getWidth(), tex->getHeight(),
-      tex->getWidth() / downsampleX, tex->getHeight() / downsampleY);
-    RawImage* downsampledTex = downsample(tex, downsampleX, downsampleY);
-    glTexImage2D(GL_TEXTURE_2D, 0, targetType,
-                 downsampledTex->getWidth(), downsampledTex->getHeight(), 0,
-                 downsampledTex->getType(), GL_UNSIGNED_BYTE, downsampledTex->getPixels());
-    delete downsampledTex;
-  }
 
-  checkGLError("Texture failed to load.");
+void Renderer::updateVirtualTextures()
+{
+  if (_virtualTextures == NULL)
+    return;
 
-  tex->setTexID(texID);
-  tex->deletePixels();
+  bool building = _virtualTextures->building();
+  _bytesUploaded += _virtualTextures->update(TILE_UPLOADS_PER_FRAME);
+  checkGLError("Error uploading virtual texture tiles.");
+  if (building && !_virtualTextures->building())
+    fprintf(stderr, "Finished tiling %lu virtual textures.\n", _virtualTextures->numTextures());
 }
 
 
@@ -1035,6 +4131,23 @@ void Renderer::drawHUD(int width, int height, float fps)
   glPushMatrix();
   glLoadIdentity();
 
+  // The text goes through the raster position, which only ends up where
+  // this projection puts it if nothing the model was drawn with (a program,
+  // keyframe blending, instancing) is still in effect. Check the first line,
+  // so that an instanced .scene and a plain .obj get the same HUD.
+  GLfloat rasterPos[4];
+  GLint rasterValid = GL_FALSE;
+  glRasterPos2f(10, 100);
+  glGetFloatv(GL_CURRENT_RASTER_POSITION, rasterPos);
+  glGetIntegerv(GL_CURRENT_RASTER_POSITION_VALID, &rasterValid);
+  float expectedX = 9.0f * width / float(width - 2);
+  float expectedY = 99.0f * height / float(height - 2);
+  if (!rasterValid || fabsf(rasterPos[0] - expectedX) > 0.5f ||
+      fabsf(rasterPos[1] - expectedY) > 0.5f) {
+    fprintf(stderr, "HUD drawn at %1.1f, %1.1f instead of %1.1f, %1.1f\n",
+        rasterPos[0], rasterPos[1], expectedX, expectedY);
+  }
+
   float defaultColor[] = { 0.0, 1.0, 1.0, 1.0 };
   glMaterialfv(GL_FRONT_AND_BACK, GL_AMBIENT, defaultColor);
   glMaterialfv(GL_FRONT_AND_BACK, GL_DIFFUSE, defaultColor);
@@ -1042,17 +4155,78 @@ void Renderer::drawHUD(int width, int height, float fps)
 
   char buf[4096];
   if (_model != NULL) {
+    char occlusion[128];
+    if (occlusionCullingActive()) {
+      sprintf(occlusion, "%lu occlusion culled, %lu visible", _occlusionCuller.numOccluded(),
+          _occlusionCuller.numTested() - _occlusionCuller.numOccluded());
+    } else {
+      sprintf(occlusion, "Occlusion culling off");
+    }
     sprintf(buf,
         "%5.2f FPS\n"
+        "%5.2f ms/frame, std dev %4.2f ms\n"
+        "%1.1f KB uploaded\n"
         "%lu faces\n"
         "%lu vertices\n"
         "%lu materials\n"
-        "%lu render groups",
-        fps, _model->faces.size(), _model->v.size(), _model->materials.size(), _renderGroups.size());
-    drawBitmapString(10, 70, GLUT_BITMAP_8_BY_13, buf);
-
-    sprintf(buf, "Frame %0.1f of %ld", _currentTime, _model->numKeyframes());
+        "%lu render groups, %lu drawn\n"
+        "%s\n"
+        "%lu triangles drawn\n"
+        "%lu GL calls\n"
+        "%s transparency",
+        fps, _fps.frameTime(), _fps.frameTimeStdDev(), _bytesUploaded / 1024.0f,
+        _model->faces.size(), _model->v.size(), _model->materials.size(), _renderGroups.size(),
+        _numVisibleGroups, occlusion, _trianglesDrawn, _drawState.calls(),
+        (_transparencyMode == kSortedTransparency) ? "Sorted" : "Weighted blended");
+    drawBitmapString(10, 100, GLUT_BITMAP_8_BY_13, buf);
+
+    MemoryUsage usage = memoryUsage();
+    const float MB = 1024 * 1024;
+    sprintf(buf,
+        "CPU %1.1f MB\n"
+        "  positions %1.1f MB\n"
+        "  normals   %1.1f MB\n"
+        "  texcoords %1.1f MB\n"
+        "  colors    %1.1f MB\n"
+        "  keyframes %1.1f MB\n"
+        "  faces     %1.1f MB\n"
+        "  materials %1.1f MB\n"
+        "  textures  %1.1f MB\n"
+        "GPU %1.1f MB\n"
+        "  buffers   %1.1f MB\n"
+        "  textures  %1.1f MB",
+        usage.cpuTotal() / MB, usage.coords / MB, usage.normals / MB,
+        usage.texCoords / MB, usage.colors / MB, usage.keyframes / MB,
+        usage.faces / MB, usage.materials / MB, usage.texturePixels / MB,
+        usage.gpuTotal() / MB, usage.vertexBuffers / MB, usage.textures / MB);
+    drawBitmapString(10, height - 20, GLUT_BITMAP_8_BY_13, buf);
+
+    if (loadingKeyframes()) {
+      sprintf(buf, "Frame %0.1f of %ld (%lu loaded)", _currentTime, _model->numKeyframes(),
+          _model->numLoadedKeyframes());
+    } else {
+      sprintf(buf, "Frame %0.1f of %ld", _currentTime, _model->numKeyframes());
+    }
     drawRightAlignedBitmapString(width - 10, 10, GLUT_BITMAP_8_BY_13, buf);
+
+    if (_frameCache != NULL) {
+      sprintf(buf, "%lu baked frames (%1.1f of %1.1f MB), %1.0f%% hits",
+          _frameCache->numEntries(), _frameCache->bytesUsed() / MB,
+          _frameCache->budget() / MB, 100.0 * _frameCache->hitRate());
+      drawRightAlignedBitmapString(width - 10, 25, GLUT_BITMAP_8_BY_13, buf);
+    }
+
+    if (_textureLoader != NULL) {
+      sprintf(buf, "%lu of %lu textures loaded", _textureLoader->numTexturesLoaded(),
+          _textureLoader->numTextures());
+      drawRightAlignedBitmapString(width - 10, 40, GLUT_BITMAP_8_BY_13, buf);
+    }
+
+    if (_virtualTextures != NULL) {
+      sprintf(buf, "%lu of %lu tiles resident, %lu loading", _virtualTextures->numResident(),
+          _virtualTextures->capacity(), _virtualTextures->numLoading());
+      drawRightAlignedBitmapString(width - 10, 55, GLUT_BITMAP_8_BY_13, buf);
+    }
   } else {
     sprintf(buf,
         "%5.2f FPS\n"
@@ -1216,7 +4390,17 @@ float Renderer::calculatePlaybackTime()
   if (incr > 1.0)
     incr = 1.0;
   _since = now;
-  return _currentTime + incr;
+
+  if (_frameCache != NULL) {
+    // Only move in whole samples, so that we keep landing on the baked
+    // times, and carry the rest over to the next frame.
+    float step = 1.0f / _frameCache->samplesPerKeyframe();
+    _playbackCarry += incr;
+    incr = floorf(_playbackCarry / step) * step;
+    _playbackCarry -= incr;
+    return clampToLoadedKeyframes(_frameCache->snap(_currentTime + incr));
+  }
+  return clampToLoadedKeyframes(_currentTime + incr);
 }
 
 
@@ -1230,3 +4414,73 @@ void checkGLError(const char *errMsg, const char *okMsg)
   }
 }
 
+
+double preciseTimeInMilliseconds()
+{
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec * 1000.0 + tv.tv_usec / 1000.0;
+}
+
+
+bool hasGLExtension(const char* name)
+{
+  const char* extensions = (const char*)glGetString(GL_EXTENSIONS);
+  if (extensions == NULL)
+    return false;
+
+  size_t length = strlen(name);
+  for (const char* ext = strstr(extensions, name); ext != NULL; ext = strstr(ext + length, name)) {
+    bool atStart = (ext == extensions || ext[-1] == ' ');
+    bool atEnd = (ext[length] == '\0' || ext[length] == ' ');
+    if (atStart && atEnd)
+      return true;
+  }
+  return false;
+}
+
+
+bool sortByDepth(std::vector<unsigned int>& order, const std::vector<float>& depths)
+{
+  // Insertion sort, since the order is usually left over from the last
+  // frame and nearly right. If it isn't, give up and sort properly. Returns
+  // whether the order changed.
+  size_t movesLeft = order.size() * MAX_SORT_MOVES;
+  bool changed = false;
+  for (size_t i = 1; i < order.size(); ++i) {
+    unsigned int item = order[i];
+    float depth = depths[item];
+    size_t j = i;
+    while (j > 0 && depths[order[j - 1]] > depth) {
+      order[j] = order[j - 1];
+      --j;
+      if (--movesLeft == 0) {
+        order[j] = item;
+        std::sort(order.begin(), order.end(), ByDepth(depths));
+        return true;
+      }
+    }
+    order[j] = item;
+    changed = changed || (j != i);
+  }
+  return changed;
+}
+
+
+// The ambient, diffuse, specular and dissolve maps for a material, leaving
+// out any which haven't made it onto the GPU yet.
+void materialTextures(Material* material, RawImage* textures[4])
+{
+  if (material == NULL)
+    return;
+
+  textures[0] = material->mapKa;
+  textures[1] = material->mapKd;
+  textures[2] = material->mapKs;
+  textures[3] = material->mapD;
+  for (unsigned int i = 0; i < 4; ++i) {
+    if (textures[i] != NULL && textures[i]->getTexID() == (unsigned int)-1)
+      textures[i] = NULL;
+  }
+}
+
@@ -10,7 +10,12 @@
 #include "model.h"
 #include "parser.h"
 #include "camera.h"
+#include "culling.h"
 #include "resources.h"
+#include "simplify.h"
+#include "vertexformat.h"
+#include "threadpool.h"
+#include "virtualtexture.h"
 
 
 //
@@ -21,11 +26,16 @@ enum LightType {
   kDirectional, kSpotlight
 };
 
-enum RenderGroupType {
-  kTriangleGroup, kPolygonGroup
+
+// How transparent render groups are drawn: blended from back to front, or
+// all at once in any order into weighted accumulation targets which are
+// then composited over the opaque groups.
+enum TransparencyMode {
+  kSortedTransparency, kWeightedBlendedTransparency
 };
 
 
+
 class FramesPerSecond {
 public:
   FramesPerSecond();
@@ -33,58 +43,478 @@ public:
   void increment();
   float fps() const;
 
+  // The mean and standard deviation of the time between frames over the
+  // last second, in milliseconds.
+  float frameTime() const;
+  float frameTimeStdDev() const;
+
 private:
   int _framesDrawn;
   int _since;
   float _fps;
+
+  double _lastFrame;
+  double _frameTimeSum, _frameTimeSumSq;
+  float _frameTime, _frameTimeStdDev;
+};
+
+
+// A range of vertices within a render group, from start up to but not
+// including end.
+struct VertexRange {
+  size_t start, end;
+
+  VertexRange(size_t iStart, size_t iEnd);
+};
+
+
+// Where a shader program's uniforms and attributes are, so they only need
+// looking up once. Anything the program doesn't use is -1.
+struct ShaderLocations {
+  GLint positionScale, positionBias, normalEncoding;
+  GLint interpolateKeyframes, keyframeFraction;
+  GLint maps[4], hasMaps[4];
+  GLint packedNormal, nextPosition, nextNormal;
+  GLint weightedBlend;
+  GLint instanced, instanceRows[3];
+  GLint virtualMaps[4], tileCache, pageTable, mipTail, virtualLevels, tileCacheLayout;
+  GLint virtualFeedback, virtualIndex, feedbackBias;
+
+  ShaderLocations();
+};
+
+
+// The GL state left behind by the last render group drawn, so that the next
+// one only changes what's different, plus a count of the GL calls made.
+// Render groups drawn one after another with the same program, textures and
+// material then cost little more than their buffer bindings and the draw
+// call itself.
+//
+// Uniform values are remembered for as long as the programs exist, since
+// nothing else sets them. Everything else is forgotten by reset(), which
+// must be called after anything changes GL state behind our back. restore()
+// puts the GL back how the render groups found it: no arrays enabled, no
+// textures enabled, no buffers bound and no program in use.
+class DrawState {
+public:
+  DrawState();
+
+  void reset();
+  void restore();
+
+  size_t calls() const;
+  void resetCalls();
+  void countCalls(size_t n);
+
+  // Whether groups are being drawn into the weighted blended transparency
+  // targets, which the shaders need to know.
+  bool weightedBlend() const;
+  void setWeightedBlend(bool enabled);
+
+  // Whether groups are being drawn into the virtual texture feedback pass.
+  bool virtualFeedback() const;
+  void setVirtualFeedback(bool enabled);
+
+  // Makes the program current and returns its locations.
+  const ShaderLocations& useProgram(GLuint program);
+
+  void uniform1i(GLint loc, GLint value);
+  void uniform1f(GLint loc, GLfloat value);
+  void uniform3fv(GLint loc, const GLfloat* value);
+
+  void bindBuffer(GLenum target, GLuint buffer);
+
+  // Enables GL_TEXTURE_2D on the unit and binds the texture, or disables the
+  // unit if texture is 0. Units 0 to 3 are for the material's maps and 4 to 6
+  // for the virtual texture cache and a virtual texture's page table and mip
+  // tail.
+  void bindTexture(unsigned int unit, GLuint texture);
+  void texCoordArray(unsigned int unit, bool enabled);
+  void texCoordPointer(unsigned int unit, GLenum type, GLsizei stride, const GLvoid* offset);
+
+  void clientState(GLenum array, bool enabled);
+  void vertexAttribArray(GLint loc, bool enabled);
+
+  // Sets the ambient, diffuse and specular colours from the material, or to
+  // white if it's NULL.
+  void material(const Material* material);
+  void shininess(float value);
+
+private:
+  enum { kVertexArray, kNormalArray, kColorArray, kNumClientStates };
+  enum { kMaxAttribs = 16 };
+  enum { kNumTextureUnits = 7 };
+
+  int clientStateIndex(GLenum array) const;
+  void activeTexture(unsigned int unit);
+  void clientActiveTexture(unsigned int unit);
+
+  // Records a uniform's new value for the current program and returns true
+  // if it's different from the last one set.
+  bool uniformChanged(GLint loc, const vh::Vector3& value);
+
+private:
+  size_t _calls;
+  bool _weightedBlend;
+  bool _virtualFeedback;
+
+  std::map<GLuint, ShaderLocations> _locations;
+  std::map<std::pair<GLuint, GLint>, vh::Vector3> _uniforms;
+
+  // Each of these is -1 when we don't know its state.
+  GLint _program;
+  GLint _arrayBuffer;
+  GLint _elementBuffer;
+  int _activeTexture;
+  int _clientActiveTexture;
+  GLint _textures[kNumTextureUnits];
+  int _texCoordArrays[4];
+  int _clientStates[kNumClientStates];
+  int _attribArrays[kMaxAttribs];
+
+  bool _materialKnown;
+  const Material* _material;
+  float _shininess;
 };
 
 
 class RenderGroup {
 public:
-  RenderGroup(Material* iMaterial, RenderGroupType iType, GLuint iShaderProgramID);
+  RenderGroup(Material* iMaterial, GLuint iShaderProgramID,
+      const VertexFormat& iFormat);
 
   Material* getMaterial() const;
 
   void add(Model* model, Face* face);
   size_t size() const;
 
-  size_t floatsPerVertex() const;
+  size_t animatedBytesPerVertex() const;
+  size_t staticBytesPerVertex() const;
   void flipNormals();
 
-  void prepare();
-  void render(float time);
+  size_t cpuBytes() const;
+  size_t gpuBytes() const;
+  size_t keyframeBytes(size_t numKeyframes) const;
+
+  // Works out which ranges of vertices have positions or normals that change
+  // between keyframes; only those get refilled as the time changes. The
+  // flags are indexed like the model's v and vn arrays. Call before
+  // prepare(), or afterwards followed by keyframesChanged().
+  void findDirtyRanges(const std::vector<bool>& animatedCoords,
+      const std::vector<bool>& animatedNormals, bool animatedTexCoordsOrColors);
+  size_t numDirtyVertices() const;
+
+  // Call when the keyframes have changed after prepare(). Works out the
+  // position scale again, either from the group's own coords or to fit the
+  // given box, and has every buffer refilled in full.
+  void keyframesChanged();
+  void keyframesChanged(const vh::Vector3& low, const vh::Vector3& high);
+
+  // Sets up numBuffers position and normal buffers, so that one can be
+  // filled while the GPU is still drawing from the others, plus a single
+  // buffer for the tex coords and colors. With persistent == true the
+  // position and normal buffers are mapped once, here, and stay mapped.
+  void prepare(size_t numBuffers, bool persistent);
+
+  // Filling a position and normal buffer for a new time: pick the buffer to
+  // fill (the least recently drawn one, never the current one), make sure the
+  // GPU has finished with it, map it, fill it, unmap it and then switch to
+  // it. A buffer which has been filled before only needs its dirty ranges
+  // rewriting. Only fillBuffer() is safe to call from a thread other than the
+  // GL thread. It returns the number of bytes written.
+  bool isCurrent(float time) const;
+  size_t nextBuffer() const;
+  size_t lastDrawn(size_t buffer) const;
+  bool isFilled(size_t buffer) const;
+  char* mapBuffer(size_t buffer);
+  void unmapBuffer(size_t buffer);
+  size_t fillBuffer(float time, char* vertexBuffer, bool everything) const;
+  void useBuffer(size_t buffer, float time);
+
+  // Refills the tex coord and color buffer if they're animated and the time
+  // has changed. Returns the number of bytes uploaded.
+  size_t updateStaticBuffer(float time);
+
+  // Records that the current buffer was drawn from in the given frame.
+  void markDrawn(size_t frame);
+
+  // Copies the current position and normal buffer into a new buffer on the
+  // GPU and returns its ID, or 0 if that wasn't possible. The copy belongs to
+  // the caller. useBakedBuffer() draws from such a copy until the next
+  // useBuffer(), without disturbing the ring of buffers.
+  GLuint bakeBuffer() const;
+  void useBakedBuffer(GLuint buffer, float time);
+
+  // Allocates a buffer holding the positions and normals for every keyframe
+  // so that they can be interpolated in the vertex shader. Returns false if
+  // there isn't enough GPU memory, in which case the group carries on
+  // interpolating on the CPU. Each keyframe must then be uploaded once the
+  // group has been prepared.
+  bool prepareKeyframes(size_t numKeyframes);
+  void uploadKeyframe(size_t keyframe, const float* coords, const float* normals);
+  bool hasGPUKeyframes() const;
+
+  // Orders groups so that ones which need the same shader program, then the
+  // same textures, then the same material end up next to each other.
+  bool drawsBefore(const RenderGroup& other) const;
+
+  // Grows the box to take in the group's coords from the given array, which
+  // holds 3 floats for every coord in the model.
+  void growBounds(const float* coords, vh::Vector3& low, vh::Vector3& high) const;
+
+  // Simplified versions of the group, made before prepare() from the coords
+  // in the given array (as for growBounds). prepare() uploads them after the
+  // full set of triangles, which is level 0. detailHash() identifies
+  // everything the levels depend on, so that they can be cached.
+  uint64_t detailHash(const float* coords) const;
+  void buildDetailLevels(const float* coords, size_t maxLevels);
+  const std::vector<DetailLevel>& detailLevels() const;
+  void setDetailLevels(const std::vector<DetailLevel>& levels);
+
+  // Picks which level render(), renderPoints() and renderLines() draw.
+  size_t numDetailLevels() const;
+  float detailError(size_t level) const;
+  void setDetailLevel(size_t level);
+  size_t numTrianglesDrawn() const;
+
+  // Back to front sorting of the group's triangles, for transparency. Call
+  // prepareTriangleSort() before prepare(), with coords as for growBounds.
+  // sortTriangles() orders the triangles for a view where the depth of a
+  // point p is dot(depthRow, (p, 1)) and is safe to call from any thread;
+  // uploadSortedTriangles() then hands the new order to GL, returning the
+  // number of bytes uploaded. Level 0 is drawn in the sorted order.
+  void prepareTriangleSort(const float* coords);
+  bool sortsTriangles() const;
+  void sortTriangles(const vh::Vector4& depthRow);
+  size_t uploadSortedTriangles();
+
+  // Draws the group once for each of the given transforms, which must
+  // outlive the group. The buffer holds the top three rows of each transform
+  // for instanced drawing; if it's 0 the instances are drawn one at a time.
+  void setInstances(const std::vector<vh::Matrix4>* instances, GLuint buffer);
+  bool instanced() const;
+  size_t numInstances() const;
+  const std::vector<vh::Matrix4>* instances() const;
+
+  // Draws whichever of the material's maps are the given virtual texture's
+  // image from the cache, once it's ready. Until then they aren't drawn.
+  void setVirtualTexture(VirtualTextureCache* cache, size_t index);
+
+  void render(float time, DrawState& state);
   void renderPoints(float time);
   void renderLines(float time);
 
 private:
-  void setTime(float time);
-  void setupShaders();
+  void packAnimatedVertex(size_t index, const vh::Vector3& coord, const vh::Vector3& normal,
+      char* dst) const;
+  size_t fillStaticBuffer(float time);
+  void setupShaders(DrawState& state, const ShaderLocations& locations, float keyframeFraction);
+  bool virtualMap(unsigned int map) const;
+  bool usesVirtualTexture() const;
+  GLenum positionType() const;
+  void setupVertexPointer(GLsizei stride, size_t offset);
+  void setupNormalPointer(DrawState& state, const ShaderLocations& locations,
+      GLsizei stride, size_t offset);
+  void setupNormalAttribute(GLint loc, GLsizei stride, size_t offset);
+  void setupFixedFunctionPositions(float time);
+  void drawElements();
+  void drawInstances(DrawState& state, const ShaderLocations& locations);
+  void drawFixedFunctionElements();
+  void keyframesAt(float time, size_t& left, size_t& right, float& fraction) const;
+  void calculatePositionScale();
+  void setPositionScale(const vh::Vector3& low, const vh::Vector3& high);
 
 private:
   Material* _material;
-  RenderGroupType _type;
   size_t _size;
   bool _hasColors;
   float _currentTime;
   bool _flipNormals;
 
-  // Coords are interleaved in groups of up to 12 elements:
-  // - First 3 elements in each group are vertex x, y, z.
-  // - Next 2 are texture u and v (if _hasTexCoords == true).
-  // - Next 4 are normal x, y, z and w (if _hasNormalCoords == true).
-  // - Final 3 are color r, g and b (if _hasColors == true).
-  std::vector<Curve3*> _coords;
-  std::vector<Curve2*> _texCoords;
-  std::vector<Curve3*> _normals;
-  std::vector<Curve4*> _colors;
-  GLuint _bufferID;
+  // Positions and normals are interleaved in one buffer and tex coords and
+  // colors (if _hasColors == true) in another, each stored as described by
+  // _format.
+  //
+  // Packed positions are stored relative to the group's bounding box; the
+  // shaders multiply by _positionScale and add _positionBias to get back to
+  // model space. _packScale is the inverse of _positionScale.
+  VertexFormat _format;
+  vh::Vector3 _positionScale;
+  vh::Vector3 _positionBias;
+  vh::Vector3 _packScale;
+
+  // The vectors below hold the index into the model's v, vt, vn and colors
+  // arrays for each vertex in the group.
+  Model* _model;
+  std::vector<int> _coords;
+  std::vector<int> _texCoords;
+  std::vector<int> _normals;
+  std::vector<int> _colors;
   GLuint _indexesID;
+  size_t _numIndexes;
+
+  // The simplified levels. Their indexes are only kept until prepare() has
+  // put them in the index buffer; after that, _levelRanges says where each
+  // level's indexes are, starting with level 0.
+  std::vector<DetailLevel> _detailLevels;
+  std::vector<VertexRange> _levelRanges;
+  size_t _detailLevel;
+
+  // For sorting: the center of each triangle (in the first keyframe), its
+  // depth in the last view sorted for, the order to draw the triangles in
+  // and whether that's changed since it was last uploaded. The sorted
+  // indexes go at the end of the index buffer, in _sortedRange.
+  std::vector<vh::Vector3> _triangleCenters;
+  std::vector<float> _triangleDepths;
+  std::vector<unsigned int> _triangleOrder;
+  bool _orderChanged;
+  VertexRange _sortedRange;
+
+  // The ring of position and normal buffers. _bufferID is the one we're
+  // drawing from. Outside of _dirtyRanges, every buffer which has been filled
+  // once holds the same data.
+  GLuint _bufferID;
+  size_t _currentBuffer;
+  std::vector<GLuint> _bufferIDs;
+  std::vector<char*> _mappedBuffers;
+  std::vector<size_t> _lastDrawn;
+  std::vector<bool> _bufferFilled;
+  std::vector<VertexRange> _dirtyRanges;
+
+  // Tex coords and colors. Only refilled when they're animated.
+  GLuint _staticBufferID;
+  bool _staticAnimated;
+  float _staticTime;
+
+  // Every keyframe's positions and normals, one block of _size vertices per
+  // keyframe, laid out as described by VertexFormat::animatedBytesPerVertex.
+  GLuint _keyframeBufferID;
+  size_t _numKeyframes;
+
+  // The transforms to draw the group with, or NULL to draw it just once.
+  const std::vector<vh::Matrix4>* _instances;
+  GLuint _instanceBufferID;
+
+  // The cache holding the group's virtual texture, or NULL if it hasn't got
+  // one.
+  VirtualTextureCache* _virtualTextures;
+  size_t _virtualIndex;
 
   GLuint _shaderProgramID;
 };
 
 
+// Vertex buffers holding the interpolated positions and normals for render
+// groups at particular playback times, so that an animation loop can switch
+// buffers instead of refilling them once it's been round once.
+//
+// Playback times are snapped to a fixed number of samples per keyframe so
+// that each loop visits the same ones. Each entry is one render group at one
+// sample; when the budget is used up, the least recently used entries are
+// deleted.
+class FrameCache {
+public:
+  FrameCache(size_t budget, size_t samplesPerKeyframe);
+  ~FrameCache();
+
+  size_t samplesPerKeyframe() const;
+
+  // The nearest time to the given one that falls on a sample.
+  float snap(float time) const;
+
+  // Returns the baked buffer for a group at a time, or 0 if there isn't one
+  // (including when the time isn't on a sample). find() counts towards the
+  // hit rate; contains() doesn't. Both count as a use of the entry.
+  GLuint find(const RenderGroup* group, float time);
+  bool contains(const RenderGroup* group, float time);
+
+  // Bakes a copy of the group's current buffer for the given time, unless
+  // it's already baked or isn't on a sample.
+  void bake(RenderGroup* group, float time);
+
+  // Deletes everything, e.g. because the keyframes have changed.
+  void clear();
+
+  size_t budget() const;
+  size_t bytesUsed() const;
+  size_t numEntries() const;
+  float hitRate() const;
+
+private:
+  typedef std::pair<long, const RenderGroup*> Key;
+
+  struct Entry {
+    GLuint buffer;
+    size_t bytes;
+    std::list<Key>::iterator lru;
+  };
+
+  long sampleAt(float time) const;
+  Entry* lookup(const RenderGroup* group, float time);
+  void remove(std::map<Key, Entry>::iterator entry);
+
+private:
+  size_t _budget;
+  size_t _samplesPerKeyframe;
+  size_t _bytesUsed;
+  size_t _hits, _misses;
+  std::map<Key, Entry> _entries;
+  std::list<Key> _lru; // Most recently used first.
+};
+
+
+// Conservative occlusion culling with hardware occlusion queries. Once the
+// opaque render groups have been drawn, the bounding box of each group in
+// the view frustum is drawn inside a query, without touching the colour or
+// depth buffers. The results are picked up in later frames as they arrive,
+// so we never wait for the GPU. A group is only skipped once its box has
+// been hidden for several results in a row, and it's drawn again as soon as
+// a result says any of it showed.
+class OcclusionCuller {
+public:
+  OcclusionCuller();
+  ~OcclusionCuller();
+
+  // Makes the boxes and queries for a set of render groups, given their
+  // bounding boxes. Returns false if occlusion queries aren't supported.
+  bool prepare(const std::vector<vh::Vector3>& lows, const std::vector<vh::Vector3>& highs);
+  void clear();
+  bool prepared() const;
+
+  // Collects any query results which have arrived, then clears visible[i]
+  // for each group which has been hidden for long enough. Groups outside
+  // the frustum (i.e. not in visible) or reaching its near plane, where
+  // their boxes would be clipped, are never counted as hidden.
+  void cull(const Frustum& frustum, std::vector<bool>& visible);
+
+  // Draws the boxes for the groups which were in the frustum when cull()
+  // was called, except those which still have a query in flight. The
+  // current modelview & projection matrices are used, and the depth buffer
+  // should hold whatever can hide them. Leaves no program or buffers bound.
+  void query();
+
+  size_t numOccluded() const;
+  size_t numTested() const;
+
+private:
+  // The padded boxes, also stored as 8 corners each in _boxBuffer, with
+  // the 12 triangles for each in _boxIndexes.
+  std::vector<vh::Vector3> _lows, _highs;
+  GLuint _boxBuffer, _boxIndexes;
+  std::vector<GLuint> _queries;
+  std::vector<bool> _pending;
+  std::vector<unsigned int> _hiddenFor; // Consecutive results with nothing drawn.
+  std::vector<bool> _toQuery;
+  size_t _numOccluded, _numTested;
+};
+
+
+class KeyframeLoader;
+class PlaybackJob;
+class SortJob;
+class TextureLoader;
+
+
 class Renderer {
 public:
   Renderer(ResourceManager* resources, Model* model, Camera* camera,
@@ -98,6 +528,10 @@ public:
   void toggleDrawPoints();
   void toggleDrawLines();
   void toggleHeadlightType();
+  void toggleFrustumCulling();
+  void toggleOcclusionCulling();
+  void toggleDetailLevels();
+  void toggleTransparencyMode();
   void printGLInfo();
 
   void prepare();
@@ -112,19 +546,133 @@ public:
 
   void flipNormals();
 
+  void setCompressKeyframes(bool compress, bool deltaCoding);
+
+  // Factor the keyframes into a mean shape plus basis shapes instead of
+  // quantizing them. See Model::factorKeyframes for the parameters; with
+  // both 0 (the default) the keyframes aren't factored.
+  void setPCAKeyframes(size_t numBases, float errorTolerance, const std::string& cacheFile);
+  void setVertexFormat(const VertexFormat& format);
+
+  // Interpolate keyframes in the vertex shader instead of on the CPU, if
+  // they'll fit in GPU memory. A memory budget of 0 means use whatever the
+  // driver says is free.
+  void setGPUKeyframes(bool enabled, size_t memoryBudget);
+
+  // Interpolate the next frame on a worker thread while the current one is
+  // drawing, when playing an animation on the CPU.
+  void setAsyncPlayback(bool enabled);
+
+  // Keep up to budget bytes of interpolated frames on the GPU for reuse when
+  // the animation loops (see FrameCache). Playback then steps through a
+  // fixed set of times. A budget of 0 (the default) turns this off.
+  void setFrameCache(size_t budget);
+
+  // Draw each render group using the simplest of its detail levels whose
+  // error, projected onto the screen, is at most pixelError pixels. The
+  // levels are made from the first keyframe during prepare() and kept in
+  // cacheFile (if it isn't empty) for next time. A pixelError of 0 (the
+  // default) means always draw everything.
+  void setDetailLevels(float pixelError, const std::string& cacheFile);
+
+  // Transparent render groups are always drawn from back to front. This
+  // sorts the triangles within each of them as well, on a worker thread,
+  // using the view from the frame before. Sorted groups are always drawn
+  // in full detail.
+  void setSortTriangles(bool enabled);
+
+  // Weighted blended transparency needs floating point render targets; if
+  // they aren't available, transparency stays sorted.
+  void setTransparencyMode(TransparencyMode mode);
+
+  // Skip render groups hidden behind others, using occlusion queries from
+  // earlier frames. A group can show up a frame late when it comes into
+  // view. Off by default.
+  void setOcclusionCulling(bool enabled);
+
+  // Hands over a loader which is still filling in the model's keyframes.
+  // Until it finishes, playback stops at the last keyframe loaded so far;
+  // anything which needs every keyframe (packing, compression, GPU
+  // keyframes, background playback) gets set up once it has. Call after
+  // prepare(). The renderer deletes the loader when it's done with it.
+  void setKeyframeLoader(KeyframeLoader* loader);
+  bool loadingKeyframes() const;
+
+  // Draw diffuse maps which are bigger than the maximum texture size (or
+  // 4096, if there isn't one) as virtual textures, wherever else their
+  // images are used too, from a cache of about cacheBytes of tiles. The
+  // tiled pyramids go in dir. A cacheBytes of 0 (the default) turns this
+  // off, so that big textures get downsampled instead.
+  void setVirtualTextures(size_t cacheBytes, const std::string& dir);
+
+  // Textures are uploaded a few mip levels per frame once prepare() has
+  // started them loading. True until the last level is in and every
+  // virtual texture has been tiled.
+  bool loadingTextures() const;
+
+  // The model's memory usage plus the render groups, buffers and textures
+  // the renderer has created for it.
+  MemoryUsage memoryUsage() const;
+  void printMemoryReport(FILE* out) const;
+
+  // The box around everything drawn, over all keyframes. This is the
+  // model's own box unless it has parts, in which case it takes in every
+  // instance of them.
+  void modelBounds(vh::Vector3& low, vh::Vector3& high) const;
+
 private:
   void setupCamera(int width, int height, const vh::Vector3& low, const vh::Vector3& high);
   void transformToCamera();
   void prepareModel();
+  void countAnimatedPoints();
+  void packKeyframes();
+  void prepareInstances();
   void prepareRenderGroups();
+  void sortRenderGroups(std::vector<RenderGroup*>& groups);
+  void calculateGroupBounds();
+  void cullRenderGroups(const float* projection, const float* modelview);
+  bool occlusionCullingActive() const;
+  void prepareDetailLevels(const float* coords);
+  void chooseDetailLevels(const float* projection, const float* modelview, int height);
+  void prepareTransparency(const float* coords);
+  void sortTransparentGroups(const float* modelview);
+  void startSortJob(const float* modelview);
+  void finishSortJob();
+  bool prepareWeightedBlend(int width, int height);
+  bool beginWeightedBlend(int width, int height);
+  void endWeightedBlend();
+  size_t countRenderGroups();
   void prepareMaterials();
   void prepareShaders();
+  void prepareGPUKeyframes();
+  void uploadGPUKeyframes();
+  size_t availableGPUMemory();
+  void prepareVertexBuffers();
+  void preparePlayback();
+
+  void updateKeyframeLoader();
+  void finishLoadingKeyframes();
+  float wrapTime(float time);
+  float clampToLoadedKeyframes(float time);
+
+  void findDirtyRanges();
+  void updateRenderGroups(float time);
+  bool useBakedFrame(RenderGroup* group, float time);
+  void bakeFrame(RenderGroup* group, float time);
+  void startPlaybackJob(float time);
+  bool finishPlaybackJob();
+  void waitForFrame(size_t frame);
+  void endFrame();
 
   void drawModel(Model* theModel, std::list<RenderGroup*>& groups);
   void drawDefaultModel();
 
   void loadTextures(std::list<RenderGroup*>& groups);
-  void loadTexture(RawImage* tex, bool isMatte);
+  void updateTextureLoader();
+  void updateVirtualTextures();
+  bool prepareFeedback(int width, int height);
+  void drawFeedback(int width, int height);
+  void readFeedback();
   void headlight(GLenum light, const vh::Vector4& color);
   void drawHUD(int width, int height, float fps);
   void drawBitmapString(float x, float y, void* font, char* str);
@@ -150,6 +698,13 @@ private:
   std::list<RenderGroup*> _renderGroups;
   size_t _transparentGroupsStart;
 
+  // A buffer of instance transforms for each of the model's parts (or 0 for
+  // each, if instanced drawing isn't supported), and the box around every
+  // render group with all of its instances.
+  std::vector<GLuint> _instanceBuffers;
+  vh::Vector3 _drawnLow;
+  vh::Vector3 _drawnHigh;
+
   RawImage* _currentMapKa;
   RawImage* _currentMapKd;
   RawImage* _currentMapKs;
@@ -163,6 +718,117 @@ private:
   float _currentTime;
   bool _playing;
   int _since;
+
+  bool _compressKeyframes;
+  bool _deltaCodeKeyframes;
+  size_t _pcaBases;
+  float _pcaErrorTolerance;
+  std::string _pcaCachePath;
+  VertexFormat _vertexFormat;
+  bool _gpuKeyframes;
+  size_t _gpuMemoryBudget;
+
+  // Vertex buffers per render group and whether they're persistently mapped.
+  // Each frame ends with a fence, so we can tell when the GPU has finished
+  // with the buffers drawn in it; _frameFences holds the fences for the most
+  // recent frames, indexed by frame number modulo its size.
+  size_t _numVertexBuffers;
+  bool _persistentBuffers;
+  std::vector<GLsync> _frameFences;
+  size_t _frame;
+  size_t _completedFrame;
+
+  bool _asyncPlayback;
+  ThreadPool* _workers;
+  PlaybackJob* _playbackJob;
+  bool _playbackJobRunning;
+  float _playbackJobFrom;
+
+  // While keyframes are loading: the loader, and the box around the
+  // keyframes loaded so far which packed positions are fitted to.
+  KeyframeLoader* _keyframeLoader;
+  size_t _numLoadedKeyframes;
+  vh::Vector3 _loadedLow;
+  vh::Vector3 _loadedHigh;
+
+  // Builds and uploads the textures' mip chains; deleted once they're all in.
+  TextureLoader* _textureLoader;
+
+  // Virtual textures, and the framebuffer their feedback pass is drawn into
+  // at a fraction of the window size. With pixel buffers the feedback is
+  // read back through one of a pair of them and looked at a frame later, so
+  // we don't wait for it.
+  size_t _virtualTextureBudget;
+  std::string _virtualTextureDir;
+  VirtualTextureCache* _virtualTextures;
+  GLuint _feedbackFramebuffer;
+  GLuint _feedbackRenderbuffers[2];
+  int _feedbackWidth, _feedbackHeight;
+  GLuint _feedbackPixelBuffers[2];
+  size_t _feedbackPixels[2]; // Pixels read into each buffer, if any.
+  size_t _feedbackFrame;
+  std::vector<unsigned char> _feedback;
+
+  // Baked frames for looping playback, and how far playback has got towards
+  // the next sample.
+  size_t _frameCacheBudget;
+  FrameCache* _frameCache;
+  float _playbackCarry;
+
+  // Bytes written to vertex buffers for the frame being drawn.
+  size_t _bytesUploaded;
+
+  // The GL state while drawing the render groups, and the number of GL calls
+  // it took in the frame being drawn.
+  DrawState _drawState;
+
+  // A BVH over the render groups' bounding boxes (which take in every
+  // keyframe), and which groups were inside the view frustum this frame,
+  // in the same order as _renderGroups.
+  bool _frustumCulling;
+  BVH _groupBVH;
+  std::vector<bool> _visibleGroups;
+  size_t _numVisibleGroups;
+  Frustum _frustum;
+
+  // Occlusion culling, which takes groups out of _visibleGroups after the
+  // frustum has had its go.
+  bool _occlusionCulling;
+  OcclusionCuller _occlusionCuller;
+
+  // The bounding sphere around each render group's box, and the detail
+  // level settings. _trianglesDrawn counts the triangles in the frame being
+  // drawn.
+  std::vector<vh::Vector3> _groupCenters;
+  std::vector<float> _groupRadii;
+  float _pixelError;
+  std::string _detailCachePath;
+  bool _useDetailLevels;
+  size_t _trianglesDrawn;
+
+  // The transparent render groups (the end of _renderGroups) and the order
+  // to draw them in, back to front, which is updated every frame. The
+  // triangles within them are sorted by _sortJob when _sortTriangles is on.
+  std::vector<RenderGroup*> _transparentGroups;
+  std::vector<unsigned int> _transparentOrder;
+  std::vector<float> _transparentDepths;
+  bool _sortTriangles;
+  SortJob* _sortJob;
+  bool _sortJobRunning;
+
+  // Weighted blended transparency: a framebuffer with the accumulation and
+  // weight textures plus a copy of the opaque groups' depth, all sized to
+  // match the window, and the program which composites them.
+  TransparencyMode _transparencyMode;
+  GLuint _compositeProgram;
+  GLuint _blendFramebuffer;
+  GLuint _blendTextures[2];
+  GLuint _blendDepthTexture;
+  int _blendWidth, _blendHeight;
+  GLint _previousFramebuffer;
+
+  // Only the render group, vertex buffer and texture fields are used.
+  MemoryUsage _memory;
 };
 
 
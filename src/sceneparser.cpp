@@ -0,0 +1,305 @@
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <vector>
+
+#include "model.h"
+#include "parser.h"
+#include "sceneparser.h"
+
+
+//
+// CONSTANTS
+//
+
+const unsigned int kSceneMaxLineLen = 4096;
+
+
+//
+// INTERNAL TYPES
+//
+
+// A model declared by a scene file, along with everywhere it's placed.
+struct SceneModel {
+  std::string name;
+  std::string path;
+  std::vector<vh::Matrix4> instances;
+};
+
+
+// Passes everything parsed from one of the scene's models on to the real
+// callbacks, renumbering the indexes in each face so that they refer to the
+// combined arrays and tagging it with the model's part number.
+class ScenePartCallbacks : public ParserCallbacks {
+public:
+  ScenePartCallbacks(ParserCallbacks* target) :
+    _target(target),
+    _part(-1),
+    _prefix(),
+    _numCoords(0), _numTexCoords(0), _numNormals(0), _numColors(0),
+    _baseCoord(0), _baseTexCoord(0), _baseNormal(0), _baseColor(0)
+  {}
+
+  void beginPart(int part, const std::string& name)
+  {
+    _part = part;
+    _prefix = name + "/";
+    _baseCoord = _numCoords;
+    _baseTexCoord = _numTexCoords;
+    _baseNormal = _numNormals;
+    _baseColor = _numColors;
+  }
+
+  size_t numCoords() const { return _numCoords; }
+
+  // The scene as a whole is a single model as far as the target is concerned.
+  virtual void beginModel(const char* path) {}
+  virtual void endModel() {}
+
+  virtual void coordParsed(const vh::Vector3& coord)
+  {
+    _target->coordParsed(coord);
+    ++_numCoords;
+  }
+
+  virtual void texCoordParsed(const vh::Vector2& coord)
+  {
+    _target->texCoordParsed(coord);
+    ++_numTexCoords;
+  }
+
+  virtual void normalParsed(const vh::Vector3& normal)
+  {
+    _target->normalParsed(normal);
+    ++_numNormals;
+  }
+
+  virtual void colorParsed(const vh::Vector4& color)
+  {
+    _target->colorParsed(color);
+    ++_numColors;
+  }
+
+  virtual void faceParsed(Face* face)
+  {
+    for (unsigned int i = 0; i < face->size(); ++i) {
+      Vertex& vert = (*face)[i];
+      if (vert.v >= 0)
+        vert.v += _baseCoord;
+      if (vert.vt >= 0)
+        vert.vt += _baseTexCoord;
+      if (vert.vn >= 0)
+        vert.vn += _baseNormal;
+      if (vert.c >= 0)
+        vert.c += _baseColor;
+    }
+    face->part = _part;
+    _target->faceParsed(face);
+  }
+
+  // Material names only have to be unique within a single model file.
+  virtual void materialParsed(const std::string& name, Material* material)
+  {
+    _target->materialParsed(_prefix + name, material);
+  }
+
+  virtual void textureParsed(RawImage* texture)
+  {
+    _target->textureParsed(texture);
+  }
+
+  virtual void partParsed(const std::string& name, const std::vector<vh::Matrix4>& instances)
+  {
+    throw ParseException("Scene files can't include other scene files.");
+  }
+
+private:
+  ParserCallbacks* _target;
+  int _part;
+  std::string _prefix;
+
+  size_t _numCoords, _numTexCoords, _numNormals, _numColors;
+  size_t _baseCoord, _baseTexCoord, _baseNormal, _baseColor;
+};
+
+
+//
+// FUNCTIONS
+//
+
+// Splits a line into whitespace separated words, stopping at a comment.
+void sceneSplitLine(char* line, std::vector<char*>& words)
+{
+  char* comment = strchr(line, '#');
+  if (comment != NULL)
+    *comment = '\0';
+
+  words.clear();
+  char* state = NULL;
+  for (char* word = strtok_r(line, " \t\r\n", &state); word != NULL;
+       word = strtok_r(NULL, " \t\r\n", &state)) {
+    words.push_back(word);
+  }
+}
+
+
+bool sceneIsNumber(const char* word)
+{
+  char* end = NULL;
+  strtod(word, &end);
+  return end != word && *end == '\0';
+}
+
+
+float sceneParseNumber(const std::vector<char*>& words, size_t index) throw(ParseException)
+{
+  if (index >= words.size())
+    throw ParseException("Expected a number at the end of the line.");
+  if (!sceneIsNumber(words[index]))
+    throw ParseException("Expected a number but got %s", words[index]);
+  return float(strtod(words[index], NULL));
+}
+
+
+void sceneParseModel(const std::vector<char*>& words, const std::string& baseDir,
+    std::map<std::string, size_t>& modelIndexes, std::vector<SceneModel>& models)
+  throw(ParseException)
+{
+  if (words.size() != 3)
+    throw ParseException("Expected 'model NAME PATH'.");
+
+  std::string name = words[1];
+  if (modelIndexes.find(name) != modelIndexes.end())
+    throw ParseException("Model %s has already been declared.", words[1]);
+
+  SceneModel model;
+  model.name = name;
+  model.path = words[2];
+  if (model.path[0] != '/' && !baseDir.empty())
+    model.path = baseDir + "/" + model.path;
+
+  modelIndexes[name] = models.size();
+  models.push_back(model);
+}
+
+
+void sceneParseInstance(const std::vector<char*>& words,
+    const std::map<std::string, size_t>& modelIndexes, std::vector<SceneModel>& models)
+  throw(ParseException)
+{
+  if (words.size() < 2)
+    throw ParseException("Expected 'instance NAME' followed by any transforms.");
+
+  std::map<std::string, size_t>::const_iterator model = modelIndexes.find(words[1]);
+  if (model == modelIndexes.end())
+    throw ParseException("Unknown model %s; models must be declared before they're used.", words[1]);
+
+  // Each transform is applied after the ones before it, so it goes on the
+  // left.
+  vh::Matrix4 transform = vh::Matrix4::identity();
+  size_t i = 2;
+  while (i < words.size()) {
+    const char* op = words[i++];
+    if (strcmp(op, "translate") == 0) {
+      float x = sceneParseNumber(words, i++);
+      float y = sceneParseNumber(words, i++);
+      float z = sceneParseNumber(words, i++);
+      transform = vh::Matrix4::translation(x, y, z) * transform;
+    } else if (strcmp(op, "rotate") == 0) {
+      float x = sceneParseNumber(words, i++);
+      float y = sceneParseNumber(words, i++);
+      float z = sceneParseNumber(words, i++);
+      transform = vh::Matrix4::rotationZ(z) * vh::Matrix4::rotationY(y) *
+          vh::Matrix4::rotationX(x) * transform;
+    } else if (strcmp(op, "scale") == 0) {
+      float x = sceneParseNumber(words, i++);
+      float y = x, z = x;
+      if (i < words.size() && sceneIsNumber(words[i])) {
+        y = sceneParseNumber(words, i++);
+        z = sceneParseNumber(words, i++);
+      }
+      transform = vh::Matrix4::scale(x, y, z, 1) * transform;
+    } else {
+      throw ParseException("Unknown transform %s", op);
+    }
+  }
+
+  models[model->second].instances.push_back(transform);
+}
+
+
+//
+// PUBLIC FUNCTIONS
+//
+
+void loadScene(ParserCallbacks* callbacks, const char* path, ResourceManager* resources,
+    const LoadOptions& options)
+  throw(ParseException)
+{
+  FILE* f = fopen(path, "r");
+  if (f == NULL)
+    throw ParseException("Unable to open file %s.\n", path);
+
+  const char* slash = strrchr(path, '/');
+  std::string baseDir = (slash != NULL) ? std::string(path, slash - path) : std::string();
+  if (slash == path)
+    baseDir = "/";
+
+  char line[kSceneMaxLineLen];
+  unsigned int lineNo = 0;
+  std::vector<char*> words;
+  std::map<std::string, size_t> modelIndexes;
+  std::vector<SceneModel> models;
+  try {
+    while (fgets(line, kSceneMaxLineLen, f) != NULL) {
+      ++lineNo;
+      sceneSplitLine(line, words);
+      if (words.empty())
+        continue;
+
+      if (strcmp(words[0], "model") == 0)
+        sceneParseModel(words, baseDir, modelIndexes, models);
+      else if (strcmp(words[0], "instance") == 0)
+        sceneParseInstance(words, modelIndexes, models);
+      else
+        throw ParseException("Unknown line type %s", words[0]);
+    }
+    if (ferror(f))
+      throw ParseException("Error reading from file: %s", strerror(errno));
+  } catch (ParseException& ex) {
+    fclose(f);
+    throw ParseException("[%s: line %d] %s\n", path, lineNo, ex.what());
+  }
+  fclose(f);
+
+  // Load each model once, no matter how many times it's used. Keyframes
+  // after the first only need the vertex data from each model, which comes
+  // in the same order as long as the scene file lists the same models.
+  LoadOptions modelOptions(options);
+  modelOptions.expectedCoords = 0;
+
+  ScenePartCallbacks partCallbacks(callbacks);
+  int part = 0;
+  for (size_t i = 0; i < models.size(); ++i) {
+    if (models[i].instances.empty())
+      continue;
+
+    if (!options.geometryOnly)
+      callbacks->partParsed(models[i].name, models[i].instances);
+    partCallbacks.beginPart(part, models[i].name);
+    try {
+      loadModel(&partCallbacks, models[i].path.c_str(), resources, modelOptions);
+    } catch (ParseException& ex) {
+      throw ParseException("[%s: model %s] %s", path, models[i].name.c_str(), ex.what());
+    }
+    ++part;
+  }
+
+  if (options.expectedCoords > 0 && partCallbacks.numCoords() != options.expectedCoords) {
+    fprintf(stderr, "Warning: %s has %lu coords, but the first keyframe has %lu.\n",
+        path, partCallbacks.numCoords(), options.expectedCoords);
+  }
+}
+
@@ -0,0 +1,31 @@
+#ifndef OBJViewer_sceneparser_h
+#define OBJViewer_sceneparser_h
+
+#include "parser.h"
+#include "resources.h"
+
+
+// A scene file lists the models it uses and places copies of them with
+// per-instance transforms, one statement per line:
+//
+//   model NAME PATH          Declares a model, loaded from an .obj or .ply
+//                            file (relative to the scene file).
+//   instance NAME [xform..]  Places a copy of a declared model.
+//   # ...                    A comment.
+//
+// where each xform is one of
+//
+//   translate X Y Z
+//   rotate X Y Z             Degrees about the x, then y, then z axis.
+//   scale S | scale X Y Z
+//
+// and they're applied in the order written, as in POV-Ray. Each model with
+// at least one instance is loaded once and reported as a part, with its
+// faces tagged with the part number; models without instances are skipped.
+void loadScene(ParserCallbacks* callbacks, const char* path, ResourceManager* resources,
+    const LoadOptions& options)
+  throw(ParseException);
+
+
+#endif // OBJViewer_sceneparser_h
+
@@ -0,0 +1,548 @@
+#include "simplify.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <iterator>
+#include <queue>
+
+
+//
+// CONSTANTS
+//
+
+// Each detail level has at most this fraction of the triangles of the one
+// before it.
+const double LEVEL_RATIO = 0.5;
+
+// A collapse is rejected if it would turn any triangle's normal by more than
+// the angle with this cosine, since that's usually the start of a fold.
+const double MIN_NORMAL_COS = 0.25;
+
+// Identifies the detail level file format. Change it whenever the format or
+// the way levels are made changes, so old files get ignored.
+const char DETAIL_LEVELS_MAGIC[8] = { 'O', 'V', 'L', 'O', 'D', '0', '0', '1' };
+
+
+//
+// TYPES
+//
+
+// A symmetric 4x4 matrix giving the sum of the squared distances from a
+// point to a set of planes (Garland & Heckbert).
+struct Quadric {
+  double a2, ab, ac, ad, b2, bc, bd, c2, cd, d2;
+
+  Quadric() :
+    a2(0), ab(0), ac(0), ad(0), b2(0), bc(0), bd(0), c2(0), cd(0), d2(0)
+  {
+  }
+
+  // The plane a*x + b*y + c*z + d = 0, where (a, b, c) has unit length.
+  Quadric(double a, double b, double c, double d) :
+    a2(a * a), ab(a * b), ac(a * c), ad(a * d),
+    b2(b * b), bc(b * c), bd(b * d),
+    c2(c * c), cd(c * d),
+    d2(d * d)
+  {
+  }
+
+  void add(const Quadric& q)
+  {
+    a2 += q.a2; ab += q.ab; ac += q.ac; ad += q.ad;
+    b2 += q.b2; bc += q.bc; bd += q.bd;
+    c2 += q.c2; cd += q.cd;
+    d2 += q.d2;
+  }
+
+  double error(const vh::Vector3& p) const
+  {
+    double x = p.x, y = p.y, z = p.z;
+    double e = a2 * x * x + 2 * ab * x * y + 2 * ac * x * z + 2 * ad * x +
+               b2 * y * y + 2 * bc * y * z + 2 * bd * y +
+               c2 * z * z + 2 * cd * z +
+               d2;
+    return std::max(e, 0.0);
+  }
+};
+
+
+// Moving vertex from onto vertex to. The versions are those of the two
+// vertices when the cost was worked out; if either has changed since, the
+// collapse is out of date.
+struct Collapse {
+  double cost;
+  unsigned int from, to;
+  unsigned int fromVersion, toVersion;
+
+  // The cheapest collapse sorts last, so it's at the top of the queue.
+  bool operator < (const Collapse& other) const
+  {
+    return cost > other.cost;
+  }
+};
+
+
+// The working state while simplifying one mesh.
+class Simplifier {
+public:
+  Simplifier(const std::vector<vh::Vector3>& positions,
+      const std::vector<unsigned int>& vertices, const std::vector<unsigned int>& corners);
+
+  void run(size_t maxLevels, std::vector<DetailLevel>& levels);
+
+private:
+  void lockVertices();
+  void calculateQuadrics();
+  void addCollapses(unsigned int vertex);
+  void pushCollapse(unsigned int from, unsigned int to);
+
+  bool canCollapse(unsigned int from, unsigned int to, unsigned int& corner);
+  void collapse(unsigned int from, unsigned int to, unsigned int corner);
+
+  void neighbours(unsigned int vertex, std::vector<unsigned int>& result);
+  void purge(unsigned int vertex);
+  vh::Vector3 normal(size_t triangle, unsigned int vertex, const vh::Vector3& position) const;
+  void snapshot(double maxCost, std::vector<DetailLevel>& levels) const;
+
+private:
+  const std::vector<vh::Vector3>& _positions;
+  std::vector<unsigned int> _vertices;
+  std::vector<unsigned int> _corners;
+  std::vector<bool> _alive;
+  size_t _numAlive;
+
+  // The triangles around each vertex. Triangles removed by a collapse are
+  // only dropped from these lazily, so check _alive.
+  std::vector<std::vector<size_t> > _triangles;
+  std::vector<bool> _locked;
+  std::vector<unsigned int> _versions;
+  std::vector<Quadric> _quadrics;
+  std::priority_queue<Collapse> _queue;
+};
+
+
+//
+// INTERNAL FUNCTIONS
+//
+
+bool readValue(FILE* file, void* value, size_t size)
+{
+  return fread(value, size, 1, file) == 1;
+}
+
+
+bool writeValue(FILE* file, const void* value, size_t size)
+{
+  return fwrite(value, size, 1, file) == 1;
+}
+
+
+//
+// DetailLevel METHODS
+//
+
+DetailLevel::DetailLevel() :
+  indexes(),
+  error(0)
+{
+}
+
+
+//
+// Simplifier METHODS
+//
+
+Simplifier::Simplifier(const std::vector<vh::Vector3>& positions,
+    const std::vector<unsigned int>& vertices, const std::vector<unsigned int>& corners) :
+  _positions(positions),
+  _vertices(vertices),
+  _corners(corners),
+  _alive(vertices.size() / 3, true),
+  _numAlive(0),
+  _triangles(positions.size()),
+  _locked(positions.size(), false),
+  _versions(positions.size(), 0),
+  _quadrics(positions.size()),
+  _queue()
+{
+  // Triangles which have already collapsed to a line or a point have no
+  // part in the topology.
+  for (size_t t = 0; t < _alive.size(); ++t) {
+    const unsigned int* v = &_vertices[t * 3];
+    if (v[0] == v[1] || v[1] == v[2] || v[2] == v[0]) {
+      _alive[t] = false;
+      continue;
+    }
+    for (unsigned int j = 0; j < 3; ++j)
+      _triangles[v[j]].push_back(t);
+    ++_numAlive;
+  }
+
+  lockVertices();
+  calculateQuadrics();
+  for (unsigned int v = 0; v < _positions.size(); ++v)
+    addCollapses(v);
+}
+
+
+void Simplifier::run(size_t maxLevels, std::vector<DetailLevel>& levels)
+{
+  levels.clear();
+  size_t lastSize = _numAlive;
+  size_t target = size_t(lastSize * LEVEL_RATIO);
+  double maxCost = 0;
+
+  while (levels.size() < maxLevels && !_queue.empty()) {
+    Collapse next = _queue.top();
+    _queue.pop();
+    if (_versions[next.from] != next.fromVersion || _versions[next.to] != next.toVersion)
+      continue;
+
+    unsigned int corner = 0;
+    if (!canCollapse(next.from, next.to, corner))
+      continue;
+
+    collapse(next.from, next.to, corner);
+    maxCost = std::max(maxCost, next.cost);
+    if (_numAlive <= target) {
+      snapshot(maxCost, levels);
+      lastSize = _numAlive;
+      target = size_t(lastSize * LEVEL_RATIO);
+    }
+  }
+
+  // We ran out of collapses before reaching the next target; whatever
+  // progress we made still makes a level.
+  if (levels.size() < maxLevels && _numAlive < lastSize)
+    snapshot(maxCost, levels);
+}
+
+
+void Simplifier::lockVertices()
+{
+  // Edges with only one triangle are on the mesh's boundary, and edges with
+  // more than two are non-manifold. Either way, their ends stay put.
+  std::map<std::pair<unsigned int, unsigned int>, unsigned int> edges;
+  for (size_t t = 0; t < _alive.size(); ++t) {
+    if (!_alive[t])
+      continue;
+    for (unsigned int j = 0; j < 3; ++j) {
+      unsigned int a = _vertices[t * 3 + j];
+      unsigned int b = _vertices[t * 3 + (j + 1) % 3];
+      ++edges[std::make_pair(std::min(a, b), std::max(a, b))];
+    }
+  }
+  std::map<std::pair<unsigned int, unsigned int>, unsigned int>::iterator edge;
+  for (edge = edges.begin(); edge != edges.end(); ++edge) {
+    if (edge->second != 2) {
+      _locked[edge->first.first] = true;
+      _locked[edge->first.second] = true;
+    }
+  }
+
+  // So do vertices on seams.
+  std::vector<int> firstCorner(_positions.size(), -1);
+  for (size_t i = 0; i < _vertices.size(); ++i) {
+    if (!_alive[i / 3])
+      continue;
+    unsigned int v = _vertices[i];
+    if (firstCorner[v] < 0)
+      firstCorner[v] = int(_corners[i]);
+    else if (firstCorner[v] != int(_corners[i]))
+      _locked[v] = true;
+  }
+}
+
+
+void Simplifier::calculateQuadrics()
+{
+  for (size_t t = 0; t < _alive.size(); ++t) {
+    if (!_alive[t])
+      continue;
+
+    const unsigned int* v = &_vertices[t * 3];
+    vh::Vector3 n = normal(t, v[0], _positions[v[0]]);
+    float length = vh::length(n);
+    if (length == 0)
+      continue;
+    n = n / length;
+
+    Quadric plane(n.x, n.y, n.z, -vh::dot(n, _positions[v[0]]));
+    for (unsigned int j = 0; j < 3; ++j)
+      _quadrics[v[j]].add(plane);
+  }
+}
+
+
+void Simplifier::addCollapses(unsigned int vertex)
+{
+  std::vector<unsigned int> others;
+  neighbours(vertex, others);
+  for (size_t i = 0; i < others.size(); ++i) {
+    pushCollapse(vertex, others[i]);
+    pushCollapse(others[i], vertex);
+  }
+}
+
+
+void Simplifier::pushCollapse(unsigned int from, unsigned int to)
+{
+  if (_locked[from])
+    return;
+
+  Quadric sum = _quadrics[from];
+  sum.add(_quadrics[to]);
+
+  Collapse c;
+  c.cost = sum.error(_positions[to]);
+  c.from = from;
+  c.to = to;
+  c.fromVersion = _versions[from];
+  c.toVersion = _versions[to];
+  _queue.push(c);
+}
+
+
+bool Simplifier::canCollapse(unsigned int from, unsigned int to, unsigned int& corner)
+{
+  purge(from);
+  const std::vector<size_t>& triangles = _triangles[from];
+
+  // The edge must have a triangle on either side, which agree on which of
+  // to's corners the triangles around from will take over.
+  size_t shared = 0;
+  for (size_t i = 0; i < triangles.size(); ++i) {
+    size_t t = triangles[i];
+    for (unsigned int j = 0; j < 3; ++j) {
+      if (_vertices[t * 3 + j] != to)
+        continue;
+      if (shared > 0 && _corners[t * 3 + j] != corner)
+        return false;
+      corner = _corners[t * 3 + j];
+      ++shared;
+    }
+  }
+  if (shared != 2)
+    return false;
+
+  // The link condition: the only vertices next to both ends of the edge are
+  // the ones opposite it, otherwise the collapse pinches the surface.
+  std::vector<unsigned int> fromNeighbours, toNeighbours, common;
+  neighbours(from, fromNeighbours);
+  neighbours(to, toNeighbours);
+  std::set_intersection(fromNeighbours.begin(), fromNeighbours.end(),
+      toNeighbours.begin(), toNeighbours.end(), std::back_inserter(common));
+  if (common.size() != 2)
+    return false;
+
+  // No triangle may flip over or turn too far.
+  const vh::Vector3& target = _positions[to];
+  for (size_t i = 0; i < triangles.size(); ++i) {
+    size_t t = triangles[i];
+    const unsigned int* v = &_vertices[t * 3];
+    if (v[0] == to || v[1] == to || v[2] == to)
+      continue;
+
+    vh::Vector3 before = normal(t, from, _positions[from]);
+    vh::Vector3 after = normal(t, from, target);
+    double lengths = double(vh::length(before)) * double(vh::length(after));
+    if (lengths == 0 || vh::dot(before, after) < MIN_NORMAL_COS * lengths)
+      return false;
+  }
+  return true;
+}
+
+
+void Simplifier::collapse(unsigned int from, unsigned int to, unsigned int corner)
+{
+  const std::vector<size_t>& triangles = _triangles[from];
+  for (size_t i = 0; i < triangles.size(); ++i) {
+    size_t t = triangles[i];
+    unsigned int* v = &_vertices[t * 3];
+    if (v[0] == to || v[1] == to || v[2] == to) {
+      _alive[t] = false;
+      --_numAlive;
+      continue;
+    }
+    for (unsigned int j = 0; j < 3; ++j) {
+      if (v[j] == from) {
+        v[j] = to;
+        _corners[t * 3 + j] = corner;
+      }
+    }
+    _triangles[to].push_back(t);
+  }
+
+  // Bumping the versions makes any queued collapses involving either
+  // vertex out of date.
+  std::vector<size_t>().swap(_triangles[from]);
+  _quadrics[to].add(_quadrics[from]);
+  ++_versions[from];
+  ++_versions[to];
+  purge(to);
+
+  // Only collapses involving the target have changed cost.
+  addCollapses(to);
+}
+
+
+void Simplifier::neighbours(unsigned int vertex, std::vector<unsigned int>& result)
+{
+  purge(vertex);
+  result.clear();
+  const std::vector<size_t>& triangles = _triangles[vertex];
+  for (size_t i = 0; i < triangles.size(); ++i) {
+    const unsigned int* v = &_vertices[triangles[i] * 3];
+    for (unsigned int j = 0; j < 3; ++j) {
+      if (v[j] != vertex)
+        result.push_back(v[j]);
+    }
+  }
+  std::sort(result.begin(), result.end());
+  result.erase(std::unique(result.begin(), result.end()), result.end());
+}
+
+
+void Simplifier::purge(unsigned int vertex)
+{
+  std::vector<size_t>& triangles = _triangles[vertex];
+  size_t end = 0;
+  for (size_t i = 0; i < triangles.size(); ++i) {
+    if (_alive[triangles[i]])
+      triangles[end++] = triangles[i];
+  }
+  triangles.resize(end);
+}
+
+
+vh::Vector3 Simplifier::normal(size_t triangle, unsigned int vertex, const vh::Vector3& position) const
+{
+  // The (unnormalised) normal the triangle would have with the given vertex
+  // moved to position.
+  vh::Vector3 p[3];
+  for (unsigned int j = 0; j < 3; ++j) {
+    unsigned int v = _vertices[triangle * 3 + j];
+    p[j] = (v == vertex) ? position : _positions[v];
+  }
+  return vh::cross(p[1] - p[0], p[2] - p[0]);
+}
+
+
+void Simplifier::snapshot(double maxCost, std::vector<DetailLevel>& levels) const
+{
+  levels.push_back(DetailLevel());
+  DetailLevel& level = levels.back();
+  level.indexes.reserve(_numAlive * 3);
+  for (size_t t = 0; t < _alive.size(); ++t) {
+    if (_alive[t])
+      level.indexes.insert(level.indexes.end(), &_corners[t * 3], &_corners[t * 3] + 3);
+  }
+  level.error = sqrt(maxCost);
+}
+
+
+//
+// FUNCTIONS
+//
+
+void simplifyMesh(const std::vector<vh::Vector3>& positions,
+    const std::vector<unsigned int>& vertices, const std::vector<unsigned int>& corners,
+    size_t maxLevels, std::vector<DetailLevel>& levels)
+{
+  Simplifier simplifier(positions, vertices, corners);
+  simplifier.run(maxLevels, levels);
+}
+
+
+bool readDetailLevels(const std::string& path, const DetailLevelSizes& sizes,
+    size_t maxLevels, DetailLevelCache& cache)
+{
+  // The file is the magic number, then for each mesh: its hash, the number
+  // of levels and, for each level, its error, the number of indexes and the
+  // indexes themselves.
+  cache.clear();
+  FILE* file = fopen(path.c_str(), "rb");
+  if (file == NULL)
+    return errno == ENOENT;
+
+  char magic[sizeof(DETAIL_LEVELS_MAGIC)];
+  if (!readValue(file, magic, sizeof(magic)) ||
+      memcmp(magic, DETAIL_LEVELS_MAGIC, sizeof(magic)) != 0) {
+    bool ok = !ferror(file);
+    fclose(file);
+    return ok;
+  }
+
+  // Nothing is allocated until its count has been checked against the mesh
+  // it's for: a level can't have more indexes than the mesh has corners, nor
+  // point past the last of them. Meshes which aren't in sizes any more are
+  // skipped.
+  bool ok = true;
+  uint64_t hash;
+  while (ok && readValue(file, &hash, sizeof(hash))) {
+    DetailLevelSizes::const_iterator size = sizes.find(hash);
+    uint32_t numLevels = 0;
+    ok = readValue(file, &numLevels, sizeof(numLevels)) && numLevels <= maxLevels;
+    std::vector<DetailLevel> levels(ok && size != sizes.end() ? numLevels : 0);
+    for (uint32_t i = 0; ok && i < numLevels; ++i) {
+      float error;
+      uint32_t numIndexes = 0;
+      ok = readValue(file, &error, sizeof(error)) &&
+           readValue(file, &numIndexes, sizeof(numIndexes)) && numIndexes % 3 == 0;
+      if (ok && size == sizes.end()) {
+        ok = fseek(file, long(numIndexes) * sizeof(unsigned int), SEEK_CUR) == 0;
+      } else if (ok) {
+        ok = numIndexes <= size->second;
+        if (ok) {
+          levels[i].error = error;
+          levels[i].indexes.resize(numIndexes);
+          ok = numIndexes == 0 ||
+               fread(&levels[i].indexes[0], sizeof(unsigned int), numIndexes, file) == numIndexes;
+        }
+        for (uint32_t j = 0; ok && j < numIndexes; ++j)
+          ok = levels[i].indexes[j] < size->second;
+      }
+    }
+    if (ok && size != sizes.end())
+      cache[hash].swap(levels);
+  }
+
+  // A truncated or inconsistent file is as good as an out of date one.
+  if (!ok)
+    cache.clear();
+  ok = !ferror(file);
+  fclose(file);
+  return ok;
+}
+
+
+bool writeDetailLevels(const std::string& path, const DetailLevelCache& cache)
+{
+  FILE* file = fopen(path.c_str(), "wb");
+  if (file == NULL)
+    return false;
+
+  bool ok = writeValue(file, DETAIL_LEVELS_MAGIC, sizeof(DETAIL_LEVELS_MAGIC));
+  DetailLevelCache::const_iterator iter;
+  for (iter = cache.begin(); ok && iter != cache.end(); ++iter) {
+    const std::vector<DetailLevel>& levels = iter->second;
+    uint32_t numLevels = levels.size();
+    ok = writeValue(file, &iter->first, sizeof(iter->first)) &&
+         writeValue(file, &numLevels, sizeof(numLevels));
+    for (size_t i = 0; ok && i < levels.size(); ++i) {
+      uint32_t numIndexes = levels[i].indexes.size();
+      ok = writeValue(file, &levels[i].error, sizeof(float)) &&
+           writeValue(file, &numIndexes, sizeof(numIndexes)) &&
+           (numIndexes == 0 ||
+            fwrite(&levels[i].indexes[0], sizeof(unsigned int), numIndexes, file) == numIndexes);
+    }
+  }
+
+  if (fclose(file) != 0)
+    ok = false;
+  return ok;
+}
+
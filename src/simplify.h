@@ -0,0 +1,66 @@
+#ifndef OBJViewer_simplify_h
+#define OBJViewer_simplify_h
+
+#include <cstddef>
+#include <map>
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+#include "vector.h"
+
+
+//
+// TYPES
+//
+
+// A simplified version of a triangle mesh. The indexes pick out corners of
+// the original mesh, three per triangle, and error is roughly how far (in
+// model units) the surface has moved from the original.
+struct DetailLevel {
+  std::vector<unsigned int> indexes;
+  float error;
+
+  DetailLevel();
+};
+
+
+// Sets of detail levels, keyed by a hash of the mesh they were made from.
+typedef std::map<uint64_t, std::vector<DetailLevel> > DetailLevelCache;
+
+// The number of corners in each mesh a cache is expected to hold, keyed by
+// the same hash.
+typedef std::map<uint64_t, size_t> DetailLevelSizes;
+
+
+//
+// FUNCTIONS
+//
+
+// Simplifies a mesh by collapsing edges, cheapest first according to the
+// quadric error metric, taking a snapshot each time the number of triangles
+// halves, up to maxLevels snapshots.
+//
+// The mesh is given as positions plus, for each triangle, three indexes into
+// the positions (its vertices) and three corner indexes, which are what the
+// snapshots are made of. Corners with the same index must have the same
+// attributes. A vertex with more than one distinct corner sits on a seam in
+// the tex coords, normals or colors and never moves; nor does any vertex on
+// the edge of the mesh, so meshes which meet along their edges still meet at
+// any level.
+void simplifyMesh(const std::vector<vh::Vector3>& positions,
+    const std::vector<unsigned int>& vertices, const std::vector<unsigned int>& corners,
+    size_t maxLevels, std::vector<DetailLevel>& levels);
+
+// Reading a missing or out of date file isn't an error: the cache just
+// comes back empty. Nor is a file whose counts don't fit the meshes in sizes
+// or which has more than maxLevels levels for one; only meshes in sizes are
+// read. Both return false and set errno if the file couldn't be read or
+// written.
+bool readDetailLevels(const std::string& path, const DetailLevelSizes& sizes,
+    size_t maxLevels, DetailLevelCache& cache);
+bool writeDetailLevels(const std::string& path, const DetailLevelCache& cache);
+
+
+#endif // OBJViewer_simplify_h
+
@@ -0,0 +1,417 @@
+#define GL_GLEXT_PROTOTYPES 1
+
+#ifdef linux
+#include <GL/gl.h>
+#include <GL/glext.h>
+#else
+#include <OpenGL/gl.h>
+#include <OpenGL/glext.h>
+#endif
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+
+#include <unistd.h>
+
+#include "textureloader.h"
+#include "threadpool.h"
+
+
+//
+// TYPES
+//
+
+// Builds the mip chain for one texture. Everything after ready is only
+// touched on the GL thread.
+class TextureMipJob : public Job {
+public:
+  TextureLoader* loader;
+  RawImage* texture;
+  bool isMatte;
+  size_t width, height;   // Of level 0, after fitting to the maximum size.
+  std::vector<std::vector<unsigned char> > levels;
+  bool ready;             // Guarded by the loader's lock.
+
+  GLuint texID;
+  GLenum format, internalFormat;
+  size_t levelsLeft;      // Levels not yet uploaded, which are 0 to levelsLeft - 1.
+
+  virtual void run()
+  {
+    size_t channels = texture->getBytesPerPixel();
+    levels.push_back(std::vector<unsigned char>());
+    resampleImage(texture->getPixels(), texture->getWidth(), texture->getHeight(),
+        channels, width, height, levels.back());
+
+    // Each level is filtered from the one before, so it's cheap.
+    size_t w = width, h = height;
+    while (w > 1 || h > 1) {
+      size_t nextW = std::max(w / 2, size_t(1));
+      size_t nextH = std::max(h / 2, size_t(1));
+      levels.push_back(std::vector<unsigned char>());
+      resampleImage(&levels[levels.size() - 2][0], w, h, channels, nextW, nextH, levels.back());
+      w = nextW;
+      h = nextH;
+    }
+    loader->jobFinished(this);
+  }
+
+  size_t levelWidth(size_t level) const { return std::max(width >> level, size_t(1)); }
+  size_t levelHeight(size_t level) const { return std::max(height >> level, size_t(1)); }
+};
+
+
+// Which input pixels go into an output pixel, and how much of each.
+struct AreaWeights {
+  size_t first;
+  std::vector<float> weights;
+};
+
+
+//
+// TextureLoader METHODS
+//
+
+TextureLoader::TextureLoader(Model* model, size_t maxWidth, size_t maxHeight, bool pixelBuffers) :
+  _model(model),
+  _maxWidth(maxWidth),
+  _maxHeight(maxHeight),
+  _pixelBuffers(pixelBuffers),
+  _pixelBufferID(0),
+  _pool(NULL),
+  _jobs(),
+  _numLoaded(0),
+  _gpuBytes(0),
+  _pendingBytes(0)
+{
+  pthread_mutex_init(&_lock, NULL);
+}
+
+
+TextureLoader::~TextureLoader()
+{
+  // The pool finishes off its queue before it goes.
+  delete _pool;
+  for (size_t i = 0; i < _jobs.size(); ++i)
+    delete _jobs[i];
+#ifdef GL_ARB_pixel_buffer_object
+  if (_pixelBufferID != 0)
+    glDeleteBuffers(1, &_pixelBufferID);
+#endif
+  pthread_mutex_destroy(&_lock);
+}
+
+
+void TextureLoader::add(RawImage* texture, bool isMatte)
+{
+  if (texture == NULL || texture->getTexID() != (unsigned int)-1 || _pool != NULL)
+    return;
+  for (size_t i = 0; i < _jobs.size(); ++i) {
+    if (_jobs[i]->texture == texture)
+      return;
+  }
+
+  TextureMipJob* job = new TextureMipJob();
+  job->loader = this;
+  job->texture = texture;
+  job->isMatte = isMatte;
+  job->width = texture->getWidth();
+  job->height = texture->getHeight();
+  if (_maxWidth > 0)
+    job->width = std::min(job->width, _maxWidth);
+  if (_maxHeight > 0)
+    job->height = std::min(job->height, _maxHeight);
+  job->ready = false;
+  job->texID = 0;
+  job->format = texture->getType();
+  if (isMatte)
+    job->internalFormat = GL_ALPHA;
+  else if (job->format == GL_BGR)
+    job->internalFormat = GL_RGB;
+  else if (job->format == GL_BGRA)
+    job->internalFormat = GL_RGBA;
+  else
+    job->internalFormat = job->format;
+  job->levelsLeft = 0;
+  _jobs.push_back(job);
+
+  if (job->width != texture->getWidth() || job->height != texture->getHeight()) {
+    fprintf(stderr, "Downsampling texture: %ux%u --> %lux%lu\n",
+        texture->getWidth(), texture->getHeight(), job->width, job->height);
+  }
+}
+
+
+void TextureLoader::start()
+{
+  if (_jobs.empty() || _pool != NULL)
+    return;
+
+  long numCPUs = sysconf(_SC_NPROCESSORS_ONLN);
+  size_t numThreads = std::min(_jobs.size(), size_t(std::max(numCPUs, 1L)));
+  fprintf(stderr, "Building mipmaps for %lu textures in the background on %lu threads...\n",
+      _jobs.size(), numThreads);
+
+  _pool = new ThreadPool(numThreads);
+  for (size_t i = 0; i < _jobs.size(); ++i)
+    _pool->add(_jobs[i]);
+}
+
+
+size_t TextureLoader::update(size_t budget)
+{
+  // Take one level at a time from each texture which is ready, so that they
+  // all get their coarse levels in before any get their fine ones.
+  std::vector<std::pair<TextureMipJob*, size_t> > uploads;
+  size_t bytes = 0;
+  pthread_mutex_lock(&_lock);
+  bool more = true;
+  while (more && (bytes < budget || uploads.empty())) {
+    more = false;
+    for (size_t i = 0; i < _jobs.size() && (bytes < budget || uploads.empty()); ++i) {
+      TextureMipJob* job = _jobs[i];
+      if (!job->ready || job->levelsLeft == 0)
+        continue;
+      size_t level = --job->levelsLeft;
+      uploads.push_back(std::make_pair(job, level));
+      bytes += job->levels[level].size();
+      more = true;
+    }
+  }
+  pthread_mutex_unlock(&_lock);
+  if (uploads.empty())
+    return 0;
+
+  glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+  for (size_t i = 0; i < uploads.size(); ++i) {
+    if (uploads[i].first->texID == 0)
+      createTexture(uploads[i].first);
+  }
+
+  // Through a pixel buffer the copy into GL is just a memcpy, and the
+  // transfer to the texture happens without us waiting for it. The buffer is
+  // orphaned each time so we never wait on last frame's transfer either.
+  bool uploaded = false;
+#ifdef GL_ARB_pixel_buffer_object
+  if (_pixelBuffers) {
+    if (_pixelBufferID == 0)
+      glGenBuffers(1, &_pixelBufferID);
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER_ARB, _pixelBufferID);
+    glBufferData(GL_PIXEL_UNPACK_BUFFER_ARB, bytes, NULL, GL_STREAM_DRAW);
+    char* mapped = (char*)glMapBuffer(GL_PIXEL_UNPACK_BUFFER_ARB, GL_WRITE_ONLY);
+    if (mapped != NULL) {
+      size_t offset = 0;
+      for (size_t i = 0; i < uploads.size(); ++i) {
+        const std::vector<unsigned char>& pixels = uploads[i].first->levels[uploads[i].second];
+        memcpy(mapped + offset, &pixels[0], pixels.size());
+        offset += pixels.size();
+      }
+      glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER_ARB);
+
+      offset = 0;
+      for (size_t i = 0; i < uploads.size(); ++i) {
+        uploadLevel(uploads[i].first, uploads[i].second, (const GLvoid*)offset);
+        offset += uploads[i].first->levels[uploads[i].second].size();
+      }
+      uploaded = true;
+    }
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER_ARB, 0);
+  }
+#endif
+  if (!uploaded) {
+    for (size_t i = 0; i < uploads.size(); ++i) {
+      TextureMipJob* job = uploads[i].first;
+      uploadLevel(job, uploads[i].second, &job->levels[uploads[i].second][0]);
+    }
+  }
+
+  // The chains are freed as they go in.
+  size_t freed = 0;
+  for (size_t i = 0; i < uploads.size(); ++i) {
+    TextureMipJob* job = uploads[i].first;
+    freed += job->levels[uploads[i].second].size();
+    std::vector<unsigned char>().swap(job->levels[uploads[i].second]);
+    if (uploads[i].second == 0)
+      ++_numLoaded;
+  }
+  pthread_mutex_lock(&_lock);
+  _pendingBytes -= freed;
+  pthread_mutex_unlock(&_lock);
+
+  return bytes;
+}
+
+
+bool TextureLoader::finished() const
+{
+  return _numLoaded == _jobs.size();
+}
+
+
+size_t TextureLoader::numTextures() const
+{
+  return _jobs.size();
+}
+
+
+size_t TextureLoader::numTexturesLoaded() const
+{
+  return _numLoaded;
+}
+
+
+size_t TextureLoader::gpuBytes() const
+{
+  return _gpuBytes;
+}
+
+
+size_t TextureLoader::pendingBytes() const
+{
+  pthread_mutex_lock(const_cast<pthread_mutex_t*>(&_lock));
+  size_t bytes = _pendingBytes;
+  pthread_mutex_unlock(const_cast<pthread_mutex_t*>(&_lock));
+  return bytes;
+}
+
+
+void TextureLoader::jobFinished(TextureMipJob* job)
+{
+  size_t bytes = 0;
+  for (size_t i = 0; i < job->levels.size(); ++i)
+    bytes += job->levels[i].size();
+
+  pthread_mutex_lock(&_lock);
+  job->levelsLeft = job->levels.size();
+  job->ready = true;
+  _pendingBytes += bytes;
+  pthread_mutex_unlock(&_lock);
+}
+
+
+void TextureLoader::createTexture(TextureMipJob* job)
+{
+  // Every level gets its storage up front. Only the levels from
+  // GL_TEXTURE_BASE_LEVEL down get used, and that starts at the coarsest.
+  GLsizei numLevels = job->levels.size();
+  glGenTextures(1, &job->texID);
+  glBindTexture(GL_TEXTURE_2D, job->texID);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, numLevels - 1);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_BASE_LEVEL, numLevels - 1);
+  for (GLsizei level = 0; level < numLevels; ++level) {
+    GLsizei w = job->levelWidth(level);
+    GLsizei h = job->levelHeight(level);
+    glTexImage2D(GL_TEXTURE_2D, level, job->internalFormat, w, h, 0,
+        job->format, GL_UNSIGNED_BYTE, NULL);
+    _gpuBytes += size_t(w) * h * bytesPerTexel(job->internalFormat);
+  }
+
+  // The chain has everything we need from the original pixels.
+  _model->removeTexturePixels(job->texture);
+  job->texture->deletePixels();
+}
+
+
+void TextureLoader::uploadLevel(TextureMipJob* job, size_t level, const void* pixels)
+{
+  glBindTexture(GL_TEXTURE_2D, job->texID);
+  glTexSubImage2D(GL_TEXTURE_2D, level, 0, 0, job->levelWidth(level), job->levelHeight(level),
+      job->format, GL_UNSIGNED_BYTE, pixels);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_BASE_LEVEL, level);
+
+  // The texture can be drawn with from its first level onwards.
+  if (job->texture->getTexID() == (unsigned int)-1)
+    job->texture->setTexID(job->texID);
+}
+
+
+//
+// FUNCTIONS
+//
+
+void areaWeights(size_t srcSize, size_t dstSize, std::vector<AreaWeights>& weights)
+{
+  double scale = double(srcSize) / double(dstSize);
+  weights.resize(dstSize);
+  for (size_t i = 0; i < dstSize; ++i) {
+    double start = i * scale;
+    double end = (i + 1) * scale;
+    size_t first = size_t(start);
+    size_t last = std::min(size_t(ceil(end)), srcSize);
+    weights[i].first = first;
+    weights[i].weights.clear();
+    for (size_t j = first; j < last; ++j) {
+      double overlap = std::min(end, double(j + 1)) - std::max(start, double(j));
+      weights[i].weights.push_back(float(std::max(overlap, 0.0) / scale));
+    }
+  }
+}
+
+
+void resampleImage(const unsigned char* src, size_t srcWidth, size_t srcHeight,
+    size_t channels, size_t dstWidth, size_t dstHeight, std::vector<unsigned char>& dst)
+{
+  dst.resize(dstWidth * dstHeight * channels);
+  if (dstWidth == srcWidth && dstHeight == srcHeight) {
+    memcpy(&dst[0], src, dst.size());
+    return;
+  }
+
+  std::vector<AreaWeights> xWeights, yWeights;
+  areaWeights(srcWidth, dstWidth, xWeights);
+  areaWeights(srcHeight, dstHeight, yWeights);
+
+  // Each output row is a weighted sum of input rows filtered across. Only
+  // one filtered row is kept, so that huge images don't need a float copy;
+  // rows shared by neighbouring outputs are usually the last one filtered.
+  size_t rowSize = dstWidth * channels;
+  std::vector<float> row(rowSize);
+  std::vector<float> sum(rowSize);
+  size_t filteredRow = srcHeight;
+  for (size_t y = 0; y < dstHeight; ++y) {
+    const AreaWeights& w = yWeights[y];
+    std::fill(sum.begin(), sum.end(), 0.0f);
+    for (size_t k = 0; k < w.weights.size(); ++k) {
+      if (filteredRow != w.first + k) {
+        filteredRow = w.first + k;
+        const unsigned char* srcRow = src + filteredRow * srcWidth * channels;
+        std::fill(row.begin(), row.end(), 0.0f);
+        for (size_t x = 0; x < dstWidth; ++x) {
+          const AreaWeights& xw = xWeights[x];
+          for (size_t j = 0; j < xw.weights.size(); ++j) {
+            const unsigned char* pixel = srcRow + (xw.first + j) * channels;
+            for (size_t c = 0; c < channels; ++c)
+              row[x * channels + c] += pixel[c] * xw.weights[j];
+          }
+        }
+      }
+      for (size_t i = 0; i < rowSize; ++i)
+        sum[i] += row[i] * w.weights[k];
+    }
+    unsigned char* dstRow = &dst[y * rowSize];
+    for (size_t i = 0; i < rowSize; ++i)
+      dstRow[i] = (unsigned char)std::min(std::max(sum[i] + 0.5f, 0.0f), 255.0f);
+  }
+}
+
+
+size_t bytesPerTexel(unsigned int internalFormat)
+{
+  switch (internalFormat) {
+    case GL_ALPHA:
+    case GL_LUMINANCE:
+      return 1;
+    case GL_LUMINANCE_ALPHA:
+      return 2;
+    default:
+      // RGB textures are padded out to 4 bytes per texel by most drivers.
+      return 4;
+  }
+}
+
@@ -0,0 +1,101 @@
+#ifndef OBJViewer_textureloader_h
+#define OBJViewer_textureloader_h
+
+#include <vector>
+
+#include <pthread.h>
+
+#include "model.h"
+
+
+class TextureMipJob;
+class ThreadPool;
+
+
+//
+// TYPES
+//
+
+// Gets a model's textures onto the GPU without holding up the first frame.
+// Each texture is resampled to fit within the maximum texture size and a
+// full mip chain is built from it on a thread pool, using an area filter.
+// The chains are then uploaded a few levels per frame, coarsest first. A
+// texture can be drawn with as soon as its first level is in: its base level
+// comes down as the finer levels arrive. Until then its texture ID stays at
+// -1, so it should be drawn as if it wasn't there.
+class TextureLoader {
+public:
+  // A maximum width or height of 0 means no limit. With pixelBuffers ==
+  // true the levels are copied into a pixel buffer object, so that GL can
+  // transfer them without stalling us.
+  TextureLoader(Model* model, size_t maxWidth, size_t maxHeight, bool pixelBuffers);
+  ~TextureLoader();
+
+  // Queues a texture to be loaded, as alpha only if it's a matte. NULL,
+  // already loaded and already queued textures are ignored. Call before
+  // start().
+  void add(RawImage* texture, bool isMatte);
+
+  // Starts building the mip chains for everything queued on as many
+  // threads as there are CPUs. Returns straight away.
+  void start();
+
+  // Uploads levels from the chains which are ready until about budget bytes
+  // have gone in, taking a level from each texture in turn; at least one
+  // level goes in if any is ready. Call on the GL thread: it changes the
+  // texture bound to the active unit. Returns the number of bytes uploaded.
+  size_t update(size_t budget);
+
+  // True once every level of every texture has been uploaded.
+  bool finished() const;
+  size_t numTextures() const;
+  size_t numTexturesLoaded() const;
+
+  // GPU memory for the textures created so far, including all of their
+  // levels, and the CPU memory held by chains waiting to be uploaded.
+  size_t gpuBytes() const;
+  size_t pendingBytes() const;
+
+private:
+  friend class TextureMipJob;
+  void jobFinished(TextureMipJob* job);
+
+  void createTexture(TextureMipJob* job);
+  void uploadLevel(TextureMipJob* job, size_t level, const void* pixels);
+
+private:
+  Model* _model;
+  size_t _maxWidth, _maxHeight;
+  bool _pixelBuffers;
+  unsigned int _pixelBufferID;
+
+  ThreadPool* _pool;
+  std::vector<TextureMipJob*> _jobs;
+  size_t _numLoaded;
+  size_t _gpuBytes;
+  size_t _pendingBytes;
+
+  // Guards the jobs' ready flags and _pendingBytes, which the workers set
+  // as they finish.
+  pthread_mutex_t _lock;
+};
+
+
+//
+// FUNCTIONS
+//
+
+// Resamples an image with an area filter: each output pixel is the average
+// of the input pixels it covers, weighted by how much of each it covers.
+// Works for enlarging too, which tiling needs for non-square images. Pixels
+// have channels bytes each, one per channel.
+void resampleImage(const unsigned char* src, size_t srcWidth, size_t srcHeight,
+    size_t channels, size_t dstWidth, size_t dstHeight, std::vector<unsigned char>& dst);
+
+// The GPU memory taken by each texel of a texture with the given internal
+// format.
+size_t bytesPerTexel(unsigned int internalFormat);
+
+
+#endif // OBJViewer_textureloader_h
+
@@ -0,0 +1,138 @@
+#include "threadpool.h"
+
+
+//
+// Job METHODS
+//
+
+Job::Job() :
+  _finished(false)
+{
+}
+
+
+Job::~Job()
+{
+}
+
+
+//
+// ThreadPool METHODS
+//
+
+ThreadPool::ThreadPool(size_t numThreads) :
+  _threads(),
+  _queue(),
+  _running(0),
+  _stopping(false)
+{
+  pthread_mutex_init(&_lock, NULL);
+  pthread_cond_init(&_jobAdded, NULL);
+  pthread_cond_init(&_jobFinished, NULL);
+
+  for (size_t i = 0; i < numThreads; ++i) {
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, threadMain, this) == 0)
+      _threads.push_back(thread);
+  }
+}
+
+
+ThreadPool::~ThreadPool()
+{
+  pthread_mutex_lock(&_lock);
+  _stopping = true;
+  pthread_cond_broadcast(&_jobAdded);
+  pthread_mutex_unlock(&_lock);
+
+  for (size_t i = 0; i < _threads.size(); ++i)
+    pthread_join(_threads[i], NULL);
+
+  pthread_cond_destroy(&_jobFinished);
+  pthread_cond_destroy(&_jobAdded);
+  pthread_mutex_destroy(&_lock);
+}
+
+
+size_t ThreadPool::numThreads() const
+{
+  return _threads.size();
+}
+
+
+void ThreadPool::add(Job* job)
+{
+  // Without any threads, just do the work here.
+  if (_threads.empty()) {
+    job->run();
+    job->_finished = true;
+    return;
+  }
+
+  pthread_mutex_lock(&_lock);
+  job->_finished = false;
+  _queue.push_back(job);
+  pthread_cond_signal(&_jobAdded);
+  pthread_mutex_unlock(&_lock);
+}
+
+
+void ThreadPool::wait(Job* job)
+{
+  pthread_mutex_lock(&_lock);
+  while (!job->_finished)
+    pthread_cond_wait(&_jobFinished, &_lock);
+  pthread_mutex_unlock(&_lock);
+}
+
+
+void ThreadPool::waitAll()
+{
+  pthread_mutex_lock(&_lock);
+  while (!_queue.empty() || _running > 0)
+    pthread_cond_wait(&_jobFinished, &_lock);
+  pthread_mutex_unlock(&_lock);
+}
+
+
+bool ThreadPool::idle()
+{
+  pthread_mutex_lock(&_lock);
+  bool result = _queue.empty() && _running == 0;
+  pthread_mutex_unlock(&_lock);
+  return result;
+}
+
+
+void* ThreadPool::threadMain(void* pool)
+{
+  ((ThreadPool*)pool)->workLoop();
+  return NULL;
+}
+
+
+void ThreadPool::workLoop()
+{
+  pthread_mutex_lock(&_lock);
+  while (true) {
+    while (_queue.empty() && !_stopping)
+      pthread_cond_wait(&_jobAdded, &_lock);
+    // Finish off anything that's already queued before stopping.
+    if (_queue.empty())
+      break;
+
+    Job* job = _queue.front();
+    _queue.pop_front();
+    ++_running;
+    pthread_mutex_unlock(&_lock);
+
+    job->run();
+
+    pthread_mutex_lock(&_lock);
+    --_running;
+    job->_finished = true;
+    pthread_cond_broadcast(&_jobFinished);
+  }
+  pthread_mutex_unlock(&_lock);
+}
+
@@ -0,0 +1,66 @@
+#ifndef OBJViewer_threadpool_h
+#define OBJViewer_threadpool_h
+
+#include <deque>
+#include <vector>
+
+#include <pthread.h>
+
+
+//
+// TYPES
+//
+
+// A unit of work for a ThreadPool. Subclasses implement run(), which gets
+// called on one of the pool's threads.
+class Job {
+public:
+  Job();
+  virtual ~Job();
+
+  virtual void run() = 0;
+
+private:
+  friend class ThreadPool;
+  bool _finished;
+};
+
+
+// A fixed set of worker threads taking jobs from a shared queue. Jobs are
+// owned by the caller and must stay alive until they've been waited for.
+class ThreadPool {
+public:
+  ThreadPool(size_t numThreads);
+  ~ThreadPool();
+
+  size_t numThreads() const;
+
+  void add(Job* job);
+
+  // Blocks until the given job has finished running.
+  void wait(Job* job);
+
+  // Blocks until every job added so far has finished running.
+  void waitAll();
+
+  // True if every job added so far has finished running. Doesn't block.
+  bool idle();
+
+private:
+  static void* threadMain(void* pool);
+  void workLoop();
+
+private:
+  std::vector<pthread_t> _threads;
+  std::deque<Job*> _queue;
+  size_t _running;
+  bool _stopping;
+
+  pthread_mutex_t _lock;
+  pthread_cond_t _jobAdded;
+  pthread_cond_t _jobFinished;
+};
+
+
+#endif // OBJViewer_threadpool_h
+
@@ -0,0 +1,158 @@
+#include "vertexformat.h"
+
+
+//
+// CONSTANTS
+//
+
+const float OCTAHEDRAL_NORMAL_MAX = 32767.0f;
+
+
+//
+// INTERNAL FUNCTIONS
+//
+
+size_t positionBytes(PositionFormat format)
+{
+  return (format == kFloatPositions) ? 3 * sizeof(float) : 4 * sizeof(uint16_t);
+}
+
+
+size_t texCoordBytes(TexCoordFormat format)
+{
+  return (format == kFloatTexCoords) ? 2 * sizeof(float) : 2 * sizeof(uint16_t);
+}
+
+
+size_t normalBytes(NormalFormat format)
+{
+  return (format == kFloatNormals) ? 4 * sizeof(float) : sizeof(uint32_t);
+}
+
+
+size_t colorBytes(ColorFormat format)
+{
+  return (format == kFloatColors) ? 3 * sizeof(float) : 4 * sizeof(uint8_t);
+}
+
+
+//
+// VertexFormat METHODS
+//
+
+VertexFormat::VertexFormat() :
+  positions(kFloatPositions),
+  normals(kFloatNormals),
+  texCoords(kFloatTexCoords),
+  colors(kFloatColors)
+{
+}
+
+
+VertexFormat::VertexFormat(PositionFormat p, NormalFormat n, TexCoordFormat t, ColorFormat c) :
+  positions(p),
+  normals(n),
+  texCoords(t),
+  colors(c)
+{
+}
+
+
+bool VertexFormat::named(const char* name, VertexFormat& format)
+{
+  if (strcmp(name, "float") == 0)
+    format = VertexFormat();
+  else if (strcmp(name, "half") == 0)
+    format = VertexFormat(kHalfPositions, kPackedNormals, kHalfTexCoords, kByteColors);
+  else if (strcmp(name, "packed") == 0)
+    format = VertexFormat(kShortPositions, kPackedNormals, kHalfTexCoords, kByteColors);
+  else if (strcmp(name, "octahedral") == 0)
+    format = VertexFormat(kShortPositions, kOctahedralNormals, kHalfTexCoords, kByteColors);
+  else
+    return false;
+  return true;
+}
+
+
+size_t VertexFormat::animatedNormalOffset() const
+{
+  return positionBytes(positions);
+}
+
+
+size_t VertexFormat::animatedBytesPerVertex() const
+{
+  return animatedNormalOffset() + normalBytes(normals);
+}
+
+
+size_t VertexFormat::staticColorOffset() const
+{
+  return texCoordBytes(texCoords);
+}
+
+
+size_t VertexFormat::staticBytesPerVertex(bool hasColors) const
+{
+  return staticColorOffset() + (hasColors ? colorBytes(colors) : 0);
+}
+
+
+//
+// PUBLIC FUNCTIONS
+//
+
+uint16_t floatToHalf(float value)
+{
+  uint32_t bits;
+  memcpy(&bits, &value, sizeof(bits));
+
+  uint32_t sign = (bits >> 16) & 0x8000;
+  int exponent = int((bits >> 23) & 0xff) - 127 + 15;
+  uint32_t mantissa = bits & 0x7fffff;
+
+  if (((bits >> 23) & 0xff) == 0xff) // Infinity or NaN.
+    return uint16_t(sign | 0x7c00 | (mantissa ? 0x200 : 0));
+  if (exponent >= 31) // Too big, clamp to infinity.
+    return uint16_t(sign | 0x7c00);
+
+  if (exponent <= 0) {
+    // Denormal, or too small to represent at all.
+    if (exponent < -10)
+      return uint16_t(sign);
+    mantissa |= 0x800000;
+    unsigned int shift = 14 - exponent;
+    uint32_t half = mantissa >> shift;
+    if ((mantissa >> (shift - 1)) & 1)
+      ++half;
+    return uint16_t(sign | half);
+  }
+
+  // Rounding may carry into the exponent, which still gives the right answer.
+  uint32_t half = sign | (uint32_t(exponent) << 10) | (mantissa >> 13);
+  if (mantissa & 0x1000)
+    ++half;
+  return uint16_t(half);
+}
+
+
+void octEncode(const vh::Vector3& n, int16_t* out)
+{
+  float l1 = fabsf(n.x) + fabsf(n.y) + fabsf(n.z);
+  if (l1 == 0) {
+    out[0] = out[1] = 0;
+    return;
+  }
+
+  float u = n.x / l1;
+  float v = n.y / l1;
+  if (n.z < 0) {
+    float foldedU = (1 - fabsf(v)) * (u >= 0 ? 1 : -1);
+    float foldedV = (1 - fabsf(u)) * (v >= 0 ? 1 : -1);
+    u = foldedU;
+    v = foldedV;
+  }
+  out[0] = (int16_t)floorf(u * OCTAHEDRAL_NORMAL_MAX + 0.5f);
+  out[1] = (int16_t)floorf(v * OCTAHEDRAL_NORMAL_MAX + 0.5f);
+}
+
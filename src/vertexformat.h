@@ -0,0 +1,162 @@
+#ifndef OBJViewer_vertexformat_h
+#define OBJViewer_vertexformat_h
+
+#include <stdint.h>
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+#include "vector.h"
+
+
+//
+// TYPES
+//
+
+enum PositionFormat {
+  kFloatPositions,  // 3 floats.
+  kHalfPositions,   // 3 half floats + padding, scaled into [-1, 1].
+  kShortPositions   // 3 shorts + padding, scaled into [-32767, 32767].
+};
+
+// The values match the normalEncoding uniform in the vertex shaders.
+enum NormalFormat {
+  kFloatNormals = 0,      // 4 floats (x, y, z and w = 1).
+  kPackedNormals = 1,     // Signed 10:10:10:2 (GL_INT_2_10_10_10_REV).
+  kOctahedralNormals = 2  // 2 normalized shorts, decoded in the vertex shader.
+};
+
+enum TexCoordFormat {
+  kFloatTexCoords,  // 2 floats.
+  kHalfTexCoords    // 2 half floats.
+};
+
+enum ColorFormat {
+  kFloatColors,     // 3 floats.
+  kByteColors       // RGBA8.
+};
+
+
+// Describes how each attribute is stored in a render group's vertex buffers.
+// Positions and normals, which change as the model animates, are interleaved
+// in one buffer; tex coords and colors, which usually don't, in another.
+// Every attribute starts on a 4 byte boundary.
+struct VertexFormat {
+  PositionFormat positions;
+  NormalFormat normals;
+  TexCoordFormat texCoords;
+  ColorFormat colors;
+
+  VertexFormat();
+  VertexFormat(PositionFormat p, NormalFormat n, TexCoordFormat t, ColorFormat c);
+
+  // Looks up one of the predefined formats: "float", "half", "packed" or
+  // "octahedral". Returns false if the name isn't recognised.
+  static bool named(const char* name, VertexFormat& format);
+
+  // Layout of the position and normal buffer. Keyframes interpolated on the
+  // GPU use this layout too.
+  size_t animatedNormalOffset() const;
+  size_t animatedBytesPerVertex() const;
+
+  // Layout of the tex coord and color buffer.
+  size_t staticColorOffset() const;
+  size_t staticBytesPerVertex(bool hasColors) const;
+};
+
+
+//
+// FUNCTIONS
+//
+
+uint16_t floatToHalf(float value);
+void octEncode(const vh::Vector3& n, int16_t* out);
+
+
+// Positions passed in here should already have the render group's scale and
+// bias applied if the format needs it.
+inline void packPosition(PositionFormat format, const vh::Vector3& p, void* dst)
+{
+  switch (format) {
+    case kFloatPositions:
+      memcpy(dst, p.data, 3 * sizeof(float));
+      break;
+    case kHalfPositions:
+      {
+        uint16_t* out = (uint16_t*)dst;
+        out[0] = floatToHalf(p.x);
+        out[1] = floatToHalf(p.y);
+        out[2] = floatToHalf(p.z);
+        out[3] = 0;
+      }
+      break;
+    case kShortPositions:
+      {
+        int16_t* out = (int16_t*)dst;
+        for (unsigned int i = 0; i < 3; ++i)
+          out[i] = (int16_t)floorf(p.data[i] + 0.5f);
+        out[3] = 0;
+      }
+      break;
+  }
+}
+
+
+inline void packTexCoord(TexCoordFormat format, const vh::Vector2& uv, void* dst)
+{
+  if (format == kFloatTexCoords) {
+    memcpy(dst, uv.data, 2 * sizeof(float));
+  } else {
+    uint16_t* out = (uint16_t*)dst;
+    out[0] = floatToHalf(uv.u);
+    out[1] = floatToHalf(uv.v);
+  }
+}
+
+
+inline void packNormal(NormalFormat format, const vh::Vector3& n, void* dst)
+{
+  switch (format) {
+    case kFloatNormals:
+      {
+        float* out = (float*)dst;
+        out[0] = n.x;
+        out[1] = n.y;
+        out[2] = n.z;
+        out[3] = 1;
+      }
+      break;
+    case kPackedNormals:
+      {
+        float len = sqrtf(n.x * n.x + n.y * n.y + n.z * n.z);
+        float scale = (len > 0) ? 511.0f / len : 0.0f;
+        uint32_t packed = 0;
+        for (unsigned int i = 0; i < 3; ++i)
+          packed |= (uint32_t(int(floorf(n.data[i] * scale + 0.5f))) & 0x3ff) << (i * 10);
+        memcpy(dst, &packed, sizeof(packed));
+      }
+      break;
+    case kOctahedralNormals:
+      octEncode(n, (int16_t*)dst);
+      break;
+  }
+}
+
+
+inline void packColor(ColorFormat format, const vh::Vector4& color, void* dst)
+{
+  if (format == kFloatColors) {
+    memcpy(dst, color.data, 3 * sizeof(float));
+  } else {
+    uint8_t* out = (uint8_t*)dst;
+    for (unsigned int i = 0; i < 3; ++i) {
+      float c = std::max(0.0f, std::min(color.data[i], 1.0f));
+      out[i] = (uint8_t)floorf(c * 255.0f + 0.5f);
+    }
+    out[3] = 255;
+  }
+}
+
+
+#endif // OBJViewer_vertexformat_h
+
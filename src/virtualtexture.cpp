@@ -0,0 +1,904 @@
+#define GL_GLEXT_PROTOTYPES 1
+
+#ifdef linux
+#include <GL/gl.h>
+#include <GL/glext.h>
+#else
+#include <OpenGL/gl.h>
+#include <OpenGL/glext.h>
+#endif
+
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <set>
+#include <string>
+
+#include <unistd.h>
+
+#include "virtualtexture.h"
+#include "textureloader.h"
+#include "threadpool.h"
+
+
+//
+// CONSTANTS
+//
+
+// Tile size in texels, not counting the border. The border only needs to
+// be wide enough for bilinear filtering.
+const size_t TILE_SIZE = 128;
+const size_t TILE_BORDER = 1;
+
+// Tile and cache slot coordinates go through 8 bit channels in the feedback
+// and page table textures, which limits level 0 to 32768 texels across.
+const size_t MAX_TILES_ACROSS = 256;
+
+// The cache has at least this many tiles across, whatever the budget, so
+// that there's room for a view's worth.
+const size_t MIN_TILES_ACROSS = 4;
+
+// How many tiles can be waiting to be read at once. Requests beyond this
+// get made again by later feedback passes if they're still needed.
+const size_t MAX_TILE_LOADS = 64;
+
+
+//
+// TYPES
+//
+
+struct VirtualTexture {
+  RawImage* image;
+  TilePyramid pyramid;
+  bool built;           // Guarded by the cache's lock, as is failed.
+  bool failed;
+  int buildErrno;
+  bool finished;
+  bool ready;
+
+  GLuint pageTableID;
+  std::vector<std::vector<unsigned char> > pageTable; // RGBA for each level.
+  GLuint mipTailID;
+  bool pageTableDirty;
+
+  std::vector<int> tileSlots;     // Cache slot for each tile, or -1.
+  std::vector<bool> tileLoading;
+
+  VirtualTexture(RawImage* iImage) :
+    image(iImage), pyramid(), built(false), failed(false), buildErrno(0),
+    finished(false), ready(false), pageTableID(0), pageTable(),
+    mipTailID(0), pageTableDirty(false), tileSlots(), tileLoading()
+  {}
+};
+
+
+class TilePyramidJob : public Job {
+public:
+  VirtualTextureCache* cache;
+  size_t index;
+  std::string dir;
+
+  virtual void run()
+  {
+    VirtualTexture* texture = cache->_textures[index];
+    bool ok = texture->pyramid.build(dir.c_str(), texture->image,
+        TILE_SIZE, TILE_BORDER, MAX_TILES_ACROSS * TILE_SIZE);
+    int error = errno;
+
+    pthread_mutex_lock(&cache->_lock);
+    texture->built = true;
+    texture->failed = !ok;
+    texture->buildErrno = error;
+    pthread_mutex_unlock(&cache->_lock);
+  }
+};
+
+
+class TileLoadJob : public Job {
+public:
+  VirtualTextureCache* cache;
+  size_t index;
+  size_t level, x, y;
+  size_t tile;
+  std::vector<unsigned char> pixels;
+  bool ok;
+  bool done;            // Guarded by the cache's lock.
+
+  virtual void run()
+  {
+    const TilePyramid& pyramid = cache->_textures[index]->pyramid;
+    pixels.resize(pyramid.tileBytes());
+    bool result = pyramid.readTile(level, x, y, &pixels[0]);
+
+    pthread_mutex_lock(&cache->_lock);
+    ok = result;
+    done = true;
+    pthread_mutex_unlock(&cache->_lock);
+  }
+};
+
+
+// Puts the coarsest tiles first.
+struct CoarserTile {
+  bool operator () (const TileLoadJob* a, const TileLoadJob* b) const
+  {
+    return a->level > b->level;
+  }
+};
+
+
+//
+// INTERNAL FUNCTIONS
+//
+
+size_t wrapTexel(long texel, size_t size)
+{
+  texel %= long(size);
+  return (texel < 0) ? size_t(texel + long(size)) : size_t(texel);
+}
+
+
+bool tooBig(RawImage* texture, size_t maxWidth, size_t maxHeight)
+{
+  return texture != NULL &&
+      ((maxWidth > 0 && texture->getWidth() > maxWidth) ||
+       (maxHeight > 0 && texture->getHeight() > maxHeight));
+}
+
+
+//
+// TilePyramid METHODS
+//
+
+TilePyramid::TilePyramid() :
+  _fd(-1),
+  _format(0),
+  _channels(0),
+  _tileSize(0),
+  _border(0),
+  _size(0),
+  _levelStart()
+{
+}
+
+
+TilePyramid::~TilePyramid()
+{
+  if (_fd >= 0)
+    close(_fd);
+}
+
+
+bool TilePyramid::build(const char* dir, RawImage* image, size_t tileSize, size_t border, size_t maxSize)
+{
+  _format = image->getType();
+  _channels = image->getBytesPerPixel();
+  _tileSize = tileSize;
+  _border = border;
+
+  // Non-square textures get stretched to square, which only costs disk
+  // space: the tex coords don't change.
+  size_t width = image->getWidth();
+  size_t height = image->getHeight();
+  _size = tileSize;
+  while (_size < std::max(width, height) && _size < maxSize)
+    _size *= 2;
+
+  _levelStart.clear();
+  size_t tiles = 0;
+  for (size_t across = _size / tileSize; across >= 1; across /= 2) {
+    _levelStart.push_back(tiles);
+    tiles += across * across;
+  }
+  _levelStart.push_back(tiles);
+
+  std::string path = std::string(dir) + "/objviewer-tiles-XXXXXX";
+  std::vector<char> name(path.begin(), path.end());
+  name.push_back('\0');
+  _fd = mkstemp(&name[0]);
+  if (_fd < 0)
+    return false;
+  unlink(&name[0]);
+
+  if (width != _size || height != _size) {
+    fprintf(stderr, "Resampling %lux%lu texture to %lux%lu for tiling.\n",
+        width, height, _size, _size);
+  }
+
+  // Only the level being written and the one it came from are in memory.
+  const unsigned char* pixels = image->getPixels();
+  std::vector<unsigned char> level, next;
+  if (width != _size || height != _size) {
+    resampleImage(pixels, width, height, _channels, _size, _size, level);
+    pixels = &level[0];
+  }
+  for (size_t l = 0; l < numLevels(); ++l) {
+    if (l > 0) {
+      size_t levelSize = _size >> l;
+      resampleImage(pixels, levelSize * 2, levelSize * 2, _channels, levelSize, levelSize, next);
+      level.swap(next);
+      pixels = &level[0];
+    }
+    for (size_t y = 0; y < tilesAcross(l); ++y) {
+      if (!writeRow(l, y, pixels))
+        return false;
+    }
+  }
+  return true;
+}
+
+
+size_t TilePyramid::size() const
+{
+  return _size;
+}
+
+
+size_t TilePyramid::numLevels() const
+{
+  return _levelStart.empty() ? 0 : _levelStart.size() - 1;
+}
+
+
+size_t TilePyramid::tilesAcross(size_t level) const
+{
+  return (_size / _tileSize) >> level;
+}
+
+
+size_t TilePyramid::numTiles() const
+{
+  return _levelStart.empty() ? 0 : _levelStart.back();
+}
+
+
+size_t TilePyramid::tileIndex(size_t level, size_t x, size_t y) const
+{
+  return _levelStart[level] + y * tilesAcross(level) + x;
+}
+
+
+unsigned int TilePyramid::format() const
+{
+  return _format;
+}
+
+
+size_t TilePyramid::channels() const
+{
+  return _channels;
+}
+
+
+size_t TilePyramid::paddedTileSize() const
+{
+  return _tileSize + 2 * _border;
+}
+
+
+size_t TilePyramid::tileBytes() const
+{
+  return paddedTileSize() * paddedTileSize() * _channels;
+}
+
+
+bool TilePyramid::readTile(size_t level, size_t x, size_t y, unsigned char* out) const
+{
+  char* dst = (char*)out;
+  size_t size = tileBytes();
+  off_t offset = off_t(tileIndex(level, x, y)) * size;
+  while (size > 0) {
+    ssize_t bytesRead = pread(_fd, dst, size, offset);
+    if (bytesRead < 0 && errno == EINTR)
+      continue;
+    if (bytesRead <= 0) {
+      fprintf(stderr, "Error reading tile %lu from the tile store: %s\n",
+          tileIndex(level, x, y), (bytesRead < 0) ? strerror(errno) : "unexpected end of file");
+      return false;
+    }
+    dst += bytesRead;
+    size -= bytesRead;
+    offset += bytesRead;
+  }
+  return true;
+}
+
+
+bool TilePyramid::writeRow(size_t level, size_t y, const unsigned char* pixels)
+{
+  // The tiles in a row are next to each other in the file, so they all go
+  // out in one write.
+  size_t levelSize = _size >> level;
+  size_t across = tilesAcross(level);
+  size_t padded = paddedTileSize();
+  size_t texelBytes = _channels;
+  std::vector<unsigned char> row(across * tileBytes());
+  for (size_t x = 0; x < across; ++x) {
+    unsigned char* tile = &row[x * tileBytes()];
+    for (size_t ty = 0; ty < padded; ++ty) {
+      size_t srcY = wrapTexel(long(y * _tileSize + ty) - long(_border), levelSize);
+      const unsigned char* srcRow = pixels + srcY * levelSize * texelBytes;
+      unsigned char* dstRow = tile + ty * padded * texelBytes;
+      for (size_t tx = 0; tx < _border; ++tx) {
+        size_t left = wrapTexel(long(x * _tileSize + tx) - long(_border), levelSize);
+        size_t right = wrapTexel(long((x + 1) * _tileSize + tx), levelSize);
+        memcpy(dstRow + tx * texelBytes, srcRow + left * texelBytes, texelBytes);
+        memcpy(dstRow + (_border + _tileSize + tx) * texelBytes, srcRow + right * texelBytes, texelBytes);
+      }
+      memcpy(dstRow + _border * texelBytes, srcRow + x * _tileSize * texelBytes, _tileSize * texelBytes);
+    }
+  }
+
+  const char* data = (const char*)&row[0];
+  size_t size = row.size();
+  off_t offset = off_t(tileIndex(level, 0, y)) * tileBytes();
+  while (size > 0) {
+    ssize_t written = pwrite(_fd, data, size, offset);
+    if (written < 0 && errno == EINTR)
+      continue;
+    if (written <= 0)
+      return false;
+    data += written;
+    size -= written;
+    offset += written;
+  }
+  return true;
+}
+
+
+//
+// VirtualTextureCache::Slot METHODS
+//
+
+VirtualTextureCache::Slot::Slot() :
+  texture(-1),
+  tile(0),
+  lastUsed(0),
+  pinned(false)
+{
+}
+
+
+//
+// VirtualTextureCache METHODS
+//
+
+VirtualTextureCache::VirtualTextureCache(size_t budget, size_t maxTextureSize) :
+  _tilesAcross(0),
+  _tileSize(TILE_SIZE),
+  _border(TILE_BORDER),
+  _cacheTextureID(0),
+  _textures(),
+  _slots(),
+  _numResident(0),
+  _frame(0),
+  _pool(NULL),
+  _pyramidJobs(),
+  _loads(),
+  _model(NULL)
+{
+  size_t padded = _tileSize + 2 * _border;
+  _tilesAcross = size_t(std::sqrt(double(budget) / (padded * padded * 4)));
+  _tilesAcross = std::min(_tilesAcross, std::min(MAX_TILES_ACROSS, maxTextureSize / padded));
+  _tilesAcross = std::max(_tilesAcross, MIN_TILES_ACROSS);
+  pthread_mutex_init(&_lock, NULL);
+}
+
+
+VirtualTextureCache::~VirtualTextureCache()
+{
+  // The pool finishes off its queue before it goes.
+  delete _pool;
+  for (size_t i = 0; i < _pyramidJobs.size(); ++i)
+    delete _pyramidJobs[i];
+  for (size_t i = 0; i < _loads.size(); ++i)
+    delete _loads[i];
+
+  for (size_t i = 0; i < _textures.size(); ++i) {
+    if (_textures[i]->pageTableID != 0)
+      glDeleteTextures(1, &_textures[i]->pageTableID);
+    if (_textures[i]->mipTailID != 0)
+      glDeleteTextures(1, &_textures[i]->mipTailID);
+    delete _textures[i];
+  }
+  if (_cacheTextureID != 0)
+    glDeleteTextures(1, &_cacheTextureID);
+  pthread_mutex_destroy(&_lock);
+}
+
+
+size_t VirtualTextureCache::add(RawImage* texture)
+{
+  for (size_t i = 0; i < _textures.size(); ++i) {
+    if (_textures[i]->image == texture)
+      return i;
+  }
+  _textures.push_back(new VirtualTexture(texture));
+  return _textures.size() - 1;
+}
+
+
+void VirtualTextureCache::start(Model* model, const char* dir)
+{
+  if (_textures.empty() || _pool != NULL)
+    return;
+  _model = model;
+
+  // Tiles are stored in whatever format their image is in; GL converts
+  // them as they're copied in.
+  glGenTextures(1, &_cacheTextureID);
+  glBindTexture(GL_TEXTURE_2D, _cacheTextureID);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+  glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, cacheSize(), cacheSize(), 0,
+      GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+  glBindTexture(GL_TEXTURE_2D, 0);
+  _slots.reserve(capacity());
+
+  long numCPUs = sysconf(_SC_NPROCESSORS_ONLN);
+  size_t numThreads = std::min(_textures.size(), size_t(std::max(numCPUs, 1L)));
+  fprintf(stderr, "Tiling %lu virtual textures in the background on %lu threads, "
+      "for a cache of %lux%lu tiles (%1.1f MB)...\n", _textures.size(), numThreads,
+      _tilesAcross, _tilesAcross, cacheSize() * cacheSize() * 4 / 1048576.0);
+
+  _pool = new ThreadPool(numThreads);
+  for (size_t i = 0; i < _textures.size(); ++i) {
+    TilePyramidJob* job = new TilePyramidJob();
+    job->cache = this;
+    job->index = i;
+    job->dir = dir;
+    _pyramidJobs.push_back(job);
+    _pool->add(job);
+  }
+}
+
+
+size_t VirtualTextureCache::numTextures() const
+{
+  return _textures.size();
+}
+
+
+bool VirtualTextureCache::ready(size_t index) const
+{
+  return _textures[index]->ready;
+}
+
+
+size_t VirtualTextureCache::numLevels(size_t index) const
+{
+  return _textures[index]->pyramid.numLevels();
+}
+
+
+unsigned int VirtualTextureCache::pageTable(size_t index) const
+{
+  return _textures[index]->pageTableID;
+}
+
+
+RawImage* VirtualTextureCache::image(size_t index) const
+{
+  return _textures[index]->image;
+}
+
+
+unsigned int VirtualTextureCache::mipTail(size_t index) const
+{
+  return _textures[index]->mipTailID;
+}
+
+
+unsigned int VirtualTextureCache::cacheTexture() const
+{
+  return _cacheTextureID;
+}
+
+
+size_t VirtualTextureCache::tileSize() const
+{
+  return _tileSize;
+}
+
+
+size_t VirtualTextureCache::tileBorder() const
+{
+  return _border;
+}
+
+
+size_t VirtualTextureCache::cacheSize() const
+{
+  return _tilesAcross * (_tileSize + 2 * _border);
+}
+
+
+void VirtualTextureCache::requestTiles(const unsigned char* pixels, size_t numPixels)
+{
+  ++_frame;
+
+  // Neighbouring pixels mostly want the same tile, so runs are skipped.
+  std::vector<TileLoadJob*> missing;
+  const unsigned char* last = NULL;
+  for (size_t i = 0; i < numPixels; ++i) {
+    const unsigned char* pixel = pixels + i * 4;
+    if (pixel[3] == 0 || (last != NULL && memcmp(pixel, last, 4) == 0))
+      continue;
+    last = pixel;
+
+    size_t index = pixel[3] - 1;
+    if (index >= _textures.size() || !_textures[index]->ready)
+      continue;
+    const TilePyramid& pyramid = _textures[index]->pyramid;
+    size_t level = pixel[2];
+    if (level >= pyramid.numLevels() ||
+        pixel[0] >= pyramid.tilesAcross(level) || pixel[1] >= pyramid.tilesAcross(level))
+      continue;
+    touch(index, level, pixel[0], pixel[1], missing);
+  }
+
+  // Coarse tiles cover more of the screen and let the finer ones fall back
+  // to something close, so they go first.
+  std::stable_sort(missing.begin(), missing.end(), CoarserTile());
+  for (size_t i = 0; i < missing.size(); ++i) {
+    TileLoadJob* job = missing[i];
+    if (_loads.size() < MAX_TILE_LOADS) {
+      _loads.push_back(job);
+      _pool->add(job);
+    } else {
+      _textures[job->index]->tileLoading[job->tile] = false;
+      delete job;
+    }
+  }
+}
+
+
+size_t VirtualTextureCache::update(size_t maxTiles)
+{
+  if (_pool == NULL)
+    return 0;
+
+  std::vector<size_t> built;
+  std::vector<TileLoadJob*> loaded;
+  pthread_mutex_lock(&_lock);
+  for (size_t i = 0; i < _textures.size(); ++i) {
+    if (_textures[i]->built && !_textures[i]->finished)
+      built.push_back(i);
+  }
+  for (size_t i = 0; i < _loads.size() && loaded.size() < maxTiles; ++i) {
+    if (_loads[i]->done)
+      loaded.push_back(_loads[i]);
+  }
+  pthread_mutex_unlock(&_lock);
+
+  size_t bytes = 0;
+  for (size_t i = 0; i < built.size(); ++i) {
+    finishTexture(built[i]);
+    if (_textures[built[i]]->ready)
+      bytes += _textures[built[i]]->pyramid.tileBytes();
+  }
+
+  for (size_t i = 0; i < loaded.size(); ++i) {
+    TileLoadJob* job = loaded[i];
+    _pool->wait(job);
+    _loads.erase(std::find(_loads.begin(), _loads.end(), job));
+
+    // With every slot in use by this frame's tiles, this one has to wait
+    // for a later request.
+    VirtualTexture* texture = _textures[job->index];
+    texture->tileLoading[job->tile] = false;
+    int slot = job->ok ? allocateSlot() : -1;
+    if (slot >= 0) {
+      uploadTile(slot, job->index, job->tile, &job->pixels[0]);
+      bytes += job->pixels.size();
+    }
+    delete job;
+  }
+
+  for (size_t i = 0; i < _textures.size(); ++i) {
+    if (_textures[i]->pageTableDirty)
+      updatePageTable(i);
+  }
+  return bytes;
+}
+
+
+bool VirtualTextureCache::building() const
+{
+  for (size_t i = 0; i < _textures.size(); ++i) {
+    if (!_textures[i]->finished)
+      return true;
+  }
+  return false;
+}
+
+
+size_t VirtualTextureCache::numResident() const
+{
+  return _numResident;
+}
+
+
+size_t VirtualTextureCache::numLoading() const
+{
+  return _loads.size();
+}
+
+
+size_t VirtualTextureCache::capacity() const
+{
+  return _tilesAcross * _tilesAcross;
+}
+
+
+size_t VirtualTextureCache::gpuBytes() const
+{
+  size_t bytes = (_cacheTextureID != 0) ? cacheSize() * cacheSize() * 4 : 0;
+  for (size_t i = 0; i < _textures.size(); ++i) {
+    const VirtualTexture* texture = _textures[i];
+    for (size_t level = 0; level < texture->pageTable.size(); ++level)
+      bytes += texture->pageTable[level].size();
+    if (texture->mipTailID != 0)
+      bytes += _tileSize * _tileSize * 4 * 4 / 3;
+  }
+  return bytes;
+}
+
+
+size_t VirtualTextureCache::cpuBytes() const
+{
+  size_t bytes = 0;
+  for (size_t i = 0; i < _textures.size(); ++i) {
+    const VirtualTexture* texture = _textures[i];
+    for (size_t level = 0; level < texture->pageTable.size(); ++level)
+      bytes += texture->pageTable[level].size();
+    bytes += texture->tileSlots.size() * sizeof(int) + texture->tileLoading.size() / 8;
+  }
+  for (size_t i = 0; i < _loads.size(); ++i)
+    bytes += _loads[i]->pixels.capacity();
+  return bytes;
+}
+
+
+void VirtualTextureCache::touch(size_t index, size_t level, size_t x, size_t y,
+    std::vector<TileLoadJob*>& missing)
+{
+  // Each tile's coarser ancestors are what it falls back to, so they're
+  // kept too. Once we reach one already used this frame, so are the rest.
+  VirtualTexture* texture = _textures[index];
+  const TilePyramid& pyramid = texture->pyramid;
+  for (; level < pyramid.numLevels(); ++level, x /= 2, y /= 2) {
+    size_t tile = pyramid.tileIndex(level, x, y);
+    int slot = texture->tileSlots[tile];
+    if (slot >= 0) {
+      if (_slots[slot].lastUsed == _frame)
+        break;
+      _slots[slot].lastUsed = _frame;
+    } else if (!texture->tileLoading[tile]) {
+      texture->tileLoading[tile] = true;
+      TileLoadJob* job = new TileLoadJob();
+      job->cache = this;
+      job->index = index;
+      job->level = level;
+      job->x = x;
+      job->y = y;
+      job->tile = tile;
+      job->ok = false;
+      job->done = false;
+      missing.push_back(job);
+    }
+  }
+}
+
+
+void VirtualTextureCache::finishTexture(size_t index)
+{
+  VirtualTexture* texture = _textures[index];
+  texture->finished = true;
+  if (texture->failed) {
+    fprintf(stderr, "Unable to tile a %ux%u texture: %s. It won't be drawn.\n",
+        texture->image->getWidth(), texture->image->getHeight(), strerror(texture->buildErrno));
+    return;
+  }
+
+  // Everything we need from the pixels is in the pyramid now.
+  _model->removeTexturePixels(texture->image);
+  texture->image->deletePixels();
+
+  const TilePyramid& pyramid = texture->pyramid;
+  size_t numLevels = pyramid.numLevels();
+  texture->tileSlots.assign(pyramid.numTiles(), -1);
+  texture->tileLoading.assign(pyramid.numTiles(), false);
+  texture->pageTable.resize(numLevels);
+
+  glGenTextures(1, &texture->pageTableID);
+  glBindTexture(GL_TEXTURE_2D, texture->pageTableID);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST_MIPMAP_NEAREST);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, numLevels - 1);
+  for (size_t level = 0; level < numLevels; ++level) {
+    size_t across = pyramid.tilesAcross(level);
+    texture->pageTable[level].assign(across * across * 4, 0);
+    glTexImage2D(GL_TEXTURE_2D, level, GL_RGBA8, across, across, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+  }
+
+  // The coarsest tile is what everything falls back to, so it's read now and
+  // never leaves the cache.
+  std::vector<unsigned char> pixels(pyramid.tileBytes());
+  int slot = -1;
+  if (pyramid.readTile(numLevels - 1, 0, 0, &pixels[0]))
+    slot = allocateSlot();
+  if (slot < 0) {
+    fprintf(stderr, "No room in the virtual texture cache for a %ux%u texture. It won't be drawn.\n",
+        texture->image->getWidth(), texture->image->getHeight());
+    return;
+  }
+  uploadTile(slot, index, pyramid.tileIndex(numLevels - 1, 0, 0), &pixels[0]);
+  _slots[slot].pinned = true;
+  updatePageTable(index);
+  createMipTail(index, &pixels[0]);
+  texture->ready = true;
+}
+
+
+int VirtualTextureCache::allocateSlot()
+{
+  if (_slots.size() < capacity()) {
+    _slots.push_back(Slot());
+    return int(_slots.size() - 1);
+  }
+
+  // Evict the least recently used tile that isn't needed this frame.
+  int best = -1;
+  for (size_t i = 0; i < _slots.size(); ++i) {
+    const Slot& s = _slots[i];
+    if (s.pinned || s.lastUsed == _frame)
+      continue;
+    if (best < 0 || s.lastUsed < _slots[best].lastUsed)
+      best = int(i);
+  }
+  if (best >= 0 && _slots[best].texture >= 0) {
+    VirtualTexture* texture = _textures[_slots[best].texture];
+    texture->tileSlots[_slots[best].tile] = -1;
+    texture->pageTableDirty = true;
+    _slots[best].texture = -1;
+    --_numResident;
+  }
+  return best;
+}
+
+
+void VirtualTextureCache::uploadTile(int slot, size_t index, size_t tile, const unsigned char* pixels)
+{
+  Slot& s = _slots[slot];
+  s.texture = int(index);
+  s.tile = tile;
+  s.lastUsed = _frame;
+  s.pinned = false;
+  ++_numResident;
+
+  VirtualTexture* texture = _textures[index];
+  texture->tileSlots[tile] = slot;
+  texture->pageTableDirty = true;
+
+  size_t padded = texture->pyramid.paddedTileSize();
+  glBindTexture(GL_TEXTURE_2D, _cacheTextureID);
+  glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+  glTexSubImage2D(GL_TEXTURE_2D, 0, (slot % _tilesAcross) * padded, (slot / _tilesAcross) * padded,
+      padded, padded, texture->pyramid.format(), GL_UNSIGNED_BYTE, pixels);
+}
+
+
+void VirtualTextureCache::createMipTail(size_t index, const unsigned char* pixels)
+{
+  // The cache has no mip levels, so anything coarser than the coarsest
+  // tile comes from here instead: that tile without its border, and the
+  // levels below it.
+  VirtualTexture* texture = _textures[index];
+  const TilePyramid& pyramid = texture->pyramid;
+  size_t channels = pyramid.channels();
+  std::vector<unsigned char> level(_tileSize * _tileSize * channels), next;
+  for (size_t y = 0; y < _tileSize; ++y) {
+    const unsigned char* src = pixels + ((y + _border) * pyramid.paddedTileSize() + _border) * channels;
+    memcpy(&level[y * _tileSize * channels], src, _tileSize * channels);
+  }
+
+  glGenTextures(1, &texture->mipTailID);
+  glBindTexture(GL_TEXTURE_2D, texture->mipTailID);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+  glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+  for (size_t l = 0, size = _tileSize; size >= 1; ++l, size /= 2) {
+    if (l > 0) {
+      resampleImage(&level[0], size * 2, size * 2, channels, size, size, next);
+      level.swap(next);
+    }
+    glTexImage2D(GL_TEXTURE_2D, l, GL_RGBA8, size, size, 0, pyramid.format(), GL_UNSIGNED_BYTE, &level[0]);
+  }
+}
+
+
+void VirtualTextureCache::updatePageTable(size_t index)
+{
+  // Working down from the coarsest level, a tile which isn't resident
+  // points wherever its parent does. The level in each entry tells the
+  // shader which level it's really getting.
+  VirtualTexture* texture = _textures[index];
+  const TilePyramid& pyramid = texture->pyramid;
+  glBindTexture(GL_TEXTURE_2D, texture->pageTableID);
+  glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+  for (size_t level = pyramid.numLevels(); level-- > 0; ) {
+    size_t across = pyramid.tilesAcross(level);
+    std::vector<unsigned char>& entries = texture->pageTable[level];
+    for (size_t y = 0; y < across; ++y) {
+      for (size_t x = 0; x < across; ++x) {
+        unsigned char* entry = &entries[(y * across + x) * 4];
+        int slot = texture->tileSlots[pyramid.tileIndex(level, x, y)];
+        if (slot >= 0) {
+          entry[0] = slot % _tilesAcross;
+          entry[1] = slot / _tilesAcross;
+          entry[2] = level;
+          entry[3] = 255;
+        } else if (level + 1 < pyramid.numLevels()) {
+          const std::vector<unsigned char>& parents = texture->pageTable[level + 1];
+          memcpy(entry, &parents[((y / 2) * (across / 2) + x / 2) * 4], 4);
+        }
+      }
+    }
+    glTexSubImage2D(GL_TEXTURE_2D, level, 0, 0, across, across, GL_RGBA, GL_UNSIGNED_BYTE, &entries[0]);
+  }
+  texture->pageTableDirty = false;
+}
+
+
+//
+// FUNCTIONS
+//
+
+void chooseVirtualTextures(const std::vector<Material*>& materials,
+    size_t maxWidth, size_t maxHeight, std::map<Material*, RawImage*>& chosen)
+{
+  std::set<RawImage*> candidates;
+  for (size_t i = 0; i < materials.size(); ++i) {
+    RawImage* mapKd = materials[i]->mapKd;
+    if (candidates.size() < VirtualTextureCache::kMaxTextures && tooBig(mapKd, maxWidth, maxHeight))
+      candidates.insert(mapKd);
+  }
+
+  // Dropping a candidate can't give any material more of them, so one pass
+  // over the conflicts is enough. The diffuse map comes first so that it
+  // wins.
+  for (size_t i = 0; i < materials.size(); ++i) {
+    Material* material = materials[i];
+    RawImage* maps[4] = { material->mapKd, material->mapKa, material->mapKs, material->mapD };
+    RawImage* keep = NULL;
+    for (unsigned int m = 0; m < 4; ++m) {
+      if (maps[m] == NULL || candidates.count(maps[m]) == 0)
+        continue;
+      if (keep == NULL)
+        keep = maps[m];
+      else if (maps[m] != keep)
+        candidates.erase(maps[m]);
+    }
+  }
+
+  chosen.clear();
+  for (size_t i = 0; i < materials.size(); ++i) {
+    Material* material = materials[i];
+    RawImage* maps[4] = { material->mapKd, material->mapKa, material->mapKs, material->mapD };
+    chosen[material] = NULL;
+    for (unsigned int m = 0; m < 4 && chosen[material] == NULL; ++m) {
+      if (maps[m] != NULL && candidates.count(maps[m]) > 0)
+        chosen[material] = maps[m];
+    }
+  }
+}
@@ -0,0 +1,208 @@
+#ifndef OBJViewer_virtualtexture_h
+#define OBJViewer_virtualtexture_h
+
+#include <map>
+#include <vector>
+
+#include <pthread.h>
+
+#include "model.h"
+
+
+class ThreadPool;
+class TileLoadJob;
+class TilePyramidJob;
+struct VirtualTexture;
+
+
+//
+// TYPES
+//
+
+// A texture cut into square tiles at every mip level and written out to a
+// temporary file, so that any one tile can be read back on its own. The
+// texture is resampled to a square power of two size first, so level n has
+// half as many tiles across as level n - 1 and the coarsest level is a
+// single tile. Each tile carries a border of texels from its neighbours,
+// wrapping around at the edges, so it can be filtered without them.
+class TilePyramid {
+public:
+  TilePyramid();
+  ~TilePyramid();
+
+  // Creates the backing file in the given directory and writes every level
+  // of the image into it. The file is unlinked straight away, so it goes
+  // when we do. maxSize caps the size of level 0. Can be called on any
+  // thread. Returns false and leaves errno set if the file couldn't be
+  // created or written.
+  bool build(const char* dir, RawImage* image, size_t tileSize, size_t border, size_t maxSize);
+
+  size_t size() const;       // Texels across level 0.
+  size_t numLevels() const;
+  size_t tilesAcross(size_t level) const;
+  size_t numTiles() const;
+
+  // Tiles are numbered through the levels from finest to coarsest, in rows
+  // within each level.
+  size_t tileIndex(size_t level, size_t x, size_t y) const;
+
+  // Tiles are stored with the image's pixel format, borders included.
+  unsigned int format() const;
+  size_t channels() const;
+  size_t paddedTileSize() const;
+  size_t tileBytes() const;
+
+  // Reads a tile into out, which must hold tileBytes(). Can be called from
+  // several threads at once.
+  bool readTile(size_t level, size_t x, size_t y, unsigned char* out) const;
+
+private:
+  bool writeRow(size_t level, size_t y, const unsigned char* pixels);
+
+private:
+  int _fd;
+  unsigned int _format;
+  size_t _channels;
+  size_t _tileSize, _border;
+  size_t _size;
+  std::vector<size_t> _levelStart; // Number of the first tile in each level.
+};
+
+
+// Draws textures which are too big to upload whole from a fixed size cache
+// texture, holding just the tiles of each texture's TilePyramid that the
+// view needs at the detail it needs them.
+//
+// Which tiles those are comes from a feedback pass: the scene is drawn at
+// low resolution with each fragment writing out the tile it would sample
+// (see requestTiles()). Missing tiles are read on a thread pool and copied
+// into the cache a few per frame, replacing the least recently used ones.
+// Each texture has a page table with a texel per tile at each level, which
+// points at that tile's place in the cache, or if it isn't there at the
+// nearest coarser tile which is; the coarsest tile is always kept, so
+// there's always something to draw with. GPU memory use depends only on
+// the size of the cache.
+class VirtualTextureCache {
+public:
+  // Texture indexes go through an 8 bit channel in the feedback pass, with
+  // zero meaning none.
+  enum { kMaxTextures = 255 };
+
+  // The cache gets as many tiles as fit in about budget bytes of GPU memory,
+  // in a texture no more than maxTextureSize across.
+  VirtualTextureCache(size_t budget, size_t maxTextureSize);
+  ~VirtualTextureCache();
+
+  // Queues a texture to be tiled and returns its index. Adding the same
+  // texture again returns the same index. Call before start(), and no more
+  // than kMaxTextures times.
+  size_t add(RawImage* texture);
+
+  // Creates the cache texture and starts tiling the textures in the
+  // background, with their pyramids in the given directory. Their pixels
+  // are released as they finish.
+  void start(Model* model, const char* dir);
+
+  size_t numTextures() const;
+
+  // True once a texture's pyramid is built and its page table is ready, so
+  // it can be drawn.
+  bool ready(size_t index) const;
+  RawImage* image(size_t index) const;
+  size_t numLevels(size_t index) const;
+  unsigned int pageTable(size_t index) const;
+
+  // The coarsest level as an ordinary mipmapped texture, for drawing the
+  // texture smaller than a tile.
+  unsigned int mipTail(size_t index) const;
+
+  unsigned int cacheTexture() const;
+  size_t tileSize() const;
+  size_t tileBorder() const;
+  size_t cacheSize() const; // Texels across the cache texture.
+
+  // Takes the output of the feedback pass, as RGBA pixels: x and y of the
+  // tile within its level, the level, and the texture index plus one (zero
+  // for pixels without a virtual texture). Marks the tiles and all of their
+  // coarser ancestors as used and starts loading any which are missing,
+  // coarsest first.
+  void requestTiles(const unsigned char* pixels, size_t numPixels);
+
+  // Copies up to maxTiles tiles which have finished loading into the cache
+  // and updates the page tables to match. Also finishes off any textures
+  // which have finished tiling. Call on the GL thread before drawing; it
+  // changes the texture bound to the active unit. Returns the number of
+  // bytes uploaded.
+  size_t update(size_t maxTiles);
+
+  // True while any texture is still being tiled.
+  bool building() const;
+
+  size_t numResident() const;
+  size_t numLoading() const;
+  size_t capacity() const;
+
+  // GPU memory for the cache, page tables and mip tails, and the CPU memory
+  // held by the page tables and tiles waiting to be uploaded.
+  size_t gpuBytes() const;
+  size_t cpuBytes() const;
+
+private:
+  friend class TileLoadJob;
+  friend class TilePyramidJob;
+
+  // Where each cache slot is and what's in it. Empty slots have a
+  // texture of -1.
+  struct Slot {
+    int texture;
+    size_t tile;
+    size_t lastUsed;
+    bool pinned;
+
+    Slot();
+  };
+
+  void touch(size_t index, size_t level, size_t x, size_t y, std::vector<TileLoadJob*>& missing);
+  void finishTexture(size_t index);
+  int allocateSlot();
+  void uploadTile(int slot, size_t index, size_t tile, const unsigned char* pixels);
+  void createMipTail(size_t index, const unsigned char* pixels);
+  void updatePageTable(size_t index);
+
+private:
+  size_t _tilesAcross;
+  size_t _tileSize, _border;
+  unsigned int _cacheTextureID;
+
+  std::vector<VirtualTexture*> _textures;
+  std::vector<Slot> _slots;
+  size_t _numResident;
+  size_t _frame;
+
+  ThreadPool* _pool;
+  std::vector<TilePyramidJob*> _pyramidJobs;
+  std::vector<TileLoadJob*> _loads;
+  Model* _model;
+
+  // Guards the jobs' finished flags, which the workers set.
+  mutable pthread_mutex_t _lock;
+};
+
+
+//
+// FUNCTIONS
+//
+
+// Decides which of the materials' textures to draw as virtual textures:
+// diffuse maps bigger than maxWidth or maxHeight, up to kMaxTextures of
+// them. Materials share images, so the choice is per image: one which is
+// virtual must be drawn that way in every map that uses it, and never be
+// loaded as an ordinary texture as well. A material can only draw from one
+// virtual texture, so where it would need more its diffuse map's wins and
+// the others are left as ordinary textures everywhere. Sets the virtual
+// texture for each material, or NULL if it hasn't got one.
+void chooseVirtualTextures(const std::vector<Material*>& materials,
+    size_t maxWidth, size_t maxHeight, std::map<Material*, RawImage*>& chosen);
+
+
+#endif // OBJViewer_virtualtexture_h
@@ -0,0 +1,116 @@
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+#include <sys/time.h>
+
+#include "interpolate.h"
+
+
+// Compares interpolating keyframes one corner at a time through
+// Curve3::valueAt (as RenderGroup::setTime used to) with the batch
+// KeyframeArrays path, for a range of corner counts. Every corner has its own
+// vertex here, so the batch path gets no benefit from shared vertices.
+
+
+static const size_t NUM_KEYFRAMES = 2;
+static const size_t FLOATS_PER_VERTEX = 9; // x, y, z, u, v, nx, ny, nz, nw.
+static const int REPEATS = 5;
+
+
+double now()
+{
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec * 1000.0 + tv.tv_usec / 1000.0;
+}
+
+
+double timeCurves(const std::vector<Curve3>& curves, float* vertexBuffer)
+{
+  double best = 1e20;
+  for (int r = 0; r < REPEATS; ++r) {
+    float time = 0.25f + 0.1f * r;
+    double start = now();
+#pragma omp parallel for schedule(dynamic, 100)
+    for (size_t i = 0; i < curves.size(); ++i) {
+      vh::Vector3 coord = curves[i].valueAt(time);
+      float* dst = vertexBuffer + i * FLOATS_PER_VERTEX;
+      dst[0] = coord.x;
+      dst[1] = coord.y;
+      dst[2] = coord.z;
+    }
+    double elapsed = now() - start;
+    if (elapsed < best)
+      best = elapsed;
+  }
+  return best;
+}
+
+
+void timeBatch(KeyframeArrays& arrays, float* vertexBuffer, double& kernelMs, double& totalMs)
+{
+  kernelMs = totalMs = 1e20;
+  std::vector<float> result(arrays.numItems() * 3);
+  for (int r = 0; r < REPEATS; ++r) {
+    float time = 0.25f + 0.1f * r;
+    double start = now();
+    arrays.interpolate(time, &result[0]);
+    double mid = now();
+#pragma omp parallel for schedule(dynamic, 100)
+    for (size_t i = 0; i < arrays.numItems(); ++i) {
+      const float* src = &result[i * 3];
+      float* dst = vertexBuffer + i * FLOATS_PER_VERTEX;
+      dst[0] = src[0];
+      dst[1] = src[1];
+      dst[2] = src[2];
+    }
+    double end = now();
+    if (mid - start < kernelMs)
+      kernelMs = mid - start;
+    if (end - start < totalMs)
+      totalMs = end - start;
+  }
+}
+
+
+int main(int argc, char** argv)
+{
+  std::vector<size_t> sizes;
+  for (int i = 1; i < argc; ++i)
+    sizes.push_back(strtoul(argv[i], NULL, 10));
+  if (sizes.empty()) {
+    sizes.push_back(1000000);
+    sizes.push_back(10000000);
+    sizes.push_back(30000000);
+  }
+
+  fprintf(stderr, "Using the %s kernel, %lu keyframes, best of %d runs.\n",
+      lerpArraysKernel(), NUM_KEYFRAMES, REPEATS);
+  printf("%12s %12s %12s %12s %8s\n", "corners", "curves ms", "kernel ms", "batch ms", "speedup");
+
+  for (size_t s = 0; s < sizes.size(); ++s) {
+    size_t corners = sizes[s];
+
+    std::vector<Curve3> curves(corners);
+    for (size_t i = 0; i < corners; ++i) {
+      for (size_t k = 0; k < NUM_KEYFRAMES; ++k)
+        curves[i].addKeyframe(vh::Vector3(i * 0.001f, k * 0.5f, i * -0.002f + k));
+    }
+
+    std::vector<float> vertexBuffer(corners * FLOATS_PER_VERTEX);
+    double curvesMs = timeCurves(curves, &vertexBuffer[0]);
+
+    KeyframeArrays* arrays = new KeyframeArrays(curves);
+    std::vector<Curve3>().swap(curves);
+
+    double kernelMs, batchMs;
+    timeBatch(*arrays, &vertexBuffer[0], kernelMs, batchMs);
+    delete arrays;
+
+    printf("%12lu %12.2f %12.2f %12.2f %7.2fx\n", corners, curvesMs, kernelMs, batchMs,
+        curvesMs / batchMs);
+  }
+  return 0;
+}
+
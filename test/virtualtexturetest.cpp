@@ -0,0 +1,69 @@
+#include <cstdio>
+#include <map>
+#include <vector>
+
+#include "model.h"
+#include "virtualtexture.h"
+
+
+static int assertionsFailed = 0;
+
+
+void assertTrue(bool condition, const char* failMessage)
+{
+  if (!condition) {
+    ++assertionsFailed;
+    fprintf(stderr, "Assertion failed: %s\n", failMessage);
+  }
+}
+
+
+int main(int argc, char** argv)
+{
+  // The parser shares images between maps and materials, so these point at
+  // the same objects the way a .mtl file naming the same file would.
+  RawImage big(GL_RGBA, 4, 128, 128);
+  RawImage other(GL_RGBA, 4, 128, 128);
+  RawImage small(GL_RGBA, 4, 32, 32);
+  std::map<Material*, RawImage*> chosen;
+
+  // map_Kd and map_Ks are the same oversized image: it's virtual for both.
+  Material shared;
+  shared.mapKd = &big;
+  shared.mapKs = &big;
+  std::vector<Material*> materials(1, &shared);
+  chooseVirtualTextures(materials, 64, 64, chosen);
+  assertTrue(chosen[&shared] == &big, "the shared image should be virtual.");
+
+  // Another material using it as a cutout draws it virtually too.
+  Material cutout;
+  cutout.mapKd = &small;
+  cutout.mapD = &big;
+  materials.push_back(&cutout);
+  chooseVirtualTextures(materials, 64, 64, chosen);
+  assertTrue(chosen[&shared] == &big, "the shared image should still be virtual.");
+  assertTrue(chosen[&cutout] == &big, "the cutout should come from the virtual image.");
+
+  // A material which would need two virtual textures keeps its diffuse
+  // map's, and the other image stops being virtual everywhere.
+  Material both, otherOnly;
+  both.mapKd = &big;
+  both.mapKs = &other;
+  otherOnly.mapKd = &other;
+  materials.clear();
+  materials.push_back(&both);
+  materials.push_back(&otherOnly);
+  chooseVirtualTextures(materials, 64, 64, chosen);
+  assertTrue(chosen[&both] == &big, "the diffuse map should win.");
+  assertTrue(chosen[&otherOnly] == NULL, "the losing image shouldn't be virtual anywhere.");
+
+  // Nothing is virtual when it all fits.
+  chooseVirtualTextures(materials, 256, 256, chosen);
+  assertTrue(chosen[&both] == NULL && chosen[&otherOnly] == NULL, "small images shouldn't be virtual.");
+
+  if (assertionsFailed > 0)
+    printf("Test failed.\n");
+  else
+    printf("Test passed.\n");
+  return assertionsFailed;
+}
@@ -0,0 +1,8 @@
+// Draws a quad straight onto the screen, for compositing.
+
+
+void main()
+{
+  gl_TexCoord[0] = gl_MultiTexCoord0;
+  gl_Position = gl_Vertex;
+}
@@ -1,13 +1,77 @@
 varying vec3 Ka, Kd;
 varying vec3 normal, lightDir, halfVector;
 
+// Packed vertex formats store positions relative to the render group's
+// bounds; these map them back into model space. For float positions the
+// scale is 1 and the bias is 0.
+uniform vec3 positionScale;
+uniform vec3 positionBias;
+
+// How the normals are stored: 0 means they come through gl_Normal, 1 means
+// packedNormal holds a signed 10:10:10:2 normal and 2 means packedNormal.xy
+// holds an octahedral-encoded normal.
+uniform int normalEncoding;
+attribute vec4 packedNormal;
+
+// When interpolating keyframes on the GPU, gl_Vertex and the normal are the
+// left keyframe and these attributes hold the right one, in the same
+// encoding.
+uniform bool interpolateKeyframes;
+uniform float keyframeFraction;
+attribute vec3 nextPosition;
+attribute vec4 nextNormal;
+
+// For instanced render groups, the top three rows of the instance's
+// transform, which takes model space to world space.
+uniform bool instanced;
+attribute vec4 instanceRow0;
+attribute vec4 instanceRow1;
+attribute vec4 instanceRow2;
+
+
+vec3 unpackNormal(vec3 n, vec4 encoded)
+{
+  if (normalEncoding == 0)
+    return n;
+  else if (normalEncoding == 1)
+    return encoded.xyz;
+
+  vec2 e = encoded.xy;
+  vec3 o = vec3(e, 1.0 - abs(e.x) - abs(e.y));
+  float t = max(-o.z, 0.0);
+  o.x += (o.x >= 0.0) ? -t : t;
+  o.y += (o.y >= 0.0) ? -t : t;
+  return o;
+}
+
 
 void main()
 {
   float NdotL, NdotHV;
   vec3 globalAmbient, materialAmbient;
+
+  vec3 position = gl_Vertex.xyz;
+  vec3 vertexNormal = unpackNormal(gl_Normal, packedNormal);
+  if (interpolateKeyframes) {
+    position = mix(position, nextPosition, keyframeFraction);
+    vertexNormal = mix(vertexNormal, unpackNormal(nextNormal.xyz, nextNormal), keyframeFraction);
+  }
   
-  normal = normalize(gl_NormalMatrix * gl_Normal);
+  position = position * positionScale + positionBias;
+  if (instanced) {
+    vec4 p = vec4(position, 1.0);
+    position = vec3(dot(instanceRow0, p), dot(instanceRow1, p), dot(instanceRow2, p));
+
+    // Normals go through the inverse transpose, which is the cofactor
+    // matrix up to a scale factor; the sign keeps mirrored instances' normals
+    // pointing outwards.
+    vec3 r0 = instanceRow0.xyz, r1 = instanceRow1.xyz, r2 = instanceRow2.xyz;
+    vec3 c0 = cross(r1, r2), c1 = cross(r2, r0), c2 = cross(r0, r1);
+    vertexNormal = sign(dot(r0, c0)) *
+        vec3(dot(c0, vertexNormal), dot(c1, vertexNormal), dot(c2, vertexNormal));
+  }
+
+  normal = normalize(gl_NormalMatrix * vertexNormal);
   lightDir = vec3(0, 0, 1);
   halfVector = normalize(gl_LightSource[0].halfVector.xyz);
 
@@ -22,6 +86,6 @@ void main()
   gl_TexCoord[2] = gl_MultiTexCoord2;
   gl_TexCoord[3] = gl_MultiTexCoord3;
 
-  gl_Position = ftransform();
+  gl_Position = gl_ModelViewProjectionMatrix * vec4(position, 1.0);
 }
 